@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rpicam_clip.cpp - cut a time range out of a recording, using the index written with --index.
+ */
+
+#include <cstdio>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "output/recording_index.h"
+
+static void usage()
+{
+	std::cerr << "Usage: rpicam-clip [--index <index file>] [--list] <recording> [<start> <end> [<output file>|-]]"
+			  << std::endl
+			  << "Copies the part of a recording made with --index that covers the times from <start> to <end> "
+				 "seconds, from the keyframe before <start> so that it can be decoded. Times are as in the "
+				 "timestamp file, so they run on from one segment to the next. The output goes to stdout if no "
+				 "file is given. With --list, prints the keyframes in the index instead."
+			  << std::endl;
+}
+
+static double parse_seconds(std::string const &arg)
+{
+	size_t end;
+	double seconds = std::stod(arg, &end);
+	if (end != arg.size())
+		throw std::runtime_error("bad time " + arg);
+	return seconds;
+}
+
+int main(int argc, char *argv[])
+{
+	recording r = {};
+	try
+	{
+		std::string index_file;
+		bool list = false;
+		std::vector<std::string> args;
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--index" && i + 1 < argc)
+				index_file = argv[++i];
+			else if (arg == "--list")
+				list = true;
+			else if (arg == "--help" || arg == "-h")
+			{
+				usage();
+				return 0;
+			}
+			else if (arg.size() > 1 && arg[0] == '-')
+				throw std::runtime_error("unrecognised option " + arg);
+			else
+				args.push_back(arg);
+		}
+		if (list ? args.size() != 1 : args.size() < 3 || args.size() > 4)
+		{
+			usage();
+			return -1;
+		}
+
+		if (recording_open(&r, args[0].c_str(), index_file.empty() ? nullptr : index_file.c_str()))
+			throw std::runtime_error("failed to open " + args[0] + " with its index");
+
+		if (list)
+		{
+			for (size_t i = 0; i < r.num_entries; i++)
+				std::cout << r.entries[i].frame << " " << r.entries[i].timestamp_us / 1000.0 << " ms at "
+						  << r.entries[i].offset << std::endl;
+			recording_close(&r);
+			return 0;
+		}
+
+		int64_t start_us = parse_seconds(args[1]) * 1000000;
+		int64_t end_us = parse_seconds(args[2]) * 1000000;
+		size_t offset, size;
+		if (recording_find_range(&r, start_us, end_us, &offset, &size) < 0)
+			throw std::runtime_error("nothing in " + args[0] + " between " + args[1] + " and " + args[2] + " seconds");
+
+		FILE *fp = stdout;
+		if (args.size() == 4 && args[3] != "-")
+		{
+			fp = fopen(args[3].c_str(), "w");
+			if (!fp)
+				throw std::runtime_error("failed to open " + args[3]);
+		}
+		bool failed = fwrite(r.data + offset, 1, size, fp) != size;
+		failed |= fp == stdout ? fflush(fp) != 0 : fclose(fp) != 0;
+		if (failed)
+			throw std::runtime_error("failed to write output");
+		recording_close(&r);
+	}
+	catch (std::exception const &e)
+	{
+		recording_close(&r);
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,209 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rpicam_metadata.cpp - convert binary metadata files to json or txt.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "output/metadata_format.h"
+
+template <typename T>
+static T get(uint8_t const *data)
+{
+	T value;
+	memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+// Format a value exactly as libcamera's ControlValue::toString does, so that the output
+// matches what --metadata-format json or txt would have written.
+static std::string value_string(metadata_value_header const &header, uint8_t const *data)
+{
+	if (header.type == METADATA_TYPE_STRING)
+		return std::string((char const *)data, header.data_size);
+
+	static const std::map<uint32_t, size_t> element_sizes = {
+		{ METADATA_TYPE_BOOL, 1 },	{ METADATA_TYPE_BYTE, 1 },		{ METADATA_TYPE_INT32, 4 }, { METADATA_TYPE_INT64, 8 },
+		{ METADATA_TYPE_FLOAT, 4 }, { METADATA_TYPE_RECTANGLE, 16 }, { METADATA_TYPE_SIZE, 8 },
+	};
+	auto it = element_sizes.find(header.type);
+	if (it == element_sizes.end() || (uint64_t)it->second * header.num_elements > header.data_size)
+		return "<ValueType Error>";
+
+	bool array = header.flags & METADATA_VALUE_FLAG_ARRAY;
+	std::ostringstream out;
+	out << (array ? "[ " : "");
+	for (unsigned int i = 0; i < header.num_elements; i++, data += it->second)
+	{
+		switch (header.type)
+		{
+		case METADATA_TYPE_BOOL:
+			out << (data[0] ? "true" : "false");
+			break;
+		case METADATA_TYPE_BYTE:
+			out << (unsigned int)data[0];
+			break;
+		case METADATA_TYPE_INT32:
+			out << get<int32_t>(data);
+			break;
+		case METADATA_TYPE_INT64:
+			out << get<int64_t>(data);
+			break;
+		case METADATA_TYPE_FLOAT:
+			out << std::to_string(get<float>(data));
+			break;
+		case METADATA_TYPE_RECTANGLE:
+			out << "(" << get<int32_t>(data) << ", " << get<int32_t>(data + 4) << ")/" << get<uint32_t>(data + 8)
+				<< "x" << get<uint32_t>(data + 12);
+			break;
+		case METADATA_TYPE_SIZE:
+			out << get<uint32_t>(data) << "x" << get<uint32_t>(data + 4);
+			break;
+		}
+		if (i + 1 != header.num_elements)
+			out << ", ";
+	}
+	out << (array ? " ]" : "");
+	return out.str();
+}
+
+static void usage()
+{
+	std::cerr << "Usage: rpicam-metadata [--format json|txt] <metadata file> [<output file>|-]" << std::endl
+			  << "Converts a metadata file written with --metadata-format bin into json (the default) or txt, "
+				 "as those formats would have written it. The output goes to stdout if no file is given."
+			  << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		std::string format = "json";
+		std::vector<std::string> files;
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--format" && i + 1 < argc)
+				format = argv[++i];
+			else if (arg == "--help" || arg == "-h")
+			{
+				usage();
+				return 0;
+			}
+			else if (arg.size() > 1 && arg[0] == '-')
+				throw std::runtime_error("unrecognised option " + arg);
+			else
+				files.push_back(arg);
+		}
+		if (files.empty() || files.size() > 2 || (format != "json" && format != "txt"))
+		{
+			usage();
+			return -1;
+		}
+
+		FILE *fp = fopen(files[0].c_str(), "r");
+		if (!fp)
+			throw std::runtime_error("failed to open " + files[0]);
+		metadata_file_header header;
+		if (fread(&header, sizeof(header), 1, fp) != 1 ||
+			memcmp(header.magic, METADATA_FILE_MAGIC, sizeof(header.magic)))
+			throw std::runtime_error(files[0] + " is not a binary metadata file");
+		if (header.version != METADATA_VERSION)
+			throw std::runtime_error("unsupported metadata version " + std::to_string(header.version));
+		if (fseek(fp, header.header_size, SEEK_SET))
+			throw std::runtime_error("failed to read " + files[0]);
+
+		std::map<uint32_t, std::string> names;
+		for (unsigned int i = 0; i < header.num_controls; i++)
+		{
+			metadata_control_info info;
+			if (fread(&info, sizeof(info), 1, fp) != 1)
+				throw std::runtime_error("truncated control dictionary in " + files[0]);
+			std::string name((info.name_size + 3) & ~3, '\0');
+			if (fread(name.data(), name.size(), 1, fp) != 1)
+				throw std::runtime_error("truncated control dictionary in " + files[0]);
+			name.resize(info.name_size);
+			names[info.id] = name;
+		}
+
+		std::ofstream file;
+		if (files.size() == 2 && files[1] != "-")
+		{
+			file.open(files[1]);
+			if (!file)
+				throw std::runtime_error("failed to open " + files[1]);
+		}
+		std::ostream &out = file.is_open() ? file : std::cout;
+
+		if (format == "json")
+			out << "[" << std::endl;
+		std::vector<uint8_t> record;
+		unsigned int count = 0;
+		for (metadata_record_header record_header; fread(&record_header, sizeof(record_header), 1, fp) == 1; count++)
+		{
+			if (record_header.magic != METADATA_RECORD_MAGIC || record_header.size < sizeof(record_header))
+				throw std::runtime_error("bad record " + std::to_string(count) + " in " + files[0]);
+			record.resize(record_header.size - sizeof(record_header));
+			if (record.size() && fread(record.data(), record.size(), 1, fp) != 1)
+			{
+				std::cerr << "WARNING: last record in " << files[0] << " is truncated" << std::endl;
+				break;
+			}
+
+			if (format == "json")
+				out << (count ? ",\n{" : "{");
+			size_t pos = 0;
+			for (unsigned int i = 0; i < record_header.num_values; i++)
+			{
+				metadata_value_header value;
+				if (pos + sizeof(value) > record.size())
+					throw std::runtime_error("bad record " + std::to_string(count) + " in " + files[0]);
+				memcpy(&value, record.data() + pos, sizeof(value));
+				pos += sizeof(value);
+				if (pos + value.data_size > record.size())
+					throw std::runtime_error("bad record " + std::to_string(count) + " in " + files[0]);
+
+				auto name = names.find(value.id);
+				std::string name_string = name == names.end() ? std::to_string(value.id) : name->second;
+				std::string value_str = value_string(value, record.data() + pos);
+				pos += (value.data_size + 3) & ~3;
+				if (format == "txt")
+					out << name_string << "=" << value_str << std::endl;
+				else
+				{
+					std::string quote = value_str.find('/') != std::string::npos ? "\"" : "";
+					out << (i ? "," : "") << std::endl
+						<< "    \"" << name_string << "\": " << quote << value_str << quote;
+				}
+			}
+			if (format == "txt")
+				out << std::endl;
+			else
+				out << std::endl << "}";
+		}
+		if (format == "json")
+			out << std::endl << "]" << std::endl;
+
+		fclose(fp);
+		out.flush();
+		if (!out)
+			throw std::runtime_error("failed to write output");
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -8,7 +8,7 @@
 #include <chrono>
 
 #include "core/rpicam_encoder.hpp"
-#include "encoder/null_encoder.hpp"
+#include "encoder/encoder.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
@@ -19,8 +19,8 @@ public:
 	LibcameraRaw() : RPiCamEncoder() {}
 
 protected:
-	// Force the use of "null" encoder.
-	void createEncoder() { encoder_ = std::unique_ptr<Encoder>(new NullEncoder(GetOptions())); }
+	// Force the use of "null" encoder, or the lossless compressor if one was asked for.
+	void createEncoder() { encoder_ = std::unique_ptr<Encoder>(Encoder::CreateUncompressed(GetOptions())); }
 };
 
 // The main even loop for the application.
@@ -30,10 +30,11 @@ static void event_loop(LibcameraRaw &app)
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
 	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2, _3, _4));
 
 	app.OpenCamera();
 	app.ConfigureVideo(LibcameraRaw::FLAG_VIDEO_RAW);
+	output->SetStreamInfo(app.GetStreamInfo(app.RawStream()), app.CameraModel(), app.SensorMode());
 	app.StartEncoder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
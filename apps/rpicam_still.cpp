@@ -6,6 +6,7 @@
  */
 #include <chrono>
 #include <filesystem>
+#include <optional>
 #include <poll.h>
 #include <signal.h>
 #include <sys/signalfd.h>
@@ -13,8 +14,10 @@
 
 #include <chrono>
 
+#include "core/burst_buffer.hpp"
 #include "core/frame_info.hpp"
 #include "core/rpicam_app.hpp"
+#include "core/save_queue.hpp"
 #include "core/still_options.hpp"
 
 #include "output/output.hpp"
@@ -64,68 +67,277 @@ static void update_latest_link(std::string const &filename, StillOptions const *
 	// Create a fixed-name link to the most recent output file, if requested.
 	if (!options->latest.empty())
 	{
+		// Make the new link under another name and rename it over the old one, so that the
+		// link is never missing, and a stale temporary link can't stop us.
 		fs::path link { options->latest };
-		fs::path target { filename };
-
-		if (fs::exists(link) && !fs::remove(link))
-			LOG_ERROR("WARNING: could not delete latest link " << options->latest);
+		fs::path temp { options->latest + ".tmp" };
+		std::error_code ec;
+		fs::remove(temp, ec);
+		fs::create_symlink(fs::path { filename }, temp, ec);
+		if (!ec)
+			fs::rename(temp, link, ec);
+		if (ec)
+			LOG_ERROR("WARNING: could not update latest link " << options->latest << ": " << ec.message());
 		else
-		{
-			fs::create_symlink(target, link);
 			LOG(2, "Link " << options->latest << " created");
-		}
 	}
 }
 
-static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream *stream,
-					   std::string const &filename)
+static SaveQueue::SaveFunction image_saver(RPiCamStillApp &app, Stream *stream)
 {
 	StillOptions const *options = app.GetOptions();
+	std::string cam_model = app.CameraModel();
+	bool raw = stream == app.RawStream();
+	return [options, cam_model, raw](std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+									 libcamera::ControlList const &metadata, std::string const &filename) {
+		if (raw)
+			dng_save(mem, info, metadata, filename, cam_model, options);
+		else if (options->encoding == "jpg")
+			jpeg_save(mem, info, metadata, filename, cam_model, options);
+		else if (options->encoding == "png")
+			png_save(mem, info, filename, options);
+		else if (options->encoding == "bmp")
+			bmp_save(mem, info, filename, options);
+		else
+			yuv_save(mem, info, filename, options);
+		LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
+	};
+}
+
+static void save_metadata(StillOptions const *options, libcamera::ControlList const &metadata)
+{
+	std::streambuf *buf = std::cout.rdbuf();
+	std::ofstream of;
+	const std::string &filename = options->metadata;
+
+	if (filename.compare("-"))
+	{
+		of.open(filename, std::ios::out);
+		buf = of.rdbuf();
+	}
+
+	write_metadata(buf, options->metadata_format, metadata, true);
+}
+
+// Called once an image is saved. Background saves run on several threads and may finish
+// together or out of order, so serialise them, and only move the latest link and metadata
+// file forward to newer frames. Metadata going to stdout is written for every frame.
+static void image_done(StillOptions const *options, std::string const &filename,
+					   libcamera::ControlList const &metadata)
+{
+	static std::mutex done_mutex;
+	static int64_t latest_timestamp = -1;
+	std::lock_guard<std::mutex> lock(done_mutex);
+
+	int64_t timestamp = metadata.get(libcamera::controls::SensorTimestamp).value_or(0);
+	bool newest = timestamp >= latest_timestamp;
+	if (newest)
+	{
+		latest_timestamp = timestamp;
+		update_latest_link(filename, options);
+	}
+	else
+		LOG(2, "Not linking " << filename << " as a newer image was saved first");
+	if (!options->metadata.empty() && (newest || options->metadata == "-"))
+		save_metadata(options, metadata);
+}
+
+static void save_image(RPiCamStillApp &app, CompletedRequestPtr &payload, Stream *stream,
+					   std::string const &filename, SaveQueue *save_queue, SaveQueue::DoneFunction done)
+{
+	if (save_queue)
+	{
+		save_queue->Push(payload, stream, filename, image_saver(app, stream), done);
+		return;
+	}
+
 	StreamInfo info = app.GetStreamInfo(stream);
 	BufferReadSync r(&app, payload->buffers[stream]);
-	const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-	if (stream == app.RawStream())
-		dng_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
-	else if (options->encoding == "jpg")
-		jpeg_save(mem, info, payload->metadata, filename, app.CameraModel(), options);
-	else if (options->encoding == "png")
-		png_save(mem, info, filename, options);
-	else if (options->encoding == "bmp")
-		bmp_save(mem, info, filename, options);
-	else
-		yuv_save(mem, info, filename, options);
-	LOG(2, "Saved image " << info.width << " x " << info.height << " to file " << filename);
+	image_saver(app, stream)(r.Get(), info, payload->metadata, filename);
+	if (done)
+		done(filename, payload->metadata);
 }
 
-static void save_images(RPiCamStillApp &app, CompletedRequestPtr &payload)
+static void save_images(RPiCamStillApp &app, CompletedRequestPtr &payload, SaveQueue *save_queue)
 {
 	StillOptions *options = app.GetOptions();
 	std::string filename = generate_filename(options);
-	save_image(app, payload, app.StillStream(), filename);
-	update_latest_link(filename, options);
+	auto done = [options](std::string const &filename, libcamera::ControlList const &metadata) {
+		image_done(options, filename, metadata);
+	};
+	save_image(app, payload, app.StillStream(), filename, save_queue, done);
 	if (options->raw)
 	{
 		filename = filename.substr(0, filename.rfind('.')) + ".dng";
-		save_image(app, payload, app.RawStream(), filename);
+		save_image(app, payload, app.RawStream(), filename, save_queue, nullptr);
 	}
 	options->framestart++;
 	if (options->wrap)
 		options->framestart %= options->wrap;
 }
 
-static void save_metadata(StillOptions const *options, libcamera::ControlList &metadata)
+// Burst captures copy each frame into a preallocated RAM ring and hand the camera
+// buffer straight back, so that we keep up with the sensor. Frames are saved once
+// the burst is over, or during it if we have background save threads.
+
+struct BurstFrame
 {
-	std::streambuf *buf = std::cout.rdbuf();
-	std::ofstream of;
-	const std::string &filename = options->metadata;
+	BurstBuffer::Slot *slot;
+	std::string filename;
+	std::vector<libcamera::Span<uint8_t>> still;
+	std::vector<libcamera::Span<uint8_t>> raw;
+};
 
-	if (filename.compare("-"))
+struct BurstState
+{
+	~BurstState()
 	{
-		of.open(filename, std::ios::out);
-		buf = of.rdbuf();
+		// Frames from an interrupted burst never got saved.
+		for (auto const &frame : pending)
+			ring->Release(frame.slot);
 	}
 
-	write_metadata(buf, options->metadata_format, metadata, true);
+	std::unique_ptr<BurstBuffer> ring;
+	std::vector<BurstFrame> pending;
+	StreamInfo still_info;
+	StreamInfo raw_info;
+	SaveQueue::SaveFunction still_saver;
+	SaveQueue::SaveFunction raw_saver;
+	unsigned int captured = 0;
+	unsigned int dropped = 0;
+	unsigned int last_sequence = 0;
+	int64_t first_timestamp = 0;
+	int64_t last_timestamp = 0;
+};
+
+static void save_burst_frame(RPiCamStillApp &app, BurstState &burst, BurstFrame const &frame, SaveQueue *save_queue)
+{
+	StillOptions const *options = app.GetOptions();
+	std::string raw_filename = frame.filename.substr(0, frame.filename.rfind('.')) + ".dng";
+	BurstBuffer *ring = burst.ring.get();
+	libcamera::ControlList const &metadata = frame.slot->metadata;
+	auto done = [options](std::string const &filename, libcamera::ControlList const &metadata) {
+		image_done(options, filename, metadata);
+	};
+
+	if (save_queue)
+	{
+		// The slot goes back to the ring once both the still and raw images are written.
+		std::shared_ptr<BurstBuffer::Slot> hold(frame.slot, [ring](BurstBuffer::Slot *slot) { ring->Release(slot); });
+		save_queue->Push(frame.still, burst.still_info, metadata, frame.filename, burst.still_saver,
+						 [done, hold](std::string const &filename, libcamera::ControlList const &metadata) {
+							 done(filename, metadata);
+						 });
+		if (!frame.raw.empty())
+			save_queue->Push(frame.raw, burst.raw_info, metadata, raw_filename, burst.raw_saver,
+							 [hold](std::string const &, libcamera::ControlList const &) {});
+		return;
+	}
+
+	burst.still_saver(frame.still, burst.still_info, metadata, frame.filename);
+	done(frame.filename, metadata);
+	if (!frame.raw.empty())
+		burst.raw_saver(frame.raw, burst.raw_info, metadata, raw_filename);
+	ring->Release(frame.slot);
+}
+
+// Returns true once the burst is complete.
+static bool burst_capture(RPiCamStillApp &app, CompletedRequestPtr &payload, BurstState &burst,
+						  SaveQueue *save_queue)
+{
+	StillOptions *options = app.GetOptions();
+	Stream *still_stream = app.StillStream();
+	Stream *raw_stream = options->raw ? app.RawStream() : nullptr;
+	// Both syncs must last until the frame has been copied into the ring.
+	BufferReadSync still_buffer(&app, payload->buffers[still_stream]);
+	std::optional<BufferReadSync> raw_buffer;
+	std::vector<libcamera::Span<uint8_t>> raw_planes;
+	if (raw_stream)
+	{
+		raw_buffer.emplace(&app, payload->buffers[raw_stream]);
+		raw_planes = raw_buffer->Get();
+	}
+
+	if (!burst.captured)
+	{
+		// Allow for each plane being aligned within the slot.
+		size_t frame_size = 0;
+		for (auto const &plane : still_buffer.Get())
+			frame_size += plane.size() + 64;
+		for (auto const &plane : raw_planes)
+			frame_size += plane.size() + 64;
+
+		unsigned int num_slots = std::min<size_t>(options->burst, ((size_t)options->burst_budget << 20) / frame_size);
+		num_slots = std::max(num_slots, 1u);
+		if (!burst.ring || burst.ring->SlotSize() < frame_size || burst.ring->NumSlots() != num_slots)
+		{
+			burst.ring.reset();
+			burst.ring = std::make_unique<BurstBuffer>(frame_size, num_slots, options->burst_hugepages);
+		}
+		if (num_slots < options->burst && !save_queue)
+			LOG(1, "Burst: memory budget only allows " << num_slots << " frames without --save-threads");
+
+		burst.still_info = app.GetStreamInfo(still_stream);
+		burst.still_saver = image_saver(app, still_stream);
+		if (raw_stream)
+		{
+			burst.raw_info = app.GetStreamInfo(raw_stream);
+			burst.raw_saver = image_saver(app, raw_stream);
+		}
+		burst.dropped = 0;
+	}
+
+	unsigned int sequence = payload->buffers[still_stream]->metadata().sequence;
+	auto ts = payload->metadata.get(controls::SensorTimestamp);
+	int64_t timestamp = ts ? *ts : payload->buffers[still_stream]->metadata().timestamp;
+	if (!burst.captured)
+		burst.first_timestamp = timestamp;
+	else if (sequence > burst.last_sequence + 1)
+		burst.dropped += sequence - burst.last_sequence - 1;
+	burst.last_sequence = sequence;
+
+	BurstBuffer::Slot *slot = burst.ring->Acquire();
+	if (!slot)
+	{
+		// Without save threads nothing frees up a slot until the burst is over.
+		if (!save_queue)
+			return true;
+		burst.dropped++;
+		return false;
+	}
+
+	BurstFrame frame;
+	frame.slot = slot;
+	frame.filename = generate_filename(options);
+	frame.still = burst.ring->Copy(slot, still_buffer.Get());
+	if (raw_stream)
+		frame.raw = burst.ring->Copy(slot, raw_planes);
+	slot->metadata = payload->metadata;
+	options->framestart++;
+	if (options->wrap)
+		options->framestart %= options->wrap;
+
+	burst.captured++;
+	burst.last_timestamp = timestamp;
+	if (save_queue)
+		save_burst_frame(app, burst, frame, save_queue);
+	else
+		burst.pending.push_back(frame);
+
+	return burst.captured >= options->burst;
+}
+
+static void burst_finish(RPiCamStillApp &app, BurstState &burst, SaveQueue *save_queue)
+{
+	double duration = (burst.last_timestamp - burst.first_timestamp) / 1e9;
+	double fps = burst.captured > 1 && duration > 0 ? (burst.captured - 1) / duration : 0;
+	LOG(1, "Burst captured " << burst.captured << " frames in " << duration * 1000 << "ms (" << fps
+							 << " fps), dropped " << burst.dropped << " frames");
+
+	for (auto const &frame : burst.pending)
+		save_burst_frame(app, burst, frame, save_queue);
+	burst.pending.clear();
+	burst.captured = 0;
 }
 
 // Some keypress/signal handling.
@@ -163,7 +375,7 @@ static int get_key_or_signal(StillOptions const *options, pollfd p[1])
 
 // The main even loop for the application.
 
-static void event_loop(RPiCamStillApp &app)
+static void event_loop(RPiCamStillApp &app, SaveQueue *save_queue)
 {
 	StillOptions const *options = app.GetOptions();
 	bool output = !options->output.empty() || options->datetime || options->timestamp; // output requested?
@@ -177,6 +389,10 @@ static void event_loop(RPiCamStillApp &app)
 		still_flags |= RPiCamApp::FLAG_STILL_RGB;
 	if (options->raw)
 		still_flags |= RPiCamApp::FLAG_STILL_RAW;
+	// Bursts need the camera to keep streaming while we copy each frame out.
+	if (options->burst)
+		still_flags |= RPiCamApp::FLAG_STILL_TRIPLE_BUFFER;
+	BurstState burst;
 
 	app.OpenCamera();
 
@@ -291,6 +507,8 @@ static void event_loop(RPiCamStillApp &app)
 				if (!options->zsl)
 				{
 					app.StopCamera();
+					if (save_queue)
+						save_queue->Detach();
 					app.Teardown();
 					app.ConfigureStill(still_flags);
 				}
@@ -311,18 +529,25 @@ static void event_loop(RPiCamStillApp &app)
 		// otherwise quit.
 		else if (app.StillStream() && want_capture)
 		{
+			if (options->burst && !burst_capture(app, completed_request, burst, save_queue))
+				continue;
 			want_capture = false;
 			if (!options->zsl)
 				app.StopCamera();
-			LOG(1, "Still capture image received");
-			save_images(app, completed_request);
-			if (!options->metadata.empty())
-				save_metadata(options, completed_request->metadata);
+			if (options->burst)
+				burst_finish(app, burst, save_queue);
+			else
+			{
+				LOG(1, "Still capture image received");
+				save_images(app, completed_request, save_queue);
+			}
 			timelapse_frames = 0;
 			if (!options->immediate && (options->timelapse || options->signal || options->keypress))
 			{
 				if (!options->zsl)
 				{
+					if (save_queue)
+						save_queue->Detach();
 					app.Teardown();
 					app.ConfigureViewfinder();
 				}
@@ -354,7 +579,16 @@ int main(int argc, char *argv[])
 			if (options->verbose >= 2)
 				options->Print();
 
-			event_loop(app);
+			// Encoding and writing images in the background lets us get straight back to
+			// capturing, particularly in timelapse and keypress modes.
+			std::unique_ptr<SaveQueue> save_queue;
+			if (options->save_threads)
+				save_queue = std::make_unique<SaveQueue>(&app, options->save_threads,
+														 (size_t)options->save_budget << 20);
+
+			event_loop(app, save_queue.get());
+			if (save_queue)
+				save_queue->Flush();
 		}
 	}
 	catch (std::exception const &e)
@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rpicam_unpack.cpp - extract frames from an indexed container file.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#if ZSTD_PRESENT
+#include <zstd.h>
+#endif
+
+#include "output/container_format.h"
+
+// Undo the predictor of the zstd encoder, returning each sample to its original value.
+template <typename T>
+static void delta_decode(T *data, size_t samples, size_t line_samples, unsigned int distance)
+{
+	for (size_t line = 0; line < samples; line += line_samples)
+	{
+		size_t n = std::min(line_samples, samples - line);
+		T *d = data + line;
+		for (size_t i = distance; i < n; i++)
+		{
+			T zigzag = d[i];
+			T diff = (T)(zigzag >> 1) ^ (T)(0 - (zigzag & 1));
+			d[i] = d[i - distance] + diff;
+		}
+	}
+}
+
+struct Container
+{
+	Container(std::string const &filename)
+	{
+		fp = fopen(filename.c_str(), "r");
+		if (!fp)
+			throw std::runtime_error("failed to open " + filename);
+
+		if (fread(&header, sizeof(header), 1, fp) != 1 ||
+			memcmp(header.magic, CONTAINER_FILE_MAGIC, sizeof(header.magic)))
+			throw std::runtime_error(filename + " is not a container file");
+		if (header.version != CONTAINER_VERSION)
+			throw std::runtime_error("unsupported container version " + std::to_string(header.version));
+		// Don't trust the strings to be terminated.
+		header.pixel_format_name[sizeof(header.pixel_format_name) - 1] = 0;
+		header.camera[sizeof(header.camera) - 1] = 0;
+		header.sensor_mode[sizeof(header.sensor_mode) - 1] = 0;
+		header.tuning_file[sizeof(header.tuning_file) - 1] = 0;
+
+		// Use the index at the end if it's there. A recording that never finished has no index,
+		// in which case we find the frames by walking through their headers.
+		container_footer footer;
+		if (fseeko(fp, -(off_t)sizeof(footer), SEEK_END) == 0 && fread(&footer, sizeof(footer), 1, fp) == 1 &&
+			footer.magic == CONTAINER_INDEX_MAGIC && fseeko(fp, footer.index_offset, SEEK_SET) == 0)
+		{
+			index.resize(footer.count);
+			if (fread(index.data(), sizeof(container_index_entry), footer.count, fp) != footer.count)
+				throw std::runtime_error("failed to read index");
+			return;
+		}
+
+		std::cerr << "No index found, scanning " << filename << std::endl;
+		uint64_t alignment = header.alignment ? header.alignment : 1;
+		off_t offset = header.data_offset;
+		container_frame_header frame;
+		while (fseeko(fp, offset, SEEK_SET) == 0 && fread(&frame, sizeof(frame), 1, fp) == 1 &&
+			   frame.magic == CONTAINER_FRAME_MAGIC)
+		{
+			index.push_back({ (uint64_t)offset, frame.data_size, frame.timestamp_us });
+			offset += (frame.header_size + frame.data_size + alignment - 1) / alignment * alignment;
+		}
+	}
+	~Container() { fclose(fp); }
+
+	// Read the frame data as it was written to the container.
+	void Read(size_t n, std::vector<uint8_t> &data, container_frame_header &frame)
+	{
+		if (fseeko(fp, index[n].offset, SEEK_SET) || fread(&frame, sizeof(frame), 1, fp) != 1 ||
+			frame.magic != CONTAINER_FRAME_MAGIC || fseeko(fp, index[n].offset + frame.header_size, SEEK_SET))
+			throw std::runtime_error("bad frame header for frame " + std::to_string(n));
+		data.resize(frame.data_size);
+		if (frame.data_size && fread(data.data(), frame.data_size, 1, fp) != 1)
+			throw std::runtime_error("frame " + std::to_string(n) + " is truncated");
+	}
+
+	// Get back the original bytes of the frame.
+	void Unpack(size_t n, std::vector<uint8_t> &data, std::vector<uint8_t> &raw)
+	{
+		container_frame_header frame_header;
+		Read(n, data, frame_header);
+		if (header.compression == CONTAINER_COMPRESSION_NONE)
+		{
+			raw.swap(data);
+			return;
+		}
+
+		compressed_frame_header frame;
+		if (data.size() < sizeof(frame))
+			throw std::runtime_error("frame " + std::to_string(n) + " is too short");
+		memcpy(&frame, data.data(), sizeof(frame));
+		if (frame.magic != COMPRESSED_FRAME_MAGIC || frame.header_size + frame.compressed_size > data.size())
+			throw std::runtime_error("bad compressed frame header for frame " + std::to_string(n));
+
+		raw.resize(frame.raw_size);
+		if (frame.compression == CONTAINER_COMPRESSION_ZSTD)
+		{
+#if ZSTD_PRESENT
+			size_t ret = ZSTD_decompress(raw.data(), raw.size(), data.data() + frame.header_size,
+										 frame.compressed_size);
+			if (ZSTD_isError(ret) || ret != raw.size())
+				throw std::runtime_error("failed to decompress frame " + std::to_string(n) + ": " +
+										 (ZSTD_isError(ret) ? ZSTD_getErrorName(ret) : "wrong size"));
+#else
+			throw std::runtime_error("zstd is not available in this build");
+#endif
+		}
+		else
+			throw std::runtime_error("unknown compression " + std::to_string(frame.compression));
+
+		if (frame.predictor == CONTAINER_PREDICTOR_DELTA)
+		{
+			if ((frame.sample_bytes != 1 && frame.sample_bytes != 2) || !frame.stride || !frame.sample_distance)
+				throw std::runtime_error("bad predictor parameters for frame " + std::to_string(n));
+			size_t samples = raw.size() / frame.sample_bytes;
+			if (frame.sample_bytes == 2)
+				delta_decode((uint16_t *)raw.data(), samples, frame.stride / 2, frame.sample_distance);
+			else
+				delta_decode(raw.data(), samples, frame.stride, frame.sample_distance);
+		}
+		else if (frame.predictor != CONTAINER_PREDICTOR_NONE)
+			throw std::runtime_error("unknown predictor " + std::to_string(frame.predictor));
+	}
+
+	FILE *fp;
+	container_file_header header;
+	std::vector<container_index_entry> index;
+};
+
+static void usage()
+{
+	std::cerr << "Usage: rpicam-unpack [--info] [--frame <n>] <container file> [<output file>|-]" << std::endl
+			  << "Writes out the frames of a container file exactly as an uncompressed recording would have had "
+				 "them, or just the one frame given by --frame. --info lists the frames instead."
+			  << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		bool info = false;
+		long frame = -1;
+		std::vector<std::string> files;
+		for (int i = 1; i < argc; i++)
+		{
+			std::string arg = argv[i];
+			if (arg == "--info")
+				info = true;
+			else if (arg == "--frame" && i + 1 < argc)
+				frame = std::stol(argv[++i]);
+			else if (arg == "--help" || arg == "-h")
+			{
+				usage();
+				return 0;
+			}
+			else if (arg.size() > 1 && arg[0] == '-')
+				throw std::runtime_error("unrecognised option " + arg);
+			else
+				files.push_back(arg);
+		}
+		if (files.size() != (info ? 1 : 2))
+		{
+			usage();
+			return -1;
+		}
+
+		Container container(files[0]);
+		size_t first = 0, last = container.index.size();
+		if (frame >= 0)
+		{
+			if ((size_t)frame >= container.index.size())
+				throw std::runtime_error("there are only " + std::to_string(container.index.size()) + " frames");
+			first = frame, last = frame + 1;
+		}
+
+		std::vector<uint8_t> data, raw;
+		if (info)
+		{
+			container_file_header const &header = container.header;
+			std::cout << header.width << "x" << header.height << " stride " << header.stride << " format "
+					  << header.pixel_format_name << std::endl
+					  << "camera " << header.camera << " sensor mode " << header.sensor_mode << " tuning file "
+					  << (header.tuning_file[0] ? header.tuning_file : "(libcamera)") << std::endl
+					  << container.index.size() << " frames, compression " << header.compression << std::endl;
+			for (size_t n = first; n < last; n++)
+			{
+				auto const &entry = container.index[n];
+				container_frame_header frame_header;
+				container.Read(n, data, frame_header);
+				std::cout << n << ": offset " << entry.offset << " size " << entry.data_size << " timestamp "
+						  << entry.timestamp_us << "us sequence " << frame_header.sequence << " exposure "
+						  << frame_header.exposure_time << "us gain " << frame_header.analogue_gain << " * "
+						  << frame_header.digital_gain;
+				if (container.header.compression != CONTAINER_COMPRESSION_NONE)
+				{
+					compressed_frame_header header;
+					memcpy(&header, data.data(), std::min(data.size(), sizeof(header)));
+					std::cout << " " << header.width << "x" << header.height << " stride " << header.stride
+							  << " raw size " << header.raw_size << " ratio "
+							  << (double)header.raw_size / header.compressed_size;
+				}
+				std::cout << std::endl;
+			}
+			return 0;
+		}
+
+		FILE *out = files[1] == "-" ? stdout : fopen(files[1].c_str(), "w");
+		if (!out)
+			throw std::runtime_error("failed to open " + files[1]);
+		for (size_t n = first; n < last; n++)
+		{
+			container.Unpack(n, data, raw);
+			if (raw.size() && fwrite(raw.data(), raw.size(), 1, out) != 1)
+				throw std::runtime_error("failed to write " + files[1]);
+		}
+		if (out == stdout ? fflush(out) : fclose(out))
+			throw std::runtime_error("failed to write " + files[1]);
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -9,9 +9,12 @@
 #include <poll.h>
 #include <signal.h>
 #include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 
 #include "core/rpicam_encoder.hpp"
+#include "output/frame_bus.hpp"
 #include "output/output.hpp"
 
 using namespace std::placeholders;
@@ -45,6 +48,10 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 	{
 		if (signal_received == SIGUSR1)
 			key = '\n';
+		else if (signal_received == SIGRTMIN)
+			key = 'k';
+		else if (signal_received == SIGRTMIN + 1)
+			key = 't';
 		else if ((signal_received == SIGUSR2) || (signal_received == SIGPIPE))
 			key = 'x';
 		signal_received = 0;
@@ -52,6 +59,70 @@ static int get_key_or_signal(VideoOptions const *options, pollfd p[1])
 	return key;
 }
 
+// A unix datagram socket that other processes can send commands to, such as
+// "keyframe", "bitrate 2mbps" or "trigger".
+
+class ControlSocket
+{
+public:
+	ControlSocket(std::string const &path) : path_(path)
+	{
+		fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd_ < 0)
+			throw std::runtime_error("unable to open control socket");
+		sockaddr_un addr = {};
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			throw std::runtime_error("control socket path too long: " + path);
+		strcpy(addr.sun_path, path.c_str());
+		unlink(path.c_str());
+		if (bind(fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+			throw std::runtime_error("failed to bind control socket " + path);
+		LOG(1, "Listening for commands on " << path);
+	}
+	~ControlSocket()
+	{
+		close(fd_);
+		unlink(path_.c_str());
+	}
+	void Handle(RPiCamEncoder &app, Output &output)
+	{
+		char buf[256];
+		ssize_t n;
+		while ((n = recv(fd_, buf, sizeof(buf) - 1, 0)) > 0)
+		{
+			std::string command(buf, n);
+			command.erase(command.find_last_not_of(" \r\n") + 1);
+			LOG(2, "Control command: " << command);
+			if (command == "keyframe")
+				app.RequestKeyframe();
+			else if (command == "trigger")
+				output.Trigger();
+			else if (command.compare(0, 8, "bitrate ") == 0)
+			{
+				Bitrate bitrate;
+				try
+				{
+					bitrate.set(command.substr(8));
+				}
+				catch (std::exception const &)
+				{
+					LOG_ERROR("WARNING: bad control command: " << command);
+					continue;
+				}
+				if (!app.SetBitrate(bitrate.bps()))
+					LOG_ERROR("WARNING: encoder cannot change bitrate");
+			}
+			else
+				LOG_ERROR("WARNING: unknown control command: " << command);
+		}
+	}
+
+private:
+	std::string path_;
+	int fd_;
+};
+
 static int get_colourspace_flags(std::string const &codec)
 {
     if (codec == "mjpeg" || codec == "yuv420" || codec == "h264")
@@ -66,11 +137,27 @@ static void event_loop(RPiCamEncoder &app)
 {
 	VideoOptions const *options = app.GetOptions();
 	std::unique_ptr<Output> output = std::unique_ptr<Output>(Output::Create(options));
-	app.SetEncodeOutputReadyCallback(std::bind(&Output::OutputReady, output.get(), _1, _2, _3, _4));
-	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1));
+	std::unique_ptr<FrameBusPublisher> frame_bus;
+	app.SetEncodeOutputReadyCallback(
+		[&output, &frame_bus](void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+		{
+			if (frame_bus)
+				frame_bus->PublishPacket(mem, size, timestamp_us, keyframe);
+			output->OutputReady(mem, size, timestamp_us, keyframe);
+		});
+	app.SetMetadataReadyCallback(std::bind(&Output::MetadataReady, output.get(), _1, _2, _3, _4));
+	output->SetBitrateCallback(std::bind(&RPiCamEncoder::SetBitrate, &app, _1));
+	output->SetKeyframeCallback(std::bind(&RPiCamEncoder::RequestKeyframe, &app));
+	output->SetHoldCallback(std::bind(&RPiCamEncoder::HoldOutputBuffer, &app));
+	std::unique_ptr<ControlSocket> control_socket;
+	if (!options->control_socket.empty())
+		control_socket = std::make_unique<ControlSocket>(options->control_socket);
 
 	app.OpenCamera();
 	app.ConfigureVideo(get_colourspace_flags(options->codec));
+	if (!options->frame_bus.empty())
+		frame_bus = std::make_unique<FrameBusPublisher>(app, options);
+	output->SetStreamInfo(app.GetStreamInfo(app.VideoStream()), app.CameraModel(), app.SensorMode());
 	app.StartEncoder();
 	app.StartCamera();
 	auto start_time = std::chrono::high_resolution_clock::now();
@@ -78,6 +165,8 @@ static void event_loop(RPiCamEncoder &app)
 	// Monitoring for keypresses and signals.
 	signal(SIGUSR1, default_signal_handler);
 	signal(SIGUSR2, default_signal_handler);
+	signal(SIGRTMIN, default_signal_handler);
+	signal(SIGRTMIN + 1, default_signal_handler);
 	signal(SIGINT, default_signal_handler);
 	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
 	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
@@ -102,6 +191,12 @@ static void event_loop(RPiCamEncoder &app)
 		int key = get_key_or_signal(options, p);
 		if (key == '\n')
 			output->Signal();
+		else if (key == 'k' || key == 'K')
+			app.RequestKeyframe();
+		else if (key == 't' || key == 'T')
+			output->Trigger();
+		if (control_socket)
+			control_socket->Handle(app, *output);
 
 		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
@@ -119,7 +214,21 @@ static void event_loop(RPiCamEncoder &app)
 		}
 
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
-		
+		if (!options->trigger_metadata.empty())
+		{
+			bool detected = false;
+			try
+			{
+				completed_request->post_process_metadata.Get(options->trigger_metadata, detected);
+			}
+			catch (std::bad_any_cast const &)
+			{
+				throw std::runtime_error("trigger-metadata " + options->trigger_metadata + " is not a boolean");
+			}
+			if (detected)
+				output->Trigger();
+		}
+
 		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
 		int64_t timestamp_ns = *ts;
 		auto now_ts = std::chrono::steady_clock::now();
@@ -128,6 +237,8 @@ static void event_loop(RPiCamEncoder &app)
 		LOG(2, "Frame " << count << " delay: " << (now_ns.count() - timestamp_ns)/1000000 << "ms");
 
 		app.EncodeBuffer(completed_request, app.VideoStream());
+		if (frame_bus)
+			frame_bus->PublishRequest(completed_request);
 		app.ShowPreview(completed_request, app.VideoStream());
 	}
 }
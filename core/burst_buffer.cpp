@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * burst_buffer.cpp - preallocated RAM ring for burst captures.
+ */
+
+#include <sys/mman.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "core/burst_buffer.hpp"
+#include "core/logging.hpp"
+
+// Slots start on a (huge) page boundary so that they copy efficiently.
+static constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+static constexpr size_t SLOT_ALIGN = 64;
+
+BurstBuffer::BurstBuffer(size_t slot_size, unsigned int num_slots, bool hugepages)
+	: slot_size_((slot_size + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1)), map_(nullptr), hugepages_(false)
+{
+	if (!num_slots)
+		throw std::runtime_error("burst buffer needs at least one slot");
+
+	map_size_ = (slot_size_ * num_slots + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	void *map = MAP_FAILED;
+	if (hugepages)
+	{
+		// This needs pages reserved in /proc/sys/vm/nr_hugepages, otherwise we fall
+		// back to asking for transparent huge pages.
+		map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+				   -1, 0);
+		hugepages_ = map != MAP_FAILED;
+		if (!hugepages_)
+			LOG(1, "BurstBuffer: no hugetlb pages available, using transparent huge pages");
+	}
+	if (map == MAP_FAILED)
+	{
+		map = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			throw std::runtime_error("failed to allocate " + std::to_string(map_size_ >> 20) + "MB burst buffer");
+		if (hugepages)
+			madvise(map, map_size_, MADV_HUGEPAGE);
+		// Fault everything in now rather than during the burst.
+		if (madvise(map, map_size_, MADV_WILLNEED) < 0 || mlock(map, map_size_) < 0)
+			memset(map, 0, map_size_);
+	}
+	map_ = static_cast<uint8_t *>(map);
+
+	slots_.resize(num_slots);
+	for (unsigned int i = 0; i < num_slots; i++)
+	{
+		slots_[i].mem = map_ + i * slot_size_;
+		slots_[i].used = 0;
+		free_.push_back(&slots_[num_slots - 1 - i]);
+	}
+
+	LOG(1, "BurstBuffer: " << num_slots << " slots of " << (slot_size_ >> 10) << "kB"
+						   << (hugepages_ ? " in huge pages" : ""));
+}
+
+BurstBuffer::~BurstBuffer()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		cond_var_.wait(lock, [this] { return free_.size() == slots_.size(); });
+	}
+	munlock(map_, map_size_);
+	munmap(map_, map_size_);
+}
+
+BurstBuffer::Slot *BurstBuffer::Acquire()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (free_.empty())
+		return nullptr;
+	Slot *slot = free_.back();
+	free_.pop_back();
+	slot->used = 0;
+	slot->planes.clear();
+	slot->metadata.clear();
+	return slot;
+}
+
+void BurstBuffer::Release(Slot *slot)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	free_.push_back(slot);
+	cond_var_.notify_all();
+}
+
+std::vector<libcamera::Span<uint8_t>> BurstBuffer::Copy(Slot *slot,
+														std::vector<libcamera::Span<uint8_t>> const &planes)
+{
+	std::vector<libcamera::Span<uint8_t>> copy;
+	for (auto const &plane : planes)
+	{
+		if (slot->used + plane.size() > slot_size_)
+			throw std::runtime_error("burst buffer slot too small");
+		uint8_t *dst = slot->mem + slot->used;
+		CopyStreaming(dst, plane.data(), plane.size());
+		copy.emplace_back(dst, plane.size());
+		slot->planes.emplace_back(dst, plane.size());
+		slot->used = (slot->used + plane.size() + SLOT_ALIGN - 1) & ~(SLOT_ALIGN - 1);
+	}
+	return copy;
+}
+
+void BurstBuffer::CopyStreaming(void *dst, void const *src, size_t n)
+{
+	uint8_t *d = static_cast<uint8_t *>(dst);
+	uint8_t const *s = static_cast<uint8_t const *>(src);
+
+#if defined(__aarch64__)
+	// Non-temporal load/store pairs, 64 bytes at a time.
+	size_t blocks = n >> 6;
+	if (blocks)
+	{
+		asm volatile("1:\n\t"
+					 "ldnp q0, q1, [%[s]]\n\t"
+					 "ldnp q2, q3, [%[s], #32]\n\t"
+					 "add %[s], %[s], #64\n\t"
+					 "subs %[b], %[b], #1\n\t"
+					 "stnp q0, q1, [%[d]]\n\t"
+					 "stnp q2, q3, [%[d], #32]\n\t"
+					 "add %[d], %[d], #64\n\t"
+					 "b.ne 1b\n\t"
+					 : [d] "+r"(d), [s] "+r"(s), [b] "+r"(blocks)
+					 :
+					 : "v0", "v1", "v2", "v3", "memory", "cc");
+	}
+	n &= 63;
+#elif defined(__x86_64__)
+	// Streaming stores need an aligned destination, which the slots always give us.
+	if (!((uintptr_t)d & 15))
+	{
+		for (; n >= 64; n -= 64, s += 64, d += 64)
+		{
+			__m128i a = _mm_loadu_si128((__m128i const *)s);
+			__m128i b = _mm_loadu_si128((__m128i const *)(s + 16));
+			__m128i c = _mm_loadu_si128((__m128i const *)(s + 32));
+			__m128i e = _mm_loadu_si128((__m128i const *)(s + 48));
+			_mm_stream_si128((__m128i *)d, a);
+			_mm_stream_si128((__m128i *)(d + 16), b);
+			_mm_stream_si128((__m128i *)(d + 32), c);
+			_mm_stream_si128((__m128i *)(d + 48), e);
+		}
+		_mm_sfence();
+	}
+#endif
+
+	memcpy(d, s, n);
+}
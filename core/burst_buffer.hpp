@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * burst_buffer.hpp - preallocated RAM ring for burst captures.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/controls.h>
+
+// All the memory is allocated (and faulted in) up front, so that copying a frame
+// out of a camera buffer during a burst never waits on the kernel. The camera
+// buffer can then go straight back to the camera.
+
+class BurstBuffer
+{
+public:
+	struct Slot
+	{
+		uint8_t *mem;
+		size_t used;
+		std::vector<libcamera::Span<uint8_t>> planes;
+		libcamera::ControlList metadata;
+	};
+
+	BurstBuffer(size_t slot_size, unsigned int num_slots, bool hugepages);
+	// Waits for any slots that are still being saved.
+	~BurstBuffer();
+
+	// Returns nullptr if every slot is in use.
+	Slot *Acquire();
+	void Release(Slot *slot);
+	// Append a copy of these planes to the slot, returning the spans of the copy.
+	std::vector<libcamera::Span<uint8_t>> Copy(Slot *slot, std::vector<libcamera::Span<uint8_t>> const &planes);
+
+	size_t SlotSize() const { return slot_size_; }
+	unsigned int NumSlots() const { return slots_.size(); }
+	bool Hugepages() const { return hugepages_; }
+
+	// Copy without dragging the source through the cache, as each camera frame is
+	// only ever read once.
+	static void CopyStreaming(void *dst, void const *src, size_t n);
+
+private:
+	size_t slot_size_;
+	size_t map_size_;
+	uint8_t *map_;
+	bool hugepages_;
+	std::vector<Slot> slots_;
+	std::vector<Slot *> free_;
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+};
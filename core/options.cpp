@@ -304,7 +304,8 @@ Options::Options()
 		("metadata", value<std::string>(&metadata),
 			"Save captured image metadata to a file or \"-\" for stdout")
 		("metadata-format", value<std::string>(&metadata_format)->default_value("json"),
-			"Format to save the metadata in, either txt or json (requires --metadata)")
+			"Format to save the metadata in, either txt, json or bin (requires --metadata). bin is a compact "
+			"binary format for video, which rpicam-metadata converts to json")
 		("flicker-period", value<std::string>(&flicker_period_)->default_value("0s"),
 			"Manual flicker correction period"
 			"\nSet to 10000us to cancel 50Hz flicker."
@@ -640,6 +641,8 @@ bool Options::Parse(int argc, char *argv[])
 		metadata_format = "json";
 	else if (strcasecmp(metadata_format.c_str(), "txt") == 0)
 		metadata_format = "txt";
+	else if (strcasecmp(metadata_format.c_str(), "bin") == 0)
+		metadata_format = "bin";
 	else
 		throw std::runtime_error("unrecognised metadata format " + metadata_format);
 
@@ -7,6 +7,9 @@
 
 #pragma once
 
+#include <algorithm>
+#include <deque>
+
 #include "core/rpicam_app.hpp"
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
@@ -14,7 +17,7 @@
 #include "encoder/encoder.hpp"
 
 typedef std::function<void(void *, size_t, int64_t, bool)> EncodeOutputReadyCallback;
-typedef std::function<void(libcamera::ControlList &)> MetadataReadyCallback;
+typedef std::function<void(int64_t, unsigned int, libcamera::ControlList &, Metadata const &)> MetadataReadyCallback;
 
 class RPiCamEncoder : public RPiCamApp
 {
@@ -45,13 +48,38 @@ public:
 			throw std::runtime_error("no buffer to encode");
 		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
 		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		// The output matches this up with the encoded frame by its timestamp, and ignores it
+		// if it has no use for it.
+		if (metadata_ready_callback_)
+			metadata_ready_callback_(timestamp_ns / 1000, buffer->metadata().sequence, completed_request->metadata,
+									 completed_request->post_process_metadata);
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			encode_buffer_queue_.emplace_back(mem, completed_request); // creates a new reference
 		}
+		encoder_->FrameMetadata(timestamp_ns / 1000, buffer->metadata().sequence, completed_request->metadata,
+								completed_request->post_process_metadata);
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
+	// Change the encoder bitrate on the fly, returning false if the encoder can't.
+	bool SetBitrate(unsigned int bps) { return encoder_ && encoder_->SetBitrate(bps); }
+	void RequestKeyframe()
+	{
+		if (encoder_)
+			encoder_->RequestKeyframe();
+	}
+	// Keep the encoded buffer now being output, see Encoder::HoldOutputBuffer.
+	std::function<void()> HoldOutputBuffer() { return encoder_ ? encoder_->HoldOutputBuffer() : nullptr; }
 	VideoOptions *GetOptions() const { return static_cast<VideoOptions *>(options_.get()); }
+	// The size and format of the raw stream, which is the sensor mode being used.
+	std::string SensorMode() const
+	{
+		Stream *raw_stream = RawStream();
+		if (!raw_stream)
+			return "";
+		libcamera::StreamConfiguration const &cfg = raw_stream->configuration();
+		return cfg.size.toString() + " " + cfg.pixelFormat.toString();
+	}
 	void StopEncoder() { encoder_.reset(); }
 
 protected:
@@ -68,23 +96,24 @@ protected:
 private:
 	void encodeBufferDone(void *mem)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		// mem tells us which buffer has been completed, so each request goes back to the
+		// camera as soon as the encoder is done with it, whatever order that happens in.
+		// A null mem means the oldest buffer.
+		CompletedRequestPtr completed_request;
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
+			auto it = mem ? std::find_if(encode_buffer_queue_.begin(), encode_buffer_queue_.end(),
+										 [mem](auto const &item) { return item.first == mem; })
+						  : encode_buffer_queue_.begin();
+			if (it == encode_buffer_queue_.end())
 				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (metadata_ready_callback_ && !GetOptions()->metadata.empty())
-				metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			completed_request = std::move(it->second);
+			encode_buffer_queue_.erase(it);
 		}
+		// Dropping the last reference recycles the request, which we do without the lock held.
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	std::deque<std::pair<void *, CompletedRequestPtr>> encode_buffer_queue_;
 	std::mutex encode_buffer_queue_mutex_;
 	EncodeOutputReadyCallback encode_output_ready_callback_;
 	MetadataReadyCallback metadata_ready_callback_;
@@ -0,0 +1,196 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * save_queue.cpp - background queue for encoding and saving captured images.
+ */
+
+#include <chrono>
+
+#include "core/logging.hpp"
+#include "core/rpicam_app.hpp"
+#include "core/save_queue.hpp"
+
+SaveQueue::SaveQueue(RPiCamApp *app, unsigned int num_threads, size_t budget_bytes)
+	: app_(app), budget_(budget_bytes), bytes_queued_(0), busy_(0), busy_camera_(0), abort_(false)
+{
+	if (!num_threads)
+		num_threads = 1;
+	for (unsigned int i = 0; i < num_threads; i++)
+		threads_.emplace_back(&SaveQueue::workerThread, this);
+	LOG(2, "SaveQueue: " << num_threads << " threads, budget " << (budget_ >> 20) << "MB");
+}
+
+SaveQueue::~SaveQueue()
+{
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		abort_ = true;
+		work_cond_var_.notify_all();
+	}
+	for (auto &t : threads_)
+		t.join();
+	if (error_)
+		LOG_ERROR("WARNING: SaveQueue closed with unreported errors");
+}
+
+void SaveQueue::rethrow()
+{
+	// Caller must hold the lock. Errors are reported once, on the event loop thread.
+	if (error_)
+	{
+		std::exception_ptr e = error_;
+		error_ = nullptr;
+		std::rethrow_exception(e);
+	}
+}
+
+void SaveQueue::Push(CompletedRequestPtr &payload, libcamera::Stream *stream, std::string const &filename,
+					 SaveFunction save, DoneFunction done)
+{
+	std::unique_ptr<Job> job = std::make_unique<Job>();
+	job->payload = payload; // creates a new reference
+	job->buffer = payload->buffers[stream];
+	job->info = app_->GetStreamInfo(stream);
+	job->metadata = payload->metadata;
+	job->filename = filename;
+	job->save = save;
+	job->done = done;
+	job->bytes = 0;
+	if (!job->buffer)
+		throw std::runtime_error("no buffer to save for " + filename);
+
+	BufferReadSync r(app_, job->buffer);
+	for (auto const &span : r.Get())
+		job->bytes += span.size();
+
+	enqueue(job);
+}
+
+void SaveQueue::Push(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+					 libcamera::ControlList const &metadata, std::string const &filename, SaveFunction save,
+					 DoneFunction done)
+{
+	std::unique_ptr<Job> job = std::make_unique<Job>();
+	job->buffer = nullptr;
+	job->info = info;
+	job->metadata = metadata;
+	job->filename = filename;
+	job->save = save;
+	job->done = done;
+	job->mem = mem;
+	job->bytes = 0;
+
+	enqueue(job);
+}
+
+void SaveQueue::enqueue(std::unique_ptr<Job> &job)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	rethrow();
+	// Always admit a job into an empty queue, otherwise a budget smaller than one
+	// image would stall us forever.
+	if (bytes_queued_ && bytes_queued_ + job->bytes > budget_)
+	{
+		auto start_time = std::chrono::high_resolution_clock::now();
+		space_cond_var_.wait(lock, [this, &job] {
+			return !bytes_queued_ || bytes_queued_ + job->bytes <= budget_ || error_;
+		});
+		std::chrono::duration<double, std::milli> waited = std::chrono::high_resolution_clock::now() - start_time;
+		LOG(1, "SaveQueue: memory budget full, waited " << waited.count() << "ms");
+		rethrow();
+	}
+	bytes_queued_ += job->bytes;
+	queue_.push_back(std::move(job));
+	work_cond_var_.notify_one();
+}
+
+void SaveQueue::Detach()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (auto &job : queue_)
+	{
+		if (!job->payload)
+			continue;
+		BufferReadSync r(app_, job->buffer);
+		for (auto const &span : r.Get())
+			job->copy.emplace_back(span.begin(), span.end());
+		job->payload.reset(); // drop shared_ptr reference
+		job->buffer = nullptr;
+	}
+	space_cond_var_.wait(lock, [this] { return !busy_camera_; });
+}
+
+void SaveQueue::Flush()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	space_cond_var_.wait(lock, [this] { return queue_.empty() && !busy_; });
+	rethrow();
+}
+
+unsigned int SaveQueue::Pending()
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	return queue_.size() + busy_;
+}
+
+void SaveQueue::workerThread()
+{
+	while (true)
+	{
+		std::unique_ptr<Job> job;
+		bool from_camera;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			work_cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+			job = std::move(queue_.front());
+			queue_.pop_front();
+			from_camera = !!job->payload;
+			busy_++;
+			busy_camera_ += from_camera;
+		}
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		try
+		{
+			std::vector<libcamera::Span<uint8_t>> mem;
+			if (from_camera)
+			{
+				BufferReadSync r(app_, job->buffer);
+				job->save(r.Get(), job->info, job->metadata, job->filename);
+			}
+			else if (!job->copy.empty())
+			{
+				for (auto &plane : job->copy)
+					mem.emplace_back(plane.data(), plane.size());
+				job->save(mem, job->info, job->metadata, job->filename);
+			}
+			else
+				job->save(job->mem, job->info, job->metadata, job->filename);
+			if (job->done)
+				job->done(job->filename, job->metadata);
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: failed to save " << job->filename << ": " << e.what());
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (!error_)
+				error_ = std::current_exception();
+		}
+		std::chrono::duration<double, std::milli> save_time = std::chrono::high_resolution_clock::now() - start_time;
+		LOG(2, "SaveQueue: saved " << job->filename << " in " << save_time.count() << "ms");
+
+		// Drop our reference before taking the lock, as returning the request to the
+		// camera may take a while.
+		size_t bytes = job->bytes;
+		job.reset();
+
+		std::unique_lock<std::mutex> lock(mutex_);
+		bytes_queued_ -= bytes;
+		busy_--;
+		busy_camera_ -= from_camera;
+		space_cond_var_.notify_all();
+	}
+}
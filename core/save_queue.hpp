@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * save_queue.hpp - background queue for encoding and saving captured images.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+#include <libcamera/controls.h>
+#include <libcamera/stream.h>
+
+#include "core/completed_request.hpp"
+#include "core/stream_info.hpp"
+
+class RPiCamApp;
+
+// Jobs hold a reference to the CompletedRequest, so the camera buffer is only
+// returned once the image has been written. Encoding runs on a pool of worker
+// threads, each writing its own file, so the event loop only ever waits when
+// the total size of the images in the queue would exceed the memory budget.
+
+class SaveQueue
+{
+public:
+	// Encode one buffer and write it out. This runs on a worker thread.
+	typedef std::function<void(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+							   libcamera::ControlList const &metadata, std::string const &filename)>
+		SaveFunction;
+	// Called on the worker thread once the file has been written.
+	typedef std::function<void(std::string const &filename, libcamera::ControlList const &metadata)> DoneFunction;
+
+	SaveQueue(RPiCamApp *app, unsigned int num_threads, size_t budget_bytes);
+	~SaveQueue();
+
+	// Queue the given stream of this request for saving. Blocks only while the
+	// memory budget is exhausted.
+	void Push(CompletedRequestPtr &payload, libcamera::Stream *stream, std::string const &filename,
+			  SaveFunction save, DoneFunction done = nullptr);
+	// Queue memory that the caller owns, and which must stay valid until the job
+	// has finished. This doesn't count against the memory budget.
+	void Push(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
+			  libcamera::ControlList const &metadata, std::string const &filename, SaveFunction save,
+			  DoneFunction done = nullptr);
+	// Jobs still referencing camera buffers copy them out, and we wait for any
+	// encodes reading camera memory to finish. Call before the camera is torn down.
+	void Detach();
+	// Wait for every queued job to complete.
+	void Flush();
+
+	unsigned int Pending();
+
+private:
+	struct Job
+	{
+		CompletedRequestPtr payload;
+		libcamera::FrameBuffer *buffer;
+		StreamInfo info;
+		libcamera::ControlList metadata;
+		std::string filename;
+		SaveFunction save;
+		DoneFunction done;
+		std::vector<std::vector<uint8_t>> copy;
+		std::vector<libcamera::Span<uint8_t>> mem;
+		size_t bytes;
+	};
+
+	void enqueue(std::unique_ptr<Job> &job);
+	void workerThread();
+	void rethrow();
+
+	RPiCamApp *app_;
+	size_t budget_;
+	size_t bytes_queued_;
+	unsigned int busy_;
+	unsigned int busy_camera_;
+	bool abort_;
+	std::deque<std::unique_ptr<Job>> queue_;
+	std::mutex mutex_;
+	std::condition_variable work_cond_var_;
+	std::condition_variable space_cond_var_;
+	std::exception_ptr error_;
+	std::vector<std::thread> threads_;
+};
@@ -40,8 +40,16 @@ struct StillOptions : public Options
 			 "Set thumbnail parameters as width:height:quality, or none")
 			("encoding,e", value<std::string>(&encoding)->default_value("jpg"),
 			 "Set the desired output encoding, either jpg, png, rgb/rgb24, rgb48, bmp or yuv420")
+			("png-compression", value<int>(&png_compression)->default_value(1),
+			 "Set the PNG compression level, from 0 (none) to 9 (smallest)")
+			("png-filter", value<std::string>(&png_filter)->default_value("avg"),
+			 "Set the PNG row filter, either none, sub, up, avg, paeth or adaptive")
+			("png-threads", value<unsigned int>(&png_threads)->default_value(1),
+			 "Number of threads used to compress PNG images, or 0 to use all the cores")
 			("raw,r", value<bool>(&raw)->default_value(false)->implicit_value(true),
 			 "Also save raw file in DNG format")
+			("dng-compression", value<std::string>(&dng_compression)->default_value("none"),
+			 "Set the compression for DNG files, either none or ljpeg (lossless JPEG)")
 			("latest", value<std::string>(&latest),
 			 "Create a symbolic link with this name to most recent saved file")
 			("immediate", value<bool>(&immediate)->default_value(false)->implicit_value(true),
@@ -50,6 +58,17 @@ struct StillOptions : public Options
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
 			("zsl", value<bool>(&zsl)->default_value(false)->implicit_value(true),
 			 "Switch to AfModeAuto and trigger a scan just before capturing a still")
+			("save-threads", value<unsigned int>(&save_threads)->default_value(0),
+			 "Number of background threads used to encode and save images, or 0 to save them synchronously")
+			("save-budget", value<unsigned int>(&save_budget)->default_value(256),
+			 "Memory budget (in MB) for images waiting to be saved in the background")
+			("burst", value<unsigned int>(&burst)->default_value(0),
+			 "Capture this many frames at the full sensor rate into RAM for each capture, saving them afterwards "
+			 "(or in the background with --save-threads)")
+			("burst-budget", value<unsigned int>(&burst_budget)->default_value(1024),
+			 "Memory budget (in MB) for the burst capture buffer")
+			("burst-hugepages", value<bool>(&burst_hugepages)->default_value(false)->implicit_value(true),
+			 "Allocate the burst capture buffer from huge pages")
 			;
 		// clang-format on
 	}
@@ -66,10 +85,19 @@ struct StillOptions : public Options
 	std::string thumb;
 	unsigned int thumb_width, thumb_height, thumb_quality;
 	std::string encoding;
+	int png_compression;
+	std::string png_filter;
+	unsigned int png_threads;
 	bool raw;
+	std::string dng_compression;
 	std::string latest;
 	bool immediate;
 	bool zsl;
+	unsigned int save_threads;
+	unsigned int save_budget;
+	unsigned int burst;
+	unsigned int burst_budget;
+	bool burst_hugepages;
 
 	virtual bool Parse(int argc, char *argv[]) override
 	{
@@ -80,6 +108,8 @@ struct StillOptions : public Options
 
 		if ((keypress || signal) && timelapse)
 			throw std::runtime_error("keypress/signal and timelapse options are mutually exclusive");
+		if (metadata_format == "bin")
+			throw std::runtime_error("the bin metadata format is only for video");
 		if (strcasecmp(thumb.c_str(), "none") == 0)
 			thumb_quality = 0;
 		else if (sscanf(thumb.c_str(), "%u:%u:%u", &thumb_width, &thumb_height, &thumb_quality) != 3)
@@ -98,6 +128,17 @@ struct StillOptions : public Options
 			encoding = "bmp";
 		else
 			throw std::runtime_error("invalid encoding format " + encoding);
+		if (png_compression < 0 || png_compression > 9)
+			throw std::runtime_error("PNG compression level must be between 0 and 9");
+		if (png_filter != "none" && png_filter != "sub" && png_filter != "up" && png_filter != "avg" &&
+			png_filter != "paeth" && png_filter != "adaptive")
+			throw std::runtime_error("invalid PNG filter " + png_filter);
+		if (strcasecmp(dng_compression.c_str(), "none") == 0)
+			dng_compression = "none";
+		else if (strcasecmp(dng_compression.c_str(), "ljpeg") == 0)
+			dng_compression = "ljpeg";
+		else
+			throw std::runtime_error("invalid DNG compression " + dng_compression);
 		return true;
 	}
 	virtual void Print() const override
@@ -105,7 +146,11 @@ struct StillOptions : public Options
 		Options::Print();
 		std::cerr << "    encoding: " << encoding << std::endl;
 		std::cerr << "    quality: " << quality << std::endl;
+		std::cerr << "    png compression: " << png_compression << std::endl;
+		std::cerr << "    png filter: " << png_filter << std::endl;
+		std::cerr << "    png threads: " << png_threads << std::endl;
 		std::cerr << "    raw: " << raw << std::endl;
+		std::cerr << "    dng compression: " << dng_compression << std::endl;
 		std::cerr << "    restart: " << restart << std::endl;
 		std::cerr << "    timelapse: " << timelapse.get() << "ms" << std::endl;
 		std::cerr << "    framestart: " << framestart << std::endl;
@@ -120,6 +165,11 @@ struct StillOptions : public Options
 		std::cerr << "    immediate " << immediate << std::endl;
 		std::cerr << "    AF on capture: " << af_on_capture << std::endl;
 		std::cerr << "    Zero shutter lag: " << zsl << std::endl;
+		std::cerr << "    save threads: " << save_threads << std::endl;
+		std::cerr << "    save budget: " << save_budget << "MB" << std::endl;
+		std::cerr << "    burst: " << burst << std::endl;
+		std::cerr << "    burst budget: " << burst_budget << "MB" << std::endl;
+		std::cerr << "    burst hugepages: " << burst_hugepages << std::endl;
 		for (auto &s : exif)
 			std::cerr << "    EXIF: " << s << std::endl;
 	}
@@ -9,6 +9,7 @@
 
 #include <cstdio>
 
+#include <sstream>
 #include <string>
 
 #include "options.hpp"
@@ -88,6 +89,15 @@ struct VideoOptions : public Options
 		options_.add_options()
 			("bitrate,b", value<std::string>(&bitrate_)->default_value("0bps"),
 			 "Set the video bitrate for encoding. If no units are provided, default to bits/second.")
+			("adaptive-bitrate", value<bool>(&adaptive_bitrate)->default_value(false)->implicit_value(true),
+			 "Adjust the bitrate of network (udp:// and tcp://) outputs to avoid congestion, between "
+			 "--bitrate-min and --bitrate-max")
+			("bitrate-min", value<std::string>(&bitrate_min_)->default_value("0bps"),
+			 "Lowest bitrate for --adaptive-bitrate, defaults to a tenth of the maximum")
+			("bitrate-max", value<std::string>(&bitrate_max_)->default_value("0bps"),
+			 "Highest bitrate for --adaptive-bitrate, defaults to --bitrate")
+			("bitrate-trace", value<std::string>(&bitrate_trace),
+			 "Write each --adaptive-bitrate measurement and decision to this file")
 			("profile", value<std::string>(&profile),
 			 "Set the encoding profile")
 			("level", value<std::string>(&level),
@@ -107,11 +117,23 @@ struct VideoOptions : public Options
 			("quality,q", value<int>(&quality)->default_value(50),
 			 "Set the MJPEG quality parameter (mjpeg only)")
 			("listen,l", value<bool>(&listen)->default_value(false)->implicit_value(true),
-			 "Listen for an incoming client network connection before sending data to the client")
+			 "Listen for tcp clients to send the stream to, which may connect and disconnect at any time, "
+			 "instead of connecting to a server")
+			("client-queue", value<size_t>(&client_queue)->default_value(4),
+			 "Size (in MB) of the queue of frames for each client when listening or serving rtsp://. Clients "
+			 "that fall further behind than this skip frames")
+			("mtu", value<unsigned int>(&mtu)->default_value(1400),
+			 "Largest IP packet to send for rtp:// and rtsp:// output, which is never fragmented")
+			("sdp", value<std::string>(&sdp),
+			 "Write a session description for rtp:// output to this file, for players to open")
 			("keypress,k", value<bool>(&keypress)->default_value(false)->implicit_value(true),
-			 "Pause or resume video recording when ENTER pressed")
+			 "Pause or resume video recording when ENTER pressed, request a keyframe with k and ENTER, or trigger "
+			 "an event recording with t and ENTER")
 			("signal,s", value<bool>(&signal)->default_value(false)->implicit_value(true),
-			 "Pause or resume video recording when signal received")
+			 "Pause or resume video recording when signal received. SIGRTMIN requests a keyframe and SIGRTMIN+1 "
+			 "triggers an event recording")
+			("control-socket", value<std::string>(&control_socket),
+			 "Accept commands on a unix datagram socket at this path: \"keyframe\", \"bitrate <bitrate>\" or \"trigger\"")
 			("initial,i", value<std::string>(&initial)->default_value("record"),
 			 "Use 'pause' to pause the recording at startup, otherwise 'record' (the default)")
 			("split", value<bool>(&split)->default_value(false)->implicit_value(true),
@@ -120,6 +142,65 @@ struct VideoOptions : public Options
 			 "Break the recording into files of approximately this many milliseconds")
 			("circular", value<size_t>(&circular)->default_value(0)->implicit_value(4),
 			 "Write output to a circular buffer of the given size (in MB) which is saved on exit")
+			("circular-hugepages", value<bool>(&circular_hugepages)->default_value(false)->implicit_value(true),
+			 "Put the circular buffer in huge pages, if the system has some reserved, to reduce TLB misses")
+			("circular-lock", value<bool>(&circular_lock)->default_value(false)->implicit_value(true),
+			 "Lock the circular buffer into memory so that it can never be swapped out")
+			("pre-roll", value<uint32_t>(&pre_roll)->default_value(0),
+			 "With --circular, save this many milliseconds from before each trigger into a new output file, "
+			 "instead of saving the buffer on exit")
+			("post-roll", value<uint32_t>(&post_roll)->default_value(0),
+			 "With --circular, carry on saving for this many milliseconds after each trigger")
+			("trigger-metadata", value<std::string>(&trigger_metadata),
+			 "Trigger an event recording whenever this boolean post-processing metadata is true, "
+			 "for example motion_detect.result")
+			("fmp4", value<bool>(&fmp4)->default_value(false)->implicit_value(true),
+			 "Write a fragmented MP4 file, with one fragment per GOP, instead of a raw H.264 stream (h264 only)")
+			("hls", value<unsigned int>(&hls)->default_value(0),
+			 "Write HLS fragmented MP4 segments and a playlist into the output directory, keeping this many "
+			 "segments in the playlist. Segments are cut at the first I frame after --segment milliseconds "
+			 "(default 2000) (h264 only)")
+			("hls-port", value<unsigned int>(&hls_port)->default_value(0),
+			 "Serve the HLS playlist and segments from memory over HTTP on this port")
+			("mpegts", value<bool>(&mpegts)->default_value(false)->implicit_value(true),
+			 "Write an MPEG transport stream, to a file or to udp://<ip-addr>:<port> with 7 packets per datagram, "
+			 "instead of a raw H.264 stream (h264 only)")
+			("klv", value<bool>(&klv)->default_value(false)->implicit_value(true),
+			 "With --mpegts, add a KLV metadata stream (MISB ST 0601) that gives the time of each frame, the camera, "
+			 "and any klv.<name> double values from post-processing, such as klv.sensor_latitude")
+			("sei", value<bool>(&sei)->default_value(false)->implicit_value(true),
+			 "Put each frame's timestamp, exposure, gains and object detections into its H.264 access unit, "
+			 "in a user data unregistered SEI message (h264, or libav with an H.264 codec)")
+			("index", value<bool>(&index)->default_value(false)->implicit_value(true),
+			 "Write the byte offset, timestamp and frame number of every keyframe to an index alongside each output "
+			 "file, in <file>.idx, so that time ranges can be cut out quickly with rpicam-clip (implies --inline)")
+			("container", value<bool>(&container)->default_value(false)->implicit_value(true),
+			 "Write yuv420 and raw frames into an indexed container file that records the stream format and "
+			 "each frame's timestamp, exposure and gain")
+			("compress", value<std::string>(&compress)->default_value("none"),
+			 "Losslessly compress yuv420 and raw frames into an indexed container file, either none or zstd")
+			("compress-level", value<int>(&compress_level)->default_value(1),
+			 "Set the zstd compression level. Low levels are needed to keep up with high resolutions")
+			("compress-threads", value<unsigned int>(&compress_threads)->default_value(4),
+			 "Number of threads compressing frames")
+			("compress-predict", value<bool>(&compress_predict)->default_value(true)->implicit_value(true),
+			 "Replace each sample by its difference from the previous sample of the same colour before compressing")
+			("write-buffer", value<unsigned int>(&write_buffer)->default_value(0),
+			 "Write output files from a background thread through a buffer of this many MB, so that storage "
+			 "stalls don't hold up the encoder. 0 writes directly from the encoder's thread")
+			("direct-io", value<bool>(&direct_io)->default_value(false)->implicit_value(true),
+			 "Bypass the page cache when writing output files (needs --write-buffer)")
+			("preallocate", value<unsigned int>(&preallocate)->default_value(0),
+			 "Reserve space for output files this many MB at a time (needs --write-buffer)")
+			("sync-every", value<unsigned int>(&sync_every)->default_value(0),
+			 "Sync output files to storage after every this many MB (needs --write-buffer)")
+			("frame-bus", value<std::string>(&frame_bus),
+			 "Publish frames into shared memory for other processes to read, in rings named <name>-<stream> "
+			 "(see output/frame_bus.h)")
+			("frame-bus-streams", value<std::string>(&frame_bus_streams)->default_value("encoded"),
+			 "Comma separated list of the streams to put on the frame bus, from encoded, video, lores and raw")
+			("frame-bus-slots", value<unsigned int>(&frame_bus_slots)->default_value(8),
+			 "Number of frames that each frame bus ring holds")
             ("file_out_date", value<bool>(&file_out_date)->default_value(false)->implicit_value(true),
              "Write output with date embedded in filename. strftime wildcards like %Y:%m:%d %H:%M:%S can be used")
 
@@ -139,6 +220,9 @@ struct VideoOptions : public Options
 			 "Sets the libav encoder output format to use. "
 			 "Leave blank to try and deduce this from the filename.\n"
 			 "To list available formats, run  the \"ffmpeg -formats\" command.")
+			("low-latency", value<bool>(&low_latency)->default_value(false)->implicit_value(true),
+			 "Configure the libav encoder for the lowest latency, with no B-frames or lookahead, and slice rather "
+			 "than frame threading for libx264. Output packets are flushed as soon as they are written.")
 			("libav-audio", value<bool>(&libav_audio)->default_value(false)->implicit_value(true),
 			 "Records an audio stream together with the video.")
 			("audio-codec", value<std::string>(&audio_codec)->default_value("aac"),
@@ -167,6 +251,10 @@ struct VideoOptions : public Options
 	}
 
 	Bitrate bitrate;
+	bool adaptive_bitrate;
+	Bitrate bitrate_min;
+	Bitrate bitrate_max;
+	std::string bitrate_trace;
 	std::string profile;
 	std::string level;
 	unsigned int intra;
@@ -175,6 +263,7 @@ struct VideoOptions : public Options
 	std::string libav_video_codec;
 	std::string libav_video_codec_opts;
 	std::string libav_format;
+	bool low_latency;
 	bool libav_audio;
 	std::string audio_codec;
 	std::string audio_device;
@@ -186,14 +275,42 @@ struct VideoOptions : public Options
 	std::string save_pts;
 	int quality;
 	bool listen;
+	size_t client_queue;
+	unsigned int mtu;
+	std::string sdp;
 	bool keypress;
 	bool signal;
+	std::string control_socket;
 	std::string initial;
 	bool pause;
 	bool split;
 	uint32_t segment;
     bool file_out_date;
 	size_t circular;
+	bool circular_hugepages;
+	bool circular_lock;
+	uint32_t pre_roll;
+	uint32_t post_roll;
+	std::string trigger_metadata;
+	unsigned int write_buffer;
+	bool direct_io;
+	unsigned int preallocate;
+	unsigned int sync_every;
+	std::string frame_bus;
+	std::string frame_bus_streams;
+	unsigned int frame_bus_slots;
+	bool fmp4;
+	unsigned int hls;
+	unsigned int hls_port;
+	bool mpegts;
+	bool klv;
+	bool sei;
+	bool index;
+	bool container;
+	std::string compress;
+	int compress_level;
+	unsigned int compress_threads;
+	bool compress_predict;
 	uint32_t frames;
 
 	virtual bool Parse(int argc, char *argv[]) override
@@ -202,6 +319,8 @@ struct VideoOptions : public Options
 			return false;
 
 		bitrate.set(bitrate_);
+		bitrate_min.set(bitrate_min_);
+		bitrate_max.set(bitrate_max_);
 #if LIBAV_PRESENT
 		av_sync.set(av_sync_);
 		audio_bitrate.set(audio_bitrate_);
@@ -220,15 +339,60 @@ struct VideoOptions : public Options
 			codec = "mjpeg";
 		else
 			throw std::runtime_error("unrecognised codec " + codec);
+		if (strcasecmp(compress.c_str(), "none") == 0)
+			compress = "none";
+		else if (strcasecmp(compress.c_str(), "zstd") == 0)
+		{
+#if !ZSTD_PRESENT
+			throw std::runtime_error("zstd compression is not available in this build");
+#endif
+			compress = "zstd";
+		}
+		else
+			throw std::runtime_error("unrecognised compression " + compress);
+		if (compress_threads == 0)
+			throw std::runtime_error("compress-threads must be at least 1");
+		if ((direct_io || preallocate || sync_every) && !write_buffer)
+			LOG_ERROR("WARNING: direct-io, preallocate and sync-every need --write-buffer");
+		if (!frame_bus.empty())
+		{
+			if (frame_bus_slots < 2)
+				throw std::runtime_error("frame-bus-slots must be at least 2");
+			std::stringstream streams(frame_bus_streams);
+			for (std::string stream; std::getline(streams, stream, ',');)
+			{
+				if (stream != "encoded" && stream != "video" && stream != "lores" && stream != "raw")
+					throw std::runtime_error("unrecognised frame bus stream " + stream);
+			}
+		}
+		// Compressed frames always go into a container.
+		if (compress != "none")
+			container = true;
 		if (strcasecmp(initial.c_str(), "pause") == 0)
 			pause = true;
 		else if (strcasecmp(initial.c_str(), "record") == 0)
 			pause = false;
 		else
 			throw std::runtime_error("incorrect initial value " + initial);
+		// RTP and transport stream receivers can only get the stream headers from the stream itself. RTSP
+		// clients get them from the session description too, but only those that join after the first keyframe.
+		// Clips cut out of an indexed recording start at a keyframe, so that needs them there too.
+		if (output.compare(0, 6, "rtp://") == 0 || output.compare(0, 7, "rtsp://") == 0 || mpegts || index)
+			inline_headers = true;
+		if (klv && !mpegts)
+			LOG_ERROR("WARNING: klv needs --mpegts");
+		if (sei && codec != "h264" && codec != "libav")
+			LOG_ERROR("WARNING: sei needs an H.264 codec");
+		if (index && (output.empty() || output == "-" || output.find("://") != std::string::npos))
+			LOG_ERROR("WARNING: index needs an output file");
 		if ((pause || split || segment || circular) && !inline_headers)
 			LOG_ERROR("WARNING: consider inline headers with 'pause'/split/segment/circular");
-        if ((split || segment || file_out_date) && output.find('%') == std::string::npos)
+		if ((pre_roll || post_roll) && !circular)
+			LOG_ERROR("WARNING: pre-roll and post-roll need --circular");
+		if (!trigger_metadata.empty() && !(circular && (pre_roll || post_roll)))
+			LOG_ERROR("WARNING: trigger-metadata needs --circular with a pre-roll or post-roll");
+        if ((split || segment || file_out_date || (circular && (pre_roll || post_roll))) && !hls &&
+			output.find('%') == std::string::npos)
 			LOG_ERROR("WARNING: expected % directive in output filename");
 
 		// From https://en.wikipedia.org/wiki/Advanced_Video_Coding#Levels
@@ -245,6 +409,13 @@ struct VideoOptions : public Options
 	{
 		Options::Print();
 		std::cerr << "    bitrate: " << bitrate.kbps() << "kbps" << std::endl;
+		std::cerr << "    adaptive-bitrate: " << adaptive_bitrate << std::endl;
+		if (adaptive_bitrate)
+		{
+			std::cerr << "    bitrate-min: " << bitrate_min.kbps() << "kbps" << std::endl;
+			std::cerr << "    bitrate-max: " << bitrate_max.kbps() << "kbps" << std::endl;
+			std::cerr << "    bitrate-trace: " << bitrate_trace << std::endl;
+		}
 		std::cerr << "    profile: " << profile << std::endl;
 		std::cerr << "    level:  " << level << std::endl;
 		std::cerr << "    intra: " << intra << std::endl;
@@ -252,17 +423,69 @@ struct VideoOptions : public Options
 		std::cerr << "    save-pts: " << save_pts << std::endl;
 		std::cerr << "    codec: " << codec << std::endl;
 		std::cerr << "    quality (for MJPEG): " << quality << std::endl;
+		if (listen || output.compare(0, 7, "rtsp://") == 0)
+			std::cerr << "    client-queue: " << client_queue << std::endl;
+		if (output.compare(0, 7, "rtsp://") == 0)
+			std::cerr << "    mtu: " << mtu << std::endl;
+		if (output.compare(0, 6, "rtp://") == 0)
+		{
+			std::cerr << "    mtu: " << mtu << std::endl;
+			std::cerr << "    sdp: " << sdp << std::endl;
+		}
 		std::cerr << "    keypress: " << keypress << std::endl;
 		std::cerr << "    signal: " << signal << std::endl;
+		std::cerr << "    control-socket: " << control_socket << std::endl;
 		std::cerr << "    initial: " << initial << std::endl;
 		std::cerr << "    split: " << split << std::endl;
 		std::cerr << "    segment: " << segment << std::endl;
         std::cerr << "    file_out_date: " << file_out_date << std::endl;
 		std::cerr << "    circular: " << circular << std::endl;
+		if (circular)
+		{
+			std::cerr << "    circular-hugepages: " << circular_hugepages << std::endl;
+			std::cerr << "    circular-lock: " << circular_lock << std::endl;
+		}
+		if (pre_roll || post_roll)
+		{
+			std::cerr << "    pre-roll: " << pre_roll << std::endl;
+			std::cerr << "    post-roll: " << post_roll << std::endl;
+			std::cerr << "    trigger-metadata: " << trigger_metadata << std::endl;
+		}
+		std::cerr << "    write-buffer: " << write_buffer << std::endl;
+		if (write_buffer)
+		{
+			std::cerr << "    direct-io: " << direct_io << std::endl;
+			std::cerr << "    preallocate: " << preallocate << std::endl;
+			std::cerr << "    sync-every: " << sync_every << std::endl;
+		}
+		std::cerr << "    frame-bus: " << frame_bus << std::endl;
+		if (!frame_bus.empty())
+		{
+			std::cerr << "    frame-bus-streams: " << frame_bus_streams << std::endl;
+			std::cerr << "    frame-bus-slots: " << frame_bus_slots << std::endl;
+		}
+		std::cerr << "    fmp4: " << fmp4 << std::endl;
+		std::cerr << "    hls: " << hls << std::endl;
+		std::cerr << "    hls-port: " << hls_port << std::endl;
+		std::cerr << "    mpegts: " << mpegts << std::endl;
+		if (mpegts)
+			std::cerr << "    klv: " << klv << std::endl;
+		std::cerr << "    sei: " << sei << std::endl;
+		std::cerr << "    index: " << index << std::endl;
+		std::cerr << "    container: " << container << std::endl;
+		std::cerr << "    compress: " << compress << std::endl;
+		if (compress != "none")
+		{
+			std::cerr << "    compress-level: " << compress_level << std::endl;
+			std::cerr << "    compress-threads: " << compress_threads << std::endl;
+			std::cerr << "    compress-predict: " << compress_predict << std::endl;
+		}
 	}
 
 private:
 	std::string bitrate_;
+	std::string bitrate_min_;
+	std::string bitrate_max_;
 #if LIBAV_PRESENT
 	std::string av_sync_;
 	std::string audio_bitrate_;
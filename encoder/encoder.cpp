@@ -21,6 +21,10 @@
 #include "libav_encoder.hpp"
 #endif
 
+#if ZSTD_PRESENT
+#include "zstd_encoder.hpp"
+#endif
+
 static Encoder *h264_codec_select(VideoOptions *options, const StreamInfo &info)
 {
 	if (options->GetPlatform() == Platform::VC4)
@@ -49,10 +53,19 @@ static Encoder *libav_codec_select(VideoOptions *options, const StreamInfo &info
 }
 #endif
 
+Encoder *Encoder::CreateUncompressed(VideoOptions *options)
+{
+#if ZSTD_PRESENT
+	if (options->compress == "zstd")
+		return new ZstdEncoder(options);
+#endif
+	return new NullEncoder(options);
+}
+
 Encoder *Encoder::Create(VideoOptions *options, const StreamInfo &info)
 {
 	if (strcasecmp(options->codec.c_str(), "yuv420") == 0)
-		return new NullEncoder(options);
+		return CreateUncompressed(options);
 	else if (strcasecmp(options->codec.c_str(), "h264") == 0)
 		return h264_codec_select(options, info);
 #if LIBAV_PRESENT
@@ -8,10 +8,13 @@
 #pragma once
 
 #include <functional>
+#include <memory>
 
 #include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
+#include "sei_inserter.hpp"
+
 typedef std::function<void(void *)> InputDoneCallback;
 typedef std::function<void(void *, size_t, int64_t, bool)> OutputReadyCallback;
 
@@ -19,22 +22,45 @@ class Encoder
 {
 public:
 	static Encoder *Create(VideoOptions *options, StreamInfo const &info);
+	// The encoder for frames that are written out as they are, or only losslessly compressed.
+	static Encoder *CreateUncompressed(VideoOptions *options);
 
 	Encoder(VideoOptions const *options) : options_(options) {}
 	virtual ~Encoder() {}
 	// This is where the application sets the callback it gets whenever the encoder
-	// has finished with an input buffer, so the application can re-use it.
+	// has finished with an input buffer, so the application can re-use it. The
+	// callback is given the mem pointer that was passed to EncodeBuffer, and buffers
+	// may be returned in any order.
 	void SetInputDoneCallback(InputDoneCallback callback) { input_done_callback_ = callback; }
 	// This callback is how the application is told that an encoded buffer is
-	// available. The application may not hang on to the memory once it returns
-	// (but the callback is already running in its own thread).
+	// available. The application may not hang on to the memory once it returns, unless
+	// it uses HoldOutputBuffer (but the callback is already running in its own thread).
 	void SetOutputReadyCallback(OutputReadyCallback callback) { output_ready_callback_ = callback; }
+	// Called from within the output ready callback, this lets the application keep the
+	// encoded buffer after the callback returns. The buffer goes back to the encoder when
+	// the returned function is called, which may be from any thread. Encoders that can't
+	// lend out their buffers return an empty function, and the data must be copied.
+	virtual std::function<void()> HoldOutputBuffer() { return {}; }
 	// Encode the given buffer. The buffer is specified both by an fd and size
 	// describing a DMABUF, and by a mmapped userland pointer.
 	virtual void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) = 0;
+	// Change the bitrate while encoding. Returns false if this encoder can't.
+	virtual bool SetBitrate(unsigned int bps) { return false; }
+	// Make the next frame a keyframe, so that a new viewer, or a decoder that has lost
+	// data, doesn't have to wait for the next one. Encoders that can't do this ignore it.
+	virtual void RequestKeyframe() {}
+	// Called with the metadata of each frame just before it is given to EncodeBuffer. H.264
+	// encoders that were asked to do so put it into the frame's access unit in an SEI message.
+	void FrameMetadata(int64_t timestamp_us, unsigned int sequence, libcamera::ControlList const &controls,
+					   Metadata const &post_process)
+	{
+		if (sei_)
+			sei_->Add(timestamp_us, sequence, controls, post_process);
+	}
 
 protected:
 	InputDoneCallback input_done_callback_;
 	OutputReadyCallback output_ready_callback_;
 	VideoOptions const *options_;
+	std::unique_ptr<SeiInserter> sei_; // for encoders that support --sei to create
 };
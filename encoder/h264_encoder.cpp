@@ -13,6 +13,7 @@
 #include <linux/videodev2.h>
 
 #include <chrono>
+#include <cstring>
 #include <iostream>
 
 #include "h264_encoder.hpp"
@@ -29,6 +30,21 @@ static int xioctl(int fd, unsigned long ctl, void *arg)
 	return ret;
 }
 
+// Give an encoded buffer back to the codec to be written into again.
+static bool requeue_capture_buffer(int fd, unsigned int index, size_t length)
+{
+	v4l2_buffer buf = {};
+	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = index;
+	buf.length = 1;
+	buf.m.planes = planes;
+	buf.m.planes[0].bytesused = 0;
+	buf.m.planes[0].length = length;
+	return xioctl(fd, VIDIOC_QBUF, &buf) == 0;
+}
+
 static int get_v4l2_colorspace(std::optional<libcamera::ColorSpace> const &cs)
 {
 	if (cs == libcamera::ColorSpace::Rec709)
@@ -51,7 +67,7 @@ static int get_v4l2_pixfmt(const libcamera::PixelFormat& pixfmt)
 
 
 H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
-	: Encoder(options), abortPoll_(false), abortOutput_(false)
+	: Encoder(options), abortPoll_(false), abortOutput_(false), output_item_(nullptr), output_item_held_(false)
 {
 	// First open the encoder device. Maybe we should double-check its "caps".
 
@@ -213,6 +229,10 @@ H264Encoder::H264Encoder(VideoOptions const *options, StreamInfo const &info)
 		throw std::runtime_error("failed to start capture streaming");
 	LOG(2, "Codec streaming started");
 
+	held_buffers_ = std::make_shared<HeldBuffers>();
+	held_buffers_->fd = fd_;
+	if (options->sei)
+		sei_ = std::make_unique<SeiInserter>();
 	output_thread_ = std::thread(&H264Encoder::outputThread, this);
 	poll_thread_ = std::thread(&H264Encoder::pollThread, this);
 }
@@ -224,6 +244,18 @@ H264Encoder::~H264Encoder()
 	abortOutput_ = true;
 	output_thread_.join();
 
+	// Give the application a moment to hand back any buffers it's still holding. If it
+	// doesn't, we must leave those mapped, and they can't be freed.
+	bool buffers_held;
+	{
+		std::unique_lock<std::mutex> lock(held_buffers_->mutex);
+		using namespace std::chrono_literals;
+		buffers_held = !held_buffers_->cond_var.wait_for(lock, 1s, [this] { return held_buffers_->count == 0; });
+		held_buffers_->closed = true;
+	}
+	if (buffers_held)
+		LOG_ERROR("WARNING: H264Encoder: encoded buffers still held, leaving them mapped");
+
 	// Turn off streaming on both the output and capture queues, and "free" the
 	// buffers that we requested. The capture ones need to be "munmapped" first.
 
@@ -241,15 +273,18 @@ H264Encoder::~H264Encoder()
 	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
 		LOG(1, "Request to free output buffers failed");
 
-	for (int i = 0; i < num_capture_buffers_; i++)
-		if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
-			LOG(1, "Failed to unmap buffer");
-	reqbufs = {};
-	reqbufs.count = 0;
-	reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-	reqbufs.memory = V4L2_MEMORY_MMAP;
-	if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
-		LOG(1, "Request to free capture buffers failed");
+	if (!buffers_held)
+	{
+		for (int i = 0; i < num_capture_buffers_; i++)
+			if (munmap(buffers_[i].mem, buffers_[i].size) < 0)
+				LOG(1, "Failed to unmap buffer");
+		reqbufs = {};
+		reqbufs.count = 0;
+		reqbufs.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+		reqbufs.memory = V4L2_MEMORY_MMAP;
+		if (xioctl(fd_, VIDIOC_REQBUFS, &reqbufs) < 0)
+			LOG(1, "Request to free capture buffers failed");
+	}
 
 	close(fd_);
 	LOG(2, "H264Encoder closed");
@@ -266,6 +301,7 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 			throw std::runtime_error("no buffers available to queue codec input");
 		index = input_buffers_available_.front();
 		input_buffers_available_.pop();
+		input_mem_[index] = mem;
 	}
 	v4l2_buffer buf = {};
 	v4l2_plane planes[VIDEO_MAX_PLANES] = {};
@@ -284,6 +320,29 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 		throw std::runtime_error("failed to queue input to codec");
 }
 
+bool H264Encoder::SetBitrate(unsigned int bps)
+{
+	// The codec picks this up from the next frame it encodes.
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_BITRATE;
+	ctrl.value = bps;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+	{
+		LOG(1, "H264Encoder: failed to set bitrate " << bps);
+		return false;
+	}
+	return true;
+}
+
+void H264Encoder::RequestKeyframe()
+{
+	v4l2_control ctrl = {};
+	ctrl.id = V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME;
+	ctrl.value = 1;
+	if (xioctl(fd_, VIDIOC_S_CTRL, &ctrl) < 0)
+		LOG(1, "H264Encoder: failed to force keyframe");
+}
+
 void H264Encoder::pollThread()
 {
 	while (true)
@@ -314,11 +373,13 @@ void H264Encoder::pollThread()
 			{
 				// Return this to the caller, first noting that this buffer, identified
 				// by its index, is available for queueing up another frame.
+				void *mem;
 				{
 					std::lock_guard<std::mutex> lock(input_buffers_available_mutex_);
 					input_buffers_available_.push(buf.index);
+					mem = input_mem_[buf.index];
 				}
-				input_done_callback_(nullptr);
+				input_done_callback_(mem);
 			}
 
 			buf = {};
@@ -374,17 +435,62 @@ void H264Encoder::outputThread()
 			}
 		}
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, item.keyframe);
-		v4l2_buffer buf = {};
-		v4l2_plane planes[VIDEO_MAX_PLANES] = {};
-		buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-		buf.memory = V4L2_MEMORY_MMAP;
-		buf.index = item.index;
-		buf.length = 1;
-		buf.m.planes = planes;
-		buf.m.planes[0].bytesused = 0;
-		buf.m.planes[0].length = item.length;
-		if (xioctl(fd_, VIDIOC_QBUF, &buf) < 0)
+		output_item_ = &item;
+		output_item_held_ = false;
+		void *mem = item.mem;
+		size_t size = item.bytes_used;
+		if (sei_)
+			insertSei(item, mem, size);
+		output_ready_callback_(mem, size, item.timestamp_us, item.keyframe);
+		output_item_ = nullptr;
+		if (!output_item_held_ && !requeue_capture_buffer(fd_, item.index, item.length))
 			throw std::runtime_error("failed to re-queue encoded buffer");
 	}
 }
+
+void H264Encoder::insertSei(OutputItem const &item, void *&mem, size_t &size)
+{
+	std::vector<uint8_t> sei = sei_->Take(item.timestamp_us);
+	if (sei.empty())
+		return;
+
+	// There is normally room to slide the slices up within the capture buffer, which saves
+	// copying the whole frame, and lets the application still hold on to the buffer.
+	uint8_t *data = static_cast<uint8_t *>(item.mem);
+	size_t pos = SeiInserter::InsertPosition(data, item.bytes_used);
+	if (item.bytes_used + sei.size() <= item.length)
+	{
+		memmove(data + pos + sei.size(), data + pos, item.bytes_used - pos);
+		memcpy(data + pos, sei.data(), sei.size());
+		size = item.bytes_used + sei.size();
+		return;
+	}
+
+	sei_buffer_.assign(data, data + pos);
+	sei_buffer_.insert(sei_buffer_.end(), sei.begin(), sei.end());
+	sei_buffer_.insert(sei_buffer_.end(), data + pos, data + item.bytes_used);
+	mem = sei_buffer_.data();
+	size = sei_buffer_.size();
+	output_item_ = nullptr; // so the application copies it instead
+}
+
+std::function<void()> H264Encoder::HoldOutputBuffer()
+{
+	if (!output_item_ || output_item_held_)
+		return {};
+	output_item_held_ = true;
+	{
+		std::lock_guard<std::mutex> lock(held_buffers_->mutex);
+		held_buffers_->count++;
+	}
+
+	return [held_buffers = held_buffers_, index = output_item_->index, length = output_item_->length]()
+	{
+		std::lock_guard<std::mutex> lock(held_buffers->mutex);
+		// Once the encoder has gone there's nothing left to give the buffer back to.
+		if (!held_buffers->closed && !requeue_capture_buffer(held_buffers->fd, index, length))
+			LOG_ERROR("WARNING: H264Encoder: failed to re-queue held buffer");
+		held_buffers->count--;
+		held_buffers->cond_var.notify_all();
+	};
+}
@@ -8,9 +8,11 @@
 #pragma once
 
 #include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 #include "encoder.hpp"
 
@@ -21,6 +23,9 @@ public:
 	~H264Encoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool SetBitrate(unsigned int bps) override;
+	void RequestKeyframe() override;
+	std::function<void()> HoldOutputBuffer() override;
 
 private:
 	// We want at least as many output buffers as there are in the camera queue
@@ -53,6 +58,7 @@ private:
 	std::thread poll_thread_;
 	std::mutex input_buffers_available_mutex_;
 	std::queue<int> input_buffers_available_;
+	void *input_mem_[NUM_OUTPUT_BUFFERS];
 	struct OutputItem
 	{
 		void *mem;
@@ -62,8 +68,27 @@ private:
 		bool keyframe;
 		int64_t timestamp_us;
 	};
+	// Splice this frame's SEI into the access unit, in the capture buffer if there's room.
+	void insertSei(OutputItem const &item, void *&mem, size_t &size);
 	std::queue<OutputItem> output_queue_;
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
+
+	// Capture buffers the application is holding on to. This is shared with the functions
+	// that give them back, which may outlive us if the application hangs on too long.
+	struct HeldBuffers
+	{
+		std::mutex mutex;
+		std::condition_variable cond_var;
+		int fd;
+		unsigned int count = 0;
+		bool closed = false;
+	};
+	std::shared_ptr<HeldBuffers> held_buffers_;
+	// The buffer being passed to the application right now, and whether it kept it.
+	OutputItem const *output_item_;
+	bool output_item_held_;
+	// For frames that the SEI doesn't fit in the capture buffer with.
+	std::vector<uint8_t> sei_buffer_;
 };
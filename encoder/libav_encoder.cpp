@@ -14,6 +14,7 @@
 #include <libdrm/drm_fourcc.h>
 #include <linux/videodev2.h>
 
+#include <algorithm>
 #include <chrono>
 #include <iostream>
 
@@ -76,6 +77,8 @@ void encoderOptionsH264M2M(VideoOptions const *options, AVCodecContext *codec)
 {
 	codec->pix_fmt = AV_PIX_FMT_DRM_PRIME;
 	codec->max_b_frames = 0;
+	if (options->low_latency)
+		codec->flags |= AV_CODEC_FLAG_LOW_DELAY;
 }
 
 void encoderOptionsLibx264(VideoOptions const *options, AVCodecContext *codec)
@@ -96,6 +99,19 @@ void encoderOptionsLibx264(VideoOptions const *options, AVCodecContext *codec)
 	av_opt_set(codec->priv_data, "sc_threshold", "0", 0);
 	av_opt_set(codec->priv_data, "rc-lookahead", "0", 0);
 	av_opt_set(codec->priv_data, "mixed_ref", "0", 0);
+	av_opt_set(codec->priv_data, "forced-idr", "1", 0);
+
+	if (options->low_latency)
+	{
+		// Frame threading holds one frame per thread in flight, whereas slice threads all
+		// work on the same frame, letting x264 choose the slice count to match.
+		codec->max_b_frames = 0;
+		codec->thread_type = FF_THREAD_SLICE;
+		codec->slices = 0;
+		codec->flags |= AV_CODEC_FLAG_LOW_DELAY;
+		av_opt_set(codec->priv_data, "tune", "zerolatency", 0);
+		av_opt_set(codec->priv_data, "x264-params", "sync-lookahead=0", 0);
+	}
 }
 
 const std::map<std::string, std::function<void(VideoOptions const *, AVCodecContext *)>> optionsMap =
@@ -213,6 +229,13 @@ void LibAvEncoder::initVideoCodec(VideoOptions const *options, StreamInfo const
 	if (out_fmt_ctx_->oformat->flags & AVFMT_GLOBALHEADER)
 		codec_ctx_[Video]->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
 
+	// Don't let packets sit in the muxer or avio buffers.
+	if (options->low_latency)
+	{
+		out_fmt_ctx_->flags |= AVFMT_FLAG_FLUSH_PACKETS;
+		out_fmt_ctx_->max_delay = 0;
+	}
+
 	int ret = avcodec_open2(codec_ctx_[Video], codec, nullptr);
 	if (ret < 0)
 		throw std::runtime_error("libav: unable to open video codec: " + std::to_string(ret));
@@ -330,7 +353,9 @@ void LibAvEncoder::initAudioOutCodec(VideoOptions const *options, StreamInfo con
 
 LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 	: Encoder(options), output_ready_(false), abort_video_(false), abort_audio_(false), video_start_ts_(0),
-	  audio_samples_(0), in_fmt_ctx_(nullptr), out_fmt_ctx_(nullptr), output_file_(options->output)
+	  audio_samples_(0), frames_sent_(0), packets_received_(0), max_queue_depth_(0), pending_bitrate_(0),
+	  keyframe_requested_(false), in_fmt_ctx_(nullptr),
+	  out_fmt_ctx_(nullptr), output_file_(options->output)
 {
 	if (options->circular || options->segment || !options->save_pts.empty() || options->split)
 		LOG_ERROR("\nERROR: Pi 5 and libav encoder does not currently support the circular, segment, save_pts or "
@@ -342,6 +367,10 @@ LibAvEncoder::LibAvEncoder(VideoOptions const *options, StreamInfo const &info)
 		av_log_set_level(AV_LOG_VERBOSE);
 
 	initVideoCodec(options, info);
+	if (options->sei && options->libav_video_codec != "libx264" && options->libav_video_codec != "h264_v4l2m2m")
+		LOG_ERROR("WARNING: libav: SEI can only be added to H.264 streams");
+	else if (options->sei)
+		sei_ = std::make_unique<SeiInserter>();
 	if (options->libav_audio)
 	{
 		initAudioInCodec(options, info);
@@ -370,6 +399,9 @@ LibAvEncoder::~LibAvEncoder()
 	abort_video_ = true;
 	video_thread_.join();
 
+	for (AVFrame *frame : frame_pool_)
+		av_frame_free(&frame);
+
 	avformat_free_context(out_fmt_ctx_);
 	avcodec_free_context(&codec_ctx_[Video]);
 
@@ -385,7 +417,18 @@ LibAvEncoder::~LibAvEncoder()
 
 void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	AVFrame *frame = av_frame_alloc();
+	// Frames are recycled by the video thread once they have been encoded.
+	AVFrame *frame = nullptr;
+	{
+		std::scoped_lock<std::mutex> lock(video_mutex_);
+		if (!frame_pool_.empty())
+		{
+			frame = frame_pool_.back();
+			frame_pool_.pop_back();
+		}
+	}
+	if (!frame)
+		frame = av_frame_alloc();
 	if (!frame)
 		throw std::runtime_error("libav: could not allocate AVFrame");
 
@@ -397,15 +440,14 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	frame->height = info.height;
 	frame->linesize[0] = info.stride;
 	frame->linesize[1] = frame->linesize[2] = info.stride >> 1;
-	frame->pts = timestamp_us - video_start_ts_ +
-				 (options_->av_sync.value < 0us ? -options_->av_sync.get<std::chrono::microseconds>() : 0);
+	frame->pts = timestamp_us - video_start_ts_ + videoSyncOffset();
 
 	if (codec_ctx_[Video]->pix_fmt == AV_PIX_FMT_DRM_PRIME)
 	{
-		std::scoped_lock<std::mutex> lock(drm_queue_lock_);
-		drm_frame_queue_.emplace(std::make_unique<AVDRMFrameDescriptor>());
-		frame->buf[0] = av_buffer_create((uint8_t *)drm_frame_queue_.back().get(), sizeof(AVDRMFrameDescriptor),
-										 &LibAvEncoder::releaseBuffer, this, 0);
+		DrmFrame *drm_frame = new DrmFrame();
+		drm_frame->mem = mem;
+		frame->buf[0] = av_buffer_create((uint8_t *)&drm_frame->desc, sizeof(AVDRMFrameDescriptor),
+										 &LibAvEncoder::releaseDrmBuffer, this, 0);
 		frame->data[0] = frame->buf[0]->data;
 
 		AVDRMFrameDescriptor *desc = (AVDRMFrameDescriptor *)frame->data[0];
@@ -439,6 +481,20 @@ void LibAvEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 	video_cv_.notify_all();
 }
 
+bool LibAvEncoder::SetBitrate(unsigned int bps)
+{
+	// Of our codecs, only libx264 reconfigures itself when the bitrate changes mid-stream.
+	if (options_->libav_video_codec != "libx264")
+		return false;
+	pending_bitrate_ = bps;
+	return true;
+}
+
+void LibAvEncoder::RequestKeyframe()
+{
+	keyframe_requested_ = true;
+}
+
 void LibAvEncoder::initOutput()
 {
 	int ret;
@@ -506,6 +562,10 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 			initOutput();
 			output_ready_ = true;
 		}
+		if (stream_id == Video)
+			packets_received_++;
+		if (stream_id == Video && sei_)
+			insertSei(pkt);
 
 		pkt->stream_index = stream_id;
 		pkt->pos = -1;
@@ -528,16 +588,68 @@ void LibAvEncoder::encode(AVPacket *pkt, unsigned int stream_id)
 	}
 }
 
+int64_t LibAvEncoder::videoSyncOffset() const
+{
+	return options_->av_sync.value < 0us ? -options_->av_sync.get<std::chrono::microseconds>() : 0;
+}
+
+void LibAvEncoder::insertSei(AVPacket *pkt)
+{
+	// Packets still have their frame's pts, in the codec's microsecond timebase.
+	std::vector<uint8_t> sei = sei_->Take(pkt->pts + video_start_ts_ - videoSyncOffset());
+	if (sei.empty())
+		return;
+
+	// Our H.264 codecs give us Annex B streams, which the muxers convert as they need to.
+	if (pkt->size < 4 || pkt->data[0] || pkt->data[1] || (pkt->data[2] != 1 && pkt->data[3] != 1))
+	{
+		LOG_ERROR("WARNING: libav: codec output is not an Annex B stream, no SEI will be added");
+		// The app thread may be adding metadata to it right now, so it has to stay.
+		sei_->Disable();
+		return;
+	}
+
+	size_t pos = SeiInserter::InsertPosition(pkt->data, pkt->size);
+	size_t size = pkt->size;
+	if (av_packet_make_writable(pkt) < 0 || av_grow_packet(pkt, sei.size()) < 0)
+		throw std::runtime_error("libav: unable to add SEI to packet");
+	memmove(pkt->data + pos + sei.size(), pkt->data + pos, size - pos);
+	memcpy(pkt->data + pos, sei.data(), sei.size());
+}
+
 extern "C" void LibAvEncoder::releaseBuffer(void *opaque, uint8_t *data)
+{
+	// Codecs with frame threads may finish with their frames in any order.
+	LibAvEncoder *enc = static_cast<LibAvEncoder *>(opaque);
+	enc->input_done_callback_(data);
+}
+
+extern "C" void LibAvEncoder::releaseDrmBuffer(void *opaque, uint8_t *data)
 {
 	LibAvEncoder *enc = static_cast<LibAvEncoder *>(opaque);
+	DrmFrame *drm_frame = reinterpret_cast<DrmFrame *>(data);
+	enc->input_done_callback_(drm_frame->mem);
+	delete drm_frame;
+}
 
-	enc->input_done_callback_(nullptr);
+void LibAvEncoder::reportQueueDepth()
+{
+	// Frames waiting for the video thread, and frames the codec has taken but not yet
+	// returned a packet for, both add directly to the latency.
+	auto now = std::chrono::steady_clock::now();
+	if (now - last_report_ < std::chrono::seconds(1))
+		return;
 
-	// Pop the entry from the queue to release the AVDRMFrameDescriptor allocation
-	std::scoped_lock<std::mutex> lock(enc->drm_queue_lock_);
-	if (!enc->drm_frame_queue_.empty())
-		enc->drm_frame_queue_.pop();
+	unsigned int queued;
+	{
+		std::scoped_lock<std::mutex> lock(video_mutex_);
+		queued = frame_queue_.size();
+	}
+	unsigned int level = options_->low_latency ? 1 : 2;
+	LOG(level, "libav: encoder queue depth " << queued << " (max " << max_queue_depth_ << "), frames in codec "
+											 << frames_sent_ - packets_received_);
+	max_queue_depth_ = 0;
+	last_report_ = now;
 }
 
 void LibAvEncoder::videoThread()
@@ -559,6 +671,7 @@ void LibAvEncoder::videoThread()
 
 				if (!frame_queue_.empty())
 				{
+					max_queue_depth_ = std::max<unsigned int>(max_queue_depth_, frame_queue_.size());
 					frame = frame_queue_.front();
 					frame_queue_.pop();
 					break;
@@ -568,12 +681,32 @@ void LibAvEncoder::videoThread()
 			}
 		}
 
+		// The codec context belongs to this thread, so bitrate changes are applied here.
+		unsigned int bitrate = pending_bitrate_.exchange(0);
+		if (bitrate)
+		{
+			codec_ctx_[Video]->bit_rate = bitrate;
+			LOG(2, "libav: bitrate changed to " << bitrate / 1000 << "kbps");
+		}
+
+		// libx264 turns a forced I frame into an IDR, and h264_v4l2m2m passes it on to the
+		// hardware as V4L2_CID_MPEG_VIDEO_FORCE_KEY_FRAME.
+		if (keyframe_requested_.exchange(false))
+			frame->pict_type = AV_PICTURE_TYPE_I;
+
 		int ret = avcodec_send_frame(codec_ctx_[Video], frame);
 		if (ret < 0)
 			throw std::runtime_error("libav: error encoding frame: " + std::to_string(ret));
+		frames_sent_++;
 
 		encode(pkt, Video);
-		av_frame_free(&frame);
+		av_frame_unref(frame);
+		{
+			std::scoped_lock<std::mutex> lock(video_mutex_);
+			frame_pool_.push_back(frame);
+		}
+
+		reportQueueDepth();
 	}
 
 done:
@@ -8,11 +8,13 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
+#include <vector>
 
 extern "C"
 {
@@ -38,6 +40,8 @@ public:
 	~LibAvEncoder();
 	// Encode the given DMABUF.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	bool SetBitrate(unsigned int bps) override;
+	void RequestKeyframe() override;
 
 private:
 	void initVideoCodec(VideoOptions const *options, StreamInfo const &info);
@@ -47,11 +51,16 @@ private:
 	void initOutput();
 	void deinitOutput();
 	void encode(AVPacket *pkt, unsigned int stream_id);
+	// The amount added to each frame's timestamp, less the first one, to make its pts.
+	int64_t videoSyncOffset() const;
+	void insertSei(AVPacket *pkt);
 
 	void videoThread();
 	void audioThread();
+	void reportQueueDepth();
 
 	static void releaseBuffer(void *opaque, uint8_t *data);
+	static void releaseDrmBuffer(void *opaque, uint8_t *data);
 
 	std::atomic<bool> output_ready_;
 	bool abort_video_;
@@ -60,6 +69,13 @@ private:
 	uint64_t audio_samples_;
 
 	std::queue<AVFrame *> frame_queue_;
+	std::vector<AVFrame *> frame_pool_;
+	uint64_t frames_sent_;
+	uint64_t packets_received_;
+	unsigned int max_queue_depth_;
+	std::chrono::steady_clock::time_point last_report_;
+	std::atomic<unsigned int> pending_bitrate_;
+	std::atomic<bool> keyframe_requested_;
 	std::mutex video_mutex_;
 	std::mutex output_mutex_;
 	std::condition_variable video_cv_;
@@ -73,8 +89,12 @@ private:
 	AVFormatContext *in_fmt_ctx_;
 	AVFormatContext *out_fmt_ctx_;
 
-	std::mutex drm_queue_lock_;
-	std::queue<std::unique_ptr<AVDRMFrameDescriptor>> drm_frame_queue_;
+	// The descriptor must come first, as libav hands us back a pointer to it.
+	struct DrmFrame
+	{
+		AVDRMFrameDescriptor desc;
+		void *mem;
+	};
 
 	std::string output_file_;
 };
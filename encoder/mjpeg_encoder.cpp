@@ -19,7 +19,7 @@ typedef unsigned long jpeg_mem_len_t;
 #endif
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), output_mem_(nullptr)
 {
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
 	for (int i = 0; i < NUM_ENC_THREADS; i++)
@@ -134,8 +134,9 @@ void MjpegEncoder::encodeThread(int num)
 		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
-		// Don't return buffers until the output thread as that's where they're
-		// in order again.
+		// The camera buffer can go back straight away, even if earlier frames are still
+		// being encoded by the other threads.
+		input_done_callback_(encode_item.mem);
 
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
@@ -184,10 +185,20 @@ void MjpegEncoder::outputThread()
 			}
 		}
 	got_item:
-		input_done_callback_(nullptr);
-
+		output_mem_ = item.mem;
 		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
+		free(output_mem_); // unless the application is holding it
+		output_mem_ = nullptr;
 		index++;
 	}
 }
+
+std::function<void()> MjpegEncoder::HoldOutputBuffer()
+{
+	// Each of our buffers is freshly allocated, so the application can simply have it.
+	void *mem = output_mem_;
+	output_mem_ = nullptr;
+	if (!mem)
+		return {};
+	return [mem]() { free(mem); };
+}
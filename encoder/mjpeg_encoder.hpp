@@ -23,6 +23,7 @@ public:
 	~MjpegEncoder();
 	// Encode the given buffer.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	std::function<void()> HoldOutputBuffer() override;
 
 private:
 	// How many threads to use. Whichever thread is idle will pick up the next frame.
@@ -64,4 +65,6 @@ private:
 	std::mutex output_mutex_;
 	std::condition_variable output_cond_var_;
 	std::thread output_thread_;
+	// The buffer being passed to the application right now, unless it has taken it.
+	void *output_mem_;
 };
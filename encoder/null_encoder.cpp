@@ -57,10 +57,9 @@ void NullEncoder::outputThread()
 					return;
 			}
 		}
-		// Ensure the input done callback happens before the output ready callback.
-		// This is needed as the metadata queue gets pushed in the former, and popped
-		// in the latter.
-		input_done_callback_(nullptr);
+		// The output reads straight from the camera buffer, so only give it back afterwards.
+		// (Metadata is matched by timestamp, so it no longer matters which callback is first.)
 		output_ready_callback_(item.mem, item.length, item.timestamp_us, true);
+		input_done_callback_(item.mem);
 	}
 }
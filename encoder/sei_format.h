@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * sei_format.h - layout of the per-frame metadata carried in H.264 SEI messages.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * With --sei, every access unit carries a user data unregistered SEI message (payload
+ * type 5) just before its first slice. Its payload is:
+ *
+ *   the 16 bytes of SEI_METADATA_UUID (c05207ff-f347-4ae4-bae9-57a88eab3dc6)
+ *   sei_metadata_header
+ *   sei_detection                     } num_detections times
+ *
+ * All fields are little endian. Readers should skip header_size bytes to find the
+ * detections, as later versions may add fields to the end of the header. Fields
+ * whose flag is clear were not in the frame's metadata, and are zero.
+ */
+
+#define SEI_METADATA_UUID "\xc0\x52\x07\xff\xf3\x47\x4a\xe4\xba\xe9\x57\xa8\x8e\xab\x3d\xc6"
+#define SEI_METADATA_VERSION 1
+/* Detections beyond this many are left out, to keep the message small. */
+#define SEI_METADATA_MAX_DETECTIONS 64
+
+enum sei_metadata_flags
+{
+	SEI_METADATA_FLAG_EXPOSURE_TIME = 1,
+	SEI_METADATA_FLAG_ANALOGUE_GAIN = 2,
+	SEI_METADATA_FLAG_DIGITAL_GAIN = 4,
+	SEI_METADATA_FLAG_LENS_POSITION = 8,
+	SEI_METADATA_FLAG_COLOUR_TEMPERATURE = 16,
+	SEI_METADATA_FLAG_DETECTIONS = 32, /* set even when there were none, if detection was running */
+};
+
+struct sei_metadata_header
+{
+	uint8_t version;
+	uint8_t header_size;
+	uint16_t flags;
+	uint32_t sequence; /* from the sensor */
+	int64_t sensor_timestamp_ns; /* CLOCK_MONOTONIC, as the SensorTimestamp control */
+	uint32_t exposure_time_us;
+	float analogue_gain;
+	float digital_gain;
+	float lens_position; /* in dioptres */
+	uint16_t colour_temperature;
+	uint16_t num_detections;
+	uint32_t reserved;
+};
+
+/* From the object_detect.results post-processing metadata. */
+struct sei_detection
+{
+	uint16_t category;
+	uint16_t confidence; /* 0 to 65535 for 0 to 1 */
+	int16_t x;
+	int16_t y;
+	uint16_t width;
+	uint16_t height;
+};
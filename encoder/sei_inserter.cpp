@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * sei_inserter.cpp - put per-frame metadata into H.264 SEI messages.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+#include <libcamera/control_ids.h>
+
+#include "post_processing_stages/object_detect.hpp"
+
+#include "sei_format.h"
+#include "sei_inserter.hpp"
+
+static constexpr uint8_t NAL_TYPE_SEI = 6;
+static constexpr uint8_t SEI_USER_DATA_UNREGISTERED = 5;
+
+template <typename T>
+static T clamp_to(int value)
+{
+	return std::clamp<int>(value, std::numeric_limits<T>::min(), std::numeric_limits<T>::max());
+}
+
+static std::vector<uint8_t> make_payload(unsigned int sequence, libcamera::ControlList const &controls,
+										 Metadata const &post_process)
+{
+	using namespace libcamera;
+
+	sei_metadata_header header = {};
+	header.version = SEI_METADATA_VERSION;
+	header.header_size = sizeof(header);
+	header.sequence = sequence;
+	header.sensor_timestamp_ns = controls.get(controls::SensorTimestamp).value_or(0);
+	if (auto exposure_time = controls.get(controls::ExposureTime))
+		header.exposure_time_us = *exposure_time, header.flags |= SEI_METADATA_FLAG_EXPOSURE_TIME;
+	if (auto analogue_gain = controls.get(controls::AnalogueGain))
+		header.analogue_gain = *analogue_gain, header.flags |= SEI_METADATA_FLAG_ANALOGUE_GAIN;
+	if (auto digital_gain = controls.get(controls::DigitalGain))
+		header.digital_gain = *digital_gain, header.flags |= SEI_METADATA_FLAG_DIGITAL_GAIN;
+	if (auto lens_position = controls.get(controls::LensPosition))
+		header.lens_position = *lens_position, header.flags |= SEI_METADATA_FLAG_LENS_POSITION;
+	if (auto colour_temperature = controls.get(controls::ColourTemperature))
+	{
+		header.colour_temperature = clamp_to<uint16_t>(*colour_temperature);
+		header.flags |= SEI_METADATA_FLAG_COLOUR_TEMPERATURE;
+	}
+
+	std::vector<Detection> detections;
+	if (post_process.Get("object_detect.results", detections) == 0)
+		header.flags |= SEI_METADATA_FLAG_DETECTIONS;
+	header.num_detections = std::min<size_t>(detections.size(), SEI_METADATA_MAX_DETECTIONS);
+
+	std::vector<uint8_t> payload(16 + sizeof(header) + header.num_detections * sizeof(sei_detection));
+	memcpy(payload.data(), SEI_METADATA_UUID, 16);
+	memcpy(payload.data() + 16, &header, sizeof(header));
+	uint8_t *ptr = payload.data() + 16 + sizeof(header);
+	for (unsigned int i = 0; i < header.num_detections; i++, ptr += sizeof(sei_detection))
+	{
+		Detection const &d = detections[i];
+		sei_detection detection = { clamp_to<uint16_t>(d.category),
+									clamp_to<uint16_t>(d.confidence * 65535.0f + 0.5f),
+									clamp_to<int16_t>(d.box.x),
+									clamp_to<int16_t>(d.box.y),
+									clamp_to<uint16_t>(d.box.width),
+									clamp_to<uint16_t>(d.box.height) };
+		memcpy(ptr, &detection, sizeof(detection));
+	}
+	return payload;
+}
+
+void SeiInserter::Add(int64_t timestamp_us, unsigned int sequence, libcamera::ControlList const &controls,
+					  Metadata const &post_process)
+{
+	if (disabled_)
+		return;
+	std::vector<uint8_t> payload = make_payload(sequence, controls, post_process);
+
+	// The SEI message, then the RBSP trailing bits.
+	std::vector<uint8_t> rbsp = { SEI_USER_DATA_UNREGISTERED };
+	size_t size = payload.size();
+	for (; size >= 255; size -= 255)
+		rbsp.push_back(255);
+	rbsp.push_back(size);
+	rbsp.insert(rbsp.end(), payload.begin(), payload.end());
+	rbsp.push_back(0x80);
+
+	// Our binary payload is bound to contain byte sequences that look like start codes.
+	std::vector<uint8_t> nal = { 0, 0, 0, 1, NAL_TYPE_SEI };
+	unsigned int zeros = 0;
+	for (uint8_t byte : rbsp)
+	{
+		if (zeros == 2 && byte <= 3)
+		{
+			nal.push_back(3);
+			zeros = 0;
+		}
+		nal.push_back(byte);
+		zeros = byte ? 0 : zeros + 1;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (disabled_) // while we weren't looking
+		return;
+	pending_[timestamp_us] = std::move(nal);
+	if (pending_.size() > MAX_PENDING)
+		pending_.erase(pending_.begin());
+}
+
+std::vector<uint8_t> SeiInserter::Take(int64_t timestamp_us)
+{
+	std::vector<uint8_t> nal;
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = pending_.find(timestamp_us);
+	if (it != pending_.end())
+	{
+		nal = std::move(it->second);
+		pending_.erase(it);
+	}
+	pending_.erase(pending_.begin(), pending_.lower_bound(timestamp_us - MAX_AGE_US));
+	return nal;
+}
+
+void SeiInserter::Disable()
+{
+	disabled_ = true;
+	std::lock_guard<std::mutex> lock(mutex_);
+	pending_.clear();
+}
+
+size_t SeiInserter::InsertPosition(uint8_t const *data, size_t size)
+{
+	for (size_t i = 0; i + 3 < size; i++)
+	{
+		if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+			continue;
+		uint8_t type = data[i + 3] & 0x1f;
+		if (type >= 1 && type <= 5)
+			return i > 0 && data[i - 1] == 0 ? i - 1 : i; // before any 4 byte start code
+		i += 2;
+	}
+	return size;
+}
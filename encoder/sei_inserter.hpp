@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * sei_inserter.hpp - put per-frame metadata into H.264 SEI messages.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+#include "core/metadata.hpp"
+
+// Turns each frame's metadata into an SEI NAL unit (laid out as sei_format.h describes) as
+// the frame goes into the encoder, and keeps it until the encoded frame comes out, when the
+// encoder splices it into the access unit. Frames are matched up by their timestamps.
+
+class SeiInserter
+{
+public:
+	// From the thread that queues frames for encoding.
+	void Add(int64_t timestamp_us, unsigned int sequence, libcamera::ControlList const &controls,
+			 Metadata const &post_process);
+	// The SEI NAL unit, with its start code, for the frame with this timestamp, or nothing if
+	// there isn't one. Frames may come out of the encoder in a different order (B frames),
+	// so only those left over from long before, which the encoder must have dropped, go too.
+	std::vector<uint8_t> Take(int64_t timestamp_us);
+	// For when the encoder finds it can't use them after all. Add and Take then do nothing.
+	void Disable();
+
+	// Where the SEI goes in an Annex B access unit, which is just before its first slice.
+	static size_t InsertPosition(uint8_t const *data, size_t size);
+
+private:
+	// Should the encoder stop producing frames, don't let these pile up.
+	static constexpr size_t MAX_PENDING = 64;
+	// Reordering never holds a frame back for anything like this long.
+	static constexpr int64_t MAX_AGE_US = 1000000;
+
+	std::atomic<bool> disabled_ { false };
+	std::mutex mutex_;
+	std::map<int64_t, std::vector<uint8_t>> pending_;
+};
@@ -0,0 +1,239 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * zstd_encoder.cpp - lossless zstd frame compressor.
+ */
+
+#include <cctype>
+#include <chrono>
+#include <cstring>
+
+#include <zstd.h>
+
+#include "output/container_format.h"
+
+#include "zstd_encoder.hpp"
+
+// Work out how to predict each sample from an earlier one of the same colour. Returns false
+// if the format isn't one we know how to predict, or is already compressed.
+static bool choose_predictor(libcamera::PixelFormat const &format, unsigned int &sample_bytes,
+							 unsigned int &sample_distance)
+{
+	std::string name = format.toString();
+	bool bayer = name.size() > 5 && name[0] == 'S' && name.find_first_not_of("RGB", 1) == 5;
+	bool mono = name.size() > 1 && name[0] == 'R' && isdigit(name[1]);
+	unsigned int colours = bayer ? 2 : 1;
+
+	if (name.find("PISP") != std::string::npos)
+		return false;
+	else if (name.rfind("YUV", 0) == 0 || name.rfind("YVU", 0) == 0)
+		sample_bytes = 1, sample_distance = 1;
+	else if (!bayer && !mono)
+		return false;
+	// CSI2 packed formats put the top bits of a group of pixels in consecutive bytes, so the
+	// same byte of the previous group is always the same colour.
+	else if (name.find("10_CSI2P") != std::string::npos)
+		sample_bytes = 1, sample_distance = 5;
+	else if (name.find("12_CSI2P") != std::string::npos)
+		sample_bytes = 1, sample_distance = 3;
+	else if (name.find("_CSI2P") != std::string::npos)
+		return false;
+	else if (name.back() == '8')
+		sample_bytes = 1, sample_distance = colours;
+	else
+		sample_bytes = 2, sample_distance = colours;
+
+	return true;
+}
+
+// Replace each sample by the zigzag coded difference from the one sample_distance before it
+// on the same line. The line length is the stride, which for planar YUV makes each "line" of
+// the chroma planes two real lines long, but that is harmless as the decoder does the same.
+template <typename T>
+static void delta_encode(T const *src, T *dst, size_t samples, size_t line_samples, unsigned int distance)
+{
+	constexpr unsigned int shift = sizeof(T) * 8 - 1;
+	for (size_t line = 0; line < samples; line += line_samples)
+	{
+		size_t n = std::min(line_samples, samples - line);
+		T const *s = src + line;
+		T *d = dst + line;
+		size_t i = 0;
+		for (; i < std::min<size_t>(distance, n); i++)
+			d[i] = s[i];
+		for (; i < n; i++)
+		{
+			T diff = s[i] - s[i - distance];
+			d[i] = (T)(diff << 1) ^ (T)(0 - (diff >> shift));
+		}
+	}
+}
+
+ZstdEncoder::ZstdEncoder(VideoOptions const *options)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0),
+	  output_queue_(options->compress_threads)
+{
+	output_thread_ = std::thread(&ZstdEncoder::outputThread, this);
+	for (unsigned int i = 0; i < options->compress_threads; i++)
+		encode_thread_.emplace_back(&ZstdEncoder::encodeThread, this, i);
+	LOG(2, "Opened ZstdEncoder with " << options->compress_threads << " threads, level "
+									  << options->compress_level);
+}
+
+ZstdEncoder::~ZstdEncoder()
+{
+	abortEncode_ = true;
+	for (auto &thread : encode_thread_)
+		thread.join();
+	abortOutput_ = true;
+	output_thread_.join();
+	LOG(2, "ZstdEncoder closed");
+}
+
+void ZstdEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
+{
+	std::lock_guard<std::mutex> lock(encode_mutex_);
+	EncodeItem item = { mem, size, info, timestamp_us, index_++ };
+	encode_queue_.push(item);
+	encode_cond_var_.notify_all();
+}
+
+void ZstdEncoder::encodeThread(int num)
+{
+	ZSTD_CCtx *cctx = ZSTD_createCCtx();
+	if (!cctx)
+		throw std::runtime_error("failed to create zstd context");
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, options_->compress_level);
+	ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	std::vector<uint8_t> predicted;
+	std::chrono::duration<double> encode_time(0);
+	uint64_t raw_bytes = 0, compressed_bytes = 0;
+	uint32_t frames = 0;
+
+	EncodeItem encode_item;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(encode_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				if (abortEncode_ && encode_queue_.empty())
+				{
+					if (frames)
+						LOG(2, "Compressed " << frames << " frames, average time "
+											 << encode_time.count() * 1000 / frames << "ms, ratio "
+											 << (double)raw_bytes / compressed_bytes);
+					ZSTD_freeCCtx(cctx);
+					return;
+				}
+				if (!encode_queue_.empty())
+				{
+					encode_item = encode_queue_.front();
+					encode_queue_.pop();
+					break;
+				}
+				else
+					encode_cond_var_.wait_for(lock, 200ms);
+			}
+		}
+
+		auto start_time = std::chrono::high_resolution_clock::now();
+		StreamInfo const &info = encode_item.info;
+		compressed_frame_header header = {};
+		header.magic = COMPRESSED_FRAME_MAGIC;
+		header.header_size = sizeof(header);
+		header.compression = CONTAINER_COMPRESSION_ZSTD;
+		header.width = info.width;
+		header.height = info.height;
+		header.stride = info.stride;
+		header.pixel_format = info.pixel_format.fourcc();
+		header.raw_size = encode_item.size;
+
+		// The predictor writes into our own buffer, after which the camera buffer can go back
+		// straight away, even if earlier frames are still being compressed by other threads.
+		void const *src = encode_item.mem;
+		unsigned int sample_bytes = 1, sample_distance = 1;
+		if (options_->compress_predict && info.stride &&
+			choose_predictor(info.pixel_format, sample_bytes, sample_distance))
+		{
+			predicted.resize(encode_item.size);
+			size_t samples = encode_item.size / sample_bytes;
+			if (sample_bytes == 2)
+				delta_encode((uint16_t const *)src, (uint16_t *)predicted.data(), samples, info.stride / 2,
+							 sample_distance);
+			else
+				delta_encode((uint8_t const *)src, predicted.data(), samples, info.stride, sample_distance);
+			// Any odd byte at the end is passed through as it is.
+			memcpy(predicted.data() + samples * sample_bytes, (uint8_t const *)src + samples * sample_bytes,
+				   encode_item.size - samples * sample_bytes);
+			header.predictor = CONTAINER_PREDICTOR_DELTA;
+			header.sample_bytes = sample_bytes;
+			header.sample_distance = sample_distance;
+			src = predicted.data();
+			input_done_callback_(encode_item.mem);
+		}
+
+		size_t bound = ZSTD_compressBound(encode_item.size);
+		uint8_t *buffer = (uint8_t *)malloc(sizeof(header) + bound);
+		if (!buffer)
+			throw std::runtime_error("failed to allocate compressed frame buffer");
+		size_t ret = ZSTD_compress2(cctx, buffer + sizeof(header), bound, src, encode_item.size);
+		if (ZSTD_isError(ret))
+			throw std::runtime_error("zstd compression failed: " + std::string(ZSTD_getErrorName(ret)));
+		if (header.predictor == CONTAINER_PREDICTOR_NONE)
+			input_done_callback_(encode_item.mem);
+		header.compressed_size = ret;
+		memcpy(buffer, &header, sizeof(header));
+
+		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
+		raw_bytes += encode_item.size;
+		compressed_bytes += ret;
+		frames++;
+
+		OutputItem output_item = { buffer, sizeof(header) + ret, encode_item.timestamp_us, encode_item.index };
+		std::lock_guard<std::mutex> lock(output_mutex_);
+		output_queue_[num].push(output_item);
+		output_cond_var_.notify_one();
+	}
+}
+
+void ZstdEncoder::outputThread()
+{
+	OutputItem item;
+	uint64_t index = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(output_mutex_);
+			while (true)
+			{
+				using namespace std::chrono_literals;
+				// Find the thread that has compressed the next frame, and wait if none has yet.
+				// When aborting, every queue must be empty first so that no frame is lost.
+				bool abort = abortOutput_ ? true : false;
+				for (auto &q : output_queue_)
+				{
+					if (abort && !q.empty())
+						abort = false;
+
+					if (!q.empty() && q.front().index == index)
+					{
+						item = q.front();
+						q.pop();
+						goto got_item;
+					}
+				}
+				if (abort)
+					return;
+
+				output_cond_var_.wait_for(lock, 200ms);
+			}
+		}
+	got_item:
+		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
+		free(item.mem);
+		index++;
+	}
+}
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * zstd_encoder.hpp - lossless zstd frame compressor.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "encoder.hpp"
+
+// Compresses each frame independently, so any frame of the recording can be decoded on its
+// own. Frames are shared out between several threads and put back in order for the output.
+// Each output buffer is a compressed_frame_header (see output/container_format.h) followed
+// by the zstd data.
+class ZstdEncoder : public Encoder
+{
+public:
+	ZstdEncoder(VideoOptions const *options);
+	~ZstdEncoder();
+	// Compress the given buffer.
+	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+
+private:
+	// These threads do the actual compression.
+	void encodeThread(int num);
+
+	// Pass the compressed frames to the application, in order, from a separate thread.
+	void outputThread();
+
+	bool abortEncode_;
+	bool abortOutput_;
+	uint64_t index_;
+
+	struct EncodeItem
+	{
+		void *mem;
+		size_t size;
+		StreamInfo info;
+		int64_t timestamp_us;
+		uint64_t index;
+	};
+	std::queue<EncodeItem> encode_queue_;
+	std::mutex encode_mutex_;
+	std::condition_variable encode_cond_var_;
+	std::vector<std::thread> encode_thread_;
+
+	struct OutputItem
+	{
+		void *mem;
+		size_t bytes_used;
+		int64_t timestamp_us;
+		uint64_t index;
+	};
+	std::vector<std::queue<OutputItem>> output_queue_;
+	std::mutex output_mutex_;
+	std::condition_variable output_cond_var_;
+	std::thread output_thread_;
+};
@@ -5,8 +5,23 @@
  * dng.cpp - Save raw image as DNG file.
  */
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <limits>
 #include <map>
+#include <thread>
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__x86_64__)
+#include <tmmintrin.h>
+#endif
 
 #include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
@@ -22,6 +37,11 @@
 
 using namespace libcamera;
 
+// Lossless JPEG compressed images are written in tiles of this size.
+static constexpr unsigned int DNG_TILE_SIZE = 256;
+// Uncompressed images are written in strips of roughly this many bytes.
+static constexpr unsigned int DNG_STRIP_SIZE = 4 << 20;
+
 static char TIFF_RGGB[4] = { 0, 1, 1, 2 };
 static char TIFF_GRBG[4] = { 1, 0, 2, 1 };
 static char TIFF_BGGR[4] = { 2, 1, 1, 0 };
@@ -76,52 +96,184 @@ static const std::map<PixelFormat, BayerFormat> bayer_formats =
 	{ formats::BGGR_PISP_COMP1, { "BGGR-16-PISP", 16, TIFF_BGGR, false, true } },
 };
 
-static void unpack_10bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+// Unpacking and decompressing run in bands of rows on all the available cores.
+static void parallel_for(unsigned int n, std::function<void(unsigned int, unsigned int)> const &fn)
 {
-	unsigned int w_align = info.width & ~3;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
-	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 4, ptr += 5)
+	unsigned int num_threads = std::min(std::max(std::thread::hardware_concurrency(), 1u), std::max(n, 1u));
+	std::vector<std::thread> threads;
+	std::vector<std::exception_ptr> errors(num_threads);
+	auto run = [&](unsigned int i) {
+		try
 		{
-			*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
-			*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
-			*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
-			*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+			fn(n * i / num_threads, n * (i + 1) / num_threads);
 		}
-		for (; x < info.width; x++)
-			*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
+		catch (...)
+		{
+			errors[i] = std::current_exception();
+		}
+	};
+	for (unsigned int i = 1; i < num_threads; i++)
+		threads.emplace_back(run, i);
+	run(0);
+	for (auto &t : threads)
+		t.join();
+	for (auto &e : errors)
+	{
+		if (e)
+			std::rethrow_exception(e);
 	}
 }
 
-static void unpack_12bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+// The vector versions of the unpackers return the number of pixels they have done, and
+// never read beyond the end of the row's stride. The scalar code finishes off the row.
+
+#if defined(__aarch64__)
+
+static unsigned int unpack_10bit_neon(uint8_t const *src, unsigned int stride, unsigned int width, uint16_t *dest)
 {
-	unsigned int w_align = info.width & ~1;
-	for (unsigned int y = 0; y < info.height; y++, src += info.stride)
+	// 16 pixels from 20 bytes, gathered out of a 32 byte load.
+	static const uint8_t hi_idx[16] = { 0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 15, 16, 17, 18 };
+	static const uint8_t lo_idx[16] = { 4, 4, 4, 4, 9, 9, 9, 9, 14, 14, 14, 14, 19, 19, 19, 19 };
+	static const int16_t lo_shift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+	uint8x16_t hi_tbl = vld1q_u8(hi_idx), lo_tbl = vld1q_u8(lo_idx);
+	int16x8_t shift = vld1q_s16(lo_shift);
+	uint16x8_t mask = vdupq_n_u16(3);
+
+	unsigned int x = 0;
+	for (; x + 16 <= width && x / 4 * 5 + 32 <= stride; x += 16, src += 20, dest += 16)
 	{
-		uint8_t const *ptr = src;
-		unsigned int x;
-		for (x = 0; x < w_align; x += 2, ptr += 3)
-		{
-			*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
-			*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
-		}
-		if (x < info.width)
-			*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+		uint8x16x2_t in = { { vld1q_u8(src), vld1q_u8(src + 16) } };
+		uint8x16_t hi = vqtbl2q_u8(in, hi_tbl);
+		uint8x16_t lo = vqtbl2q_u8(in, lo_tbl);
+		uint16x8_t lo0 = vandq_u16(vshlq_u16(vmovl_u8(vget_low_u8(lo)), shift), mask);
+		uint16x8_t lo1 = vandq_u16(vshlq_u16(vmovl_high_u8(lo), shift), mask);
+		vst1q_u16(dest, vorrq_u16(vshll_n_u8(vget_low_u8(hi), 2), lo0));
+		vst1q_u16(dest + 8, vorrq_u16(vshll_high_n_u8(hi, 2), lo1));
 	}
+	return x;
 }
 
-static void unpack_16bit(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static unsigned int unpack_12bit_neon(uint8_t const *src, unsigned int stride, unsigned int width, uint16_t *dest)
 {
-	/* Assume the pixels in memory are already in native byte order */
-	unsigned int w = info.width;
-	for (unsigned int y = 0; y < info.height; y++)
+	// 16 pixels from 24 bytes, gathered out of a 32 byte load.
+	static const uint8_t hi_idx[16] = { 0, 1, 3, 4, 6, 7, 9, 10, 12, 13, 15, 16, 18, 19, 21, 22 };
+	static const uint8_t lo_idx[16] = { 2, 2, 5, 5, 8, 8, 11, 11, 14, 14, 17, 17, 20, 20, 23, 23 };
+	static const int16_t lo_shift[8] = { 0, -4, 0, -4, 0, -4, 0, -4 };
+	uint8x16_t hi_tbl = vld1q_u8(hi_idx), lo_tbl = vld1q_u8(lo_idx);
+	int16x8_t shift = vld1q_s16(lo_shift);
+	uint16x8_t mask = vdupq_n_u16(15);
+
+	unsigned int x = 0;
+	for (; x + 16 <= width && x / 2 * 3 + 32 <= stride; x += 16, src += 24, dest += 16)
 	{
-		memcpy(dest, src, 2 * w);
-		dest += w;
-		src += info.stride;
+		uint8x16x2_t in = { { vld1q_u8(src), vld1q_u8(src + 16) } };
+		uint8x16_t hi = vqtbl2q_u8(in, hi_tbl);
+		uint8x16_t lo = vqtbl2q_u8(in, lo_tbl);
+		uint16x8_t lo0 = vandq_u16(vshlq_u16(vmovl_u8(vget_low_u8(lo)), shift), mask);
+		uint16x8_t lo1 = vandq_u16(vshlq_u16(vmovl_high_u8(lo), shift), mask);
+		vst1q_u16(dest, vorrq_u16(vshll_n_u8(vget_low_u8(hi), 4), lo0));
+		vst1q_u16(dest + 8, vorrq_u16(vshll_high_n_u8(hi, 4), lo1));
 	}
+	return x;
+}
+
+#elif defined(__x86_64__)
+
+// SSSE3 isn't in the x86-64 baseline, so these are only used if the CPU has it. There's
+// no variable shift for 16-bit lanes either, so the low bits get multiplied up instead.
+
+__attribute__((target("ssse3"))) static unsigned int unpack_10bit_ssse3(uint8_t const *src, unsigned int stride,
+																		 unsigned int width, uint16_t *dest)
+{
+	// 8 pixels from 10 bytes of a 16 byte load.
+	__m128i hi_idx = _mm_setr_epi8(0, -1, 1, -1, 2, -1, 3, -1, 5, -1, 6, -1, 7, -1, 8, -1);
+	__m128i lo_idx = _mm_setr_epi8(4, -1, 4, -1, 4, -1, 4, -1, 9, -1, 9, -1, 9, -1, 9, -1);
+	__m128i lo_mul = _mm_setr_epi16(64, 16, 4, 1, 64, 16, 4, 1);
+	__m128i mask = _mm_set1_epi16(3);
+
+	unsigned int x = 0;
+	for (; x + 8 <= width && x / 4 * 5 + 16 <= stride; x += 8, src += 10, dest += 8)
+	{
+		__m128i in = _mm_loadu_si128((__m128i const *)src);
+		__m128i hi = _mm_slli_epi16(_mm_shuffle_epi8(in, hi_idx), 2);
+		__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(in, lo_idx), lo_mul), 6);
+		_mm_storeu_si128((__m128i *)dest, _mm_or_si128(hi, _mm_and_si128(lo, mask)));
+	}
+	return x;
+}
+
+__attribute__((target("ssse3"))) static unsigned int unpack_12bit_ssse3(uint8_t const *src, unsigned int stride,
+																		 unsigned int width, uint16_t *dest)
+{
+	// 8 pixels from 12 bytes of a 16 byte load.
+	__m128i hi_idx = _mm_setr_epi8(0, -1, 1, -1, 3, -1, 4, -1, 6, -1, 7, -1, 9, -1, 10, -1);
+	__m128i lo_idx = _mm_setr_epi8(2, -1, 2, -1, 5, -1, 5, -1, 8, -1, 8, -1, 11, -1, 11, -1);
+	__m128i lo_mul = _mm_setr_epi16(16, 1, 16, 1, 16, 1, 16, 1);
+	__m128i mask = _mm_set1_epi16(15);
+
+	unsigned int x = 0;
+	for (; x + 8 <= width && x / 2 * 3 + 16 <= stride; x += 8, src += 12, dest += 8)
+	{
+		__m128i in = _mm_loadu_si128((__m128i const *)src);
+		__m128i hi = _mm_slli_epi16(_mm_shuffle_epi8(in, hi_idx), 4);
+		__m128i lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_shuffle_epi8(in, lo_idx), lo_mul), 4);
+		_mm_storeu_si128((__m128i *)dest, _mm_or_si128(hi, _mm_and_si128(lo, mask)));
+	}
+	return x;
+}
+
+#endif
+
+static void unpack_10bit_row(uint8_t const *src, unsigned int stride, unsigned int width, uint16_t *dest)
+{
+	unsigned int x = 0;
+#if defined(__aarch64__)
+	x = unpack_10bit_neon(src, stride, width, dest);
+#elif defined(__x86_64__)
+	static const bool have_ssse3 = __builtin_cpu_supports("ssse3");
+	if (have_ssse3)
+		x = unpack_10bit_ssse3(src, stride, width, dest);
+#endif
+	uint8_t const *ptr = src + x / 4 * 5;
+	dest += x;
+	unsigned int w_align = width & ~3;
+	for (; x < w_align; x += 4, ptr += 5)
+	{
+		*dest++ = (ptr[0] << 2) | ((ptr[4] >> 0) & 3);
+		*dest++ = (ptr[1] << 2) | ((ptr[4] >> 2) & 3);
+		*dest++ = (ptr[2] << 2) | ((ptr[4] >> 4) & 3);
+		*dest++ = (ptr[3] << 2) | ((ptr[4] >> 6) & 3);
+	}
+	for (; x < width; x++)
+		*dest++ = (ptr[x & 3] << 2) | ((ptr[4] >> ((x & 3) << 1)) & 3);
+}
+
+static void unpack_12bit_row(uint8_t const *src, unsigned int stride, unsigned int width, uint16_t *dest)
+{
+	unsigned int x = 0;
+#if defined(__aarch64__)
+	x = unpack_12bit_neon(src, stride, width, dest);
+#elif defined(__x86_64__)
+	static const bool have_ssse3 = __builtin_cpu_supports("ssse3");
+	if (have_ssse3)
+		x = unpack_12bit_ssse3(src, stride, width, dest);
+#endif
+	uint8_t const *ptr = src + x / 2 * 3;
+	dest += x;
+	unsigned int w_align = width & ~1;
+	for (; x < w_align; x += 2, ptr += 3)
+	{
+		*dest++ = (ptr[0] << 4) | ((ptr[2] >> 0) & 15);
+		*dest++ = (ptr[1] << 4) | ((ptr[2] >> 4) & 15);
+	}
+	if (x < width)
+		*dest++ = (ptr[x & 1] << 4) | ((ptr[2] >> ((x & 1) << 2)) & 15);
+}
+
+static void unpack_16bit_row(uint8_t const *src, unsigned int, unsigned int width, uint16_t *dest)
+{
+	/* Assume the pixels in memory are already in native byte order */
+	memcpy(dest, src, 2 * width);
 }
 
 // We always use these compression parameters.
@@ -215,37 +367,223 @@ static void subBlockFunction(uint16_t *d, uint32_t w)
 	d[6] = dequantize(q[3], qmode);
 }
 
-static void uncompress(uint8_t const *src, StreamInfo const &info, uint16_t *dest)
+static void uncompress_row(uint8_t const *src, unsigned int, unsigned int width, uint16_t *dest)
+{
+	// In all cases, the *decompressed* row must be a multiple of 8 columns wide.
+	uint16_t *dp = dest;
+	uint8_t const *sp = src;
+
+	for (unsigned int x = 0; x < width; x += 8)
+	{
+		if (COMPRESS_MODE & 1)
+		{
+			uint32_t w0 = 0, w1 = 0;
+			for (int b = 0; b < 4; ++b)
+				w0 |= (*sp++) << (b * 8);
+			for (int b = 0; b < 4; ++b)
+				w1 |= (*sp++) << (b * 8);
+			subBlockFunction(dp, w0);
+			subBlockFunction(dp + 1, w1);
+			for (int i = 0; i < 8; ++i, ++dp)
+				*dp = postprocess(*dp);
+		}
+		else
+		{
+			for (int i = 0; i < 8; ++i)
+				*dp++ = postprocess((*sp++) << 8);
+		}
+	}
+}
+
+// Lossless JPEG (ITU T.81 process 14, as DNG uses it) for compressed DNGs. Each row of the
+// Bayer image is coded as a pair of interleaved components of half the width, so that the
+// left-hand predictor always refers to a pixel of the same colour.
+
+class LosslessJpegEncoder
 {
-	// In all cases, the *decompressed* image must be a multiple of 8 columns wide.
-	unsigned int buf_stride_pixels = (info.width + 7) & ~7;
-	for (unsigned int y = 0; y < info.height; ++y)
+public:
+	LosslessJpegEncoder(unsigned int bits) : bits_(bits) {}
+
+	// Encode a width x height block (width even) as a complete JPEG stream.
+	void Encode(uint16_t const *src, unsigned int stride, unsigned int width, unsigned int height,
+				std::vector<uint8_t> &out)
+	{
+		unsigned int freq[17] = {};
+		forEachDiff(src, stride, width, height, [&freq](int diff) { freq[category(diff)]++; });
+		makeTable(freq);
+
+		out.clear();
+		out.reserve(width * height * 2);
+		putMarker(out, 0xd8); // SOI
+
+		putMarker(out, 0xc4); // DHT
+		unsigned int num_codes = 0;
+		for (unsigned int len = 1; len <= 16; len++)
+			num_codes += bits_count_[len];
+		put16(out, 2 + 1 + 16 + num_codes);
+		out.push_back(0x00);
+		for (unsigned int len = 1; len <= 16; len++)
+			out.push_back(bits_count_[len]);
+		out.insert(out.end(), huff_val_, huff_val_ + num_codes);
+
+		putMarker(out, 0xc3); // SOF3
+		put16(out, 8 + 3 * 2);
+		out.push_back(bits_);
+		put16(out, height);
+		put16(out, width / 2);
+		out.push_back(2);
+		for (uint8_t c = 1; c <= 2; c++)
+			out.insert(out.end(), { c, 0x11, 0 });
+
+		putMarker(out, 0xda); // SOS
+		put16(out, 6 + 2 * 2);
+		out.push_back(2);
+		for (uint8_t c = 1; c <= 2; c++)
+			out.insert(out.end(), { c, 0x00 });
+		out.insert(out.end(), { 1, 0, 0 }); // predictor 1, no point transform
+
+		uint64_t acc = 0;
+		unsigned int acc_bits = 0;
+		auto put_bits = [&out, &acc, &acc_bits](uint32_t value, unsigned int n) {
+			acc = (acc << n) | (value & ((1u << n) - 1));
+			acc_bits += n;
+			while (acc_bits >= 8)
+			{
+				acc_bits -= 8;
+				uint8_t byte = acc >> acc_bits;
+				out.push_back(byte);
+				if (byte == 0xff)
+					out.push_back(0);
+			}
+		};
+		forEachDiff(src, stride, width, height, [this, &put_bits](int diff) {
+			unsigned int ssss = category(diff);
+			put_bits(code_[ssss], code_len_[ssss]);
+			if (ssss && ssss < 16)
+				put_bits(diff < 0 ? diff - 1 : diff, ssss);
+		});
+		if (acc_bits)
+			put_bits(0x7f, 8 - acc_bits); // pad with 1s
+
+		putMarker(out, 0xd9); // EOI
+	}
+
+private:
+	static unsigned int category(int diff)
 	{
-		uint16_t *dp = dest + y * buf_stride_pixels;
-		uint8_t const *sp = src + y * info.stride;
+		// A difference of -32768 (which is the same as +32768) has category 16 and no extra bits.
+		return diff ? 32 - __builtin_clz(std::abs(diff)) : 0;
+	}
 
-		for (unsigned int x = 0; x < info.width; x+=8)
+	template <typename F>
+	void forEachDiff(uint16_t const *src, unsigned int stride, unsigned int width, unsigned int height, F fn)
+	{
+		for (unsigned int y = 0; y < height; y++, src += stride)
+		{
+			// The first column predicts from the row above, except on the first row.
+			for (unsigned int x = 0; x < 2; x++)
+				fn((int16_t)(src[x] - (y ? (src - stride)[x] : 1 << (bits_ - 1))));
+			for (unsigned int x = 2; x < width; x++)
+				fn((int16_t)(src[x] - src[x - 2]));
+		}
+	}
+
+	// Build a length-limited Huffman code for the categories, as in T.81 Annex K.2.
+	void makeTable(unsigned int const *counts)
+	{
+		// Symbol 17 is reserved so that no code is all 1s.
+		long freq[18];
+		int code_size[18] = {}, others[18];
+		for (int i = 0; i < 17; i++)
+			freq[i] = counts[i];
+		freq[17] = 1;
+		std::fill(others, others + 18, -1);
+
+		while (true)
 		{
-			if (COMPRESS_MODE & 1)
+			int v1 = -1, v2 = -1;
+			for (int i = 0; i < 18; i++)
 			{
-				uint32_t w0 = 0, w1 = 0;
-				for (int b = 0; b < 4; ++b)
-					w0 |= (*sp++) << (b * 8);
-				for (int b = 0; b < 4; ++b)
-					w1 |= (*sp++) << (b * 8);
-				subBlockFunction(dp, w0);
-				subBlockFunction(dp + 1, w1);
-				for (int i = 0; i < 8; ++i, ++dp)
-					*dp = postprocess(*dp);
+				if (freq[i] && (v1 < 0 || freq[i] <= freq[v1]))
+					v1 = i;
 			}
-			else
+			for (int i = 0; i < 18; i++)
 			{
-				for (int i = 0; i < 8; ++i)
-					*dp++ = postprocess((*sp++) << 8);
+				if (freq[i] && i != v1 && (v2 < 0 || freq[i] <= freq[v2]))
+					v2 = i;
+			}
+			if (v2 < 0)
+				break;
+			freq[v1] += freq[v2];
+			freq[v2] = 0;
+			for (code_size[v1]++; others[v1] >= 0; code_size[v1]++)
+				v1 = others[v1];
+			others[v1] = v2;
+			for (code_size[v2]++; others[v2] >= 0; code_size[v2]++)
+				v2 = others[v2];
+		}
+
+		unsigned int bits[33] = {};
+		for (int i = 0; i < 18; i++)
+		{
+			if (code_size[i])
+				bits[code_size[i]]++;
+		}
+		for (int i = 32; i > 16; i--)
+		{
+			while (bits[i])
+			{
+				int j = i - 2;
+				while (!bits[j])
+					j--;
+				bits[i] -= 2;
+				bits[i - 1]++;
+				bits[j + 1] += 2;
+				bits[j]--;
+			}
+		}
+		int longest = 16;
+		while (!bits[longest])
+			longest--;
+		bits[longest]--; // drop the reserved symbol
+
+		unsigned int n = 0;
+		for (int len = 1; len <= 32; len++)
+		{
+			for (int i = 0; i < 17; i++)
+			{
+				if (code_size[i] == len)
+					huff_val_[n++] = i;
+			}
+		}
+		std::copy(bits, bits + 17, bits_count_);
+
+		// Assign the canonical codes; symbols that never occur get no code.
+		std::fill(code_len_, code_len_ + 17, 0);
+		uint32_t code = 0;
+		n = 0;
+		for (unsigned int len = 1; len <= 16; len++, code <<= 1)
+		{
+			for (unsigned int i = 0; i < bits_count_[len]; i++, code++)
+			{
+				code_[huff_val_[n]] = code;
+				code_len_[huff_val_[n++]] = len;
 			}
 		}
 	}
-}
+
+	static void putMarker(std::vector<uint8_t> &out, uint8_t marker) { out.insert(out.end(), { 0xff, marker }); }
+	static void put16(std::vector<uint8_t> &out, unsigned int value)
+	{
+		out.insert(out.end(), { (uint8_t)(value >> 8), (uint8_t)value });
+	}
+
+	unsigned int bits_;
+	uint8_t bits_count_[17];
+	uint8_t huff_val_[17];
+	uint32_t code_[17];
+	unsigned int code_len_[17];
+};
 
 struct Matrix
 {
@@ -296,6 +634,14 @@ Matrix(float m0, float m1, float m2,
 	}
 };
 
+// The thumbnail's simple "gamma correction".
+static const std::array<uint8_t, 65536> THUMB_GAMMA = []() {
+	std::array<uint8_t, 65536> lut;
+	for (unsigned int i = 0; i < lut.size(); i++)
+		lut[i] = sqrt((double)i);
+	return lut;
+}();
+
 void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info, ControlList const &metadata,
 			  std::string const &filename, std::string const &cam_model, StillOptions const *options)
 {
@@ -311,25 +657,22 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 	unsigned int buf_stride_pixels = info.width;
 	unsigned int buf_stride_pixels_padded = (buf_stride_pixels + 7) & ~7;
 	std::vector<uint16_t> buf(buf_stride_pixels_padded * info.height);
+	void (*unpack_row)(uint8_t const *, unsigned int, unsigned int, uint16_t *) = unpack_16bit_row;
 	if (bayer_format.compressed)
 	{
-		uncompress(mem[0].data(), info, &buf[0]);
+		unpack_row = uncompress_row;
 		buf_stride_pixels = buf_stride_pixels_padded;
 	}
 	else if (bayer_format.packed)
-	{
-		switch (bayer_format.bits)
-		{
-		case 10:
-			unpack_10bit(mem[0].data(), info, &buf[0]);
-			break;
-		case 12:
-			unpack_12bit(mem[0].data(), info, &buf[0]);
-			break;
-		}
-	}
-	else
-		unpack_16bit(mem[0].data(), info, &buf[0]);
+		unpack_row = bayer_format.bits == 10 ? unpack_10bit_row : unpack_12bit_row;
+
+	auto start_time = std::chrono::high_resolution_clock::now();
+	parallel_for(info.height, [&](unsigned int y0, unsigned int y1) {
+		for (unsigned int y = y0; y < y1; y++)
+			unpack_row(mem[0].data() + y * info.stride, info.stride, info.width, &buf[y * buf_stride_pixels]);
+	});
+	std::chrono::duration<double, std::milli> unpack_time = std::chrono::high_resolution_clock::now() - start_time;
+	LOG(2, "Unpacked raw image in " << unpack_time.count() << "ms");
 
 	// We need to fish out some metadata values for the DNG.
 	float black = 4096 * (1 << bayer_format.bits) / 65536.0;
@@ -438,22 +781,24 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_EXIFIFD, offset_exififd);
 
 		// Make a small greyscale thumbnail, just to give some clue what's in here.
-		std::vector<uint8_t> thumb_buf((info.width >> 4) * 3);
+		unsigned int thumb_width = info.width >> 4, thumb_height = info.height >> 4;
+		std::vector<uint8_t> thumb_buf(thumb_width * thumb_height * 3);
+		TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, thumb_height);
 
-		for (unsigned int y = 0; y < (info.height >> 4); y++)
+		for (unsigned int y = 0; y < thumb_height; y++)
 		{
-			for (unsigned int x = 0; x < (info.width >> 4); x++)
+			uint8_t *thumb_row = &thumb_buf[y * thumb_width * 3];
+			for (unsigned int x = 0; x < thumb_width; x++)
 			{
 				unsigned int off = (y * buf_stride_pixels + x) << 4;
 				uint32_t grey =
 					buf[off] + buf[off + 1] + buf[off + buf_stride_pixels] + buf[off + buf_stride_pixels + 1];
 				grey = (grey << 14) >> bayer_format.bits;
-				grey = sqrt((double)grey); // simple "gamma correction"
-				thumb_buf[3 * x] = thumb_buf[3 * x + 1] = thumb_buf[3 * x + 2] = grey;
+				thumb_row[3 * x] = thumb_row[3 * x + 1] = thumb_row[3 * x + 2] = THUMB_GAMMA[grey];
 			}
-			if (TIFFWriteScanline(tif, &thumb_buf[0], y, 0) != 1)
-				throw std::runtime_error("error writing DNG thumbnail data");
 		}
+		if (thumb_height && TIFFWriteEncodedStrip(tif, 0, &thumb_buf[0], thumb_buf.size()) < 0)
+			throw std::runtime_error("error writing DNG thumbnail data");
 
 		TIFFWriteDirectory(tif);
 
@@ -476,11 +821,68 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 		TIFFSetField(tif, TIFFTAG_BLACKLEVELREPEATDIM, &black_level_repeat_dim);
 		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 4, &black_levels);
 
-		for (unsigned int y = 0; y < info.height; y++)
+		start_time = std::chrono::high_resolution_clock::now();
+		if (options->dng_compression == "ljpeg")
 		{
-			if (TIFFWriteScanline(tif, &buf[buf_stride_pixels * y], y, 0) != 1)
-				throw std::runtime_error("error writing DNG image data");
+			// Tiles are what most DNG readers expect for compressed images, and they get
+			// encoded in parallel before being written out in order.
+			TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_JPEG);
+			TIFFSetField(tif, TIFFTAG_TILEWIDTH, DNG_TILE_SIZE);
+			TIFFSetField(tif, TIFFTAG_TILELENGTH, DNG_TILE_SIZE);
+			unsigned int tiles_across = (info.width + DNG_TILE_SIZE - 1) / DNG_TILE_SIZE;
+			unsigned int tiles_down = (info.height + DNG_TILE_SIZE - 1) / DNG_TILE_SIZE;
+			std::vector<std::vector<uint8_t>> tiles(tiles_across * tiles_down);
+
+			parallel_for(tiles.size(), [&](unsigned int t0, unsigned int t1) {
+				LosslessJpegEncoder encoder(bayer_format.bits);
+				std::vector<uint16_t> tile_buf(DNG_TILE_SIZE * DNG_TILE_SIZE);
+				for (unsigned int t = t0; t < t1; t++)
+				{
+					// Tiles hanging off the edge of the image are padded out by repeating the
+					// last row and column pair, which keeps the Bayer order and compresses well.
+					unsigned int tx = (t % tiles_across) * DNG_TILE_SIZE, ty = (t / tiles_across) * DNG_TILE_SIZE;
+					for (unsigned int y = 0; y < DNG_TILE_SIZE; y++)
+					{
+						unsigned int sy = std::min(ty + y, info.height - 2 + ((ty + y) & 1));
+						uint16_t const *src = &buf[sy * buf_stride_pixels];
+						uint16_t *dst = &tile_buf[y * DNG_TILE_SIZE];
+						for (unsigned int x = 0; x < DNG_TILE_SIZE; x++)
+							dst[x] = src[std::min(tx + x, info.width - 2 + ((tx + x) & 1))];
+					}
+					encoder.Encode(&tile_buf[0], DNG_TILE_SIZE, DNG_TILE_SIZE, DNG_TILE_SIZE, tiles[t]);
+				}
+			});
+
+			size_t total = 0;
+			for (unsigned int t = 0; t < tiles.size(); t++)
+			{
+				if (TIFFWriteRawTile(tif, t, tiles[t].data(), tiles[t].size()) < 0)
+					throw std::runtime_error("error writing DNG image data");
+				total += tiles[t].size();
+			}
+			LOG(2, "Lossless JPEG compressed to " << total << " bytes ("
+												  << 100.0 * total / (info.width * info.height * 2) << "%)");
+		}
+		else
+		{
+			// Write the image in a handful of large strips, rather than line by line.
+			if (buf_stride_pixels != info.width)
+			{
+				for (unsigned int y = 1; y < info.height; y++)
+					memmove(&buf[y * info.width], &buf[y * buf_stride_pixels], info.width * 2);
+			}
+			unsigned int rows_per_strip = std::max(DNG_STRIP_SIZE / (info.width * 2), 2u) & ~1;
+			TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+			TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, rows_per_strip);
+			for (unsigned int y = 0; y < info.height; y += rows_per_strip)
+			{
+				unsigned int rows = std::min(rows_per_strip, info.height - y);
+				if (TIFFWriteEncodedStrip(tif, y / rows_per_strip, &buf[y * info.width], rows * info.width * 2) < 0)
+					throw std::runtime_error("error writing DNG image data");
+			}
 		}
+		std::chrono::duration<double, std::milli> write_time = std::chrono::high_resolution_clock::now() - start_time;
+		LOG(2, "Wrote DNG image data in " << write_time.count() << "ms");
 
 		// We have to checkpoint before the directory offset is valid.
 		TIFFCheckpointDirectory(tif);
@@ -5,22 +5,124 @@
  * circular_output.cpp - Write output to circular buffer which we save on exit.
  */
 
+#include <algorithm>
+#include <climits>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 #include "circular_output.hpp"
 
 // We're going to align the frames within the buffer to friendly byte boundaries
 static constexpr int ALIGN = 16; // power of 2, please
 
-struct Header
+static unsigned int aligned(unsigned int length)
+{
+	return (length + ALIGN - 1) & ~(ALIGN - 1);
+}
+
+static size_t huge_page_size()
+{
+	std::ifstream meminfo("/proc/meminfo");
+	std::string line;
+	while (std::getline(meminfo, line))
+	{
+		if (line.compare(0, 13, "Hugepagesize:") == 0)
+			return std::stoul(line.substr(13)) * 1024;
+	}
+	return 0;
+}
+
+CircularBuffer::CircularBuffer(size_t size, bool hugepages, bool lock) : base_(nullptr), rptr_(0), wptr_(0)
+{
+	if (hugepages && !map(size, huge_page_size(), MFD_HUGETLB))
+		LOG(1, "CircularBuffer: huge pages not available, using normal pages");
+	if (!base_ && !map(size, sysconf(_SC_PAGESIZE), 0))
+		throw std::runtime_error("failed to create circular buffer");
+
+	if (lock && mlock(base_, 2 * size_) < 0)
+		LOG_ERROR("WARNING: failed to lock circular buffer into memory, check ulimit -l");
+
+	LOG(2, "CircularBuffer: " << size_ << " bytes at " << (void *)base_);
+}
+
+CircularBuffer::~CircularBuffer()
+{
+	munmap(mapping_, mapping_size_);
+}
+
+bool CircularBuffer::map(size_t size, size_t page_size, unsigned int memfd_flags)
+{
+	if (!page_size)
+		return false;
+	// The two mappings must meet on a page boundary, so round the size up to whole pages.
+	size_ = (size + page_size - 1) / page_size * page_size;
+	int fd = memfd_create("rpicam-circular", MFD_CLOEXEC | memfd_flags);
+	if (fd < 0)
+		return false;
+
+	// Reserve enough address space for both mappings, aligned to the page size, and then map
+	// the memory into it twice. The mappings keep the memory alive without the fd.
+	bool ok = false;
+	if (ftruncate(fd, size_) == 0)
+	{
+		mapping_size_ = 2 * size_ + page_size;
+		mapping_ = mmap(nullptr, mapping_size_, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mapping_ != MAP_FAILED)
+		{
+			base_ = (uint8_t *)(((uintptr_t)mapping_ + page_size - 1) & ~(uintptr_t)(page_size - 1));
+			int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_FIXED | MAP_POPULATE;
+			ok = mmap(base_, size_, prot, flags, fd, 0) != MAP_FAILED &&
+				 mmap(base_ + size_, size_, prot, flags, fd, 0) != MAP_FAILED;
+			if (!ok)
+				munmap(mapping_, mapping_size_);
+		}
+	}
+	close(fd);
+	if (!ok)
+		base_ = nullptr;
+	return ok;
+}
+
+// Write a list of frames with as few calls as possible, straight out of the buffer.
+static void write_frames(int fd, std::vector<iovec> &iov)
 {
-	unsigned int length;
-	bool keyframe;
-	int64_t timestamp;
-};
-static_assert(sizeof(Header) % ALIGN == 0, "Header should have aligned size");
+	for (size_t i = 0; i < iov.size();)
+	{
+		int count = std::min<size_t>(iov.size() - i, IOV_MAX);
+		ssize_t n = writev(fd, &iov[i], count);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to write circular buffer: " + std::string(strerror(errno)));
+		}
+		// Step over whatever was written, which might end part way through a frame.
+		for (; i < iov.size() && (size_t)n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (n)
+		{
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+}
 
 // Size of buffer (options->circular) is given in megabytes.
-CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), cb_(options->circular<<20)
+CircularOutput::CircularOutput(VideoOptions const *options)
+	: Output(options), cb_(options->circular<<20, options->circular_hugepages, options->circular_lock), fp_(nullptr),
+	  first_frame_(0), triggered_mode_(options->pre_roll || options->post_roll), trigger_(false), event_end_us_(0),
+	  event_waiting_keyframe_(false), event_count_(0)
 {
+	if (triggered_mode_)
+	{
+		// Each event gets its own file, named when it's triggered.
+		if (options_->output.empty() || options_->output == "-")
+			throw std::runtime_error("event recordings need an output file name");
+		return;
+	}
+
 	// Open this now, so that we can get any complaints out of the way
 	if (options_->output == "-")
 		fp_ = stdout;
@@ -34,65 +136,164 @@ CircularOutput::CircularOutput(VideoOptions const *options) : Output(options), c
 
 CircularOutput::~CircularOutput()
 {
-	// We do have to skip to the first I frame before dumping stuff to disk. If there are
+	if (triggered_mode_)
+	{
+		// Keep what we have of an event that hasn't finished yet.
+		if (event_)
+			finishEvent();
+		if (close_thread_.joinable())
+			close_thread_.join();
+		return;
+	}
+
+	// We do have to start from the first I frame when dumping stuff to disk. If there are
 	// no I frames you will get nothing. Caveat emptor, methinks.
-	unsigned int total = 0, frames = 0;
-	bool seen_keyframe = false;
-	Header header;
-	FILE *fp = fp_; // can't capture a class member in a lambda
-	while (!cb_.Empty())
+	uint64_t total = 0;
+	std::vector<iovec> iov;
+	if (!keyframes_.empty())
 	{
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		seen_keyframe |= header.keyframe;
-		if (seen_keyframe)
+		for (auto it = frames_.begin() + (keyframes_.front() - first_frame_); it != frames_.end(); it++)
 		{
-			cb_.Read([fp](void *src, int n) { fwrite(src, 1, n, fp); }, header.length);
-			cb_.Skip((ALIGN - header.length) & (ALIGN - 1));
-			total += header.length;
+			iov.push_back({ (void *)cb_.Data(it->offset), it->length });
+			total += it->length;
 			if (fp_timestamps_)
 			{
-				Output::timestampReady(header.timestamp);
+				Output::timestampReady(it->timestamp_us);
 			}
-			frames++;
 		}
-		else
-			cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+	}
+	try
+	{
+		fflush(fp_);
+		write_frames(fileno(fp_), iov);
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: " << e.what());
 	}
 	fclose(fp_);
-	LOG(1, "Wrote " << total << " bytes (" << frames << " frames)");
+	LOG(1, "Wrote " << total << " bytes (" << iov.size() << " frames)");
+}
+
+void CircularOutput::Trigger()
+{
+	if (triggered_mode_)
+		trigger_ = true;
+	else
+		LOG(1, "CircularOutput: ignoring trigger, set a pre-roll or post-roll to record events");
 }
 
 void CircularOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-	// First make sure there's enough space.
+	// First make sure there's enough space, dropping the oldest frames as necessary.
 	int pad = (ALIGN - size) & (ALIGN - 1);
-	while (size + pad + sizeof(Header) > cb_.Available())
+	while (size + pad > cb_.Available())
 	{
-		if (cb_.Empty())
+		if (frames_.empty())
 			throw std::runtime_error("circular buffer too small");
-		Header header;
-		uint8_t *dst = (uint8_t *)&header;
-		cb_.Read(
-			[&dst](void *src, int n) {
-				memcpy(dst, src, n);
-				dst += n;
-			},
-			sizeof(header));
-		cb_.Skip((header.length + ALIGN - 1) & ~(ALIGN - 1));
+		cb_.Skip(aligned(frames_.front().length));
+		if (!keyframes_.empty() && keyframes_.front() == first_frame_)
+			keyframes_.pop_front();
+		frames_.pop_front();
+		first_frame_++;
 	}
-	Header header = { static_cast<unsigned int>(size), !!(flags & FLAG_KEYFRAME), timestamp_us };
-	cb_.Write(&header, sizeof(header));
+
+	bool keyframe = !!(flags & FLAG_KEYFRAME);
+	if (keyframe)
+		keyframes_.push_back(first_frame_ + frames_.size());
+	frames_.push_back({ cb_.WritePos(), static_cast<unsigned int>(size), timestamp_us, keyframe });
 	cb_.Write(mem, size);
 	cb_.Pad(pad);
+
+	if (!triggered_mode_)
+		return;
+
+	// A trigger during an event only makes it last longer.
+	bool triggered = trigger_.exchange(false);
+	if (event_)
+	{
+		if (triggered)
+		{
+			event_end_us_ = timestamp_us + options_->post_roll * 1000LL;
+			LOG(2, "CircularOutput: event extended by another trigger");
+		}
+		if (event_waiting_keyframe_ && keyframe)
+			event_waiting_keyframe_ = false;
+		if (!event_waiting_keyframe_)
+			event_->Write(mem, size);
+	}
+	else if (triggered)
+		startEvent(timestamp_us);
+
+	if (event_ && timestamp_us >= event_end_us_)
+		finishEvent();
 }
 
 void CircularOutput::timestampReady(int64_t timestamp)
 {
 	// Don't want to save every timestamp as we go along, only outputs them at the end
 }
+
+uint64_t CircularOutput::findStartFrame(int64_t timestamp_us) const
+{
+	// The last keyframe at or before the time we want, or else the oldest one we have if the
+	// buffer doesn't go back that far.
+	auto later = [this](int64_t t, uint64_t frame) { return t < frames_[frame - first_frame_].timestamp_us; };
+	auto it = std::upper_bound(keyframes_.begin(), keyframes_.end(), timestamp_us, later);
+	if (it == keyframes_.begin())
+	{
+		LOG(1, "CircularOutput: buffer holds less than the requested pre-roll");
+		return keyframes_.front();
+	}
+	return *std::prev(it);
+}
+
+void CircularOutput::startEvent(int64_t timestamp_us)
+{
+	// The writer's buffer is the size of ours, so the pre-roll never waits for the disk.
+	constexpr size_t MB = 1024 * 1024;
+	FileWriter::Params params = { std::max<size_t>(options_->circular, options_->write_buffer) * MB,
+								  options_->direct_io, options_->preallocate * MB, options_->sync_every * MB };
+	std::string filename = output_filename(options_, event_count_);
+	event_count_++;
+	if (options_->wrap)
+		event_count_ = event_count_ % options_->wrap;
+	event_ = std::make_unique<FileWriter>(filename, params);
+	event_end_us_ = timestamp_us + options_->post_roll * 1000LL;
+
+	// Can only happen if the buffer is shorter than a GOP.
+	if (keyframes_.empty())
+	{
+		LOG(1, "CircularOutput: no keyframe in the buffer, event recording " << filename << " starts at the next one");
+		event_waiting_keyframe_ = true;
+		requestKeyframe();
+		return;
+	}
+
+	// The current frame is in the buffer already, so it gets written here too.
+	uint64_t start = findStartFrame(timestamp_us - options_->pre_roll * 1000LL);
+	for (auto it = frames_.begin() + (start - first_frame_); it != frames_.end(); it++)
+		event_->Write(cb_.Data(it->offset), it->length);
+	LOG(1, "CircularOutput: event recording " << filename << " starts "
+											  << (timestamp_us - frames_[start - first_frame_].timestamp_us) / 1000
+											  << "ms before the trigger");
+}
+
+void CircularOutput::finishEvent()
+{
+	// Flushing and syncing the file can take a while, so do it in the background.
+	if (close_thread_.joinable())
+		close_thread_.join();
+	close_thread_ = std::thread([writer = std::move(event_)]() {
+		try
+		{
+			writer->Close();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: CircularOutput: " << e.what());
+		}
+	});
+	event_waiting_keyframe_ = false;
+	LOG(1, "CircularOutput: event recording finished");
+}
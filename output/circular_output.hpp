@@ -7,62 +7,91 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <thread>
+
+#include "file_writer.hpp"
 #include "output.hpp"
 
-// A simple circular buffer implementation used by the CircularOutput class.
+// A circular buffer used by the CircularOutput class. The memory is mapped twice, back to
+// back, so anything up to the size of the buffer can be written or read in one go at any
+// position, with no splitting where it wraps round.
 
 class CircularBuffer
 {
 public:
-	CircularBuffer(size_t size) : size_(size), buf_(size), rptr_(0), wptr_(0) {}
+	CircularBuffer(size_t size, bool hugepages, bool lock);
+	~CircularBuffer();
+	size_t Size() const { return size_; }
 	bool Empty() const { return rptr_ == wptr_; }
 	size_t Available() const { return wptr_ == rptr_ ? size_ - 1 : (size_ - wptr_ + rptr_) % size_ - 1; }
-	void Skip(unsigned int n) { rptr_ = (rptr_ + n) % size_; }
-	// The dst function allows bytes read to go straight to memory or a file etc.
-	void Read(std::function<void(void *src, unsigned int n)> dst, unsigned int n)
-	{
-		if (rptr_ + n >= size_)
-		{
-			dst(&buf_[rptr_], size_ - rptr_);
-			n -= size_ - rptr_;
-			rptr_ = 0;
-		}
-		dst(&buf_[rptr_], n);
-		rptr_ += n;
-	}
-	void Pad(unsigned int n) { wptr_ = (wptr_ + n) % size_; }
-	void Write(const void *ptr, unsigned int n)
+	size_t WritePos() const { return wptr_; }
+	void Skip(size_t n) { rptr_ = (rptr_ + n) % size_; }
+	void Pad(size_t n) { wptr_ = (wptr_ + n) % size_; }
+	void Write(const void *ptr, size_t n)
 	{
-		if (wptr_ + n >= size_)
-		{
-			memcpy(&buf_[wptr_], ptr, size_ - wptr_);
-			n -= size_ - wptr_;
-			ptr = static_cast<const uint8_t *>(ptr) + size_ - wptr_;
-			wptr_ = 0;
-		}
-		memcpy(&buf_[wptr_], ptr, n);
-		wptr_ += n;
+		memcpy(base_ + wptr_, ptr, n);
+		wptr_ = (wptr_ + n) % size_;
 	}
+	// The bytes written at pos, which stay contiguous for up to the size of the buffer. They
+	// can be passed straight to write calls without copying.
+	uint8_t const *Data(size_t pos) const { return base_ + pos; }
 
 private:
-	const size_t size_;
-	std::vector<uint8_t> buf_;
+	bool map(size_t size, size_t page_size, unsigned int memfd_flags);
+
+	size_t size_;
+	uint8_t *base_;
+	void *mapping_;
+	size_t mapping_size_;
 	size_t rptr_, wptr_;
 };
 
-// Write frames to a circular buffer, and dump them to disk when we quit.
+// Write frames to a circular buffer, and dump them to disk when we quit. Alternatively,
+// with a pre-roll or post-roll, each trigger saves the frames from just before it and
+// the ones that follow to a new file, while recording carries on.
 
 class CircularOutput : public Output
 {
 public:
 	CircularOutput(VideoOptions const *options);
 	~CircularOutput();
+	void Trigger() override;
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 	void timestampReady(int64_t timestamp) override;
 
 private:
+	// Where each frame is in the buffer, oldest first.
+	struct Frame
+	{
+		size_t offset;
+		unsigned int length;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+	uint64_t findStartFrame(int64_t timestamp_us) const;
+	void startEvent(int64_t timestamp_us);
+	void finishEvent();
+
 	CircularBuffer cb_;
 	FILE *fp_;
+	std::deque<Frame> frames_;
+	// Frames are numbered from the start of the recording, first_frame_ being frames_.front().
+	uint64_t first_frame_;
+	// The numbers of the keyframes still in the buffer, in order.
+	std::deque<uint64_t> keyframes_;
+
+	// Event recording.
+	bool triggered_mode_;
+	std::atomic<bool> trigger_;
+	std::unique_ptr<FileWriter> event_;
+	int64_t event_end_us_;
+	bool event_waiting_keyframe_;
+	unsigned int event_count_;
+	std::thread close_thread_;
 };
@@ -0,0 +1,120 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * container_format.h - layout of the indexed frame container files.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A container file is:
+ *
+ *   container_file_header
+ *   container_frame_header, followed by data_size bytes of frame data   } once per frame
+ *   container_index_entry[count]
+ *   container_footer
+ *
+ * so a reader can find every frame from the index at the end, or, if the file was
+ * never finished, by walking the frame headers from the start. All fields are
+ * little endian.
+ *
+ * The file header, every frame header and the index start at a multiple of the
+ * alignment given in the file header, with zero padding in between, and the footer
+ * fills the last bytes of the file. Frame data starts header_size bytes after its
+ * frame header, which with the usual 4096 byte alignment makes every frame page
+ * aligned for memory mapping.
+ *
+ * Compressed frames hold a compressed_frame_header followed by the compressed data.
+ * Decompressing it gives exactly the bytes the uncompressed recording would have had.
+ */
+
+#define CONTAINER_FILE_MAGIC "RPICAMC\0"
+#define CONTAINER_VERSION 1
+#define CONTAINER_FRAME_MAGIC 0x454d5246 /* "FRME" */
+#define CONTAINER_INDEX_MAGIC 0x58444e49 /* "INDX" */
+#define COMPRESSED_FRAME_MAGIC 0x46545a52 /* "RZTF" */
+
+#define CONTAINER_ALIGNMENT 4096
+
+#define CONTAINER_FLAG_KEYFRAME 1
+
+enum container_compression
+{
+	CONTAINER_COMPRESSION_NONE = 0,
+	CONTAINER_COMPRESSION_ZSTD = 1,
+};
+
+enum container_predictor
+{
+	CONTAINER_PREDICTOR_NONE = 0,
+	/* Each sample minus the one sample_distance before it on the same line, zigzag coded. */
+	CONTAINER_PREDICTOR_DELTA = 1,
+};
+
+struct container_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t compression; /* of the frames, an enum container_compression */
+	uint32_t alignment;
+	uint64_t data_offset; /* of the first frame header */
+	/* The stream as it came from the camera, so before any compression. */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixel_format; /* libcamera fourcc */
+	char pixel_format_name[32];
+	char camera[64];
+	char sensor_mode[64]; /* size and format of the raw stream */
+	char tuning_file[256]; /* empty if libcamera chose it */
+	/* Strings are zero terminated. */
+};
+
+struct container_frame_header
+{
+	uint32_t magic;
+	uint32_t header_size;
+	uint64_t data_size;
+	int64_t timestamp_us;
+	uint32_t flags;
+	uint32_t sequence; /* from the sensor, so gaps show dropped frames */
+	uint32_t exposure_time; /* in microseconds */
+	float analogue_gain;
+	float digital_gain;
+	uint32_t reserved;
+};
+
+struct container_index_entry
+{
+	uint64_t offset; /* of the container_frame_header */
+	uint64_t data_size;
+	int64_t timestamp_us;
+};
+
+struct container_footer
+{
+	uint32_t magic;
+	uint32_t version;
+	uint64_t count;
+	uint64_t index_offset;
+};
+
+struct compressed_frame_header
+{
+	uint32_t magic;
+	uint32_t header_size;
+	uint32_t compression;
+	uint32_t predictor;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; /* lines for the predictor are this many bytes long */
+	uint32_t pixel_format; /* libcamera fourcc */
+	uint32_t sample_bytes; /* 1 or 2 */
+	uint32_t sample_distance; /* in samples, 2 for Bayer so that colours match */
+	uint64_t raw_size;
+	uint64_t compressed_size;
+};
@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * container_output.cpp - Write frames to an indexed container file.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <libcamera/control_ids.h>
+
+#include "container_output.hpp"
+
+static uint64_t align_up(uint64_t size)
+{
+	return (size + CONTAINER_ALIGNMENT - 1) & ~(uint64_t)(CONTAINER_ALIGNMENT - 1);
+}
+
+static void copy_string(char *dest, size_t size, std::string const &src)
+{
+	strncpy(dest, src.c_str(), size - 1);
+}
+
+ContainerOutput::ContainerOutput(VideoOptions const *options)
+	: Output(options), fd_(-1), direct_(false), offset_(0), file_header_ {}, frame_header_ {},
+	  staging_(nullptr, &free), staging_size_(0)
+{
+	if (options->output.empty())
+		throw std::runtime_error("container output needs an output file");
+	if (options->segment || options->split || options->circular)
+		LOG_ERROR("WARNING: segment, split and circular are ignored when writing a container file");
+
+	memcpy(file_header_.magic, CONTAINER_FILE_MAGIC, sizeof(file_header_.magic));
+	file_header_.version = CONTAINER_VERSION;
+	file_header_.header_size = sizeof(file_header_);
+	file_header_.compression =
+		options->compress == "zstd" ? CONTAINER_COMPRESSION_ZSTD : CONTAINER_COMPRESSION_NONE;
+	file_header_.alignment = CONTAINER_ALIGNMENT;
+	file_header_.data_offset = align_up(sizeof(file_header_));
+	std::string tuning_file = options->tuning_file;
+	if (tuning_file == "-")
+		tuning_file = getenv("LIBCAMERA_RPI_TUNING_FILE") ? getenv("LIBCAMERA_RPI_TUNING_FILE") : "";
+	copy_string(file_header_.tuning_file, sizeof(file_header_.tuning_file), tuning_file);
+
+	// We need the per-frame exposure and gain.
+	want_metadata_ = true;
+}
+
+ContainerOutput::~ContainerOutput()
+{
+	try
+	{
+		closeFile();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: " << e.what());
+	}
+}
+
+void ContainerOutput::SetStreamInfo(StreamInfo const &info, std::string const &camera, std::string const &sensor_mode)
+{
+	file_header_.width = info.width;
+	file_header_.height = info.height;
+	file_header_.stride = info.stride;
+	file_header_.pixel_format = info.pixel_format.fourcc();
+	copy_string(file_header_.pixel_format_name, sizeof(file_header_.pixel_format_name),
+				info.pixel_format.toString());
+	copy_string(file_header_.camera, sizeof(file_header_.camera), camera);
+	copy_string(file_header_.sensor_mode, sizeof(file_header_.sensor_mode), sensor_mode);
+}
+
+void ContainerOutput::openFile()
+{
+	// The stream info only arrives after we're created, so the file is opened with the first frame.
+	if (options_->output == "-")
+		fd_ = STDOUT_FILENO;
+	else
+	{
+		fd_ = open(options_->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+		direct_ = fd_ >= 0;
+		// Some filesystems, like tmpfs, don't do O_DIRECT.
+		if (fd_ < 0 && errno == EINVAL)
+			fd_ = open(options_->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open output file " + options_->output);
+	}
+	LOG(2, "ContainerOutput: opened output file " << options_->output << (direct_ ? " for direct I/O" : ""));
+
+	uint8_t *block = stage(file_header_.data_offset);
+	memset(block, 0, file_header_.data_offset);
+	memcpy(block, &file_header_, sizeof(file_header_));
+	write(block, file_header_.data_offset);
+}
+
+uint8_t *ContainerOutput::stage(size_t size)
+{
+	if (size > staging_size_)
+	{
+		void *buffer = nullptr;
+		if (posix_memalign(&buffer, CONTAINER_ALIGNMENT, size))
+			throw std::runtime_error("failed to allocate container staging buffer");
+		staging_.reset((uint8_t *)buffer);
+		staging_size_ = size;
+	}
+	return staging_.get();
+}
+
+void ContainerOutput::write(void const *data, size_t size)
+{
+	uint8_t const *ptr = (uint8_t const *)data;
+	for (size_t done = 0; done < size;)
+	{
+		ssize_t ret = ::write(fd_, ptr + done, size - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		// A filesystem may accept O_DIRECT when the file is opened but not when it's written.
+		if (ret < 0 && errno == EINVAL && direct_)
+		{
+			LOG(1, "ContainerOutput: direct I/O not supported, falling back to buffered writes");
+			fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+			direct_ = false;
+			continue;
+		}
+		if (ret <= 0)
+			throw std::runtime_error("failed to write output bytes");
+		done += ret;
+	}
+	offset_ += size;
+}
+
+void ContainerOutput::metadataReady(FrameMetadata const &metadata)
+{
+	frame_header_.sequence = metadata.sequence;
+	auto exposure_time = metadata.controls.get(libcamera::controls::ExposureTime);
+	frame_header_.exposure_time = exposure_time ? *exposure_time : 0;
+	auto ag = metadata.controls.get(libcamera::controls::AnalogueGain);
+	frame_header_.analogue_gain = ag ? *ag : 0;
+	auto dg = metadata.controls.get(libcamera::controls::DigitalGain);
+	frame_header_.digital_gain = dg ? *dg : 0;
+}
+
+void ContainerOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	LOG(2, "ContainerOutput: output buffer " << mem << " size " << size);
+	if (fd_ < 0)
+		openFile();
+
+	// The header gets a whole block to itself, so that the frame data is aligned too. We copy
+	// into our own buffer because direct I/O straight from camera buffers isn't reliable.
+	container_frame_header header = frame_header_;
+	header.magic = CONTAINER_FRAME_MAGIC;
+	header.header_size = CONTAINER_ALIGNMENT;
+	header.data_size = size;
+	header.timestamp_us = timestamp_us;
+	header.flags = (flags & FLAG_KEYFRAME) ? CONTAINER_FLAG_KEYFRAME : 0;
+	frame_header_ = {};
+
+	size_t record_size = align_up(header.header_size + size);
+	uint8_t *record = stage(record_size);
+	memset(record, 0, header.header_size);
+	memcpy(record, &header, sizeof(header));
+	memcpy(record + header.header_size, mem, size);
+	memset(record + header.header_size + size, 0, record_size - header.header_size - size);
+
+	index_.push_back({ offset_, size, timestamp_us });
+	write(record, record_size);
+}
+
+void ContainerOutput::closeFile()
+{
+	if (fd_ < 0)
+		return;
+
+	// The index goes at the end, followed by the footer in the last bytes of the file, so a
+	// reader finds it from there.
+	container_footer footer = {};
+	footer.magic = CONTAINER_INDEX_MAGIC;
+	footer.version = CONTAINER_VERSION;
+	footer.count = index_.size();
+	footer.index_offset = offset_;
+	size_t index_size = index_.size() * sizeof(container_index_entry);
+	size_t size = align_up(index_size + sizeof(footer));
+	uint8_t *block = stage(size);
+	memset(block, 0, size);
+	memcpy(block, index_.data(), index_size);
+	memcpy(block + size - sizeof(footer), &footer, sizeof(footer));
+	write(block, size);
+	LOG(2, "ContainerOutput: wrote index of " << index_.size() << " frames");
+
+	int fd = fd_;
+	fd_ = -1;
+	if (fd != STDOUT_FILENO && close(fd))
+		throw std::runtime_error("failed to close output file");
+}
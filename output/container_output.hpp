@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * container_output.hpp - Write frames to an indexed container file.
+ */
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include "container_format.h"
+#include "output.hpp"
+
+// Each frame goes into the file with a small header in front of it, and an index of all
+// the frames is appended when the file is closed. See container_format.h for the layout.
+// Everything is written in whole aligned blocks, so the file can be opened with O_DIRECT
+// and the recording doesn't fill the page cache.
+class ContainerOutput : public Output
+{
+public:
+	ContainerOutput(VideoOptions const *options);
+	~ContainerOutput();
+	void SetStreamInfo(StreamInfo const &info, std::string const &camera, std::string const &sensor_mode) override;
+
+protected:
+	void metadataReady(FrameMetadata const &metadata) override;
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void openFile();
+	void closeFile();
+	// Returns the aligned staging buffer, with room for at least size bytes.
+	uint8_t *stage(size_t size);
+	void write(void const *data, size_t size);
+	int fd_;
+	bool direct_;
+	uint64_t offset_;
+	container_file_header file_header_;
+	container_frame_header frame_header_;
+	std::unique_ptr<uint8_t, decltype(&free)> staging_;
+	size_t staging_size_;
+	std::vector<container_index_entry> index_;
+};
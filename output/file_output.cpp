@@ -6,16 +6,75 @@
  */
 
 #include "file_output.hpp"
-#include <ctime>
+#include "recording_index.h"
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+static FileWriter::Params writer_params(VideoOptions const *options)
+{
+	constexpr size_t MB = 1024 * 1024;
+	return { options->write_buffer * MB, options->direct_io, options->preallocate * MB, options->sync_every * MB };
+}
 
 FileOutput::FileOutput(VideoOptions const *options)
-	: Output(options), fp_(nullptr), count_(0), file_start_time_ms_(0)
+	: Output(options), fp_(nullptr), file_bytes_(0), file_frames_(0), count_(0), file_start_time_ms_(0),
+	  preopen_(false), temp_mode_(0644), abort_(false)
 {
+	// Opening files ahead of time is only worth it for a series of files, and the temporary
+	// files must go in the same directory as the real ones so that they can be renamed.
+	std::string const &output = options->output;
+	size_t slash = output.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : output.substr(0, slash);
+	if ((options->segment || options->split) && !output.empty() && output != "-" &&
+		dir.find('%') == std::string::npos)
+	{
+		preopen_ = true;
+		temp_template_ = dir + "/.rpicam-next-XXXXXX";
+		// The only way to read the umask is to change it, so do it before there's a background thread.
+		mode_t mask = umask(0);
+		umask(mask);
+		temp_mode_ = 0666 & ~mask;
+		background_thread_ = std::thread(&FileOutput::backgroundThread, this);
+		runInBackground(std::bind(&FileOutput::preopenFile, this));
+	}
 }
 
 FileOutput::~FileOutput()
 {
-	closeFile();
+	try
+	{
+		closeFile();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: " << e.what());
+	}
+
+	if (background_thread_.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(background_mutex_);
+			abort_ = true;
+			background_cond_var_.notify_all();
+		}
+		background_thread_.join();
+		// The file that was waiting to be the next segment won't be needed now.
+		if (next_file_)
+		{
+			try
+			{
+				finishFile(*next_file_, false);
+			}
+			catch (std::exception const &e)
+			{
+				LOG_ERROR("ERROR: " << e.what());
+			}
+			unlink(next_file_->temp_name.c_str());
+			if (next_file_->index)
+				unlink((next_file_->temp_name + RECORDING_INDEX_SUFFIX).c_str());
+		}
+	}
 }
 
 void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
@@ -23,17 +82,29 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
-	if (fp_ == nullptr ||
+	if ((fp_ == nullptr && !writer_) ||
 		(options_->segment && (flags & FLAG_KEYFRAME) &&
 		 timestamp_us / 1000 - file_start_time_ms_ > options_->segment) ||
 		(options_->split && (flags & FLAG_RESTART)))
 	{
-		closeFile();
+		// Get the new file going, and its proper name, before the old one is closed, as
+		// closing can be slow.
+		std::shared_ptr<File> file = detachFile();
 		openFile(timestamp_us);
+		if (file && preopen_)
+			runInBackground([file]() { finishFile(*file, true); });
+		else if (file)
+			finishFile(*file, false);
 	}
 
 	LOG(2, "FileOutput: output buffer " << mem << " size " << size);
-	if (fp_ && size)
+	if (index_ && (flags & FLAG_KEYFRAME))
+		index_->Add(file_bytes_, timestamp_us, file_frames_);
+	file_bytes_ += size;
+	file_frames_++;
+	if (writer_ && size)
+		writer_->Write(mem, size);
+	else if (fp_ && size)
 	{
 		if (fwrite(mem, size, 1, fp_) != 1)
 			throw std::runtime_error("failed to write output bytes");
@@ -44,49 +115,180 @@ void FileOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint
 
 void FileOutput::openFile(int64_t timestamp_us)
 {
-	if (options_->output == "-")
+	if (options_->output == "-" && options_->write_buffer)
+		writer_ = std::make_unique<FileWriter>("-", writer_params(options_));
+	else if (options_->output == "-")
 		fp_ = stdout;
 	else if (!options_->output.empty())
 	{
-        char filename[256];
-        int n = -1;
-        // Generate the next output file name.
-        if (options_->file_out_date)
-        {
-            std::time_t raw_time;
-            std::time(&raw_time);
-            std::tm *time_info;
-            // Generate the next output file name.
-
-            time_info = std::localtime(&raw_time);
-            n = std::strftime(filename, sizeof(filename), options_->output.c_str(), time_info);
-        } else {
-            n = snprintf(filename, sizeof(filename), options_->output.c_str(), count_);
-        }
-
+		std::string filename = output_filename(options_, count_);
 		count_++;
 		if (options_->wrap)
 			count_ = count_ % options_->wrap;
-		if (n < 0)
-			throw std::runtime_error("failed to generate filename");
 
-		fp_ = fopen(filename, "w");
-		if (!fp_)
-			throw std::runtime_error("failed to open output file " + std::string(filename));
+		if (preopen_)
+		{
+			std::unique_ptr<File> file = takeNextFile();
+			fp_ = file->fp;
+			writer_ = std::move(file->writer);
+			index_ = std::move(file->index);
+			std::string temp_name = file->temp_name, final_name = filename;
+			bool indexed = !!index_;
+			runInBackground([temp_name, final_name, indexed]() {
+				if (rename(temp_name.c_str(), final_name.c_str()))
+					throw std::runtime_error("failed to rename " + temp_name + " to " + final_name);
+				if (indexed && rename((temp_name + RECORDING_INDEX_SUFFIX).c_str(),
+									  (final_name + RECORDING_INDEX_SUFFIX).c_str()))
+					throw std::runtime_error("failed to rename index for " + final_name);
+			});
+			runInBackground(std::bind(&FileOutput::preopenFile, this));
+		}
+		else if (options_->write_buffer)
+			writer_ = std::make_unique<FileWriter>(filename, writer_params(options_));
+		else
+		{
+			fp_ = fopen(filename.c_str(), "w");
+			if (!fp_)
+				throw std::runtime_error("failed to open output file " + filename);
+		}
+		if (options_->index && !preopen_)
+			index_ = std::make_unique<IndexWriter>(filename + RECORDING_INDEX_SUFFIX);
 		LOG(2, "FileOutput: opened output file " << filename);
 
 		file_start_time_ms_ = timestamp_us / 1000;
+		file_bytes_ = 0;
+		file_frames_ = 0;
     }
 }
 
+std::shared_ptr<FileOutput::File> FileOutput::detachFile()
+{
+	if (!fp_ && !writer_)
+		return nullptr;
+
+	std::shared_ptr<File> file = std::make_shared<File>();
+	file->fp = fp_;
+	file->writer = std::move(writer_);
+	file->index = std::move(index_);
+	fp_ = nullptr;
+	return file;
+}
+
 void FileOutput::closeFile()
 {
-	if (fp_)
+	std::shared_ptr<File> file = detachFile();
+	if (file && preopen_)
+		runInBackground([file]() { finishFile(*file, true); });
+	else if (file)
+		finishFile(*file, false);
+}
+
+void FileOutput::finishFile(File &file, bool sync)
+{
+	if (file.writer)
+		file.writer->Close();
+	if (file.fp)
 	{
-		if (options_->flush)
-			fflush(fp_);
-		if (fp_ != stdout)
-			fclose(fp_);
-		fp_ = nullptr;
+		bool failed = fflush(file.fp) || (sync && fdatasync(fileno(file.fp)));
+		if (file.fp != stdout && fclose(file.fp))
+			failed = true;
+		file.fp = nullptr;
+		if (failed)
+			throw std::runtime_error("failed to close output file");
+	}
+	// Only now is everything in the index sure to be in the file.
+	if (file.index)
+		file.index->Close(sync);
+}
+
+void FileOutput::runInBackground(std::function<void()> job)
+{
+	std::lock_guard<std::mutex> lock(background_mutex_);
+	background_jobs_.push_back(std::move(job));
+	background_cond_var_.notify_all();
+}
+
+void FileOutput::backgroundThread()
+{
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(background_mutex_);
+			background_cond_var_.wait(lock, [this] { return abort_ || !background_jobs_.empty(); });
+			if (background_jobs_.empty())
+				break;
+			job = std::move(background_jobs_.front());
+			background_jobs_.pop_front();
+		}
+
+		try
+		{
+			job();
+		}
+		catch (std::exception const &e)
+		{
+			LOG_ERROR("ERROR: FileOutput: " << e.what());
+			std::lock_guard<std::mutex> lock(background_mutex_);
+			background_error_ = std::current_exception();
+			background_cond_var_.notify_all();
+		}
+	}
+}
+
+void FileOutput::preopenFile()
+{
+	std::vector<char> name(temp_template_.c_str(), temp_template_.c_str() + temp_template_.size() + 1);
+	int fd = mkstemp(name.data());
+	if (fd < 0)
+		throw std::runtime_error("failed to create file " + temp_template_);
+	// mkstemp makes files that only we can read, but these are going to be ordinary output files.
+	fchmod(fd, temp_mode_);
+
+	std::unique_ptr<File> file = std::make_unique<File>();
+	file->temp_name = name.data();
+	try
+	{
+		if (options_->write_buffer)
+			file->writer = std::make_unique<FileWriter>(fd, file->temp_name, writer_params(options_));
+		else
+		{
+			file->fp = fdopen(fd, "w");
+			if (!file->fp)
+			{
+				close(fd);
+				throw std::runtime_error("failed to open file " + file->temp_name);
+			}
+		}
+		if (options_->index)
+			file->index = std::make_unique<IndexWriter>(file->temp_name + RECORDING_INDEX_SUFFIX);
+	}
+	catch (std::exception const &)
+	{
+		// Don't leave the temporary file behind.
+		if (file->fp)
+			fclose(file->fp);
+		file->writer.reset();
+		unlink(file->temp_name.c_str());
+		throw;
+	}
+	LOG(2, "FileOutput: opened " << file->temp_name << " for the next file");
+
+	std::lock_guard<std::mutex> lock(background_mutex_);
+	next_file_ = std::move(file);
+	background_cond_var_.notify_all();
+}
+
+std::unique_ptr<FileOutput::File> FileOutput::takeNextFile()
+{
+	// Normally the file will have been ready for ages.
+	std::unique_lock<std::mutex> lock(background_mutex_);
+	background_cond_var_.wait(lock, [this] { return next_file_ || background_error_; });
+	if (background_error_)
+	{
+		std::exception_ptr e = background_error_;
+		background_error_ = nullptr;
+		std::rethrow_exception(e);
 	}
+	return std::move(next_file_);
 }
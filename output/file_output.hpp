@@ -7,6 +7,18 @@
 
 #pragma once
 
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include "file_writer.hpp"
+#include "index_writer.hpp"
 #include "output.hpp"
 
 class FileOutput : public Output
@@ -19,9 +31,43 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
+	// An open output file, which is either fp or writer, and its index if it has one.
+	struct File
+	{
+		FILE *fp = nullptr;
+		std::unique_ptr<FileWriter> writer;
+		std::unique_ptr<IndexWriter> index;
+		std::string temp_name;
+	};
 	void openFile(int64_t timestamp_us);
 	void closeFile();
+	std::shared_ptr<File> detachFile();
+	static void finishFile(File &file, bool sync);
 	FILE *fp_;
+	// Used instead of fp_ when we're writing from a background thread.
+	std::unique_ptr<FileWriter> writer_;
+	std::unique_ptr<IndexWriter> index_;
+	uint64_t file_bytes_; // written to the current file
+	uint32_t file_frames_;
 	unsigned int count_;
 	int64_t file_start_time_ms_;
+
+	// When writing a series of files, opening and closing them, which can take a while, is done
+	// by another thread. The next file is opened under a temporary name ahead of time, and gets
+	// renamed when we start writing it. Previous files are then flushed and closed after we
+	// have moved on.
+	void backgroundThread();
+	void runInBackground(std::function<void()> job);
+	void preopenFile();
+	std::unique_ptr<File> takeNextFile();
+	bool preopen_;
+	std::string temp_template_;
+	mode_t temp_mode_; // what fopen would have given the file
+	std::mutex background_mutex_;
+	std::condition_variable background_cond_var_;
+	std::deque<std::function<void()>> background_jobs_;
+	std::unique_ptr<File> next_file_;
+	std::exception_ptr background_error_;
+	bool abort_;
+	std::thread background_thread_;
 };
@@ -0,0 +1,272 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * file_writer.cpp - write a file from a background thread.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "core/logging.hpp"
+
+#include "file_writer.hpp"
+
+// O_DIRECT needs the memory, file offset and length of each write aligned to the block size.
+static constexpr size_t ALIGNMENT = 4096;
+static constexpr size_t MAX_CHUNK_SIZE = 1024 * 1024;
+
+static size_t align_up(size_t size, size_t alignment)
+{
+	return (size + alignment - 1) / alignment * alignment;
+}
+
+static int open_output(std::string const &filename, bool direct)
+{
+	if (filename == "-")
+		return STDOUT_FILENO;
+
+	int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+	// Some filesystems, like tmpfs, don't do O_DIRECT.
+	if (fd < 0 && errno == EINVAL && direct)
+		fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to open output file " + filename);
+	return fd;
+}
+
+FileWriter::FileWriter(std::string const &filename, Params const &params)
+	: FileWriter(open_output(filename, params.direct), filename, params)
+{
+}
+
+FileWriter::FileWriter(int fd, std::string const &filename, Params const &params)
+	: filename_(filename), params_(params), fd_(fd), regular_(false), owned_(false), padded_(false),
+	  buffer_(nullptr, &free), head_(0), tail_(0), closing_(false), file_size_(0), allocated_(0), unsynced_(0),
+	  writes_(0), syncs_(0), waits_(0), write_time_(0), max_write_time_(0), wait_time_(0), max_queued_(0)
+{
+	// The buffer is a whole number of blocks, so every write starts on a block boundary.
+	chunk_size_ = std::clamp(align_up(params_.buffer_size / 4, ALIGNMENT), ALIGNMENT, MAX_CHUNK_SIZE);
+	params_.buffer_size = align_up(std::max(params_.buffer_size, chunk_size_), chunk_size_);
+	void *buffer = nullptr;
+	if (posix_memalign(&buffer, ALIGNMENT, params_.buffer_size))
+	{
+		if (fd_ != STDOUT_FILENO)
+			close(fd_);
+		throw std::runtime_error("failed to allocate file write buffer");
+	}
+	buffer_.reset((uint8_t *)buffer);
+
+	struct stat st;
+	regular_ = fstat(fd_, &st) == 0 && S_ISREG(st.st_mode);
+	// Stdout may be redirected to a file, perhaps one we're appending to. We mustn't pad,
+	// reserve space in or truncate a file like that, as we don't own the rest of it.
+	owned_ = regular_ && fd_ != STDOUT_FILENO;
+	if (!owned_)
+		params_.preallocate = 0;
+	if (params_.direct && owned_ && !(fcntl(fd_, F_GETFL) & O_DIRECT))
+		fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_DIRECT);
+	if (params_.direct && !(owned_ && (fcntl(fd_, F_GETFL) & O_DIRECT)))
+	{
+		LOG(1, "FileWriter: " << filename << " doesn't support direct I/O");
+		params_.direct = false;
+	}
+	// Reserve the first stretch of the file now, which may be well ahead of the first write.
+	preallocate(1);
+
+	writer_thread_ = std::thread(&FileWriter::writerThread, this);
+	LOG(2, "FileWriter: opened " << filename << " with " << params_.buffer_size / 1024 << "kB buffer"
+								 << (params_.direct ? ", direct I/O" : ""));
+}
+
+FileWriter::~FileWriter()
+{
+	try
+	{
+		Close();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: " << e.what());
+	}
+}
+
+void FileWriter::Write(void const *data, size_t size)
+{
+	uint8_t const *src = (uint8_t const *)data;
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (size)
+	{
+		if (error_)
+		{
+			std::exception_ptr e = error_;
+			error_ = nullptr;
+			std::rethrow_exception(e);
+		}
+		size_t space = params_.buffer_size - (head_ - tail_);
+		if (!space)
+		{
+			// The storage has fallen behind by a whole buffer, so now we have to wait for it.
+			auto start_time = std::chrono::high_resolution_clock::now();
+			cond_var_.wait(lock, [this] { return error_ || head_ - tail_ < params_.buffer_size; });
+			wait_time_ += std::chrono::high_resolution_clock::now() - start_time;
+			waits_++;
+			continue;
+		}
+
+		// Nothing else writes to the free part of the buffer, so we can copy without the lock.
+		size_t offset = head_ % params_.buffer_size;
+		size_t n = std::min({ size, space, params_.buffer_size - offset });
+		lock.unlock();
+		memcpy(buffer_.get() + offset, src, n);
+		lock.lock();
+		head_ += n;
+		max_queued_ = std::max(max_queued_, head_ - tail_);
+		if (head_ - tail_ >= chunk_size_)
+			cond_var_.notify_all();
+		src += n;
+		size -= n;
+	}
+}
+
+void FileWriter::Close()
+{
+	if (!writer_thread_.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		closing_ = true;
+		cond_var_.notify_all();
+	}
+	writer_thread_.join();
+
+	// The last write may have been padded out for O_DIRECT, and truncating also releases any
+	// space reserved beyond the end. Then make sure the whole file really is on the storage.
+	bool failed = error_ != nullptr;
+	if (!failed && owned_ && (padded_ || allocated_) && ftruncate(fd_, file_size_))
+		failed = true;
+	if (!failed && regular_ && fdatasync(fd_))
+		failed = true;
+	if (fd_ != STDOUT_FILENO && close(fd_))
+		failed = true;
+	fd_ = -1;
+
+	if (writes_)
+		LOG(1, "FileWriter: " << writes_ << " writes of " << filename_ << ", average "
+							  << write_time_.count() * 1000 / writes_ << "ms, max " << max_write_time_.count() * 1000
+							  << "ms, " << syncs_ << " syncs, max queued " << max_queued_ / 1024 << "kB, waited "
+							  << waits_ << " times for " << wait_time_.count() * 1000 << "ms");
+	if (error_)
+		std::rethrow_exception(error_);
+	if (failed)
+		throw std::runtime_error("failed to close output file " + filename_);
+}
+
+void FileWriter::writerThread()
+{
+	try
+	{
+		while (true)
+		{
+			uint8_t const *data;
+			size_t size;
+			{
+				// Wait for a whole chunk, but don't sit on a partial one for too long either.
+				using namespace std::chrono_literals;
+				std::unique_lock<std::mutex> lock(mutex_);
+				bool full = cond_var_.wait_for(lock, 200ms,
+											   [this] { return closing_ || head_ - tail_ >= chunk_size_; });
+				if (closing_ && head_ == tail_)
+					break;
+				size_t offset = tail_ % params_.buffer_size;
+				data = buffer_.get() + offset;
+				size = std::min<size_t>({ head_ - tail_, chunk_size_, params_.buffer_size - offset });
+				// Until the end, direct I/O can only write whole blocks.
+				if (!full && params_.direct)
+					size -= size % ALIGNMENT;
+				if (!size)
+					continue;
+			}
+
+			writeChunk(data, size);
+
+			std::lock_guard<std::mutex> lock(mutex_);
+			tail_ += size;
+			cond_var_.notify_all();
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: FileWriter: " << e.what());
+		std::lock_guard<std::mutex> lock(mutex_);
+		error_ = std::current_exception();
+		cond_var_.notify_all();
+	}
+}
+
+void FileWriter::writeChunk(uint8_t const *data, size_t size)
+{
+	auto start_time = std::chrono::high_resolution_clock::now();
+	preallocate(file_size_ + size);
+
+	// Only the very last chunk can be a partial block. It gets padded out and the file is
+	// truncated to the right length afterwards.
+	size_t length = params_.direct ? align_up(size, ALIGNMENT) : size;
+	for (size_t done = 0; done < length;)
+	{
+		ssize_t ret = write(fd_, data + done, length - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		// A filesystem may accept O_DIRECT when the file is opened but not when it's written.
+		if (ret < 0 && errno == EINVAL && params_.direct)
+		{
+			LOG(1, "FileWriter: direct I/O not supported, falling back to buffered writes");
+			fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) & ~O_DIRECT);
+			params_.direct = false;
+			length = size;
+			continue;
+		}
+		if (ret <= 0)
+			throw std::runtime_error("failed to write output file " + filename_ + ": " + strerror(errno));
+		done += ret;
+	}
+	padded_ |= length > size;
+	file_size_ += size;
+
+	// Syncing every so often stops the page cache filling up with data that must all be
+	// written at once, which is what causes the longest stalls.
+	unsynced_ += size;
+	if (params_.sync_every && unsynced_ >= params_.sync_every && regular_)
+	{
+		if (fdatasync(fd_))
+			throw std::runtime_error("failed to sync output file " + filename_);
+		unsynced_ = 0;
+		syncs_++;
+	}
+
+	auto time_taken = std::chrono::high_resolution_clock::now() - start_time;
+	write_time_ += time_taken;
+	max_write_time_ = std::max<std::chrono::duration<double>>(max_write_time_, time_taken);
+	writes_++;
+}
+
+void FileWriter::preallocate(uint64_t end)
+{
+	if (!params_.preallocate || !regular_ || end <= allocated_)
+		return;
+
+	// Keep the file size as it is, so the file never appears to have garbage at the end.
+	uint64_t length = std::max<uint64_t>(params_.preallocate, end - allocated_);
+	if (fallocate(fd_, FALLOC_FL_KEEP_SIZE, allocated_, length))
+	{
+		LOG(1, "FileWriter: preallocation failed, continuing without it");
+		params_.preallocate = 0;
+		return;
+	}
+	allocated_ += length;
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * file_writer.hpp - write a file from a background thread.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Copies data into a large aligned ring buffer and writes it to the file from its own
+// thread, in big aligned chunks. Storage that stalls for a while then only holds up the
+// caller once the buffer is full, rather than on every write. The file may be opened with
+// O_DIRECT, can be preallocated ahead of the data, and can be synced every so many bytes
+// so that the kernel never builds up a large backlog of dirty pages.
+class FileWriter
+{
+public:
+	struct Params
+	{
+		size_t buffer_size; // bytes
+		bool direct; // write with O_DIRECT
+		size_t preallocate; // reserve this many bytes at a time ahead of the data, or 0
+		size_t sync_every; // fdatasync after this many bytes, or 0 never
+	};
+	// Opens the file, or writes to stdout if filename is "-".
+	FileWriter(std::string const &filename, Params const &params);
+	// Writes to a file that is already open, and which we now own. The filename is only for messages.
+	FileWriter(int fd, std::string const &filename, Params const &params);
+	~FileWriter();
+	// Copy the data into the buffer, waiting only if it's full. Errors from the writer
+	// thread are thrown from here.
+	void Write(void const *data, size_t size);
+	// Write everything out, sync and close the file, and report what happened.
+	void Close();
+
+private:
+	void writerThread();
+	void writeChunk(uint8_t const *data, size_t size);
+	void preallocate(uint64_t end);
+
+	std::string filename_;
+	Params params_;
+	int fd_;
+	bool regular_;
+	bool owned_; // a regular file that we opened, rather than stdout
+	bool padded_; // the file has direct I/O padding beyond its real end
+	std::unique_ptr<uint8_t, decltype(&free)> buffer_;
+	size_t chunk_size_;
+
+	// Protected by mutex_. head_ and tail_ count the bytes that have been written into the
+	// buffer and out to the file, so the buffer holds the bytes between the two.
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	uint64_t head_;
+	uint64_t tail_;
+	bool closing_;
+	std::exception_ptr error_;
+
+	// Only the writer thread touches these.
+	uint64_t file_size_;
+	uint64_t allocated_;
+	uint64_t unsynced_;
+
+	// Statistics.
+	unsigned int writes_;
+	unsigned int syncs_;
+	unsigned int waits_;
+	std::chrono::duration<double> write_time_;
+	std::chrono::duration<double> max_write_time_;
+	std::chrono::duration<double> wait_time_;
+	uint64_t max_queued_;
+
+	std::thread writer_thread_;
+};
@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * frame_bus.cpp - publish frames into shared memory for other processes to read.
+ */
+
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#include "core/buffer_sync.hpp"
+#include "core/logging.hpp"
+#include "core/rpicam_app.hpp"
+
+#include "frame_bus.h"
+#include "frame_bus.hpp"
+
+static constexpr size_t SLOT_ALIGNMENT = 4096;
+
+static size_t round_up(size_t size)
+{
+	return (size + SLOT_ALIGNMENT - 1) & ~(SLOT_ALIGNMENT - 1);
+}
+
+FrameBus::FrameBus(std::string const &name, unsigned int num_slots, size_t max_data_size, StreamInfo const &info,
+				   std::string const &format)
+	: name_(name), max_data_size_(max_data_size), too_big_(0)
+{
+	static_assert(sizeof(frame_bus_slot) <= FRAME_BUS_SLOT_HEADER_SIZE, "frame bus slot header too big");
+
+	// The socket comes first, as only one process can bind it, which stops two writers sharing a name.
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	std::string socket_name = FRAME_BUS_SOCKET_PREFIX + name;
+	if (socket_name.size() >= sizeof(addr.sun_path) - 1)
+		throw std::runtime_error("frame bus name too long: " + name);
+	memcpy(addr.sun_path + 1, socket_name.data(), socket_name.size());
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open frame bus socket");
+	if (bind(listen_fd_, (sockaddr *)&addr, offsetof(sockaddr_un, sun_path) + 1 + socket_name.size()) < 0 ||
+		listen(listen_fd_, 8) < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("frame bus " + name + " is already in use");
+	}
+
+	size_t slot_size = round_up(FRAME_BUS_SLOT_HEADER_SIZE + max_data_size);
+	map_size_ = SLOT_ALIGNMENT + num_slots * slot_size;
+	int fd = shm_open(("/" + name).c_str(), O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("failed to create frame bus " + name);
+	}
+	void *mem = MAP_FAILED;
+	if (ftruncate(fd, map_size_) == 0)
+		mem = mmap(nullptr, map_size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		shm_unlink(("/" + name).c_str());
+		close(listen_fd_);
+		throw std::runtime_error("failed to map frame bus " + name);
+	}
+
+	// The object starts out all zeros, which leaves every slot empty. The magic goes in last,
+	// so that no reader takes it for a frame bus before it's ready.
+	header_ = static_cast<frame_bus_header *>(mem);
+	header_->version = FRAME_BUS_VERSION;
+	header_->header_size = SLOT_ALIGNMENT;
+	header_->num_slots = num_slots;
+	header_->pixel_format = info.pixel_format.fourcc();
+	header_->slot_size = slot_size;
+	header_->max_data_size = max_data_size;
+	header_->width = info.width;
+	header_->height = info.height;
+	header_->stride = info.stride;
+	header_->writer_pid = getpid();
+	strncpy(header_->format, format.c_str(), sizeof(header_->format) - 1);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(header_->magic, FRAME_BUS_MAGIC, sizeof(header_->magic));
+
+	LOG(1, "Publishing " << format << " frames to frame bus " << name << ", " << num_slots << " slots of "
+						 << max_data_size << " bytes");
+	abort_fd_ = eventfd(0, EFD_CLOEXEC);
+	reader_thread_ = std::thread(&FrameBus::readerThread, this);
+}
+
+FrameBus::~FrameBus()
+{
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(abort_fd_, &one, sizeof(one));
+	reader_thread_.join();
+	for (Reader const &reader : readers_)
+	{
+		close(reader.socket_fd);
+		close(reader.event_fd);
+	}
+	close(listen_fd_);
+	close(abort_fd_);
+	// Readers keep their mappings, and see their sockets close.
+	munmap(header_, map_size_);
+	shm_unlink(("/" + name_).c_str());
+	if (too_big_)
+		LOG_ERROR("WARNING: FrameBus: " << too_big_ << " frames were too big for frame bus " << name_);
+}
+
+void FrameBus::Publish(std::vector<libcamera::Span<uint8_t>> const &mem, int64_t timestamp_us, uint32_t flags,
+					   uint32_t sensor_sequence)
+{
+	size_t size = 0;
+	for (auto const &span : mem)
+		size += span.size();
+	if (size > max_data_size_)
+	{
+		if (!too_big_++)
+			LOG_ERROR("WARNING: FrameBus: frame of " << size << " bytes too big for frame bus " << name_);
+		return;
+	}
+
+	// Only this thread writes the bus, so plain reads of what it has written are fine.
+	uint64_t frame = header_->count;
+	uint8_t *slot_mem = reinterpret_cast<uint8_t *>(header_) + header_->header_size +
+						(frame % header_->num_slots) * header_->slot_size;
+	frame_bus_slot *slot = reinterpret_cast<frame_bus_slot *>(slot_mem);
+	uint32_t sequence = slot->sequence;
+	__atomic_store_n(&slot->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	slot->flags = flags;
+	slot->frame = frame;
+	slot->timestamp_us = timestamp_us;
+	slot->size = size;
+	slot->sensor_sequence = sensor_sequence;
+	uint8_t *dest = slot_mem + FRAME_BUS_SLOT_HEADER_SIZE;
+	for (auto const &span : mem)
+	{
+		memcpy(dest, span.data(), span.size());
+		dest += span.size();
+	}
+
+	__atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&header_->count, frame + 1, __ATOMIC_RELEASE);
+
+	// Writing an eventfd only adds to its count, so this can't wait for the reader.
+	uint64_t one = 1;
+	std::lock_guard<std::mutex> lock(mutex_);
+	for (Reader const &reader : readers_)
+		[[maybe_unused]] ssize_t ret = write(reader.event_fd, &one, sizeof(one));
+}
+
+void FrameBus::addReader()
+{
+	int socket_fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (socket_fd < 0)
+		return;
+	int event_fd = eventfd(0, EFD_CLOEXEC);
+	if (event_fd < 0)
+	{
+		close(socket_fd);
+		return;
+	}
+
+	char byte = 0;
+	iovec iov = { &byte, 1 };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int))];
+		cmsghdr align;
+	} control = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &event_fd, sizeof(int));
+	if (sendmsg(socket_fd, &msg, MSG_NOSIGNAL) != 1)
+	{
+		close(event_fd);
+		close(socket_fd);
+		return;
+	}
+
+	LOG(2, "FrameBus: reader joined frame bus " << name_);
+	std::lock_guard<std::mutex> lock(mutex_);
+	readers_.push_back({ socket_fd, event_fd });
+}
+
+void FrameBus::readerThread()
+{
+	std::vector<pollfd> fds;
+	while (true)
+	{
+		fds = { { abort_fd_, POLLIN, 0 }, { listen_fd_, POLLIN, 0 } };
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (Reader const &reader : readers_)
+				fds.push_back({ reader.socket_fd, POLLIN, 0 });
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("ERROR: FrameBus: poll failed, no more readers can join frame bus " << name_);
+			return;
+		}
+		if (fds[0].revents)
+			return;
+		if (fds[1].revents & POLLIN)
+			addReader();
+
+		// Readers never send anything, so a readable socket means the reader has gone.
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (auto it = fds.begin() + 2; it != fds.end(); it++)
+		{
+			if (!it->revents)
+				continue;
+			auto reader = std::find_if(readers_.begin(), readers_.end(),
+									   [fd = it->fd](Reader const &r) { return r.socket_fd == fd; });
+			close(reader->socket_fd);
+			close(reader->event_fd);
+			readers_.erase(reader);
+			LOG(2, "FrameBus: reader left frame bus " << name_);
+		}
+	}
+}
+
+FrameBusPublisher::FrameBusPublisher(RPiCamApp &app, VideoOptions const *options) : app_(app)
+{
+	libcamera::Stream *video = app.VideoStream();
+	std::stringstream streams(options->frame_bus_streams);
+	for (std::string stream_name; std::getline(streams, stream_name, ',');)
+	{
+		std::string name = options->frame_bus + "-" + stream_name;
+		if (stream_name == "encoded")
+		{
+			// No encoded frame should come near the size of the uncompressed image.
+			StreamInfo info = app.GetStreamInfo(video);
+			size_t max_size = std::max<size_t>(video->configuration().frameSize, 1 << 20);
+			info.pixel_format = libcamera::PixelFormat();
+			info.stride = 0;
+			encoded_ = std::make_unique<FrameBus>(name, options->frame_bus_slots, max_size, info, options->codec);
+			continue;
+		}
+
+		libcamera::Stream *stream = stream_name == "video"   ? video
+									: stream_name == "lores" ? app.LoresStream()
+									: stream_name == "raw"	 ? app.RawStream()
+															 : nullptr;
+		if (!stream)
+			throw std::runtime_error("frame bus stream " + stream_name + " is not configured");
+		StreamInfo info = app.GetStreamInfo(stream);
+		streams_.emplace_back(stream,
+							  std::make_unique<FrameBus>(name, options->frame_bus_slots, stream->configuration().frameSize,
+														 info, info.pixel_format.toString()));
+	}
+}
+
+void FrameBusPublisher::PublishPacket(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	if (encoded_)
+		encoded_->Publish({ libcamera::Span<uint8_t>((uint8_t *)mem, size) }, timestamp_us,
+						  keyframe ? FRAME_BUS_FLAG_KEYFRAME : 0, 0);
+}
+
+void FrameBusPublisher::PublishRequest(CompletedRequestPtr const &completed_request)
+{
+	// The same timestamp that the encoder gives its output.
+	auto ts = completed_request->metadata.get(controls::SensorTimestamp);
+	for (auto const &[stream, bus] : streams_)
+	{
+		libcamera::FrameBuffer *buffer = completed_request->buffers[stream];
+		if (!buffer)
+			continue;
+		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		BufferReadSync r(&app_, buffer);
+		// The sensor's own frame count, so that readers can see any frames that were dropped.
+		bus->Publish(r.Get(), timestamp_ns / 1000, 0, buffer->metadata().sequence);
+	}
+}
@@ -0,0 +1,214 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * frame_bus.h - layout of the shared memory frame bus, and helpers for the
+ * processes that read it.
+ */
+
+#pragma once
+
+/* For O_CLOEXEC in strict ISO C. Include this header before any system headers. */
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * rpicam-vid --frame-bus <name> publishes each of the streams given by --frame-bus-streams
+ * into a POSIX shared memory object called "/<name>-<stream>", where the stream is one of
+ * "encoded", "video", "lores" or "raw". The object is:
+ *
+ *   frame_bus_header, padded to header_size bytes
+ *   frame_bus_slot, padded to FRAME_BUS_SLOT_HEADER_SIZE, then the frame data   } num_slots times,
+ *                                                                               } slot_size bytes apart
+ *
+ * Frame n (counting from 0) goes into slot n % num_slots, and count in the header says how
+ * many frames have been published. The writer never waits for anyone, so a slot may be
+ * overwritten while it is being read. Each slot has a sequence number, which is odd while
+ * the writer is filling the slot, so a reader checks that it is even and unchanged either
+ * side of copying the frame out, and that the slot still holds the frame it wanted.
+ * frame_bus_read does all this. A reader that falls behind just misses frames.
+ *
+ * To be woken for each new frame, a reader connects to the abstract unix socket named
+ * FRAME_BUS_SOCKET_PREFIX "<name>-<stream>", which sends back an eventfd that the writer
+ * signals after every frame. The reader must keep the socket open to stay subscribed, and
+ * sees it close when the writer goes away. frame_bus_connect does this.
+ *
+ * For example:
+ *
+ *   struct frame_bus_header const *bus = frame_bus_open("camera-encoded");
+ *   int event_fd, socket_fd = frame_bus_connect("camera-encoded", &event_fd);
+ *   uint64_t next = frame_bus_count(bus), events;
+ *   while (read(event_fd, &events, sizeof(events)) == sizeof(events))
+ *       for (; next < frame_bus_count(bus); next++)
+ *           if (frame_bus_read(bus, next, buffer, bus->max_data_size, &slot) == FRAME_BUS_OK)
+ *               use(buffer, slot.size);
+ *
+ * All fields are in the native byte order, as the bus never leaves the machine.
+ */
+
+#define FRAME_BUS_MAGIC "RPICAMF\0"
+#define FRAME_BUS_VERSION 1
+#define FRAME_BUS_SOCKET_PREFIX "rpicam-frame-bus/"
+#define FRAME_BUS_SLOT_HEADER_SIZE 64
+
+#define FRAME_BUS_FLAG_KEYFRAME 1
+
+struct frame_bus_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size; /* from the start of the object to the first slot */
+	uint32_t num_slots;
+	uint32_t pixel_format; /* fourcc of raw frames, 0 for encoded ones */
+	uint64_t slot_size; /* from the start of one slot to the next */
+	uint64_t max_data_size; /* the most data a slot can hold */
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride; /* 0 for encoded frames */
+	uint32_t writer_pid;
+	char format[16]; /* the codec, or the pixel format's name, zero terminated */
+	uint64_t count; /* frames published so far, only ever updated atomically */
+};
+
+struct frame_bus_slot
+{
+	uint32_t sequence; /* odd while the writer is filling the slot */
+	uint32_t flags;
+	uint64_t frame; /* the number of the frame in the slot */
+	/*
+	 * The frame's SensorTimestamp (CLOCK_BOOTTIME), or its buffer timestamp if the sensor gave
+	 * none, in microseconds. Encoded frames have the timestamp of the frame they were encoded
+	 * from, so they match up with the raw streams. Unlike the --save-pts file, this doesn't start
+	 * from 0 and isn't adjusted for pauses.
+	 */
+	int64_t timestamp_us;
+	uint32_t size; /* of the frame data */
+	uint32_t sensor_sequence; /* 0 for encoded frames */
+};
+
+enum frame_bus_result
+{
+	FRAME_BUS_OK = 0,
+	FRAME_BUS_NOT_READY = 1, /* the frame hasn't been published yet */
+	FRAME_BUS_MISSED = 2, /* the frame has been, or is being, overwritten */
+};
+
+/* Map the named bus for reading, returning NULL if it doesn't exist or isn't a frame bus. */
+static inline struct frame_bus_header const *frame_bus_open(char const *name)
+{
+	char path[256];
+	snprintf(path, sizeof(path), "/%s", name);
+	int fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void *mem = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct frame_bus_header))
+		mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return NULL;
+	struct frame_bus_header const *bus = (struct frame_bus_header const *)mem;
+	if (memcmp(bus->magic, FRAME_BUS_MAGIC, sizeof(bus->magic)) || bus->version != FRAME_BUS_VERSION ||
+		bus->header_size + bus->num_slots * bus->slot_size > (uint64_t)st.st_size)
+	{
+		munmap(mem, st.st_size);
+		return NULL;
+	}
+	return bus;
+}
+
+static inline void frame_bus_close(struct frame_bus_header const *bus)
+{
+	munmap((void *)bus, bus->header_size + bus->num_slots * bus->slot_size);
+}
+
+static inline uint64_t frame_bus_count(struct frame_bus_header const *bus)
+{
+	return __atomic_load_n(&bus->count, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Copy out frame number "frame", or as much of it as fits in "size" bytes, filling in
+ * the slot's details. Returns an enum frame_bus_result.
+ */
+static inline int frame_bus_read(struct frame_bus_header const *bus, uint64_t frame, void *data, size_t size,
+								 struct frame_bus_slot *slot)
+{
+	uint64_t count = frame_bus_count(bus);
+	if (frame >= count)
+		return FRAME_BUS_NOT_READY;
+	if (count - frame > bus->num_slots)
+		return FRAME_BUS_MISSED;
+
+	uint8_t const *mem = (uint8_t const *)bus + bus->header_size + (frame % bus->num_slots) * bus->slot_size;
+	struct frame_bus_slot const *shared = (struct frame_bus_slot const *)mem;
+	uint32_t sequence = __atomic_load_n(&shared->sequence, __ATOMIC_ACQUIRE);
+	if (sequence & 1)
+		return FRAME_BUS_MISSED;
+	memcpy(slot, shared, sizeof(*slot));
+	if (slot->frame != frame || slot->size > bus->max_data_size)
+		return FRAME_BUS_MISSED;
+	memcpy(data, mem + FRAME_BUS_SLOT_HEADER_SIZE, slot->size < size ? slot->size : size);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&shared->sequence, __ATOMIC_RELAXED) != sequence)
+		return FRAME_BUS_MISSED;
+	return FRAME_BUS_OK;
+}
+
+/*
+ * Subscribe to the named bus, returning a socket that must stay open for as long as the
+ * subscription lasts (or -1 on failure), and putting the eventfd to wait on in *event_fd.
+ */
+static inline int frame_bus_connect(char const *name, int *event_fd)
+{
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, FRAME_BUS_SOCKET_PREFIX "%s", name);
+	if (len < 0 || len >= (int)sizeof(addr.sun_path) - 1)
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&addr, offsetof(struct sockaddr_un, sun_path) + 1 + len) < 0)
+	{
+		close(fd);
+		return -1;
+	}
+
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg;
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) != 1 || !(cmsg = CMSG_FIRSTHDR(&msg)) ||
+		cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int)))
+	{
+		close(fd);
+		return -1;
+	}
+	memcpy(event_fd, CMSG_DATA(cmsg), sizeof(int));
+	return fd;
+}
@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * frame_bus.hpp - publish frames into shared memory for other processes to read.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/base/span.h>
+
+#include "core/completed_request.hpp"
+#include "core/stream_info.hpp"
+#include "core/video_options.hpp"
+
+class RPiCamApp;
+struct frame_bus_header;
+struct frame_bus_slot;
+
+// One named ring of frames in shared memory, laid out as frame_bus.h describes. Publishing
+// a frame copies it into the next slot, overwriting the oldest, and signals the eventfd of
+// every subscribed reader; nothing a reader does can hold it up. A thread of our own hands
+// out the eventfds to readers as they connect and forgets them when they go.
+
+class FrameBus
+{
+public:
+	// The pixel format of an encoded stream is left unset, and format names its codec.
+	FrameBus(std::string const &name, unsigned int num_slots, size_t max_data_size, StreamInfo const &info,
+			 std::string const &format);
+	~FrameBus();
+	// The frame may come in several pieces, such as the planes of an image, which are copied in one after another.
+	void Publish(std::vector<libcamera::Span<uint8_t>> const &mem, int64_t timestamp_us, uint32_t flags,
+				 uint32_t sensor_sequence);
+
+private:
+	struct Reader
+	{
+		int socket_fd;
+		int event_fd;
+	};
+
+	void readerThread();
+	void addReader();
+
+	std::string name_;
+	size_t max_data_size_;
+	size_t map_size_;
+	frame_bus_header *header_;
+	unsigned int too_big_;
+	int listen_fd_;
+	int abort_fd_;
+	std::thread reader_thread_;
+
+	// Protected by mutex_, as the reader thread adds and removes them.
+	std::mutex mutex_;
+	std::vector<Reader> readers_;
+};
+
+// Publishes the streams named by --frame-bus-streams: encoded packets as they come out of
+// the encoder, and raw frames from any of the camera streams that are configured.
+
+class FrameBusPublisher
+{
+public:
+	// Call after the camera is configured, so that the streams are known.
+	FrameBusPublisher(RPiCamApp &app, VideoOptions const *options);
+	void PublishPacket(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
+	void PublishRequest(CompletedRequestPtr const &completed_request);
+
+private:
+	RPiCamApp &app_;
+	std::unique_ptr<FrameBus> encoded_;
+	std::vector<std::pair<libcamera::Stream *, std::unique_ptr<FrameBus>>> streams_;
+};
@@ -5,60 +5,178 @@
  * gstream_output.cpp - send output over gstreamer.
  */
 
+#include <cstring>
+#include <functional>
+
 #include "gstream_output.hpp"
 
-GStreamOutput::GStreamOutput(VideoOptions const *options) : Output(options)
+// How much appsrc may queue before it tells us it has enough. Big enough for a few large
+// keyframes, so that isn't happening all the time.
+static constexpr guint64 MAX_QUEUED_BYTES = 4 << 20;
+// The encoders only have so many buffers, so beyond this many we copy the frames instead.
+static constexpr unsigned int MAX_HELD_BUFFERS = 4;
+
+namespace
+{
+
+struct HeldBuffer
+{
+	std::function<void()> release;
+	std::shared_ptr<std::atomic<unsigned int>> count;
+};
+
+void release_held_buffer(gpointer user_data)
+{
+	HeldBuffer *held = static_cast<HeldBuffer *>(user_data);
+	held->release();
+	(*held->count)--;
+	delete held;
+}
+
+} // namespace
+
+GStreamOutput::GStreamOutput(VideoOptions const *options)
+	: Output(options), enough_data_(false), dropping_(false), restart_requested_(false),
+	  pts_offset_(GST_CLOCK_TIME_NONE), held_buffers_(std::make_shared<std::atomic<unsigned int>>(0))
 {
 	gst_init(nullptr, nullptr);
 	GError *error = nullptr;
-	pipeline = gst_parse_launch(options->output.c_str(), &error);
-    if (!pipeline || error) {
-        throw std::runtime_error("Failed to create GStreamer pipeline: " + std::string(error->message));
-    }
-	
-    appsrc = gst_bin_get_by_name(GST_BIN(pipeline), "appsrc");
-    if (!appsrc) {
-        throw std::runtime_error("Pipeline does not contain an appsrc element");
-    }
-
-    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+	pipeline_ = gst_parse_launch(options->output.c_str(), &error);
+	if (!pipeline_ || error)
+		throw std::runtime_error("Failed to create GStreamer pipeline: " + std::string(error->message));
+
+	appsrc_ = gst_bin_get_by_name(GST_BIN(pipeline_), "appsrc");
+	if (!appsrc_)
+		throw std::runtime_error("Pipeline does not contain an appsrc element");
+
+	// We timestamp the buffers ourselves, in running time, and never block the encoder.
+	g_object_set(appsrc_, "format", GST_FORMAT_TIME, "is-live", TRUE, "do-timestamp", FALSE, "block", FALSE,
+				 "max-bytes", MAX_QUEUED_BYTES, nullptr);
+	g_signal_connect(appsrc_, "need-data", G_CALLBACK(&GStreamOutput::needData), this);
+	g_signal_connect(appsrc_, "enough-data", G_CALLBACK(&GStreamOutput::enoughData), this);
+
+	// Describe the stream, unless the pipeline already does.
+	GstCaps *caps = nullptr;
+	g_object_get(appsrc_, "caps", &caps, nullptr);
+	if (!caps && options->codec == "h264")
+		caps = gst_caps_new_simple("video/x-h264", "stream-format", G_TYPE_STRING, "byte-stream", "alignment",
+								   G_TYPE_STRING, "au", nullptr);
+	else if (!caps && options->codec == "mjpeg")
+		caps = gst_caps_new_empty_simple("image/jpeg");
+	else if (caps)
+	{
+		gst_caps_unref(caps);
+		caps = nullptr;
+	}
+	if (caps)
+	{
+		g_object_set(appsrc_, "caps", caps, nullptr);
+		gst_caps_unref(caps);
+	}
+
+	gst_element_set_state(pipeline_, GST_STATE_PLAYING);
 }
 
 GStreamOutput::~GStreamOutput()
 {
-	gst_element_set_state(pipeline, GST_STATE_NULL);
-	if (pipeline) {
-	    gst_object_unref(pipeline);
-	}
-	if (appsrc) {
-	    gst_object_unref(appsrc);
+	gst_element_set_state(pipeline_, GST_STATE_NULL);
+	gst_object_unref(appsrc_);
+	gst_object_unref(pipeline_);
+}
+
+void GStreamOutput::needData(GstElement * /*appsrc*/, guint /*length*/, gpointer user_data)
+{
+	static_cast<GStreamOutput *>(user_data)->enough_data_ = false;
+}
+
+void GStreamOutput::enoughData(GstElement * /*appsrc*/, gpointer user_data)
+{
+	static_cast<GStreamOutput *>(user_data)->enough_data_ = true;
+}
+
+GstBuffer *GStreamOutput::wrapBuffer(void *mem, size_t size)
+{
+	// Where we can, hand GStreamer the encoder's own buffer, which goes back to the encoder
+	// when GStreamer is done with it.
+	if (*held_buffers_ < MAX_HELD_BUFFERS)
+	{
+		std::function<void()> release = holdBuffer();
+		if (release)
+		{
+			(*held_buffers_)++;
+			HeldBuffer *held = new HeldBuffer { std::move(release), held_buffers_ };
+			return gst_buffer_new_wrapped_full(GST_MEMORY_FLAG_READONLY, mem, size, 0, size, held,
+											   release_held_buffer);
+		}
 	}
+
+	GstBuffer *buffer = gst_buffer_new_allocate(nullptr, size, nullptr);
+	if (buffer)
+		gst_buffer_fill(buffer, 0, mem, size);
+	return buffer;
 }
 
-void GStreamOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+void GStreamOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
-	LOG(2, "GStreamOutput: Start " << mem << " size " << size);
-	
-	//todo: gst_buffer_new_wrapped does not required to make a copy but have issues with deleting buffer
-    //GstBuffer *gst_buffer = gst_buffer_new_wrapped((gpointer)mem, size);
-
-	GstBuffer *gst_buffer = gst_buffer_new_allocate(nullptr, size, nullptr);
-	GstMapInfo map;
-	
-	if (gst_buffer_map(gst_buffer, &map, GST_MAP_WRITE)) {
-		memcpy(map.data, mem, size);
-		gst_buffer_unmap(gst_buffer, &map);
-		
-		GstFlowReturn ret;
-		g_signal_emit_by_name(appsrc, "push-buffer", gst_buffer, &ret);
-        gst_buffer_unref(gst_buffer);
-		if (ret != GST_FLOW_OK) {
-			throw std::runtime_error("Failed to push buffer to GStreamer pipeline");
-        }
-	} else {
-		gst_buffer_unref(gst_buffer);
-		throw std::runtime_error("Failed to map GStreamer buffer for writing");
-    }
-	
-	LOG(2, "GStreamOutput: Finish " << mem << " size " << size);
+	LOG(2, "GStreamOutput: output buffer " << mem << " size " << size);
+	bool keyframe = flags & FLAG_KEYFRAME;
+
+	// When appsrc has enough, drop frames until it wants more, and then restart from a
+	// keyframe so that the decoder has something it can use.
+	if (enough_data_)
+	{
+		if (!dropping_)
+		{
+			LOG(1, "GStreamOutput: pipeline is falling behind, dropping frames");
+			dropping_ = true;
+			restart_requested_ = false;
+		}
+		return;
+	}
+	if (dropping_ && !keyframe)
+	{
+		if (!restart_requested_)
+			requestKeyframe();
+		restart_requested_ = true;
+		return;
+	}
+	dropping_ = false;
+
+	GstBuffer *buffer = wrapBuffer(mem, size);
+	if (!buffer)
+	{
+		LOG_ERROR("WARNING: GStreamOutput: failed to allocate buffer, frame dropped");
+		return;
+	}
+
+	// Our timestamps start from zero, so line the first one up with the pipeline's running time.
+	GstClockTime pts = timestamp_us * GST_USECOND;
+	if (pts_offset_ == GST_CLOCK_TIME_NONE)
+	{
+		pts_offset_ = 0;
+		GstClock *clock = gst_element_get_clock(pipeline_);
+		if (clock)
+		{
+			GstClockTime running_time = gst_clock_get_time(clock) - gst_element_get_base_time(pipeline_);
+			pts_offset_ = running_time > pts ? running_time - pts : 0;
+			gst_object_unref(clock);
+		}
+	}
+	// Our encoders never reorder frames, so decode and presentation times are the same.
+	GST_BUFFER_PTS(buffer) = GST_BUFFER_DTS(buffer) = pts + pts_offset_;
+	if (options_->framerate)
+		GST_BUFFER_DURATION(buffer) = GST_SECOND / *options_->framerate;
+	if (!keyframe)
+		GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+	if (flags & FLAG_RESTART)
+		GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+
+	GstFlowReturn ret;
+	g_signal_emit_by_name(appsrc_, "push-buffer", buffer, &ret);
+	gst_buffer_unref(buffer);
+	// The pipeline stopping or reaching the end isn't something to bring the whole app down over.
+	if (ret == GST_FLOW_FLUSHING || ret == GST_FLOW_EOS)
+		LOG(2, "GStreamOutput: pipeline not accepting buffers (" << gst_flow_get_name(ret) << ")");
+	else if (ret != GST_FLOW_OK)
+		LOG_ERROR("WARNING: GStreamOutput: push-buffer failed (" << gst_flow_get_name(ret) << ")");
 }
@@ -7,9 +7,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
+
 #include <gst/gst.h>
 #include "output.hpp"
 
+// Pushes each encoded frame into the "appsrc" element of the given pipeline, wrapping the
+// encoder's own buffer where the encoder lets us keep it, and copying it otherwise. Frames
+// carry their timestamps and keyframe flags. When appsrc says it has enough data, frames
+// are dropped until it wants more and the next keyframe arrives.
+
 class GStreamOutput : public Output
 {
 public:
@@ -20,6 +28,17 @@ protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
 
 private:
-    GstElement *pipeline;
-    GstElement *appsrc;
+	static void needData(GstElement *appsrc, guint length, gpointer user_data);
+	static void enoughData(GstElement *appsrc, gpointer user_data);
+	GstBuffer *wrapBuffer(void *mem, size_t size);
+
+	GstElement *pipeline_;
+	GstElement *appsrc_;
+	std::atomic<bool> enough_data_;
+	bool dropping_;
+	bool restart_requested_;
+	GstClockTime pts_offset_;
+	// Encoder buffers that GStreamer is still holding. This is shared with the functions
+	// that give them back, which may run after we've gone.
+	std::shared_ptr<std::atomic<unsigned int>> held_buffers_;
 };
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * http_output.cpp - serve MJPEG to any number of HTTP clients.
+ */
+
+#include <cinttypes>
+#include <cstdio>
+
+#include "http_output.hpp"
+
+static char const BOUNDARY[] = "rpicamframe";
+static char const STREAM[] = "mjpeg";
+static char const PART_END[] = "\r\n";
+
+HttpOutput::Jpeg::~Jpeg()
+{
+	if (release)
+		release();
+}
+
+HttpOutput::HttpOutput(VideoOptions const *options) : Output(options)
+{
+	if (options->codec != "mjpeg")
+		throw std::runtime_error("http output only supports mjpeg");
+
+	char protocol[5];
+	int start, end, a, b, c, d, port;
+	if (sscanf(options->output.c_str(), "%4s://%n%d.%d.%d.%d%n:%d", protocol, &start, &a, &b, &c, &d, &end, &port) != 6)
+		throw std::runtime_error("bad network address " + options->output);
+	std::string address = options->output.substr(start, end - start);
+
+	server_ = std::make_unique<HttpServer>(
+		port, [this](std::string const &path, HttpServer::Response &response) { return serve(path, response); },
+		address);
+}
+
+HttpOutput::~HttpOutput()
+{
+	// Stop the server first, as it may be using our frames.
+	server_.reset();
+}
+
+void HttpOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t /*flags*/)
+{
+	LOG(2, "HttpOutput: output buffer " << mem << " size " << size);
+
+	// Keep the encoder's buffer if we can, otherwise this is the one and only copy.
+	auto jpeg = std::make_shared<Jpeg>();
+	jpeg->release = holdBuffer();
+	if (jpeg->release)
+		jpeg->data = mem;
+	else
+	{
+		jpeg->copy.assign((uint8_t *)mem, (uint8_t *)mem + size);
+		jpeg->data = jpeg->copy.data();
+	}
+	jpeg->size = size;
+
+	char header[160];
+	snprintf(header, sizeof(header),
+			 "--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\nX-Timestamp-Us: %" PRId64 "\r\n\r\n", BOUNDARY,
+			 size, timestamp_us);
+	jpeg->part_header = header;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		latest_ = jpeg;
+	}
+
+	HttpServer::Part part;
+	part.data = { { (void *)jpeg->part_header.data(), jpeg->part_header.size() },
+				  { (void *)jpeg->data, jpeg->size },
+				  { (void *)PART_END, sizeof(PART_END) - 1 } };
+	part.hold = std::move(jpeg);
+	server_->Push(STREAM, part);
+}
+
+bool HttpOutput::serve(std::string const &path, HttpServer::Response &response)
+{
+	if (path == "/" || path == "/stream.mjpg")
+	{
+		response.content_type = std::string("multipart/x-mixed-replace; boundary=") + BOUNDARY;
+		response.stream = STREAM;
+		return true;
+	}
+	else if (path == "/snapshot.jpg")
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!latest_)
+			return false;
+		response.content_type = "image/jpeg";
+		response.body.push_back({ (void *)latest_->data, latest_->size });
+		response.hold = latest_;
+		return true;
+	}
+	return false;
+}
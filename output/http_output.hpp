@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * http_output.hpp - serve MJPEG to any number of HTTP clients.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "http_server.hpp"
+#include "output.hpp"
+
+// Serves the MJPEG stream as multipart/x-mixed-replace at / and /stream.mjpg, which
+// browsers show as live video, and the latest frame on its own at /snapshot.jpg. Each JPEG
+// is kept, without copying where the encoder lets us, and shared by every client. Clients
+// always get the latest frame once they finish the last, so slow ones just see fewer.
+
+class HttpOutput : public Output
+{
+public:
+	HttpOutput(VideoOptions const *options);
+	~HttpOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Jpeg
+	{
+		~Jpeg();
+		std::string part_header;
+		void const *data;
+		size_t size;
+		// Gives the encoder's buffer back, or we have our own copy.
+		std::function<void()> release;
+		std::vector<uint8_t> copy;
+	};
+
+	bool serve(std::string const &path, HttpServer::Response &response);
+
+	std::unique_ptr<HttpServer> server_;
+	std::mutex mutex_;
+	std::shared_ptr<Jpeg const> latest_;
+};
@@ -0,0 +1,315 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * http_server.cpp - minimal HTTP server for serving files and streams from memory.
+ */
+
+#include <arpa/inet.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "http_server.hpp"
+
+// How often the server thread checks for clients that have stalled.
+static constexpr int POLL_TIMEOUT_MS = 200;
+// A client that stops reading or never finishes its request is dropped after this long.
+static constexpr std::chrono::seconds CLIENT_TIMEOUT(5);
+static constexpr size_t MAX_REQUEST_SIZE = 4096;
+// Keep the kernel from queueing up many parts for streaming clients, so that they really
+// do get the latest part when they catch up.
+static constexpr int STREAM_SNDBUF = 256 * 1024;
+
+HttpServer::HttpServer(unsigned int port, Handler handler, std::string const &address)
+	: handler_(handler), abort_(false)
+{
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	if (inet_aton(address.c_str(), &saddr.sin_addr) == 0)
+		throw std::runtime_error("inet_aton failed for " + address);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open http listen socket");
+
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt http listen socket");
+
+	if (bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0 || listen(listen_fd_, 16) < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("failed to listen on http port " + std::to_string(port));
+	}
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create epoll or event fd");
+	for (int fd : { listen_fd_, event_fd_ })
+	{
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+			throw std::runtime_error("failed to add fd to epoll");
+	}
+
+	thread_ = std::thread(&HttpServer::serverThread, this);
+	LOG(1, "HttpServer: listening on " << address << ":" << port);
+}
+
+HttpServer::~HttpServer()
+{
+	abort_ = true;
+	wake();
+	thread_.join();
+	for (auto &[fd, connection] : connections_)
+		close(fd);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void HttpServer::Push(std::string const &stream, Part const &part)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		Stream &s = streams_[stream];
+		s.latest = std::make_shared<Part const>(part);
+		s.generation++;
+	}
+	wake();
+}
+
+void HttpServer::wake()
+{
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+}
+
+void HttpServer::serverThread()
+{
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, POLL_TIMEOUT_MS);
+		if (n < 0 && errno != EINTR)
+		{
+			LOG_ERROR("ERROR: HttpServer: epoll_wait failed, no more clients will be served");
+			break;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptConnections();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				[[maybe_unused]] ssize_t ret = read(event_fd_, &count, sizeof(count));
+			}
+			else if (events[i].events & (EPOLLERR | EPOLLHUP))
+				removeConnection(fd, "disconnected");
+			else if (events[i].events & (EPOLLIN | EPOLLRDHUP))
+			{
+				auto it = connections_.find(fd);
+				if (it != connections_.end())
+					readRequest(fd, it->second);
+			}
+		}
+
+		// Give streaming clients that have sent everything the latest part, if it's new to them.
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			for (auto &[fd, connection] : connections_)
+			{
+				if (connection.stream.empty() || !connection.out.empty())
+					continue;
+				auto it = streams_.find(connection.stream);
+				if (it == streams_.end() || it->second.generation == connection.generation)
+					continue;
+				Part const &part = *it->second.latest;
+				connection.out = part.data;
+				connection.hold = { it->second.latest };
+				connection.generation = it->second.generation;
+			}
+		}
+
+		// Writes never block, so just try everyone. Those who can't take any more wait for EPOLLOUT.
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = connections_.begin(); it != connections_.end();)
+		{
+			int fd = it->first;
+			Connection &connection = (it++)->second;
+			if (!sendPending(fd, connection))
+				removeConnection(fd, "failed");
+			else if (connection.responded && connection.out.empty() && connection.stream.empty())
+				removeConnection(fd, "done");
+			else if ((!connection.responded || !connection.out.empty()) &&
+					 now - connection.last_progress > CLIENT_TIMEOUT)
+				removeConnection(fd, "timed out");
+		}
+	}
+}
+
+void HttpServer::acceptConnections()
+{
+	while (true)
+	{
+		sockaddr_in saddr;
+		socklen_t len = sizeof(saddr);
+		int fd = accept4(listen_fd_, (sockaddr *)&saddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG_ERROR("WARNING: HttpServer: accept failed");
+			return;
+		}
+
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			LOG_ERROR("WARNING: HttpServer: failed to add client to epoll");
+			close(fd);
+			continue;
+		}
+
+		Connection &connection = connections_[fd];
+		connection.name = std::string(inet_ntoa(saddr.sin_addr)) + ":" + std::to_string(ntohs(saddr.sin_port));
+		connection.last_progress = std::chrono::steady_clock::now();
+		// The request may well be here already, and with edge triggering we won't hear of it again.
+		readRequest(fd, connection);
+	}
+}
+
+void HttpServer::readRequest(int fd, Connection &connection)
+{
+	char buf[1024];
+	ssize_t n;
+	while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+	{
+		// Anything sent after the request is of no interest.
+		if (connection.responded)
+			continue;
+		if (connection.request.size() + n > MAX_REQUEST_SIZE)
+		{
+			removeConnection(fd, "sent a bad request");
+			return;
+		}
+		connection.request.append(buf, n);
+		connection.last_progress = std::chrono::steady_clock::now();
+	}
+	// A client may stop sending once it has made its request, but still want the answer.
+	bool complete = connection.request.find("\r\n\r\n") != std::string::npos;
+	if (n == 0 && !complete)
+	{
+		removeConnection(fd, "disconnected");
+		return;
+	}
+	if (connection.responded || !complete)
+		return;
+
+	Response response;
+	std::string const &request = connection.request;
+	size_t path_end = request.find(' ', 4);
+	if (request.compare(0, 4, "GET ") || path_end == std::string::npos)
+		response.status = 405;
+	else
+	{
+		std::string path = request.substr(4, path_end - 4);
+		path = path.substr(0, path.find('?'));
+		if (!handler_(path, response))
+			response.status = 404;
+		LOG(2, "HttpServer: GET " << path << " " << response.status << " for " << connection.name);
+	}
+
+	if (response.status != 200)
+	{
+		response.body.clear();
+		response.stream.clear();
+	}
+
+	std::string status = response.status == 200 ? "200 OK" : response.status == 404 ? "404 Not Found"
+																						: "405 Method Not Allowed";
+	auto header = std::make_shared<std::string>("HTTP/1.1 " + status + "\r\n");
+	if (response.stream.empty())
+	{
+		size_t length = 0;
+		for (auto const &iov : response.body)
+			length += iov.iov_len;
+		*header += "Content-Length: " + std::to_string(length) + "\r\n";
+	}
+	*header += "Cache-Control: no-cache\r\nAccess-Control-Allow-Origin: *\r\nConnection: close\r\n";
+	if (!response.content_type.empty())
+		*header += "Content-Type: " + response.content_type + "\r\n";
+	*header += "\r\n";
+
+	connection.responded = true;
+	connection.out = { { (void *)header->data(), header->size() } };
+	connection.out.insert(connection.out.end(), response.body.begin(), response.body.end());
+	connection.hold = { header, response.hold };
+	if (!response.stream.empty())
+	{
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &STREAM_SNDBUF, sizeof(STREAM_SNDBUF));
+		connection.stream = response.stream;
+		LOG(1, "HttpServer: streaming " << connection.stream << " to " << connection.name);
+	}
+}
+
+bool HttpServer::sendPending(int fd, Connection &connection)
+{
+	while (!connection.out.empty())
+	{
+		msghdr msg = {};
+		msg.msg_iov = connection.out.data();
+		msg.msg_iovlen = std::min<size_t>(connection.out.size(), IOV_MAX);
+		// No SIGPIPE when a client has gone away, we just forget about them.
+		ssize_t ret = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		connection.last_progress = std::chrono::steady_clock::now();
+		size_t sent = ret, done = 0;
+		for (; done < connection.out.size() && sent >= connection.out[done].iov_len; done++)
+			sent -= connection.out[done].iov_len;
+		connection.out.erase(connection.out.begin(), connection.out.begin() + done);
+		if (sent)
+		{
+			connection.out[0].iov_base = (uint8_t *)connection.out[0].iov_base + sent;
+			connection.out[0].iov_len -= sent;
+		}
+	}
+	connection.hold.clear();
+	return true;
+}
+
+void HttpServer::removeConnection(int fd, char const *reason)
+{
+	auto it = connections_.find(fd);
+	if (it == connections_.end())
+		return;
+	if (!it->second.stream.empty())
+		LOG(1, "HttpServer: stream client " << it->second.name << " " << reason);
+	else
+		LOG(2, "HttpServer: client " << it->second.name << " " << reason);
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	connections_.erase(it);
+}
@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * http_server.hpp - minimal HTTP server for serving files and streams from memory.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Answers GET requests from any number of clients on a background epoll thread, by asking
+// the handler for the body. The body is sent straight out of whatever memory the handler
+// points at, which stays alive for as long as "hold" does. Instead of a body, the handler
+// may name a stream, in which case the connection stays open and gets every part that is
+// pushed to that stream. A client still busy with one part when the next arrives only ever
+// gets the latest, so slow clients skip parts rather than fall behind.
+
+class HttpServer
+{
+public:
+	struct Response
+	{
+		int status = 200;
+		std::string content_type;
+		std::vector<iovec> body;
+		std::shared_ptr<void const> hold;
+		std::string stream;
+	};
+	// Return false for a 404.
+	typedef std::function<bool(std::string const &path, Response &response)> Handler;
+	struct Part
+	{
+		std::vector<iovec> data;
+		std::shared_ptr<void const> hold;
+	};
+
+	HttpServer(unsigned int port, Handler handler, std::string const &address = "0.0.0.0");
+	~HttpServer();
+	void Push(std::string const &stream, Part const &part);
+
+private:
+	struct Connection
+	{
+		std::string name;
+		std::string request;
+		bool responded = false;
+		// What is still to be sent, and what keeps it alive.
+		std::vector<iovec> out;
+		std::vector<std::shared_ptr<void const>> hold;
+		std::string stream;
+		uint64_t generation = 0; // of the last part of the stream that we sent
+		std::chrono::steady_clock::time_point last_progress;
+	};
+	struct Stream
+	{
+		std::shared_ptr<Part const> latest;
+		uint64_t generation = 0;
+	};
+
+	void serverThread();
+	void acceptConnections();
+	void readRequest(int fd, Connection &connection);
+	bool sendPending(int fd, Connection &connection);
+	void removeConnection(int fd, char const *reason);
+	void wake();
+
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	Handler handler_;
+	std::atomic<bool> abort_;
+	std::thread thread_;
+	// Only the server thread touches the connections.
+	std::map<int, Connection> connections_;
+
+	// Protected by mutex_.
+	std::mutex mutex_;
+	std::map<std::string, Stream> streams_;
+};
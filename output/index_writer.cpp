@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * index_writer.cpp - write the keyframe index that goes alongside a recording.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+
+#include "index_writer.hpp"
+#include "recording_index.h"
+
+IndexWriter::IndexWriter(std::string const &filename) : filename_(filename)
+{
+	fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw std::runtime_error("failed to open index file " + filename);
+
+	recording_index_header header = {};
+	memcpy(header.magic, RECORDING_INDEX_MAGIC, sizeof(header.magic));
+	header.version = RECORDING_INDEX_VERSION;
+	header.header_size = sizeof(header);
+	header.entry_size = sizeof(recording_index_entry);
+	write(&header, sizeof(header));
+}
+
+IndexWriter::~IndexWriter()
+{
+	Close(false);
+}
+
+void IndexWriter::Add(uint64_t offset, int64_t timestamp_us, uint32_t frame)
+{
+	recording_index_entry entry = {};
+	entry.offset = offset;
+	entry.timestamp_us = timestamp_us;
+	entry.frame = frame;
+	entry.check = recording_index_check(&entry);
+	write(&entry, sizeof(entry));
+}
+
+void IndexWriter::Close(bool sync)
+{
+	if (fd_ < 0)
+		return;
+	if ((sync && fdatasync(fd_)) || close(fd_))
+		LOG_ERROR("WARNING: IndexWriter: failed to close index file " << filename_);
+	fd_ = -1;
+}
+
+void IndexWriter::write(void const *data, size_t size)
+{
+	if (fd_ < 0)
+		return;
+	ssize_t ret;
+	do
+		ret = ::write(fd_, data, size);
+	while (ret < 0 && errno == EINTR);
+	if (ret != (ssize_t)size)
+	{
+		// A short write leaves a partial entry, which readers will stop at anyway.
+		LOG_ERROR("WARNING: IndexWriter: failed to write " << filename_ << ", no more keyframes will be indexed");
+		close(fd_);
+		fd_ = -1;
+	}
+}
@@ -0,0 +1,30 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * index_writer.hpp - write the keyframe index that goes alongside a recording.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+// Appends an entry to the index file for every keyframe, each with a single write so that
+// an entry is never left half written in the page cache. Should the index file fail, the
+// recording carries on without it.
+class IndexWriter
+{
+public:
+	IndexWriter(std::string const &filename);
+	~IndexWriter();
+	void Add(uint64_t offset, int64_t timestamp_us, uint32_t frame);
+	// Sync the index too, once the recording itself is safely on disk.
+	void Close(bool sync);
+
+private:
+	void write(void const *data, size_t size);
+
+	std::string filename_;
+	int fd_;
+};
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * metadata_format.h - layout of the binary per-frame metadata files.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * A binary metadata file is:
+ *
+ *   metadata_file_header
+ *   metadata_control_info, followed by name_size bytes of name     } once per control
+ *   metadata_record_header                                          } once per frame
+ *   metadata_value_header, followed by data_size bytes of data      } once per value
+ *
+ * The controls listed after the file header form the dictionary that the values'
+ * ids refer to, giving each its name and type. All fields are little endian, and
+ * everything starts on a 4 byte boundary, with zero padding after names and data.
+ *
+ * Each record gives its size, so a reader can skip records it doesn't want, and
+ * stop cleanly at a truncated one at the end of a recording that never finished.
+ */
+
+#define METADATA_FILE_MAGIC "RPICAMM\0"
+#define METADATA_VERSION 1
+#define METADATA_RECORD_MAGIC 0x4d445452 /* "RTDM" */
+
+#define METADATA_VALUE_FLAG_ARRAY 1
+
+enum metadata_type
+{
+	METADATA_TYPE_NONE = 0,
+	METADATA_TYPE_BOOL = 1, /* one byte per element */
+	METADATA_TYPE_BYTE = 2,
+	METADATA_TYPE_INT32 = 3,
+	METADATA_TYPE_INT64 = 4,
+	METADATA_TYPE_FLOAT = 5,
+	METADATA_TYPE_STRING = 6, /* one byte per character, not terminated */
+	METADATA_TYPE_RECTANGLE = 7, /* int32 x, y, then uint32 width, height */
+	METADATA_TYPE_SIZE = 8, /* uint32 width, height */
+};
+
+struct metadata_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t num_controls; /* in the dictionary that follows */
+	uint32_t reserved;
+};
+
+struct metadata_control_info
+{
+	uint32_t id;
+	uint32_t type; /* an enum metadata_type */
+	uint32_t name_size;
+	uint32_t reserved;
+};
+
+struct metadata_record_header
+{
+	uint32_t magic;
+	uint32_t size; /* of the whole record, including this header */
+	int64_t timestamp_us; /* as in the timestamp file */
+	uint32_t sequence; /* from the sensor */
+	uint32_t num_values;
+};
+
+struct metadata_value_header
+{
+	uint32_t id;
+	uint16_t type; /* an enum metadata_type */
+	uint16_t flags;
+	uint32_t num_elements;
+	uint32_t data_size;
+};
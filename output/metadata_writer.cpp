@@ -0,0 +1,197 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * metadata_writer.cpp - write per-frame metadata in the binary format.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+
+#include "core/logging.hpp"
+
+#include "metadata_format.h"
+#include "metadata_writer.hpp"
+
+// Enough for a few seconds of records at high framerates, should the file system stall.
+static constexpr size_t RING_SIZE = 2 << 20;
+static constexpr size_t MAX_WRITE = 256 << 10;
+
+static uint32_t metadata_type_of(libcamera::ControlType type)
+{
+	switch (type)
+	{
+	case libcamera::ControlTypeBool:
+		return METADATA_TYPE_BOOL;
+	case libcamera::ControlTypeByte:
+		return METADATA_TYPE_BYTE;
+	case libcamera::ControlTypeInteger32:
+		return METADATA_TYPE_INT32;
+	case libcamera::ControlTypeInteger64:
+		return METADATA_TYPE_INT64;
+	case libcamera::ControlTypeFloat:
+		return METADATA_TYPE_FLOAT;
+	case libcamera::ControlTypeString:
+		return METADATA_TYPE_STRING;
+	case libcamera::ControlTypeRectangle:
+		return METADATA_TYPE_RECTANGLE;
+	case libcamera::ControlTypeSize:
+		return METADATA_TYPE_SIZE;
+	default:
+		// Any types that are newer than this file get left out.
+		return METADATA_TYPE_NONE;
+	}
+}
+
+MetadataWriter::MetadataWriter(std::string const &filename)
+	: header_written_(false), dropped_(0), ring_(RING_SIZE), head_(0), tail_(0), abort_(false)
+{
+	if (filename == "-")
+		fd_ = STDOUT_FILENO;
+	else
+	{
+		fd_ = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open metadata file " + filename);
+	}
+	record_.reserve(16384);
+	writer_thread_ = std::thread(&MetadataWriter::writerThread, this);
+}
+
+MetadataWriter::~MetadataWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_var_.notify_one();
+	writer_thread_.join();
+	if (fd_ != STDOUT_FILENO)
+		close(fd_);
+	if (dropped_)
+		LOG_ERROR("WARNING: MetadataWriter: " << dropped_ << " records were dropped");
+}
+
+void MetadataWriter::append(void const *data, size_t size)
+{
+	uint8_t const *bytes = static_cast<uint8_t const *>(data);
+	record_.insert(record_.end(), bytes, bytes + size);
+	record_.resize((record_.size() + 3) & ~3, 0);
+}
+
+void MetadataWriter::writeHeader(libcamera::ControlIdMap const &id_map)
+{
+	metadata_file_header header = {};
+	memcpy(header.magic, METADATA_FILE_MAGIC, sizeof(header.magic));
+	header.version = METADATA_VERSION;
+	header.header_size = sizeof(header);
+	header.num_controls = id_map.size();
+	append(&header, sizeof(header));
+
+	for (auto const &[id, control] : id_map)
+	{
+		metadata_control_info info = {};
+		info.id = id;
+		info.type = metadata_type_of(control->type());
+		info.name_size = control->name().size();
+		append(&info, sizeof(info));
+		append(control->name().data(), info.name_size);
+	}
+}
+
+void MetadataWriter::Write(int64_t timestamp_us, unsigned int sequence, libcamera::ControlList const &metadata)
+{
+	record_.clear();
+	if (!header_written_)
+	{
+		if (!metadata.idMap())
+			throw std::runtime_error("metadata has no control names to write");
+		writeHeader(*metadata.idMap());
+		queueRecord();
+		record_.clear();
+		header_written_ = true;
+	}
+
+	// Values are just their raw bytes, so this is little more than a copy.
+	metadata_record_header header = {};
+	header.magic = METADATA_RECORD_MAGIC;
+	header.timestamp_us = timestamp_us;
+	header.sequence = sequence;
+	append(&header, sizeof(header));
+	for (auto const &[id, value] : metadata)
+	{
+		metadata_value_header value_header = {};
+		value_header.id = id;
+		value_header.type = metadata_type_of(value.type());
+		if (value_header.type == METADATA_TYPE_NONE)
+			continue;
+		value_header.flags = value.isArray() ? METADATA_VALUE_FLAG_ARRAY : 0;
+		value_header.num_elements = value.numElements();
+		value_header.data_size = value.data().size();
+		append(&value_header, sizeof(value_header));
+		append(value.data().data(), value_header.data_size);
+		header.num_values++;
+	}
+	header.size = record_.size();
+	memcpy(record_.data(), &header, sizeof(header));
+	queueRecord();
+}
+
+void MetadataWriter::queueRecord()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (record_.size() > ring_.size() - (head_ - tail_))
+		{
+			if (!dropped_++)
+				LOG(1, "MetadataWriter: falling behind, dropping records");
+			return;
+		}
+
+		// Copy in, wrapping round the end of the ring if necessary.
+		size_t pos = head_ % ring_.size();
+		size_t first = std::min(record_.size(), ring_.size() - pos);
+		memcpy(ring_.data() + pos, record_.data(), first);
+		memcpy(ring_.data(), record_.data() + first, record_.size() - first);
+		head_ += record_.size();
+	}
+	cond_var_.notify_one();
+}
+
+void MetadataWriter::writerThread()
+{
+	bool failed = false;
+	while (true)
+	{
+		size_t pos, size;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_var_.wait(lock, [this] { return abort_ || head_ != tail_; });
+			if (head_ == tail_)
+				return; // only when aborting, and there's nothing left to write
+			pos = tail_ % ring_.size();
+			size = std::min({ (size_t)(head_ - tail_), ring_.size() - pos, MAX_WRITE });
+		}
+
+		// Only the caller's thread writes into the ring, and never into the part we're writing out.
+		for (size_t done = 0; done < size && !failed;)
+		{
+			ssize_t ret = write(fd_, ring_.data() + pos + done, size - done);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			else if (ret <= 0)
+			{
+				LOG_ERROR("ERROR: MetadataWriter: failed to write metadata, no more will be saved");
+				failed = true;
+			}
+			else
+				done += ret;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		tail_ += size;
+	}
+}
@@ -0,0 +1,53 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * metadata_writer.hpp - write per-frame metadata in the binary format.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+// Writes each frame's metadata as a binary record (see metadata_format.h). Records are
+// built by the caller, which only copies the raw control values, into a ring buffer that
+// a thread of our own writes out, so the caller never waits for the file. Should that
+// thread fall so far behind that the ring fills up, records are dropped rather than hold
+// up the caller, and we say how many when we finish.
+
+class MetadataWriter
+{
+public:
+	// A filename of "-" means stdout.
+	MetadataWriter(std::string const &filename);
+	~MetadataWriter();
+	void Write(int64_t timestamp_us, unsigned int sequence, libcamera::ControlList const &metadata);
+
+private:
+	void writerThread();
+	void writeHeader(libcamera::ControlIdMap const &id_map);
+	void append(void const *data, size_t size);
+	void queueRecord();
+
+	int fd_;
+	bool header_written_;
+	unsigned int dropped_;
+	// The record being built, only touched by the caller's thread.
+	std::vector<uint8_t> record_;
+
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::vector<uint8_t> ring_;
+	// Running totals of bytes put into and taken out of the ring.
+	uint64_t head_;
+	uint64_t tail_;
+	bool abort_;
+	std::thread writer_thread_;
+};
@@ -0,0 +1,511 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * mp4_muxer.cpp - fragmented MP4 boxes for an H.264 stream.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "mp4_muxer.hpp"
+
+namespace
+{
+
+enum NalType
+{
+	NAL_SPS = 7,
+	NAL_PPS = 8,
+	NAL_AUD = 9
+};
+
+class BoxWriter
+{
+public:
+	BoxWriter(std::vector<uint8_t> &out) : out_(out) {}
+
+	void u8(uint8_t v) { out_.push_back(v); }
+	void u16(uint16_t v) { u8(v >> 8), u8(v); }
+	void u32(uint32_t v) { u16(v >> 16), u16(v); }
+	void u64(uint64_t v) { u32(v >> 32), u32(v); }
+	void fourcc(char const *s) { out_.insert(out_.end(), s, s + 4); }
+	void bytes(uint8_t const *p, size_t n) { out_.insert(out_.end(), p, p + n); }
+	void zeros(size_t n) { out_.insert(out_.end(), n, 0); }
+	size_t size() const { return out_.size(); }
+
+	// Boxes nest, so the size gets filled in when the box is closed.
+	void begin(char const *type)
+	{
+		starts_.push_back(out_.size());
+		u32(0);
+		fourcc(type);
+	}
+	void beginFull(char const *type, uint8_t version, uint32_t flags)
+	{
+		begin(type);
+		u32((version << 24) | flags);
+	}
+	void end()
+	{
+		size_t start = starts_.back(), size = out_.size() - start;
+		starts_.pop_back();
+		out_[start] = size >> 24, out_[start + 1] = size >> 16, out_[start + 2] = size >> 8, out_[start + 3] = size;
+	}
+
+	void matrix()
+	{
+		static const uint32_t unity[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+		for (uint32_t v : unity)
+			u32(v);
+	}
+
+private:
+	std::vector<uint8_t> &out_;
+	std::vector<size_t> starts_;
+};
+
+// Reads an RBSP, skipping the emulation prevention bytes.
+class BitReader
+{
+public:
+	BitReader(std::vector<uint8_t> const &nal) : nal_(nal), pos_(8), zeros_(0) {} // skip the NAL header
+
+	unsigned int u(unsigned int n)
+	{
+		unsigned int value = 0;
+		while (n--)
+			value = (value << 1) | bit();
+		return value;
+	}
+	unsigned int ue()
+	{
+		unsigned int leading = 0;
+		while (!bit())
+		{
+			if (++leading > 31)
+				throw std::runtime_error("Mp4Muxer: bad exp-Golomb code in SPS");
+		}
+		return (1u << leading) - 1 + u(leading);
+	}
+	int se()
+	{
+		unsigned int v = ue();
+		return v & 1 ? (int)((v + 1) / 2) : -(int)(v / 2);
+	}
+
+private:
+	unsigned int bit()
+	{
+		if ((pos_ & 7) == 0)
+		{
+			if (pos_ / 8 >= nal_.size())
+				throw std::runtime_error("Mp4Muxer: SPS too short");
+			// A 0x03 after two zero bytes is an emulation prevention byte.
+			uint8_t byte = nal_[pos_ / 8];
+			if (zeros_ >= 2 && byte == 3)
+			{
+				pos_ += 8;
+				zeros_ = 0;
+				return bit();
+			}
+			zeros_ = byte ? 0 : zeros_ + 1;
+		}
+		unsigned int b = (nal_[pos_ / 8] >> (7 - (pos_ & 7))) & 1;
+		pos_++;
+		return b;
+	}
+
+	std::vector<uint8_t> const &nal_;
+	size_t pos_;
+	unsigned int zeros_;
+};
+
+} // namespace
+
+Mp4Muxer::Mp4Muxer()
+	: width_(0), height_(0), chroma_format_idc_(1), bit_depth_luma_(8), bit_depth_chroma_(8), sequence_number_(0),
+	  first_timestamp_us_(-1), last_duration_(TIMESCALE / 30)
+{
+}
+
+Mp4Muxer::SamplePtr Mp4Muxer::MakeSample(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe)
+{
+	std::shared_ptr<Sample> sample = std::make_shared<Sample>();
+	sample->timestamp_us = timestamp_us;
+	sample->keyframe = keyframe;
+	sample->size = 0;
+
+	// Find the NAL units. The encoder uses 4-byte start codes, which we overwrite in place
+	// with the lengths, but we must cope with 3-byte ones, which need an extra byte.
+	std::vector<std::pair<size_t, size_t>> nals; // payload offset and size
+	size_t i = 0, start = 0;
+	bool short_codes = false;
+	for (; i + 3 <= size; i++)
+	{
+		if (data[i] || data[i + 1] || data[i + 2] != 1)
+			continue;
+		size_t code_start = i > 0 && !data[i - 1] ? i - 1 : i;
+		short_codes |= code_start == i;
+		if (!nals.empty())
+			nals.back().second = code_start - nals.back().first;
+		i += 3;
+		nals.emplace_back(i, 0);
+		start = i;
+	}
+	if (nals.empty())
+		throw std::runtime_error("Mp4Muxer: no start codes in encoded frame");
+	nals.back().second = size - start;
+
+	if (!short_codes)
+		sample->data.assign(data, data + size);
+	else
+	{
+		for (auto const &nal : nals)
+		{
+			sample->data.insert(sample->data.end(), { 0, 0, 0, 1 });
+			sample->data.insert(sample->data.end(), data + nal.first, data + nal.first + nal.second);
+		}
+		size_t offset = 4;
+		for (auto &nal : nals)
+		{
+			nal.first = offset;
+			offset += nal.second + 4;
+		}
+	}
+
+	for (auto const &nal : nals)
+	{
+		uint8_t const *payload = &sample->data[nal.first];
+		unsigned int type = payload[0] & 0x1f;
+		if (type == NAL_SPS || type == NAL_PPS)
+		{
+			std::vector<uint8_t> &param = type == NAL_SPS ? sps_ : pps_;
+			if (param.size() != nal.second || memcmp(param.data(), payload, nal.second))
+			{
+				if (!param.empty() && HaveHeaders())
+					LOG_ERROR("WARNING: Mp4Muxer: parameter sets changed mid-stream, ignoring");
+				else
+				{
+					param.assign(payload, payload + nal.second);
+					if (type == NAL_SPS)
+						parseSps();
+				}
+			}
+			continue;
+		}
+		if (type == NAL_AUD)
+			continue;
+		uint8_t *len = &sample->data[nal.first - 4];
+		len[0] = nal.second >> 24, len[1] = nal.second >> 16, len[2] = nal.second >> 8, len[3] = nal.second;
+		sample->nals.emplace_back(nal.first - 4, nal.second + 4);
+		sample->size += nal.second + 4;
+	}
+
+	return sample;
+}
+
+void Mp4Muxer::parseSps()
+{
+	BitReader br(sps_);
+	unsigned int profile_idc = br.u(8);
+	br.u(16); // constraint flags and level
+	br.ue(); // seq_parameter_set_id
+
+	chroma_format_idc_ = 1;
+	bit_depth_luma_ = bit_depth_chroma_ = 8;
+	static const unsigned int high_profiles[] = { 100, 110, 122, 244, 44, 83, 86, 118, 128, 138, 139, 134, 135 };
+	if (std::find(std::begin(high_profiles), std::end(high_profiles), profile_idc) != std::end(high_profiles))
+	{
+		chroma_format_idc_ = br.ue();
+		if (chroma_format_idc_ == 3)
+			br.u(1); // separate_colour_plane_flag
+		bit_depth_luma_ = br.ue() + 8;
+		bit_depth_chroma_ = br.ue() + 8;
+		br.u(1); // qpprime_y_zero_transform_bypass_flag
+		if (br.u(1)) // seq_scaling_matrix_present_flag
+		{
+			for (unsigned int i = 0; i < (chroma_format_idc_ != 3 ? 8u : 12u); i++)
+			{
+				if (!br.u(1))
+					continue;
+				int last_scale = 8, next_scale = 8;
+				for (unsigned int j = 0; j < (i < 6 ? 16u : 64u); j++)
+				{
+					if (next_scale)
+						next_scale = (last_scale + br.se() + 256) % 256;
+					last_scale = next_scale ? next_scale : last_scale;
+				}
+			}
+		}
+	}
+
+	br.ue(); // log2_max_frame_num_minus4
+	unsigned int poc_type = br.ue();
+	if (poc_type == 0)
+		br.ue(); // log2_max_pic_order_cnt_lsb_minus4
+	else if (poc_type == 1)
+	{
+		br.u(1);
+		br.se();
+		br.se();
+		for (unsigned int n = br.ue(); n; n--)
+			br.se();
+	}
+	br.ue(); // max_num_ref_frames
+	br.u(1); // gaps_in_frame_num_value_allowed_flag
+	unsigned int width_mbs = br.ue() + 1;
+	unsigned int height_map_units = br.ue() + 1;
+	unsigned int frame_mbs_only = br.u(1);
+	if (!frame_mbs_only)
+		br.u(1); // mb_adaptive_frame_field_flag
+	br.u(1); // direct_8x8_inference_flag
+
+	width_ = width_mbs * 16;
+	height_ = (2 - frame_mbs_only) * height_map_units * 16;
+	if (br.u(1)) // frame_cropping_flag
+	{
+		unsigned int crop_x = chroma_format_idc_ == 0 ? 1 : (chroma_format_idc_ == 3 ? 1 : 2);
+		unsigned int crop_y = (chroma_format_idc_ == 1 ? 2 : 1) * (2 - frame_mbs_only);
+		unsigned int left = br.ue(), right = br.ue(), top = br.ue(), bottom = br.ue();
+		width_ -= crop_x * (left + right);
+		height_ -= crop_y * (top + bottom);
+	}
+
+	LOG(2, "Mp4Muxer: SPS profile " << profile_idc << " size " << width_ << "x" << height_);
+}
+
+std::string Mp4Muxer::Codec() const
+{
+	char codec[16];
+	snprintf(codec, sizeof(codec), "avc1.%02x%02x%02x", sps_[1], sps_[2], sps_[3]);
+	return codec;
+}
+
+std::vector<uint8_t> Mp4Muxer::InitSegment() const
+{
+	if (!HaveHeaders())
+		throw std::runtime_error("Mp4Muxer: no SPS/PPS seen yet");
+
+	std::vector<uint8_t> out;
+	BoxWriter w(out);
+
+	w.begin("ftyp");
+	w.fourcc("iso6"); // major brand
+	w.u32(0);
+	for (char const *brand : { "iso6", "isom", "iso5", "avc1", "mp41" })
+		w.fourcc(brand);
+	w.end();
+
+	w.begin("moov");
+
+	w.beginFull("mvhd", 0, 0);
+	w.u32(0); // creation_time
+	w.u32(0); // modification_time
+	w.u32(1000); // timescale
+	w.u32(0); // duration, unknown as the samples are all in fragments
+	w.u32(0x10000); // rate
+	w.u16(0x100); // volume
+	w.zeros(10);
+	w.matrix();
+	w.zeros(24);
+	w.u32(2); // next_track_ID
+	w.end();
+
+	w.begin("trak");
+
+	w.beginFull("tkhd", 0, 3); // enabled, in movie
+	w.u32(0);
+	w.u32(0);
+	w.u32(1); // track_ID
+	w.u32(0);
+	w.u32(0); // duration
+	w.zeros(8);
+	w.u16(0); // layer
+	w.u16(0); // alternate_group
+	w.u16(0); // volume
+	w.u16(0);
+	w.matrix();
+	w.u32(width_ << 16);
+	w.u32(height_ << 16);
+	w.end();
+
+	w.begin("mdia");
+
+	w.beginFull("mdhd", 0, 0);
+	w.u32(0);
+	w.u32(0);
+	w.u32(TIMESCALE);
+	w.u32(0);
+	w.u16(0x55c4); // "und"
+	w.u16(0);
+	w.end();
+
+	w.beginFull("hdlr", 0, 0);
+	w.u32(0);
+	w.fourcc("vide");
+	w.zeros(12);
+	static const char handler_name[] = "VideoHandler";
+	w.bytes((uint8_t const *)handler_name, sizeof(handler_name));
+	w.end();
+
+	w.begin("minf");
+
+	w.beginFull("vmhd", 0, 1);
+	w.zeros(8); // graphicsmode, opcolor
+	w.end();
+
+	w.begin("dinf");
+	w.beginFull("dref", 0, 0);
+	w.u32(1);
+	w.beginFull("url ", 0, 1); // data is in this file
+	w.end();
+	w.end();
+	w.end();
+
+	w.begin("stbl");
+
+	w.beginFull("stsd", 0, 0);
+	w.u32(1);
+	w.begin("avc1");
+	w.zeros(6);
+	w.u16(1); // data_reference_index
+	w.zeros(16);
+	w.u16(width_);
+	w.u16(height_);
+	w.u32(0x480000); // 72 dpi
+	w.u32(0x480000);
+	w.u32(0);
+	w.u16(1); // frame_count
+	w.zeros(32); // compressorname
+	w.u16(0x18); // depth
+	w.u16(0xffff);
+
+	w.begin("avcC");
+	w.u8(1);
+	w.bytes(&sps_[1], 3); // profile, compatibility, level
+	w.u8(0xff); // 4-byte lengths
+	w.u8(0xe1); // 1 SPS
+	w.u16(sps_.size());
+	w.bytes(sps_.data(), sps_.size());
+	w.u8(1); // 1 PPS
+	w.u16(pps_.size());
+	w.bytes(pps_.data(), pps_.size());
+	if (sps_[1] != 66 && sps_[1] != 77 && sps_[1] != 88)
+	{
+		w.u8(0xfc | chroma_format_idc_);
+		w.u8(0xf8 | (bit_depth_luma_ - 8));
+		w.u8(0xf8 | (bit_depth_chroma_ - 8));
+		w.u8(0); // no SPS extensions
+	}
+	w.end();
+
+	w.end(); // avc1
+	w.end(); // stsd
+
+	// The sample tables are all empty.
+	for (char const *box : { "stts", "stsc", "stco" })
+	{
+		w.beginFull(box, 0, 0);
+		w.u32(0);
+		w.end();
+	}
+	w.beginFull("stsz", 0, 0);
+	w.u32(0);
+	w.u32(0);
+	w.end();
+
+	w.end(); // stbl
+	w.end(); // minf
+	w.end(); // mdia
+	w.end(); // trak
+
+	w.begin("mvex");
+	w.beginFull("trex", 0, 0);
+	w.u32(1); // track_ID
+	w.u32(1); // default_sample_description_index
+	w.u32(0);
+	w.u32(0);
+	w.u32(0);
+	w.end();
+	w.end();
+
+	w.end(); // moov
+	return out;
+}
+
+uint64_t Mp4Muxer::toTimescale(int64_t timestamp_us)
+{
+	if (first_timestamp_us_ < 0)
+		first_timestamp_us_ = timestamp_us;
+	return (uint64_t)(timestamp_us - first_timestamp_us_) * TIMESCALE / 1000000;
+}
+
+std::vector<uint8_t> Mp4Muxer::Fragment(std::vector<SamplePtr> const &samples, int64_t end_timestamp_us)
+{
+	std::vector<uint8_t> out;
+	BoxWriter w(out);
+	size_t mdat_size = 8;
+	for (auto const &sample : samples)
+		mdat_size += sample->size;
+
+	w.begin("moof");
+
+	w.beginFull("mfhd", 0, 0);
+	w.u32(++sequence_number_);
+	w.end();
+
+	w.begin("traf");
+
+	w.beginFull("tfhd", 0, 0x20000); // default-base-is-moof
+	w.u32(1);
+	w.end();
+
+	uint64_t base_time = toTimescale(samples[0]->timestamp_us);
+	w.beginFull("tfdt", 1, 0);
+	w.u64(base_time);
+	w.end();
+
+	// data-offset, sample-duration, sample-size and sample-flags present
+	w.beginFull("trun", 0, 0x000001 | 0x000100 | 0x000200 | 0x000400);
+	w.u32(samples.size());
+	size_t data_offset_pos = w.size();
+	w.u32(0);
+	uint64_t time = base_time;
+	for (unsigned int i = 0; i < samples.size(); i++)
+	{
+		// Durations are differences between rounded times, so they never drift.
+		int64_t next_us = i + 1 < samples.size() ? samples[i + 1]->timestamp_us : end_timestamp_us;
+		uint64_t next = next_us > samples[i]->timestamp_us ? toTimescale(next_us) : time + last_duration_;
+		last_duration_ = next - time;
+		w.u32(last_duration_);
+		w.u32(samples[i]->size);
+		// Keyframes depend on no other frames, everything else is a non-sync sample.
+		w.u32(samples[i]->keyframe ? 0x02000000 : 0x01010000);
+		time = next;
+	}
+	w.end(); // trun
+
+	w.end(); // traf
+	w.end(); // moof
+
+	size_t data_offset = out.size() + 8;
+	out[data_offset_pos] = data_offset >> 24, out[data_offset_pos + 1] = data_offset >> 16;
+	out[data_offset_pos + 2] = data_offset >> 8, out[data_offset_pos + 3] = data_offset;
+
+	w.u32(mdat_size);
+	w.fourcc("mdat");
+	return out;
+}
+
+void Mp4Muxer::AppendIovecs(std::vector<SamplePtr> const &samples, std::vector<iovec> &iov)
+{
+	for (auto const &sample : samples)
+	{
+		for (auto const &nal : sample->nals)
+			iov.push_back({ (void *)&sample->data[nal.first], nal.second });
+	}
+}
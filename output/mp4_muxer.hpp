@@ -0,0 +1,73 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * mp4_muxer.hpp - fragmented MP4 boxes for an H.264 stream.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Builds an initialisation segment (ftyp + moov, with no samples) and then a
+// moof + mdat fragment for each group of frames. Nothing ever needs rewriting
+// once it is written, so a file that gets cut short is still playable up to its
+// last complete fragment.
+
+class Mp4Muxer
+{
+public:
+	// One encoded frame, with the Annex B start codes turned into 4-byte lengths
+	// and any parameter sets taken out (they live in the avcC box instead).
+	struct Sample
+	{
+		std::vector<uint8_t> data;
+		std::vector<std::pair<size_t, size_t>> nals; // offset and size, including the length
+		size_t size;
+		int64_t timestamp_us;
+		bool keyframe;
+	};
+	typedef std::shared_ptr<Sample const> SamplePtr;
+
+	Mp4Muxer();
+
+	// Copies the frame into a new sample, picking up the SPS and PPS as they go past.
+	SamplePtr MakeSample(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe);
+
+	// Only possible once we have seen an SPS and PPS.
+	bool HaveHeaders() const { return !sps_.empty() && !pps_.empty(); }
+	unsigned int Width() const { return width_; }
+	unsigned int Height() const { return height_; }
+	std::string Codec() const; // as an RFC 6381 string, e.g. avc1.640028
+	std::vector<uint8_t> InitSegment() const;
+
+	// Returns the moof and mdat header for these samples. The sample data itself
+	// follows directly. The duration of the last sample is taken from end_timestamp_us.
+	std::vector<uint8_t> Fragment(std::vector<SamplePtr> const &samples, int64_t end_timestamp_us);
+
+	// The sample data in the order it goes in the mdat.
+	static void AppendIovecs(std::vector<SamplePtr> const &samples, std::vector<iovec> &iov);
+
+	static constexpr uint32_t TIMESCALE = 90000;
+
+private:
+	void parseSps();
+	uint64_t toTimescale(int64_t timestamp_us);
+
+	std::vector<uint8_t> sps_;
+	std::vector<uint8_t> pps_;
+	unsigned int width_;
+	unsigned int height_;
+	unsigned int chroma_format_idc_;
+	unsigned int bit_depth_luma_;
+	unsigned int bit_depth_chroma_;
+	uint32_t sequence_number_;
+	int64_t first_timestamp_us_;
+	uint64_t last_duration_;
+};
@@ -0,0 +1,313 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * mp4_output.cpp - write fragmented MP4 files or HLS segments.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "mp4_output.hpp"
+
+static constexpr unsigned int DEFAULT_HLS_SEGMENT_MS = 2000;
+
+static void write_all(int fd, std::vector<iovec> iov, std::string const &name)
+{
+	for (size_t i = 0; i < iov.size();)
+	{
+		ssize_t ret = writev(fd, &iov[i], std::min<size_t>(iov.size() - i, IOV_MAX));
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::runtime_error("failed to write " + name + ": " + strerror(errno));
+		}
+		size_t n = ret;
+		for (; i < iov.size() && n >= iov[i].iov_len; i++)
+			n -= iov[i].iov_len;
+		if (n)
+		{
+			iov[i].iov_base = (uint8_t *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+}
+
+Mp4Output::Mp4Output(VideoOptions const *options)
+	: Output(options), hls_(options->hls > 0), fd_(-1), fragment_duration_us_(0), frame_interval_us_(0),
+	  next_sequence_(0), target_duration_(0), abort_(false)
+{
+	if (options->codec != "h264")
+		throw std::runtime_error("fmp4 and hls output need the h264 codec");
+
+	if (!hls_)
+	{
+		if (options->output.empty())
+			throw std::runtime_error("fmp4 output needs an output file");
+		else if (options->output == "-")
+			fd_ = STDOUT_FILENO;
+		else
+		{
+			fd_ = open(options->output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd_ < 0)
+				throw std::runtime_error("failed to open output file " + options->output);
+		}
+	}
+	else
+	{
+		// In HLS mode the output is a directory, and is optional if we are serving over HTTP.
+		dir_ = options->output;
+		if (dir_.empty() && !options->hls_port)
+			throw std::runtime_error("hls output needs an output directory or an http port");
+		if (!dir_.empty() && mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST)
+			throw std::runtime_error("failed to create hls directory " + dir_);
+		fragment_duration_us_ = (options->segment ? options->segment : DEFAULT_HLS_SEGMENT_MS) * 1000ll;
+		if (options->hls_port)
+			http_server_ = std::make_unique<HttpServer>(
+				options->hls_port, [this](std::string const &path, HttpServer::Response &response) {
+					return serve(path, response);
+				});
+	}
+
+	writer_thread_ = std::thread(&Mp4Output::writerThread, this);
+}
+
+Mp4Output::~Mp4Output()
+{
+	http_server_.reset();
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+		cond_var_.notify_one();
+	}
+	writer_thread_.join();
+	if (fd_ >= 0 && fd_ != STDOUT_FILENO)
+		close(fd_);
+	if (error_)
+		LOG_ERROR("WARNING: Mp4Output closed with unreported errors");
+}
+
+void Mp4Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	LOG(2, "Mp4Output: output buffer " << mem << " size " << size);
+	// The encoder wants this buffer back as soon as we return, so this is the only copy.
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (error_)
+	{
+		std::exception_ptr e = error_;
+		error_ = nullptr;
+		std::rethrow_exception(e);
+	}
+	queue_.push_back(muxer_.MakeSample((uint8_t const *)mem, size, timestamp_us, flags & FLAG_KEYFRAME));
+	cond_var_.notify_one();
+}
+
+void Mp4Output::writerThread()
+{
+	try
+	{
+		while (true)
+		{
+			std::deque<Mp4Muxer::SamplePtr> samples;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				cond_var_.wait(lock, [this] { return abort_ || !queue_.empty(); });
+				if (queue_.empty())
+					break;
+				samples.swap(queue_);
+			}
+
+			for (auto &sample : samples)
+			{
+				// Fragments start on a keyframe. HLS segments must also reach the target duration.
+				if (!pending_.empty())
+				{
+					frame_interval_us_ = sample->timestamp_us - pending_.back()->timestamp_us;
+					if (sample->keyframe && sample->timestamp_us - pending_[0]->timestamp_us >= fragment_duration_us_)
+						flushFragment(sample->timestamp_us);
+				}
+				pending_.push_back(sample);
+			}
+		}
+
+		if (!pending_.empty())
+			flushFragment(pending_.back()->timestamp_us + frame_interval_us_);
+		if (hls_ && !dir_.empty() && next_sequence_)
+		{
+			std::string playlist = makePlaylist(true);
+			writeFile("index.m3u8", { { (void *)playlist.data(), playlist.size() } }, true);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: Mp4Output: " << e.what());
+		std::lock_guard<std::mutex> lock(mutex_);
+		error_ = std::current_exception();
+	}
+}
+
+void Mp4Output::flushFragment(int64_t end_timestamp_us)
+{
+	std::shared_ptr<Segment> segment = std::make_shared<Segment>();
+	segment->samples.swap(pending_);
+	segment->sequence = next_sequence_++;
+	segment->duration = (end_timestamp_us - segment->samples[0]->timestamp_us) / 1e6;
+
+	std::shared_ptr<std::vector<uint8_t> const> init_segment;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!init_segment_)
+		{
+			if (!muxer_.HaveHeaders())
+				throw std::runtime_error("no SPS/PPS found in the stream");
+			init_segment_ = init_segment = std::make_shared<std::vector<uint8_t> const>(muxer_.InitSegment());
+			LOG(1, "Mp4Output: " << muxer_.Width() << "x" << muxer_.Height() << " " << muxer_.Codec());
+		}
+		segment->header = muxer_.Fragment(segment->samples, end_timestamp_us);
+	}
+
+	if (init_segment)
+	{
+		std::vector<iovec> iov = { { (void *)init_segment->data(), init_segment->size() } };
+		if (!hls_)
+			write_all(fd_, iov, options_->output);
+		else if (!dir_.empty())
+			writeFile("init.mp4", iov, true);
+	}
+
+	if (hls_)
+		addSegment(segment);
+	else
+		writeFragment(segment);
+}
+
+void Mp4Output::writeFragment(std::shared_ptr<Segment> &segment)
+{
+	std::vector<iovec> iov = { { segment->header.data(), segment->header.size() } };
+	Mp4Muxer::AppendIovecs(segment->samples, iov);
+	write_all(fd_, iov, options_->output);
+	// Everything up to the end of this fragment survives a power cut.
+	if (fd_ != STDOUT_FILENO)
+		fdatasync(fd_);
+	LOG(2, "Mp4Output: wrote fragment " << segment->sequence << " of " << segment->samples.size() << " frames");
+}
+
+void Mp4Output::addSegment(std::shared_ptr<Segment> &segment)
+{
+	std::string name = "segment" + std::to_string(segment->sequence) + ".m4s";
+	if (!dir_.empty())
+	{
+		std::vector<iovec> iov = { { segment->header.data(), segment->header.size() } };
+		Mp4Muxer::AppendIovecs(segment->samples, iov);
+		writeFile(name, iov, false);
+	}
+
+	std::shared_ptr<std::string const> playlist;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		segments_.push_back(segment);
+		if (segments_.size() > options_->hls)
+			segments_.pop_front();
+		target_duration_ = std::max(target_duration_, std::ceil(segment->duration));
+		playlist_ = playlist = std::make_shared<std::string const>(makePlaylist(false));
+	}
+	LOG(2, "Mp4Output: added " << name << " duration " << segment->duration << "s");
+
+	if (!dir_.empty())
+	{
+		writeFile("index.m3u8", { { (void *)playlist->data(), playlist->size() } }, true);
+		// Leave the segment that just dropped out of the playlist for clients that are still
+		// fetching it, and remove the one before.
+		if (segment->sequence > options_->hls)
+			unlink((dir_ + "/segment" + std::to_string(segment->sequence - options_->hls - 1) + ".m4s").c_str());
+	}
+}
+
+std::string Mp4Output::makePlaylist(bool end) const
+{
+	std::ostringstream playlist;
+	playlist << "#EXTM3U\n"
+			 << "#EXT-X-VERSION:7\n"
+			 << "#EXT-X-TARGETDURATION:" << (unsigned int)target_duration_ << "\n"
+			 << "#EXT-X-MEDIA-SEQUENCE:" << (segments_.empty() ? 0 : segments_.front()->sequence) << "\n"
+			 << "#EXT-X-INDEPENDENT-SEGMENTS\n"
+			 << "#EXT-X-MAP:URI=\"init.mp4\"\n";
+	playlist.setf(std::ios::fixed);
+	playlist.precision(3);
+	for (auto const &segment : segments_)
+		playlist << "#EXTINF:" << segment->duration << ",\nsegment" << segment->sequence << ".m4s\n";
+	if (end)
+		playlist << "#EXT-X-ENDLIST\n";
+	return playlist.str();
+}
+
+void Mp4Output::writeFile(std::string const &name, std::vector<iovec> const &iov, bool atomic) const
+{
+	// Files that clients re-read get replaced atomically, so they never see half of one.
+	std::string path = dir_ + "/" + name;
+	std::string tmp = atomic ? path + ".tmp" : path;
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to open " + tmp);
+	try
+	{
+		write_all(fd, iov, tmp);
+	}
+	catch (std::exception const &)
+	{
+		close(fd);
+		throw;
+	}
+	close(fd);
+	if (atomic && rename(tmp.c_str(), path.c_str()) < 0)
+		throw std::runtime_error("failed to rename " + tmp);
+}
+
+bool Mp4Output::serve(std::string const &path, HttpServer::Response &response)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	unsigned int sequence;
+	int end = 0;
+	if (path == "/" || path == "/index.m3u8")
+	{
+		if (!playlist_)
+			return false;
+		response.content_type = "application/vnd.apple.mpegurl";
+		response.body.push_back({ (void *)playlist_->data(), playlist_->size() });
+		response.hold = playlist_;
+	}
+	else if (path == "/init.mp4")
+	{
+		if (!init_segment_)
+			return false;
+		response.content_type = "video/mp4";
+		response.body.push_back({ (void *)init_segment_->data(), init_segment_->size() });
+		response.hold = init_segment_;
+	}
+	else if (sscanf(path.c_str(), "/segment%u.m4s%n", &sequence, &end) == 1 && end == (int)path.size())
+	{
+		auto it = std::find_if(segments_.begin(), segments_.end(),
+							   [sequence](SegmentPtr const &s) { return s->sequence == sequence; });
+		if (it == segments_.end())
+			return false;
+		SegmentPtr const &segment = *it;
+		response.content_type = "video/iso.segment";
+		response.body.push_back({ (void *)segment->header.data(), segment->header.size() });
+		Mp4Muxer::AppendIovecs(segment->samples, response.body);
+		response.hold = segment;
+	}
+	else
+		return false;
+
+	return true;
+}
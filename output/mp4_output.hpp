@@ -0,0 +1,82 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * mp4_output.hpp - write fragmented MP4 files or HLS segments.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_server.hpp"
+#include "mp4_muxer.hpp"
+#include "output.hpp"
+
+// Each encoded frame is copied once into a reference counted sample, which is all
+// the encoder thread does. A writer thread groups the samples into fragments (one
+// per GOP) and writes them out with writev, straight from the sample memory.
+//
+// In HLS mode each segment is a single fragment, and the last few segments are kept
+// in memory. They are written to the output directory (if there is one) alongside
+// a playlist, and can also be served directly from memory over HTTP.
+
+class Mp4Output : public Output
+{
+public:
+	Mp4Output(VideoOptions const *options);
+	~Mp4Output();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Segment
+	{
+		unsigned int sequence;
+		double duration;
+		std::vector<uint8_t> header; // moof and mdat header
+		std::vector<Mp4Muxer::SamplePtr> samples;
+	};
+	typedef std::shared_ptr<Segment const> SegmentPtr;
+
+	void writerThread();
+	void flushFragment(int64_t end_timestamp_us);
+	void writeFragment(std::shared_ptr<Segment> &segment);
+	void addSegment(std::shared_ptr<Segment> &segment);
+	std::string makePlaylist(bool end) const;
+	void writeFile(std::string const &name, std::vector<iovec> const &iov, bool atomic) const;
+	bool serve(std::string const &path, HttpServer::Response &response);
+
+	Mp4Muxer muxer_;
+	bool hls_;
+	std::string dir_;
+	int fd_;
+	int64_t fragment_duration_us_;
+
+	// Only the writer thread touches these.
+	std::vector<Mp4Muxer::SamplePtr> pending_;
+	int64_t frame_interval_us_;
+	unsigned int next_sequence_;
+	double target_duration_;
+
+	// Protected by mutex_.
+	std::mutex mutex_;
+	std::condition_variable cond_var_;
+	std::deque<Mp4Muxer::SamplePtr> queue_;
+	bool abort_;
+	std::exception_ptr error_;
+	std::shared_ptr<std::vector<uint8_t> const> init_segment_;
+	std::deque<SegmentPtr> segments_;
+	std::shared_ptr<std::string const> playlist_;
+
+	std::thread writer_thread_;
+	std::unique_ptr<HttpServer> http_server_;
+};
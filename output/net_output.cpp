@@ -8,6 +8,11 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
+#include <chrono>
+#include <fstream>
+#include <random>
+#include <thread>
+
 #include "net_output.hpp"
 
 NetOutput::NetOutput(VideoOptions const *options) : Output(options)
@@ -18,7 +23,7 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 		throw std::runtime_error("bad network address " + options->output);
 	std::string address = options->output.substr(start, end - start);
 
-	if (strcmp(protocol, "udp") == 0)
+	if (strcmp(protocol, "udp") == 0 || strcmp(protocol, "rtp") == 0)
 	{
 		saddr_ = {};
 		saddr_.sin_family = AF_INET;
@@ -32,82 +37,199 @@ NetOutput::NetOutput(VideoOptions const *options) : Output(options)
 
 		saddr_ptr_ = (const sockaddr *)&saddr_; // sendto needs these for udp
 		sockaddr_in_size_ = sizeof(sockaddr_in);
+
+		if (strcmp(protocol, "rtp") == 0)
+		{
+			if (options->codec != "h264")
+				throw std::runtime_error("rtp output only supports h264");
+			// Leave room for the IP and UDP headers within the MTU.
+			if (options->mtu < 100)
+				throw std::runtime_error("mtu too small for rtp output");
+			rtp_ = std::make_unique<RtpPacketizer>(options->mtu - 28);
+			rtcp_saddr_ = saddr_;
+			rtcp_saddr_.sin_port = htons(port + 1);
+			rtp_timestamp_offset_ = std::random_device()();
+			// A framerate of 0 leaves the sensor free running, so we can only guess at the interval.
+			float framerate = options->framerate.value_or(DEFAULT_FRAMERATE);
+			if (!(framerate > 0))
+				framerate = DEFAULT_FRAMERATE;
+			frame_interval_ = std::chrono::microseconds((int64_t)(1e6 / framerate));
+			sensor_timestamp_us_ = -1;
+			// Sender reports need the sensor timestamps from the frames' metadata.
+			want_metadata_ = true;
+
+			if (!options->sdp.empty())
+			{
+				std::ofstream sdp(options->sdp);
+				sdp << "v=0\n"
+					<< "o=- " << rtp_->Ssrc() << " 0 IN IP4 " << address << "\n"
+					<< "s=rpicam-vid\n"
+					<< "c=IN IP4 " << address << "\n"
+					<< "t=0 0\n"
+					<< "m=video " << port << " RTP/AVP " << RtpPacketizer::PAYLOAD_TYPE << "\n"
+					<< "a=rtpmap:" << RtpPacketizer::PAYLOAD_TYPE << " H264/" << RtpPacketizer::CLOCK_RATE << "\n"
+					<< "a=fmtp:" << RtpPacketizer::PAYLOAD_TYPE << " packetization-mode=1\n";
+				if (!sdp)
+					throw std::runtime_error("failed to write SDP file " + options->sdp);
+			}
+		}
 	}
 	else if (strcmp(protocol, "tcp") == 0)
 	{
-		// WARNING: I've not actually tried this yet...
-		if (options->listen)
-		{
-			// We are the server.
-			int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
-			if (listen_fd < 0)
-				throw std::runtime_error("unable to open listen socket");
-
-			sockaddr_in server_saddr = {};
-			server_saddr.sin_family = AF_INET;
-			server_saddr.sin_addr.s_addr = INADDR_ANY;
-			server_saddr.sin_port = htons(port);
-
-			int enable = 1;
-			if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
-				throw std::runtime_error("failed to setsockopt listen socket");
-
-			if (bind(listen_fd, (struct sockaddr *)&server_saddr, sizeof(server_saddr)) < 0)
-				throw std::runtime_error("failed to bind listen socket");
-			listen(listen_fd, 1);
-
-			LOG(2, "Waiting for client to connect...");
-			fd_ = accept(listen_fd, (struct sockaddr *)&saddr_, &sockaddr_in_size_);
-			if (fd_ < 0)
-				throw std::runtime_error("accept socket failed");
-			LOG(2, "Client connection accepted");
-
-			close(listen_fd);
-		}
-		else
-		{
-			// We are a client.
-			saddr_ = {};
-			saddr_.sin_family = AF_INET;
-			saddr_.sin_port = htons(port);
-			if (inet_aton(address.c_str(), &saddr_.sin_addr) == 0)
-				throw std::runtime_error("inet_aton failed for " + address);
-
-			fd_ = socket(AF_INET, SOCK_STREAM, 0);
-			if (fd_ < 0)
-				throw std::runtime_error("unable to open client socket");
-
-			LOG(2, "Connecting to server...");
-			if (connect(fd_, (struct sockaddr *)&saddr_, sizeof(sockaddr_in)) < 0)
-				throw std::runtime_error("connect to server failed");
-			LOG(2, "Connected");
-		}
+		// We are a client. Listening for clients is done by the TcpServerOutput.
+		saddr_ = {};
+		saddr_.sin_family = AF_INET;
+		saddr_.sin_port = htons(port);
+		if (inet_aton(address.c_str(), &saddr_.sin_addr) == 0)
+			throw std::runtime_error("inet_aton failed for " + address);
+
+		fd_ = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd_ < 0)
+			throw std::runtime_error("unable to open client socket");
+
+		LOG(2, "Connecting to server...");
+		if (connect(fd_, (struct sockaddr *)&saddr_, sizeof(sockaddr_in)) < 0)
+			throw std::runtime_error("connect to server failed");
+		LOG(2, "Connected");
 
 		saddr_ptr_ = NULL; // sendto doesn't want these for tcp
 		sockaddr_in_size_ = 0;
 	}
 	else
 		throw std::runtime_error("unrecognised network protocol " + options->output);
+
+	if (options->adaptive_bitrate)
+		rate_controller_ = std::make_unique<RateController>(
+			options, fd_, [this](unsigned int bps) { return bitrate_callback_ && bitrate_callback_(bps); });
 }
 
 NetOutput::~NetOutput()
 {
+	if (rtp_)
+		sendRtcp(rtp_->Bye());
 	close(fd_);
 }
 
 // Maximum size that sendto will accept.
 constexpr size_t MAX_UDP_SIZE = 65507;
 
-void NetOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t /*flags*/)
+// RTP packets go out in batches of this many, which are spread over this fraction of the
+// frame interval. That leaves a little slack so that frames don't start to back up.
+constexpr unsigned int RTP_BATCH_SIZE = 16;
+constexpr double RTP_PACING_FRACTION = 0.8;
+constexpr std::chrono::seconds RTCP_INTERVAL(1);
+
+void NetOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t /*flags*/)
 {
 	LOG(2, "NetOutput: output buffer " << mem << " size " << size);
-	size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
-	for (uint8_t *ptr = (uint8_t *)mem; size;)
+	size_t frame_size = size;
+	bool dropped = false;
+	auto start_time = std::chrono::steady_clock::now();
+	std::chrono::microseconds send_time;
+	if (rtp_)
+		send_time = sendRtp((uint8_t *)mem, size, timestamp_us, dropped);
+	else
 	{
-		size_t bytes_to_send = std::min(size, max_size);
-		if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
-			throw std::runtime_error("failed to send data on socket");
-		ptr += bytes_to_send;
-		size -= bytes_to_send;
+		size_t max_size = saddr_ptr_ ? MAX_UDP_SIZE : size;
+		for (uint8_t *ptr = (uint8_t *)mem; size;)
+		{
+			size_t bytes_to_send = std::min(size, max_size);
+			if (sendto(fd_, ptr, bytes_to_send, 0, saddr_ptr_, sockaddr_in_size_) < 0)
+			{
+				// With rate control, a full interface queue is congestion to react to, not an error.
+				if (!rate_controller_ || errno != ENOBUFS)
+					throw std::runtime_error("failed to send data on socket");
+				dropped = true;
+			}
+			ptr += bytes_to_send;
+			size -= bytes_to_send;
+		}
+		send_time = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+																		   start_time);
 	}
+
+	if (rate_controller_)
+		rate_controller_->FrameSent(frame_size, send_time, dropped);
+}
+
+void NetOutput::metadataReady(FrameMetadata const &metadata)
+{
+	auto sensor_timestamp = metadata.controls.get(libcamera::controls::SensorTimestamp);
+	if (sensor_timestamp)
+		sensor_timestamp_us_ = *sensor_timestamp / 1000;
+}
+
+std::chrono::microseconds NetOutput::sendRtp(uint8_t const *mem, size_t size, int64_t timestamp_us, bool &dropped)
+{
+	uint32_t rtp_timestamp = rtp_timestamp_offset_ + timestamp_us * RtpPacketizer::CLOCK_RATE / 1000000;
+	std::vector<RtpPacketizer::Packet> const &packets = rtp_->Packetize(mem, size, rtp_timestamp);
+
+	// Spread the frame's packets out over the frame interval, rather than sending them in one
+	// burst that overflows a queue somewhere along the way.
+	unsigned int num_batches = (packets.size() + RTP_BATCH_SIZE - 1) / RTP_BATCH_SIZE;
+	auto batch_interval = std::chrono::duration<double, std::micro>(frame_interval_) * RTP_PACING_FRACTION /
+						  std::max(num_batches, 1u);
+	auto start_time = std::chrono::steady_clock::now();
+	std::chrono::microseconds send_time(0);
+	iovec iov[RTP_BATCH_SIZE][2];
+	mmsghdr msgs[RTP_BATCH_SIZE];
+	for (unsigned int i = 0, batch = 0; i < packets.size(); batch++)
+	{
+		if (batch)
+			std::this_thread::sleep_until(
+				start_time + std::chrono::duration_cast<std::chrono::steady_clock::duration>(batch * batch_interval));
+
+		unsigned int n = std::min<size_t>(RTP_BATCH_SIZE, packets.size() - i);
+		for (unsigned int j = 0; j < n; j++)
+		{
+			RtpPacketizer::Packet const &packet = packets[i + j];
+			iov[j][0] = { (void *)packet.head.data(), packet.head.size() };
+			iov[j][1] = { (void *)packet.payload, packet.payload_size };
+			msgs[j] = {};
+			msgs[j].msg_hdr.msg_name = (void *)saddr_ptr_;
+			msgs[j].msg_hdr.msg_namelen = sockaddr_in_size_;
+			msgs[j].msg_hdr.msg_iov = iov[j];
+			msgs[j].msg_hdr.msg_iovlen = packet.payload_size ? 2 : 1;
+		}
+
+		auto send_start = std::chrono::steady_clock::now();
+		for (unsigned int sent = 0; sent < n;)
+		{
+			int ret = sendmmsg(fd_, msgs + sent, n - sent, 0);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			else if (ret < 0)
+			{
+				// With rate control, a full interface queue is congestion to react to, not an error.
+				if (!rate_controller_ || errno != ENOBUFS)
+					throw std::runtime_error("failed to send data on socket");
+				dropped = true;
+				sent++;
+			}
+			else
+				sent += ret;
+		}
+		send_time +=
+			std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - send_start);
+		i += n;
+	}
+
+	// The sender report ties this frame's RTP timestamp to the wallclock time at which the
+	// sensor captured it.
+	auto now = std::chrono::steady_clock::now();
+	if (sensor_timestamp_us_ >= 0 && now - last_report_ >= RTCP_INTERVAL)
+	{
+		sendRtcp(rtp_->SenderReport(ntp_time(sensor_timestamp_us_), rtp_timestamp));
+		last_report_ = now;
+	}
+	sensor_timestamp_us_ = -1;
+
+	return send_time;
+}
+
+void NetOutput::sendRtcp(std::vector<uint8_t> const &packet)
+{
+	// Losing one of these doesn't matter, another will come along shortly.
+	if (sendto(fd_, packet.data(), packet.size(), 0, (const sockaddr *)&rtcp_saddr_, sizeof(rtcp_saddr_)) < 0)
+		LOG(1, "NetOutput: failed to send RTCP packet");
 }
@@ -9,7 +9,12 @@
 
 #include <netinet/in.h>
 
+#include <chrono>
+#include <memory>
+
 #include "output.hpp"
+#include "rate_controller.hpp"
+#include "rtp_packetizer.hpp"
 
 class NetOutput : public Output
 {
@@ -19,10 +24,23 @@ public:
 
 protected:
 	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void metadataReady(FrameMetadata const &metadata) override;
 
 private:
+	std::chrono::microseconds sendRtp(uint8_t const *mem, size_t size, int64_t timestamp_us, bool &dropped);
+	void sendRtcp(std::vector<uint8_t> const &packet);
+
 	int fd_;
 	sockaddr_in saddr_;
 	const sockaddr *saddr_ptr_;
 	socklen_t sockaddr_in_size_;
+	std::unique_ptr<RateController> rate_controller_;
+
+	// RTP mode. RTCP goes to the next port up, from the same socket.
+	std::unique_ptr<RtpPacketizer> rtp_;
+	sockaddr_in rtcp_saddr_;
+	uint32_t rtp_timestamp_offset_;
+	std::chrono::microseconds frame_interval_;
+	int64_t sensor_timestamp_us_;
+	std::chrono::steady_clock::time_point last_report_;
 };
@@ -6,16 +6,27 @@
  */
 
 #include <cinttypes>
+#include <ctime>
+#include <optional>
 #include <stdexcept>
 
 #include "circular_output.hpp"
+#include "container_output.hpp"
 #include "file_output.hpp"
+#include "http_output.hpp"
 #include "net_output.hpp"
+#include "rtsp_server_output.hpp"
+#include "tcp_server_output.hpp"
+#include "ts_output.hpp"
 #include "gstream_output.hpp"
+#include "metadata_writer.hpp"
+#include "mp4_output.hpp"
 #include "output.hpp"
 
 Output::Output(VideoOptions const *options)
-	: options_(options), fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), time_offset_(0), last_timestamp_(0),
+	: options_(options), want_metadata_(!options->metadata.empty()), want_post_process_metadata_(false),
+	  fp_timestamps_(nullptr), state_(WAITING_KEYFRAME), keyframe_requested_(false), keyframe_wanted_(false),
+	  time_offset_(0), last_timestamp_(0),
 	  buf_metadata_(std::cout.rdbuf()), of_metadata_()
 {
 	if (!options->save_pts.empty())
@@ -29,7 +40,9 @@ Output::Output(VideoOptions const *options)
 	{
 		const std::string &filename = options_->metadata;
 
-		if (filename.compare("-"))
+		if (options_->metadata_format == "bin")
+			metadata_writer_ = std::make_unique<MetadataWriter>(filename);
+		else if (filename.compare("-"))
 		{
 			of_metadata_.open(filename, std::ios::out);
 			buf_metadata_ = of_metadata_.rdbuf();
@@ -44,7 +57,7 @@ Output::~Output()
 {
 	if (fp_timestamps_)
 		fclose(fp_timestamps_);
-	if (!options_->metadata.empty())
+	if (!options_->metadata.empty() && !metadata_writer_)
 		stop_metadata_output(buf_metadata_, options_->metadata_format);
 }
 
@@ -65,6 +78,25 @@ void Output::Stop()
 
 void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
 {
+	// Outputs with their own threads can't call the encoder directly, as it may be stopped at
+	// any moment, but here we're on the encoder's own thread and it can't go away.
+	if (keyframe_wanted_.exchange(false) && keyframe_callback_)
+	{
+		LOG(2, "Output: requesting a keyframe");
+		keyframe_callback_();
+	}
+
+	// Find the metadata for this frame, discarding any left over from frames we never saw.
+	std::optional<FrameMetadata> metadata;
+	if (want_metadata_)
+	{
+		std::lock_guard<std::mutex> lock(metadata_mutex_);
+		auto it = metadata_map_.find(timestamp_us);
+		if (it != metadata_map_.end())
+			metadata = std::move(it->second);
+		metadata_map_.erase(metadata_map_.begin(), metadata_map_.upper_bound(timestamp_us));
+	}
+
 	// When output is enabled, we may have to wait for the next keyframe.
 	uint32_t flags = keyframe ? FLAG_KEYFRAME : FLAG_NONE;
 	if (!enable_)
@@ -72,15 +104,25 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 	else if (state_ == DISABLED)
 		state_ = WAITING_KEYFRAME;
 	if (state_ == WAITING_KEYFRAME && keyframe)
-		state_ = RUNNING, flags |= FLAG_RESTART;
+		state_ = RUNNING, flags |= FLAG_RESTART, keyframe_requested_ = false;
 	if (state_ != RUNNING)
+	{
+		// Rather than wait for the rest of the GOP when we're resumed, ask for a keyframe now.
+		if (state_ == WAITING_KEYFRAME && !keyframe_requested_)
+		{
+			requestKeyframe();
+			keyframe_requested_ = true;
+		}
 		return;
+	}
 
 	// Frig the timestamps to be continuous after a pause.
 	if (flags & FLAG_RESTART)
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
 
+	if (metadata)
+		metadataReady(*metadata);
 	outputBuffer(mem, size, last_timestamp_, flags);
 
 	// Save timestamps to a file, if that was requested.
@@ -89,13 +131,20 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		timestampReady(last_timestamp_);
 	}
 
-	if (!options_->metadata.empty())
+	if (metadata && metadata_writer_)
+		metadata_writer_->Write(last_timestamp_, metadata->sequence, metadata->controls);
+	else if (metadata && !options_->metadata.empty())
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
-		write_metadata(buf_metadata_, options_->metadata_format, metadata, !metadata_started_);
+		write_metadata(buf_metadata_, options_->metadata_format, metadata->controls, !metadata_started_);
 		metadata_started_ = true;
-		metadata_queue_.pop();
 	}
+	else if (want_metadata_ && !metadata)
+		LOG(1, "Output: no metadata for frame at " << timestamp_us << "us");
+}
+
+void Output::requestKeyframe()
+{
+	keyframe_wanted_ = true;
 }
 
 void Output::timestampReady(int64_t timestamp)
@@ -112,10 +161,33 @@ void Output::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t
 
 Output *Output::Create(VideoOptions const *options)
 {
+	if ((options->fmp4 || options->hls) && options->codec == "h264" && options->GetPlatform() != Platform::VC4)
+		throw std::runtime_error("fmp4/hls output needs the VC4 h264 encoder, use libav with an mp4 or hls format");
+	if (options->mpegts && options->codec == "h264" && options->GetPlatform() != Platform::VC4)
+		throw std::runtime_error("mpegts output needs the VC4 h264 encoder, use libav with the mpegts format");
 	if (options->codec == "libav" || (options->codec == "h264" && options->GetPlatform() != Platform::VC4))
 		return new Output(options);
 
-	if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0)
+	if (options->fmp4 || options->hls)
+		return new Mp4Output(options);
+	if (options->mpegts)
+		return new TsOutput(options);
+
+	if (options->container)
+	{
+		if (options->codec != "yuv420")
+			throw std::runtime_error("container files and compression only apply to yuv420 and raw recordings");
+		return new ContainerOutput(options);
+	}
+
+	if (strncmp(options->output.c_str(), "rtsp://", 7) == 0)
+		return new RtspServerOutput(options);
+	else if (strncmp(options->output.c_str(), "http://", 7) == 0)
+		return new HttpOutput(options);
+	else if (strncmp(options->output.c_str(), "tcp://", 6) == 0 && options->listen)
+		return new TcpServerOutput(options);
+	else if (strncmp(options->output.c_str(), "udp://", 6) == 0 || strncmp(options->output.c_str(), "tcp://", 6) == 0 ||
+		strncmp(options->output.c_str(), "rtp://", 6) == 0)
 		return new NetOutput(options);
     else if(strncmp(options->output.c_str(), "appsrc name=appsrc !", 20) == 0)
         return new GStreamOutput(options);
@@ -127,12 +199,32 @@ Output *Output::Create(VideoOptions const *options)
 		return new Output(options);
 }
 
-void Output::MetadataReady(libcamera::ControlList &metadata)
+void Output::MetadataReady(int64_t timestamp_us, unsigned int sequence, libcamera::ControlList &metadata,
+						   Metadata const &post_process)
 {
-	if (options_->metadata.empty())
+	if (!want_metadata_)
 		return;
 
-	metadata_queue_.push(metadata);
+	std::lock_guard<std::mutex> lock(metadata_mutex_);
+	metadata_map_.emplace(timestamp_us,
+						  FrameMetadata { sequence, metadata, want_post_process_metadata_ ? post_process : Metadata() });
+}
+
+std::string output_filename(VideoOptions const *options, unsigned int count)
+{
+	char filename[256];
+	int n;
+	if (options->file_out_date)
+	{
+		std::time_t raw_time;
+		std::time(&raw_time);
+		n = std::strftime(filename, sizeof(filename), options->output.c_str(), std::localtime(&raw_time));
+	}
+	else
+		n = snprintf(filename, sizeof(filename), options->output.c_str(), count);
+	if (n < 0)
+		throw std::runtime_error("failed to generate filename");
+	return filename;
 }
 
 void start_metadata_output(std::streambuf *buf, std::string fmt)
@@ -142,7 +234,7 @@ void start_metadata_output(std::streambuf *buf, std::string fmt)
 		out << "[" << std::endl;
 }
 
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write)
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList const &metadata, bool first_write)
 {
 	std::ostream out(buf);
 	const libcamera::ControlIdMap *id_map = metadata.idMap();
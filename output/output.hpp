@@ -10,9 +10,25 @@
 #include <cstdio>
 
 #include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 
+#include "core/metadata.hpp"
+#include "core/stream_info.hpp"
 #include "core/video_options.hpp"
 
+// What the camera told us about a frame, handed to the output along with the encoded data.
+struct FrameMetadata
+{
+	unsigned int sequence;
+	libcamera::ControlList controls;
+	Metadata post_process; // anything the post-processing stages have added, if want_post_process_metadata_
+};
+
+class MetadataWriter;
+
 class Output
 {
 public:
@@ -23,8 +39,22 @@ public:
 	virtual void Signal(); // a derived class might redefine what this means
     virtual void Start(); // a derived class might redefine what this means
     virtual void Stop(); // a derived class might redefine what this means
+	virtual void Trigger() {} // ask for an event to be recorded, if the output can do this
 	void OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe);
-	void MetadataReady(libcamera::ControlList &metadata);
+	void MetadataReady(int64_t timestamp_us, unsigned int sequence, libcamera::ControlList &metadata,
+					   Metadata const &post_process);
+	// Describes the stream being recorded, for outputs that save this in the file. This must
+	// be called before the first frame arrives.
+	virtual void SetStreamInfo(StreamInfo const &info, std::string const &camera, std::string const &sensor_mode) {}
+	// Lets an output change the encoder bitrate, for example to avoid network congestion.
+	typedef std::function<bool(unsigned int bps)> BitrateCallback;
+	void SetBitrateCallback(BitrateCallback callback) { bitrate_callback_ = callback; }
+	// Lets an output ask the encoder for a keyframe, for example when a new client connects.
+	typedef std::function<void()> KeyframeCallback;
+	void SetKeyframeCallback(KeyframeCallback callback) { keyframe_callback_ = callback; }
+	// Lets an output keep an encoded buffer after outputBuffer returns, instead of copying it.
+	typedef std::function<std::function<void()>()> HoldCallback;
+	void SetHoldCallback(HoldCallback callback) { hold_callback_ = callback; }
 
 protected:
 	enum Flag
@@ -35,8 +65,21 @@ protected:
 	};
 	virtual void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags);
 	virtual void timestampReady(int64_t timestamp);
+	// Called with the metadata of each frame just before outputBuffer, if want_metadata_ is set.
+	virtual void metadataReady(FrameMetadata const &metadata) {}
 	VideoOptions const *options_;
+	bool want_metadata_;
+	// The post-processing metadata can be large, so it's only kept for outputs that set this too.
+	bool want_post_process_metadata_;
 	FILE *fp_timestamps_;
+	BitrateCallback bitrate_callback_;
+	KeyframeCallback keyframe_callback_;
+	HoldCallback hold_callback_;
+	// Safe from any thread. The request reaches the encoder with the next frame.
+	void requestKeyframe();
+	// Only from within outputBuffer. Returns the function that gives the buffer back, or an
+	// empty one if it can't be kept.
+	std::function<void()> holdBuffer() { return hold_callback_ ? hold_callback_() : nullptr; }
 
 private:
 	enum State
@@ -46,15 +89,22 @@ private:
 		RUNNING = 2
 	};
 	State state_;
+	bool keyframe_requested_;
+	std::atomic<bool> keyframe_wanted_;
 	std::atomic<bool> enable_;
 	int64_t time_offset_;
 	int64_t last_timestamp_;
 	std::streambuf *buf_metadata_;
 	std::ofstream of_metadata_;
+	std::unique_ptr<MetadataWriter> metadata_writer_; // for the bin format
 	bool metadata_started_ = false;
-	std::queue<libcamera::ControlList> metadata_queue_;
+	std::mutex metadata_mutex_;
+	std::map<int64_t, FrameMetadata> metadata_map_;
 };
 
+// The name of the count'th output file, from the output option as a printf or strftime pattern.
+std::string output_filename(VideoOptions const *options, unsigned int count);
+
 void start_metadata_output(std::streambuf *buf, std::string fmt);
-void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList &metadata, bool first_write);
+void write_metadata(std::streambuf *buf, std::string fmt, libcamera::ControlList const &metadata, bool first_write);
 void stop_metadata_output(std::streambuf *buf, std::string fmt);
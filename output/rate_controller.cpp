@@ -0,0 +1,151 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rate_controller.cpp - adapt the encoder bitrate to network congestion.
+ */
+
+#include <linux/sockios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "rate_controller.hpp"
+
+using namespace std::chrono_literals;
+
+// How often we look at the measurements and maybe change the bitrate.
+static constexpr std::chrono::milliseconds INTERVAL = 250ms;
+// Fractions of the socket send buffer.
+static constexpr double QUEUE_HIGH = 0.5;
+static constexpr double QUEUE_LOW = 0.1;
+// Fraction of the interval spent blocked in send calls that counts as congestion.
+static constexpr double BLOCKED_HIGH = 0.5;
+static constexpr double DECREASE_FACTOR = 0.7;
+static constexpr unsigned int INCREASE_STEPS = 20; // steps from floor to ceiling
+static constexpr std::chrono::milliseconds INCREASE_HOLD = 2000ms;
+static constexpr double PACING_HEADROOM = 1.5;
+
+RateController::RateController(VideoOptions const *options, int fd, SetBitrateFunction set_bitrate)
+	: fd_(fd), set_bitrate_(set_bitrate), enabled_(true), started_(false), fp_trace_(nullptr), bytes_(0), max_queued_(0),
+	  send_time_(0), drops_(0)
+{
+	ceiling_ = options->bitrate_max ? options->bitrate_max.bps() : options->bitrate.bps();
+	if (!ceiling_)
+		throw std::runtime_error("adaptive bitrate needs --bitrate or --bitrate-max");
+	floor_ = options->bitrate_min ? options->bitrate_min.bps() : ceiling_ / 10;
+	if (floor_ > ceiling_)
+		throw std::runtime_error("adaptive bitrate floor is above the ceiling");
+	bitrate_ = options->bitrate ? std::clamp<unsigned int>(options->bitrate.bps(), floor_, ceiling_) : ceiling_;
+
+	socklen_t len = sizeof(sndbuf_);
+	if (getsockopt(fd_, SOL_SOCKET, SO_SNDBUF, &sndbuf_, &len) < 0 || sndbuf_ <= 0)
+		throw std::runtime_error("failed to read socket send buffer size");
+
+	if (!options->bitrate_trace.empty())
+	{
+		fp_trace_ = fopen(options->bitrate_trace.c_str(), "w");
+		if (!fp_trace_)
+			throw std::runtime_error("failed to open bitrate trace file " + options->bitrate_trace);
+		fprintf(fp_trace_, "# time_ms queue_bytes queue_pct send_pct drops throughput_kbps bitrate_kbps decision\n");
+	}
+
+	start_ = interval_start_ = last_decrease_ = std::chrono::steady_clock::now();
+	LOG(1, "RateController: bitrate " << bitrate_ / 1000 << "kbps, range " << floor_ / 1000 << " to "
+									  << ceiling_ / 1000 << "kbps, send buffer " << sndbuf_ << " bytes");
+}
+
+RateController::~RateController()
+{
+	if (fp_trace_)
+		fclose(fp_trace_);
+}
+
+void RateController::FrameSent(size_t bytes, std::chrono::microseconds send_time, bool dropped)
+{
+	if (!enabled_)
+		return;
+
+	// The encoder doesn't exist until after the outputs, so set the starting bitrate now.
+	if (!started_)
+	{
+		started_ = true;
+		setBitrate(bitrate_, "start");
+		if (!enabled_)
+			return;
+	}
+
+	int queued = 0;
+	if (ioctl(fd_, SIOCOUTQ, &queued) == 0)
+		max_queued_ = std::max(max_queued_, queued);
+	bytes_ += bytes;
+	send_time_ += send_time;
+	drops_ += dropped;
+
+	auto now = std::chrono::steady_clock::now();
+	if (now - interval_start_ >= INTERVAL)
+		update(now);
+}
+
+void RateController::update(std::chrono::steady_clock::time_point now)
+{
+	std::chrono::duration<double> interval = now - interval_start_;
+	double queue_fraction = (double)max_queued_ / sndbuf_;
+	double blocked_fraction = send_time_.count() / (interval.count() * 1e6);
+	unsigned int throughput = bytes_ * 8 / interval.count();
+
+	unsigned int bitrate = bitrate_;
+	char const *decision = "hold";
+	if (drops_ || queue_fraction > QUEUE_HIGH || blocked_fraction > BLOCKED_HIGH)
+	{
+		// Congested. Never go above what actually got through, though.
+		bitrate = std::min<unsigned int>(bitrate_ * DECREASE_FACTOR, std::max(throughput, floor_));
+		decision = drops_ ? "decrease (drops)" : queue_fraction > QUEUE_HIGH ? "decrease (queue)" : "decrease (blocked)";
+		last_decrease_ = now;
+	}
+	else if (queue_fraction < QUEUE_LOW && now - last_decrease_ >= INCREASE_HOLD)
+	{
+		bitrate = bitrate_ + std::max(1u, (ceiling_ - floor_) / INCREASE_STEPS);
+		decision = "increase";
+	}
+	bitrate = std::clamp(bitrate, floor_, ceiling_);
+
+	if (fp_trace_)
+	{
+		int64_t time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - start_).count();
+		fprintf(fp_trace_, "%" PRId64 " %d %.1f %.1f %u %u %u %s\n", time_ms, max_queued_, queue_fraction * 100,
+				blocked_fraction * 100, drops_, throughput / 1000, bitrate / 1000,
+				bitrate == bitrate_ ? "hold" : decision);
+		fflush(fp_trace_);
+	}
+
+	if (bitrate != bitrate_)
+		setBitrate(bitrate, decision);
+
+	interval_start_ = now;
+	bytes_ = 0;
+	max_queued_ = 0;
+	send_time_ = 0us;
+	drops_ = 0;
+}
+
+void RateController::setBitrate(unsigned int bps, char const *reason)
+{
+	if (!set_bitrate_ || !set_bitrate_(bps))
+	{
+		LOG_ERROR("WARNING: encoder cannot change bitrate, adaptive bitrate disabled");
+		enabled_ = false;
+		return;
+	}
+	LOG(2, "RateController: " << reason << " bitrate " << bitrate_ / 1000 << " -> " << bps / 1000 << "kbps");
+	bitrate_ = bps;
+
+	// Pacing only takes effect with the fq qdisc (and always for TCP), so failure is harmless.
+	unsigned int pacing_rate = bps / 8 * PACING_HEADROOM;
+	if (setsockopt(fd_, SOL_SOCKET, SO_MAX_PACING_RATE, &pacing_rate, sizeof(pacing_rate)) < 0)
+		LOG(2, "RateController: unable to set socket pacing rate");
+}
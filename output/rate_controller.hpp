@@ -0,0 +1,58 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rate_controller.hpp - adapt the encoder bitrate to network congestion.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+
+#include "core/video_options.hpp"
+
+// Watches how full the socket's send queue gets (SIOCOUTQ), and how long we spend
+// blocked sending, and adjusts the encoder bitrate between a floor and a ceiling.
+// Congestion cuts the bitrate multiplicatively straight away; once the queue has
+// stayed nearly empty for a while, the bitrate creeps back up. The socket is also
+// paced at a little above the current bitrate, so that each frame goes out spread
+// across the frame interval rather than in a single burst.
+
+class RateController
+{
+public:
+	// Sets the encoder bitrate, returning false if the encoder can't change it.
+	typedef std::function<bool(unsigned int bps)> SetBitrateFunction;
+
+	RateController(VideoOptions const *options, int fd, SetBitrateFunction set_bitrate);
+	~RateController();
+
+	// Report a frame sent on the socket, how long the send took, and whether any of it
+	// was dropped by the kernel.
+	void FrameSent(size_t bytes, std::chrono::microseconds send_time, bool dropped);
+
+private:
+	void update(std::chrono::steady_clock::time_point now);
+	void setBitrate(unsigned int bps, char const *reason);
+
+	int fd_;
+	SetBitrateFunction set_bitrate_;
+	bool enabled_;
+	bool started_;
+	unsigned int floor_;
+	unsigned int ceiling_;
+	unsigned int bitrate_;
+	int sndbuf_;
+	FILE *fp_trace_;
+	std::chrono::steady_clock::time_point start_;
+	std::chrono::steady_clock::time_point interval_start_;
+	std::chrono::steady_clock::time_point last_decrease_;
+
+	// Measurements over the current interval.
+	size_t bytes_;
+	int max_queued_;
+	std::chrono::microseconds send_time_;
+	unsigned int drops_;
+};
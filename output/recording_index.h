@@ -0,0 +1,174 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * recording_index.h - keyframe index files, and finding time ranges in recordings with them.
+ */
+
+#pragma once
+
+/* For O_CLOEXEC in strict ISO C. Include this header before any system headers. */
+#if !defined(_POSIX_C_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * With --index, each output file gets an index file alongside it, with RECORDING_INDEX_SUFFIX
+ * added to its name. An index file is:
+ *
+ *   recording_index_header
+ *   recording_index_entry             } once per keyframe
+ *
+ * Each entry gives the byte offset of a keyframe in the recording, its timestamp (as in
+ * the timestamp file, so in microseconds from the start of the whole recording, even in
+ * later segments), and its frame number within the file. All fields are little endian.
+ *
+ * Entries are appended as the keyframes are written, so an index file is always usable,
+ * even if the recording never finished. After a crash the index may have a partial or
+ * zeroed entry at the end, or run ahead of the data that made it to the disk, so readers
+ * must stop at the first entry whose check doesn't match, or which points beyond the data.
+ */
+
+#define RECORDING_INDEX_MAGIC "RPICAMX\0"
+#define RECORDING_INDEX_VERSION 1
+#define RECORDING_INDEX_SUFFIX ".idx"
+
+struct recording_index_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t entry_size;
+	uint32_t reserved;
+};
+
+struct recording_index_entry
+{
+	uint64_t offset;
+	int64_t timestamp_us;
+	uint32_t frame;
+	uint32_t check; /* from recording_index_check */
+};
+
+/* FNV-1a of the rest of the entry, which is never zero so that zeroed entries never pass. */
+static inline uint32_t recording_index_check(struct recording_index_entry const *entry)
+{
+	uint8_t const *bytes = (uint8_t const *)entry;
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < offsetof(struct recording_index_entry, check); i++)
+		hash = (hash ^ bytes[i]) * 16777619u;
+	return hash ? hash : 1;
+}
+
+/* A recording and its index, both mapped into memory. */
+struct recording
+{
+	uint8_t const *data;
+	size_t size;
+	struct recording_index_entry const *entries;
+	size_t num_entries; /* only those that are valid */
+	void *index_map;
+	size_t index_map_size;
+};
+
+static inline void *recording_map_file_(char const *filename, size_t *size)
+{
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size > 0)
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return map;
+}
+
+static inline void recording_close(struct recording *r)
+{
+	if (r->data)
+		munmap((void *)r->data, r->size);
+	if (r->index_map)
+		munmap(r->index_map, r->index_map_size);
+	memset(r, 0, sizeof(*r));
+}
+
+/* Map a recording, and the index that goes with it if index_filename is NULL. Returns 0, or -1 on failure. */
+static inline int recording_open(struct recording *r, char const *filename, char const *index_filename)
+{
+	memset(r, 0, sizeof(*r));
+	char default_index[4096];
+	if (!index_filename)
+	{
+		if (snprintf(default_index, sizeof(default_index), "%s%s", filename, RECORDING_INDEX_SUFFIX) >=
+			(int)sizeof(default_index))
+			return -1;
+		index_filename = default_index;
+	}
+
+	r->data = (uint8_t const *)recording_map_file_(filename, &r->size);
+	r->index_map = recording_map_file_(index_filename, &r->index_map_size);
+	struct recording_index_header const *header = (struct recording_index_header const *)r->index_map;
+	if (!r->data || !r->index_map || r->index_map_size < sizeof(*header) ||
+		memcmp(header->magic, RECORDING_INDEX_MAGIC, sizeof(header->magic)) ||
+		header->version != RECORDING_INDEX_VERSION || header->entry_size != sizeof(struct recording_index_entry) ||
+		header->header_size > r->index_map_size)
+	{
+		recording_close(r);
+		return -1;
+	}
+
+	r->entries = (struct recording_index_entry const *)((uint8_t const *)r->index_map + header->header_size);
+	size_t max_entries = (r->index_map_size - header->header_size) / sizeof(struct recording_index_entry);
+	for (; r->num_entries < max_entries; r->num_entries++)
+	{
+		struct recording_index_entry const *entry = &r->entries[r->num_entries];
+		if (entry->check != recording_index_check(entry) || entry->offset >= r->size ||
+			(r->num_entries && entry->offset <= entry[-1].offset))
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Find the part of the recording that covers the times from start_us to end_us. It starts at
+ * the last keyframe at or before start_us, so that it can be decoded, and ends just before the
+ * first keyframe after end_us, or at the end of the recording. Returns the index of the first
+ * entry, or -1 if the recording has nothing in that range.
+ */
+static inline long recording_find_range(struct recording const *r, int64_t start_us, int64_t end_us, size_t *offset,
+										size_t *size)
+{
+	if (!r->num_entries || end_us < r->entries[0].timestamp_us || end_us < start_us)
+		return -1;
+
+	/* Entries are in timestamp order, so binary search for the last one not after start_us. */
+	size_t lo = 0, hi = r->num_entries;
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		if (r->entries[mid].timestamp_us <= start_us)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	size_t last = lo;
+	while (last + 1 < r->num_entries && r->entries[last + 1].timestamp_us <= end_us)
+		last++;
+
+	*offset = r->entries[lo].offset;
+	*size = (last + 1 < r->num_entries ? r->entries[last + 1].offset : r->size) - *offset;
+	return lo;
+}
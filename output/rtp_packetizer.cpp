@@ -0,0 +1,248 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rtp_packetizer.cpp - split H.264 frames into RTP packets.
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+
+#include "rtp_packetizer.hpp"
+
+static constexpr size_t RTP_HEADER_SIZE = 12;
+static constexpr uint8_t NAL_STAP_A = 24;
+static constexpr uint8_t NAL_FU_A = 28;
+static constexpr uint8_t RTCP_SR = 200;
+static constexpr uint8_t RTCP_RR = 201;
+static constexpr uint8_t RTCP_SDES = 202;
+static constexpr uint8_t RTCP_BYE = 203;
+
+static void put16(std::vector<uint8_t> &buf, uint16_t value)
+{
+	buf.push_back(value >> 8);
+	buf.push_back(value);
+}
+
+static void put32(std::vector<uint8_t> &buf, uint32_t value)
+{
+	put16(buf, value >> 16);
+	put16(buf, value);
+}
+
+void find_nal_units(uint8_t const *data, size_t size, NalUnits &nals)
+{
+	nals.clear();
+	uint8_t const *end = data + size, *nal = nullptr;
+	for (uint8_t const *p = data; p + 3 <= end;)
+	{
+		if (p[2] > 1)
+			p += 3;
+		else if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+		{
+			if (nal)
+				nals.emplace_back(nal, p - nal);
+			nal = p + 3;
+			p += 3;
+		}
+		else
+			p++;
+	}
+	if (nal)
+		nals.emplace_back(nal, end - nal);
+
+	// Trailing zeros belong to the next start code (or are just padding), not to the NAL.
+	for (auto &[ptr, len] : nals)
+	{
+		while (len && ptr[len - 1] == 0)
+			len--;
+	}
+	nals.erase(std::remove_if(nals.begin(), nals.end(), [](auto const &n) { return n.second == 0; }), nals.end());
+}
+
+int64_t wallclock_us(int64_t sensor_timestamp_us)
+{
+	// Sensor timestamps come from the monotonic clock, so work out how long ago this one was.
+	timespec mono, real;
+	clock_gettime(CLOCK_MONOTONIC, &mono);
+	clock_gettime(CLOCK_REALTIME, &real);
+	int64_t age_us = mono.tv_sec * 1000000LL + mono.tv_nsec / 1000 - sensor_timestamp_us;
+	return real.tv_sec * 1000000LL + real.tv_nsec / 1000 - age_us;
+}
+
+uint64_t ntp_time(int64_t sensor_timestamp_us)
+{
+	int64_t time_us = wallclock_us(sensor_timestamp_us);
+	// NTP time counts from 1900, rather than 1970, with 32 bits of fractional seconds.
+	constexpr uint64_t NTP_UNIX_OFFSET = 2208988800u;
+	return ((time_us / 1000000 + NTP_UNIX_OFFSET) << 32) + ((uint64_t)(time_us % 1000000) << 32) / 1000000;
+}
+
+RtpPacketizer::RtpPacketizer(size_t max_packet_size) : packet_count_(0), octet_count_(0)
+{
+	// FU-A fragments need the payload to hold at least their 2 header bytes and a byte of data.
+	if (max_packet_size < RTP_HEADER_SIZE + 3)
+		throw std::runtime_error("RTP packet size too small");
+	max_payload_size_ = max_packet_size - RTP_HEADER_SIZE;
+
+	// The SSRC and starting sequence number should be random (RFC 3550).
+	std::random_device rd;
+	ssrc_ = rd();
+	sequence_ = rd();
+
+	char hostname[64] = {};
+	gethostname(hostname, sizeof(hostname) - 1);
+	cname_ = std::string("rpicam@") + hostname;
+}
+
+std::vector<RtpPacketizer::Packet> const &RtpPacketizer::Packetize(uint8_t const *data, size_t size,
+																   uint32_t timestamp)
+{
+	packets_.clear();
+	find_nal_units(data, size, nals_);
+
+	for (auto it = nals_.begin(); it != nals_.end();)
+	{
+		if (it->second > max_payload_size_)
+		{
+			addFragments(it->first, it->second, timestamp);
+			it++;
+			continue;
+		}
+
+		// Gather as many following NAL units as will fit in one STAP-A packet.
+		auto last = it;
+		size_t stap_size = 1;
+		while (last != nals_.end() && stap_size + 2 + last->second <= max_payload_size_)
+			stap_size += 2 + (last++)->second;
+
+		if (last - it <= 1)
+		{
+			addSingle(it->first, it->second, timestamp);
+			it++;
+		}
+		else
+		{
+			addAggregate(it, last, timestamp);
+			it = last;
+		}
+	}
+
+	if (!packets_.empty())
+		packets_.back().head[1] |= 0x80; // marker bit on the last packet of the frame
+	for (auto const &packet : packets_)
+		octet_count_ += packet.Size() - RTP_HEADER_SIZE;
+	packet_count_ += packets_.size();
+
+	return packets_;
+}
+
+RtpPacketizer::Packet &RtpPacketizer::newPacket(uint32_t timestamp)
+{
+	Packet &packet = packets_.emplace_back();
+	packet.head.reserve(RTP_HEADER_SIZE + 2);
+	packet.head.push_back(0x80); // version 2, no padding, no extension, no CSRCs
+	packet.head.push_back(PAYLOAD_TYPE);
+	put16(packet.head, sequence_++);
+	put32(packet.head, timestamp);
+	put32(packet.head, ssrc_);
+	packet.payload = nullptr;
+	packet.payload_size = 0;
+	return packet;
+}
+
+void RtpPacketizer::addSingle(uint8_t const *nal, size_t size, uint32_t timestamp)
+{
+	Packet &packet = newPacket(timestamp);
+	packet.payload = nal;
+	packet.payload_size = size;
+}
+
+void RtpPacketizer::addAggregate(NalUnits::const_iterator begin, NalUnits::const_iterator end, uint32_t timestamp)
+{
+	// The STAP-A header gets the F bit if any NAL unit has it, and the highest NRI of them all.
+	uint8_t f = 0, nri = 0;
+	for (auto it = begin; it != end; it++)
+	{
+		f |= it->first[0] & 0x80;
+		nri = std::max<uint8_t>(nri, it->first[0] & 0x60);
+	}
+
+	// These NAL units are small, so just copy them in.
+	Packet &packet = newPacket(timestamp);
+	packet.head.push_back(f | nri | NAL_STAP_A);
+	for (auto it = begin; it != end; it++)
+	{
+		put16(packet.head, it->second);
+		packet.head.insert(packet.head.end(), it->first, it->first + it->second);
+	}
+}
+
+void RtpPacketizer::addFragments(uint8_t const *nal, size_t size, uint32_t timestamp)
+{
+	// The NAL header is replaced by the FU indicator and FU header in every fragment.
+	uint8_t indicator = (nal[0] & 0xe0) | NAL_FU_A;
+	uint8_t type = nal[0] & 0x1f;
+	size_t fragment_size = max_payload_size_ - 2;
+	for (size_t offset = 1; offset < size; offset += fragment_size)
+	{
+		Packet &packet = newPacket(timestamp);
+		packet.payload = nal + offset;
+		packet.payload_size = std::min(fragment_size, size - offset);
+		uint8_t start = offset == 1 ? 0x80 : 0;
+		uint8_t end = offset + packet.payload_size == size ? 0x40 : 0;
+		packet.head.push_back(indicator);
+		packet.head.push_back(start | end | type);
+	}
+}
+
+void RtpPacketizer::appendSdes(std::vector<uint8_t> &buf) const
+{
+	// One chunk with our CNAME, ended by at least one null byte and padded to a 32-bit boundary.
+	size_t cname_size = std::min<size_t>(cname_.size(), 255);
+	size_t chunk_size = (4 + 2 + cname_size + 1 + 3) & ~3;
+	buf.push_back(0x81); // version 2, one chunk
+	buf.push_back(RTCP_SDES);
+	put16(buf, chunk_size / 4); // length in 32-bit words, minus one for the header
+	put32(buf, ssrc_);
+	buf.push_back(1); // CNAME
+	buf.push_back(cname_size);
+	buf.insert(buf.end(), cname_.begin(), cname_.begin() + cname_size);
+	buf.resize(buf.size() + chunk_size - (4 + 2 + cname_size), 0);
+}
+
+std::vector<uint8_t> RtpPacketizer::SenderReport(uint64_t ntp_time, uint32_t rtp_timestamp) const
+{
+	std::vector<uint8_t> buf;
+	buf.push_back(0x80); // version 2, no reception reports
+	buf.push_back(RTCP_SR);
+	put16(buf, 6);
+	put32(buf, ssrc_);
+	put32(buf, ntp_time >> 32);
+	put32(buf, ntp_time);
+	put32(buf, rtp_timestamp);
+	put32(buf, packet_count_);
+	put32(buf, octet_count_);
+	appendSdes(buf);
+	return buf;
+}
+
+std::vector<uint8_t> RtpPacketizer::Bye() const
+{
+	// A compound packet must still start with a report, an empty receiver report will do.
+	std::vector<uint8_t> buf;
+	buf.push_back(0x80);
+	buf.push_back(RTCP_RR);
+	put16(buf, 1);
+	put32(buf, ssrc_);
+	appendSdes(buf);
+	buf.push_back(0x81);
+	buf.push_back(RTCP_BYE);
+	put16(buf, 1);
+	put32(buf, ssrc_);
+	return buf;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rtp_packetizer.hpp - split H.264 frames into RTP packets.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+typedef std::vector<std::pair<uint8_t const *, size_t>> NalUnits;
+
+// Find the NAL units in an Annex B byte stream, without their start codes.
+void find_nal_units(uint8_t const *data, size_t size, NalUnits &nals);
+
+// Convert a SensorTimestamp (in microseconds) to wallclock time, in microseconds since 1970.
+int64_t wallclock_us(int64_t sensor_timestamp_us);
+
+// Convert a SensorTimestamp (in microseconds) to wallclock time in NTP format.
+uint64_t ntp_time(int64_t sensor_timestamp_us);
+
+// Turns H.264 access units (Annex B byte streams) into RTP packets as described in RFC 6184,
+// using packetization mode 1. NAL units small enough to share a packet are aggregated into
+// STAP-A packets, ones too large for a packet are split into FU-A fragments, and anything
+// else goes in a packet of its own. Packets are described by iovecs that point into the
+// caller's frame wherever possible, so the frame must stay put until they have been sent.
+
+class RtpPacketizer
+{
+public:
+	static constexpr unsigned int CLOCK_RATE = 90000;
+	static constexpr unsigned int PAYLOAD_TYPE = 96;
+
+	struct Packet
+	{
+		// The RTP header and any payload header, or the whole of a STAP-A packet.
+		std::vector<uint8_t> head;
+		// The rest of the packet, straight from the frame.
+		uint8_t const *payload;
+		size_t payload_size;
+		size_t Size() const { return head.size() + payload_size; }
+	};
+
+	// max_packet_size is the most we may put in a UDP datagram.
+	RtpPacketizer(size_t max_packet_size);
+
+	// Packetize one access unit, replacing the previous frame's packets. The last packet has
+	// the marker bit set.
+	std::vector<Packet> const &Packetize(uint8_t const *data, size_t size, uint32_t timestamp);
+
+	// Make a compound RTCP packet with a sender report and our CNAME. ntp_time is the wallclock
+	// time, in NTP format, of the instant that rtp_timestamp refers to.
+	std::vector<uint8_t> SenderReport(uint64_t ntp_time, uint32_t rtp_timestamp) const;
+	// Make a compound RTCP packet saying that we're leaving.
+	std::vector<uint8_t> Bye() const;
+
+	uint32_t Ssrc() const { return ssrc_; }
+	// The sequence number the next packet will have.
+	uint16_t Sequence() const { return sequence_; }
+
+private:
+	Packet &newPacket(uint32_t timestamp);
+	void addSingle(uint8_t const *nal, size_t size, uint32_t timestamp);
+	void addAggregate(NalUnits::const_iterator begin, NalUnits::const_iterator end, uint32_t timestamp);
+	void addFragments(uint8_t const *nal, size_t size, uint32_t timestamp);
+	void appendSdes(std::vector<uint8_t> &buf) const;
+
+	size_t max_payload_size_;
+	uint32_t ssrc_;
+	uint16_t sequence_;
+	std::string cname_;
+	NalUnits nals_;
+	std::vector<Packet> packets_;
+
+	// For sender reports.
+	uint32_t packet_count_;
+	uint32_t octet_count_;
+};
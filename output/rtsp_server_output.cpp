@@ -0,0 +1,633 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rtsp_server_output.cpp - serve H.264 to RTSP clients.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <random>
+#include <sstream>
+
+#include "rtsp_server_output.hpp"
+
+// Clients that take nothing at all for this long are assumed to have gone.
+static constexpr std::chrono::seconds CLIENT_TIMEOUT(5);
+static constexpr std::chrono::seconds RTCP_INTERVAL(1);
+// The first of the UDP ports we try to send RTP and RTCP from.
+static constexpr unsigned int FIRST_SERVER_PORT = 6970;
+// Longest request we're prepared to wait for the end of.
+static constexpr size_t MAX_REQUEST_SIZE = 16384;
+static constexpr unsigned int MAX_IOV = 64;
+
+static std::string base64(std::string const &data)
+{
+	static char const chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	std::string out;
+	for (size_t i = 0; i < data.size(); i += 3)
+	{
+		uint32_t n = (uint8_t)data[i] << 16;
+		if (i + 1 < data.size())
+			n |= (uint8_t)data[i + 1] << 8;
+		if (i + 2 < data.size())
+			n |= (uint8_t)data[i + 2];
+		out += chars[n >> 18];
+		out += chars[(n >> 12) & 63];
+		out += i + 1 < data.size() ? chars[(n >> 6) & 63] : '=';
+		out += i + 2 < data.size() ? chars[n & 63] : '=';
+	}
+	return out;
+}
+
+static std::string header_value(std::string const &request, std::string const &name)
+{
+	std::istringstream lines(request);
+	std::string line;
+	while (std::getline(lines, line))
+	{
+		if (line.size() > name.size() && line[name.size()] == ':' &&
+			strncasecmp(line.c_str(), name.c_str(), name.size()) == 0)
+		{
+			size_t start = line.find_first_not_of(' ', name.size() + 1);
+			size_t end = line.find_last_not_of("\r ");
+			return start == std::string::npos ? "" : line.substr(start, end - start + 1);
+		}
+	}
+	return "";
+}
+
+RtspServerOutput::RtspServerOutput(VideoOptions const *options)
+	: Output(options), max_queued_(options->client_queue << 20), abort_(false), packetizer_(options->mtu - 28),
+	  last_rtp_timestamp_(0), sensor_timestamp_us_(-1)
+{
+	if (options->codec != "h264")
+		throw std::runtime_error("rtsp output only supports h264");
+	if (options->mtu < 100)
+		throw std::runtime_error("mtu too small for rtsp output");
+
+	char protocol[5];
+	int start, end, a, b, c, d, port;
+	if (sscanf(options->output.c_str(), "%4s://%n%d.%d.%d.%d%n:%d", protocol, &start, &a, &b, &c, &d, &end, &port) != 6)
+		throw std::runtime_error("bad network address " + options->output);
+	std::string address = options->output.substr(start, end - start);
+
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	if (inet_aton(address.c_str(), &saddr.sin_addr) == 0)
+		throw std::runtime_error("inet_aton failed for " + address);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt listen socket");
+	if (bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, 16) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	// RTP and RTCP for UDP sessions go out from an even port and the one above it.
+	rtp_fd_ = rtcp_fd_ = -1;
+	for (server_port_ = FIRST_SERVER_PORT; server_port_ < FIRST_SERVER_PORT + 1000; server_port_ += 2)
+	{
+		rtp_fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		rtcp_fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (rtp_fd_ < 0 || rtcp_fd_ < 0)
+			throw std::runtime_error("unable to open udp sockets");
+		sockaddr_in udp_saddr = saddr;
+		udp_saddr.sin_port = htons(server_port_);
+		if (bind(rtp_fd_, (sockaddr *)&udp_saddr, sizeof(udp_saddr)) == 0)
+		{
+			udp_saddr.sin_port = htons(server_port_ + 1);
+			if (bind(rtcp_fd_, (sockaddr *)&udp_saddr, sizeof(udp_saddr)) == 0)
+				break;
+		}
+		close(rtp_fd_);
+		close(rtcp_fd_);
+		rtp_fd_ = rtcp_fd_ = -1;
+	}
+	if (rtp_fd_ < 0)
+		throw std::runtime_error("no free udp ports for rtp");
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create epoll or event fd");
+	for (int fd : { listen_fd_, event_fd_ })
+	{
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+			throw std::runtime_error("failed to add fd to epoll");
+	}
+
+	rtp_timestamp_offset_ = std::random_device()();
+	// Sender reports need the sensor timestamps from the frames' metadata.
+	want_metadata_ = true;
+
+	LOG(1, "RtspServerOutput: serving " << options->output);
+	server_thread_ = std::thread(&RtspServerOutput::serverThread, this);
+}
+
+RtspServerOutput::~RtspServerOutput()
+{
+	abort_ = true;
+	wake();
+	server_thread_.join();
+	for (auto &[fd, connection] : connections_)
+		close(fd);
+	for (int fd : { event_fd_, epoll_fd_, rtcp_fd_, rtp_fd_, listen_fd_ })
+		close(fd);
+}
+
+void RtspServerOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	LOG(2, "RtspServerOutput: output buffer " << mem << " size " << size);
+	uint32_t rtp_timestamp = rtp_timestamp_offset_ + timestamp_us * RtpPacketizer::CLOCK_RATE / 1000000;
+	std::shared_ptr<RtpFrame> frame;
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		last_rtp_timestamp_ = rtp_timestamp;
+
+		// Keep the latest SPS and PPS for the session descriptions.
+		if (flags & FLAG_KEYFRAME)
+		{
+			NalUnits nals;
+			find_nal_units((uint8_t const *)mem, size, nals);
+			for (auto const &[nal, nal_size] : nals)
+			{
+				if ((nal[0] & 0x1f) == 7)
+					sps_.assign((char const *)nal, nal_size);
+				else if ((nal[0] & 0x1f) == 8)
+					pps_.assign((char const *)nal, nal_size);
+			}
+		}
+
+		if (std::none_of(connections_.begin(), connections_.end(), [](auto const &c) { return c.second.playing; }))
+			return;
+
+		frame = std::make_shared<RtpFrame>();
+		frame->data.assign((uint8_t const *)mem, (uint8_t const *)mem + size);
+		frame->packets = packetizer_.Packetize(frame->data.data(), size, rtp_timestamp);
+		frame->keyframe = flags & FLAG_KEYFRAME;
+		sendFrame(frame);
+
+		auto now = std::chrono::steady_clock::now();
+		if (sensor_timestamp_us_ >= 0 && now - last_report_ >= RTCP_INTERVAL)
+		{
+			sendReport(packetizer_.SenderReport(ntp_time(sensor_timestamp_us_), rtp_timestamp));
+			last_report_ = now;
+		}
+	}
+	sensor_timestamp_us_ = -1;
+	wake();
+}
+
+void RtspServerOutput::metadataReady(FrameMetadata const &metadata)
+{
+	auto sensor_timestamp = metadata.controls.get(libcamera::controls::SensorTimestamp);
+	if (sensor_timestamp)
+		sensor_timestamp_us_ = *sensor_timestamp / 1000;
+}
+
+void RtspServerOutput::sendFrame(std::shared_ptr<RtpFrame const> const &frame)
+{
+	size_t num_packets = frame->packets.size();
+	std::vector<iovec> iov(2 * num_packets);
+	std::vector<mmsghdr> msgs(num_packets);
+	for (auto &[fd, connection] : connections_)
+	{
+		if (!connection.playing)
+			continue;
+
+		if (connection.interleaved)
+		{
+			// Don't let a slow client's queue grow without limit, it can lose frames up to the next keyframe.
+			if (connection.queued > max_queued_ || (connection.skipping && !frame->keyframe))
+			{
+				if (!connection.skipping)
+					LOG(1, "RtspServerOutput: client " << connection.name << " is falling behind, skipping frames");
+				connection.skipping = true;
+				continue;
+			}
+			connection.skipping = false;
+			for (unsigned int i = 0; i < num_packets; i++)
+			{
+				size_t packet_size = frame->packets[i].Size();
+				Item &item = connection.queue.emplace_back();
+				item.frame = frame;
+				item.packet = i;
+				item.interleaved[0] = '$';
+				item.interleaved[1] = connection.channel;
+				item.interleaved[2] = packet_size >> 8;
+				item.interleaved[3] = packet_size;
+				item.size = 4 + packet_size;
+				connection.queued += item.size;
+			}
+			continue;
+		}
+
+		for (unsigned int i = 0; i < num_packets; i++)
+		{
+			RtpPacketizer::Packet const &packet = frame->packets[i];
+			iov[2 * i] = { (void *)packet.head.data(), packet.head.size() };
+			iov[2 * i + 1] = { (void *)packet.payload, packet.payload_size };
+			msgs[i] = {};
+			msgs[i].msg_hdr.msg_name = &connection.rtp_addr;
+			msgs[i].msg_hdr.msg_namelen = sizeof(connection.rtp_addr);
+			msgs[i].msg_hdr.msg_iov = &iov[2 * i];
+			msgs[i].msg_hdr.msg_iovlen = packet.payload_size ? 2 : 1;
+		}
+		for (unsigned int sent = 0; sent < num_packets;)
+		{
+			int ret = sendmmsg(rtp_fd_, &msgs[sent], num_packets - sent, MSG_DONTWAIT);
+			if (ret < 0 && errno == EINTR)
+				continue;
+			else if (ret < 0)
+			{
+				// It's UDP, the rest of the frame can just be lost.
+				LOG(2, "RtspServerOutput: dropped " << num_packets - sent << " packets for " << connection.name);
+				break;
+			}
+			sent += ret;
+		}
+	}
+}
+
+void RtspServerOutput::sendReport(std::vector<uint8_t> const &report)
+{
+	for (auto &[fd, connection] : connections_)
+	{
+		if (!connection.playing)
+			continue;
+		if (connection.interleaved)
+		{
+			std::string text = { '$', (char)(connection.channel + 1), (char)(report.size() >> 8), (char)report.size() };
+			text.append(report.begin(), report.end());
+			queueText(connection, text);
+		}
+		else
+			sendto(rtcp_fd_, report.data(), report.size(), MSG_DONTWAIT, (sockaddr *)&connection.rtcp_addr,
+				   sizeof(connection.rtcp_addr));
+	}
+}
+
+void RtspServerOutput::wake()
+{
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+}
+
+void RtspServerOutput::serverThread()
+{
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, 1000);
+		if (n < 0 && errno != EINTR)
+		{
+			LOG_ERROR("ERROR: RtspServerOutput: epoll_wait failed, no more clients will be served");
+			break;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				[[maybe_unused]] ssize_t ret = read(event_fd_, &count, sizeof(count));
+			}
+			else if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+			{
+				auto it = connections_.find(fd);
+				if (it != connections_.end())
+					readRequests(fd, it->second);
+			}
+		}
+
+		// Writes never block, so just try everyone. Those who can't take any more wait for EPOLLOUT.
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = connections_.begin(); it != connections_.end();)
+		{
+			int fd = it->first;
+			Connection &connection = (it++)->second;
+			if (!sendQueued(fd, connection))
+				removeConnection(fd, "failed");
+			else if (connection.queued && now - connection.last_progress > CLIENT_TIMEOUT)
+				removeConnection(fd, "timed out");
+		}
+	}
+}
+
+void RtspServerOutput::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in saddr;
+		socklen_t len = sizeof(saddr);
+		int fd = accept4(listen_fd_, (sockaddr *)&saddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG_ERROR("WARNING: RtspServerOutput: accept failed");
+			return;
+		}
+
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			LOG_ERROR("WARNING: RtspServerOutput: failed to add client to epoll");
+			close(fd);
+			continue;
+		}
+
+		Connection &connection = connections_[fd];
+		connection.name = std::string(inet_ntoa(saddr.sin_addr)) + ":" + std::to_string(ntohs(saddr.sin_port));
+		connection.offset = connection.queued = 0;
+		connection.skipping = connection.playing = connection.interleaved = false;
+		connection.channel = 0;
+		connection.last_progress = std::chrono::steady_clock::now();
+		LOG(2, "RtspServerOutput: client " << connection.name << " connected");
+	}
+}
+
+void RtspServerOutput::removeConnection(int fd, char const *reason)
+{
+	auto it = connections_.find(fd);
+	if (it == connections_.end())
+		return;
+	LOG(1, "RtspServerOutput: client " << it->second.name << " " << reason);
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	connections_.erase(it);
+}
+
+void RtspServerOutput::readRequests(int fd, Connection &connection)
+{
+	// Edge triggered, so read everything there is.
+	while (true)
+	{
+		char buf[4096];
+		ssize_t n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		{
+			removeConnection(fd, "disconnected");
+			return;
+		}
+		else if (n < 0 && errno != EINTR)
+			break;
+		else if (n > 0)
+			connection.input.append(buf, n);
+	}
+
+	std::string &input = connection.input;
+	while (!input.empty())
+	{
+		// Interleaved RTCP from the client comes in on the same connection, which we ignore.
+		if (input[0] == '$')
+		{
+			if (input.size() < 4)
+				break;
+			size_t packet_size = 4 + ((uint8_t)input[2] << 8 | (uint8_t)input[3]);
+			if (input.size() < packet_size)
+				break;
+			input.erase(0, packet_size);
+			continue;
+		}
+
+		size_t end = input.find("\r\n\r\n");
+		if (end == std::string::npos)
+		{
+			if (input.size() > MAX_REQUEST_SIZE)
+				removeConnection(fd, "sent an oversized request");
+			break;
+		}
+		std::string request = input.substr(0, end + 4);
+		// The body counts towards the request size too, or a client could make us wait for any amount.
+		std::string content_length = header_value(request, "Content-Length");
+		size_t body_size = 0;
+		bool malformed =
+			content_length.size() > 9 || content_length.find_first_not_of("0123456789") != std::string::npos;
+		if (!malformed && !content_length.empty())
+			body_size = std::stoul(content_length);
+		if (malformed || end + 4 + body_size > MAX_REQUEST_SIZE)
+		{
+			removeConnection(fd, malformed ? "sent a bad Content-Length" : "sent an oversized request");
+			break;
+		}
+		if (input.size() < end + 4 + body_size)
+			break;
+		input.erase(0, end + 4 + body_size);
+		handleRequest(fd, connection, request);
+	}
+}
+
+void RtspServerOutput::handleRequest(int fd, Connection &connection, std::string const &request)
+{
+	std::string method, url;
+	std::istringstream(request) >> method >> url;
+	LOG(2, "RtspServerOutput: " << connection.name << " " << method << " " << url);
+
+	std::string status = "200 OK", headers, body;
+	std::string session = header_value(request, "Session");
+	session = session.substr(0, session.find(';'));
+	// Clients are remote, so don't trust them to send a URL at all.
+	if (url.empty() || (url != "*" && url.compare(0, 7, "rtsp://")))
+		status = "400 Bad Request";
+	else if (method == "OPTIONS")
+		headers = "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER\r\n";
+	else if (method == "DESCRIBE")
+	{
+		body = describe(fd, url);
+		std::string base = url.back() == '/' ? url : url + "/";
+		headers = "Content-Base: " + base + "\r\nContent-Type: application/sdp\r\n";
+	}
+	else if (method == "SETUP")
+	{
+		std::string transport = header_value(request, "Transport");
+		size_t interleaved = transport.find("interleaved=");
+		size_t client_port = transport.find("client_port=");
+		if (transport.find("RTP/AVP/TCP") != std::string::npos || interleaved != std::string::npos)
+		{
+			connection.interleaved = true;
+			connection.channel = interleaved == std::string::npos ? 0 : atoi(transport.c_str() + interleaved + 12);
+			headers = "Transport: RTP/AVP/TCP;unicast;interleaved=" + std::to_string(connection.channel) + "-" +
+					  std::to_string(connection.channel + 1) + "\r\n";
+		}
+		else if (client_port != std::string::npos)
+		{
+			unsigned int rtp_port = 0, rtcp_port = 0;
+			if (sscanf(transport.c_str() + client_port + 12, "%u-%u", &rtp_port, &rtcp_port) < 1)
+				status = "461 Unsupported Transport";
+			socklen_t len = sizeof(connection.rtp_addr);
+			getpeername(fd, (sockaddr *)&connection.rtp_addr, &len);
+			connection.rtcp_addr = connection.rtp_addr;
+			connection.rtp_addr.sin_port = htons(rtp_port);
+			connection.rtcp_addr.sin_port = htons(rtcp_port ? rtcp_port : rtp_port + 1);
+			connection.interleaved = false;
+			std::ostringstream ssrc;
+			ssrc << std::hex << std::setw(8) << std::setfill('0') << packetizer_.Ssrc();
+			headers = "Transport: RTP/AVP;unicast;client_port=" + std::to_string(rtp_port) + "-" +
+					  std::to_string(ntohs(connection.rtcp_addr.sin_port)) +
+					  ";server_port=" + std::to_string(server_port_) + "-" + std::to_string(server_port_ + 1) +
+					  ";ssrc=" + ssrc.str() + "\r\n";
+		}
+		else
+			status = "461 Unsupported Transport";
+
+		if (status[0] == '2')
+		{
+			if (connection.session.empty())
+			{
+				std::ostringstream id;
+				id << std::hex << std::random_device()() << std::random_device()();
+				connection.session = id.str();
+			}
+			session = connection.session;
+		}
+	}
+	else if (method == "PLAY")
+	{
+		if (session.empty() || session != connection.session)
+			status = "454 Session Not Found";
+		else
+		{
+			// The client gets everything from the next frame, and it may as well be a keyframe.
+			connection.playing = true;
+			headers = "Range: npt=0.000-\r\nRTP-Info: url=" + url + ";seq=" + std::to_string(packetizer_.Sequence()) +
+					  ";rtptime=" + std::to_string(last_rtp_timestamp_) + "\r\n";
+			requestKeyframe();
+			LOG(1, "RtspServerOutput: client " << connection.name << " playing over "
+											   << (connection.interleaved ? "tcp" : "udp"));
+		}
+	}
+	else if (method == "PAUSE" || method == "TEARDOWN")
+	{
+		if (session.empty() || session != connection.session)
+			status = "454 Session Not Found";
+		connection.playing = false;
+		if (method == "TEARDOWN")
+			connection.session.clear();
+	}
+	else if (method != "GET_PARAMETER" && method != "SET_PARAMETER")
+		status = "501 Not Implemented";
+
+	std::string reply = "RTSP/1.0 " + status + "\r\nCSeq: " + header_value(request, "CSeq") +
+						"\r\nServer: rpicam-apps\r\n" + headers;
+	if (!session.empty() && status[0] == '2')
+		reply += "Session: " + session + ";timeout=60\r\n";
+	if (!body.empty())
+		reply += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+	queueText(connection, reply + "\r\n" + body);
+}
+
+std::string RtspServerOutput::describe(int fd, std::string const &url)
+{
+	sockaddr_in saddr = {};
+	socklen_t len = sizeof(saddr);
+	getsockname(fd, (sockaddr *)&saddr, &len);
+
+	std::ostringstream sdp;
+	sdp << "v=0\r\n"
+		<< "o=- " << packetizer_.Ssrc() << " 1 IN IP4 " << inet_ntoa(saddr.sin_addr) << "\r\n"
+		<< "s=rpicam-vid\r\n"
+		<< "c=IN IP4 0.0.0.0\r\n"
+		<< "t=0 0\r\n"
+		<< "a=control:*\r\n"
+		<< "m=video 0 RTP/AVP " << RtpPacketizer::PAYLOAD_TYPE << "\r\n"
+		<< "a=rtpmap:" << RtpPacketizer::PAYLOAD_TYPE << " H264/" << RtpPacketizer::CLOCK_RATE << "\r\n"
+		<< "a=fmtp:" << RtpPacketizer::PAYLOAD_TYPE << " packetization-mode=1";
+	if (sps_.size() >= 4)
+	{
+		sdp << ";profile-level-id=" << std::hex << std::setfill('0');
+		for (int i = 1; i < 4; i++)
+			sdp << std::setw(2) << (unsigned int)(uint8_t)sps_[i];
+		sdp << std::dec << ";sprop-parameter-sets=" << base64(sps_) << "," << base64(pps_);
+	}
+	sdp << "\r\n"
+		<< "a=control:track0\r\n";
+	return sdp.str();
+}
+
+void RtspServerOutput::queueText(Connection &connection, std::string const &text)
+{
+	Item &item = connection.queue.emplace_back();
+	item.text = text;
+	item.size = text.size();
+	connection.queued += item.size;
+}
+
+bool RtspServerOutput::sendQueued(int fd, Connection &connection)
+{
+	while (!connection.queue.empty())
+	{
+		// Gather up the queued items, skipping what we sent of the first one last time.
+		iovec iov[MAX_IOV];
+		unsigned int count = 0;
+		size_t skip = connection.offset;
+		for (auto it = connection.queue.begin(); it != connection.queue.end() && count + 3 <= MAX_IOV; it++)
+		{
+			iovec parts[3];
+			unsigned int num_parts = 0;
+			if (it->frame)
+			{
+				RtpPacketizer::Packet const &packet = it->frame->packets[it->packet];
+				parts[num_parts++] = { (void *)it->interleaved, 4 };
+				parts[num_parts++] = { (void *)packet.head.data(), packet.head.size() };
+				if (packet.payload_size)
+					parts[num_parts++] = { (void *)packet.payload, packet.payload_size };
+			}
+			else
+				parts[num_parts++] = { (void *)it->text.data(), it->text.size() };
+
+			for (unsigned int i = 0; i < num_parts; i++)
+			{
+				if (skip >= parts[i].iov_len)
+				{
+					skip -= parts[i].iov_len;
+					continue;
+				}
+				iov[count++] = { (uint8_t *)parts[i].iov_base + skip, parts[i].iov_len - skip };
+				skip = 0;
+			}
+		}
+
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		ssize_t sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		connection.queued -= sent;
+		connection.last_progress = std::chrono::steady_clock::now();
+		sent += connection.offset;
+		while (!connection.queue.empty() && (size_t)sent >= connection.queue.front().size)
+		{
+			sent -= connection.queue.front().size;
+			connection.queue.pop_front();
+		}
+		connection.offset = sent;
+	}
+	return true;
+}
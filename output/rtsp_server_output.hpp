@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * rtsp_server_output.hpp - serve H.264 to RTSP clients.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+#include "rtp_packetizer.hpp"
+
+// An RTSP server (RFC 2326) that any number of clients can play the stream from, using
+// RTP over UDP or interleaved in the RTSP connection. Each frame is packetized just once,
+// into a single set of packets that every session sends straight from, so viewers don't
+// cost any copies. The RTSP connections are handled by an epoll thread, which also writes
+// the interleaved packets; UDP packets are sent as soon as each frame arrives. The SDP
+// carries the SPS and PPS from the stream.
+
+class RtspServerOutput : public Output
+{
+public:
+	RtspServerOutput(VideoOptions const *options);
+	~RtspServerOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void metadataReady(FrameMetadata const &metadata) override;
+
+private:
+	// One frame and its packets, which point into the data.
+	struct RtpFrame
+	{
+		std::vector<uint8_t> data;
+		std::vector<RtpPacketizer::Packet> packets;
+		bool keyframe;
+	};
+	// Something to send on an RTSP connection, either some text or an interleaved RTP packet.
+	struct Item
+	{
+		std::string text;
+		std::shared_ptr<RtpFrame const> frame;
+		unsigned int packet;
+		uint8_t interleaved[4];
+		size_t size;
+	};
+	struct Connection
+	{
+		std::string name;
+		std::string input;
+		std::deque<Item> queue;
+		size_t offset; // bytes of the front item already sent
+		size_t queued; // bytes in the queue not yet sent
+		bool skipping;
+		std::chrono::steady_clock::time_point last_progress;
+		// Each connection has at most one session.
+		std::string session;
+		bool playing;
+		bool interleaved;
+		uint8_t channel;
+		sockaddr_in rtp_addr;
+		sockaddr_in rtcp_addr;
+	};
+
+	void serverThread();
+	void acceptClients();
+	void removeConnection(int fd, char const *reason);
+	void readRequests(int fd, Connection &connection);
+	void handleRequest(int fd, Connection &connection, std::string const &request);
+	std::string describe(int fd, std::string const &url);
+	bool sendQueued(int fd, Connection &connection);
+	void queueText(Connection &connection, std::string const &text);
+	void sendFrame(std::shared_ptr<RtpFrame const> const &frame);
+	void sendReport(std::vector<uint8_t> const &report);
+	void wake();
+
+	size_t max_queued_;
+	int listen_fd_;
+	int rtp_fd_;
+	int rtcp_fd_;
+	unsigned int server_port_;
+	int epoll_fd_;
+	int event_fd_;
+	std::atomic<bool> abort_;
+	std::thread server_thread_;
+
+	// Protected by mutex_.
+	std::mutex mutex_;
+	std::map<int, Connection> connections_;
+	RtpPacketizer packetizer_;
+	uint32_t rtp_timestamp_offset_;
+	uint32_t last_rtp_timestamp_;
+	std::string sps_;
+	std::string pps_;
+
+	// Only the encoder thread touches these.
+	int64_t sensor_timestamp_us_;
+	std::chrono::steady_clock::time_point last_report_;
+};
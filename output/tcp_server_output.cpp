@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * tcp_server_output.cpp - stream output to any number of TCP clients.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "tcp_server_output.hpp"
+
+// Clients that take nothing at all for this long are assumed to have gone.
+static constexpr std::chrono::seconds CLIENT_TIMEOUT(5);
+// Keep the kernel's send buffers small, so that the client queues decide how far behind
+// clients can get, rather than the kernel queueing up seconds of video out of sight.
+static constexpr int CLIENT_SNDBUF = 256 * 1024;
+// The most frames to hand to a single sendmsg.
+static constexpr unsigned int MAX_IOV = 64;
+
+// Return the length of any H.264 stream headers at the start of this keyframe, which is
+// everything before the first slice, or 0 if there's no SPS among them.
+static size_t stream_headers_size(uint8_t const *data, size_t size)
+{
+	bool sps = false;
+	for (size_t i = 0; i + 3 < size; i++)
+	{
+		if (data[i] != 0 || data[i + 1] != 0 || data[i + 2] != 1)
+			continue;
+		unsigned int type = data[i + 3] & 0x1f;
+		if (type == 7)
+			sps = true;
+		else if (type == 1 || type == 5)
+			return sps ? (i && data[i - 1] == 0 ? i - 1 : i) : 0;
+	}
+	return 0;
+}
+
+TcpServerOutput::TcpServerOutput(VideoOptions const *options)
+	: Output(options), max_queued_(options->client_queue << 20), abort_(false)
+{
+	char protocol[4];
+	int start, end, a, b, c, d, port;
+	if (sscanf(options->output.c_str(), "%3s://%n%d.%d.%d.%d%n:%d", protocol, &start, &a, &b, &c, &d, &end, &port) != 6)
+		throw std::runtime_error("bad network address " + options->output);
+	std::string address = options->output.substr(start, end - start);
+
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	if (inet_aton(address.c_str(), &saddr.sin_addr) == 0)
+		throw std::runtime_error("inet_aton failed for " + address);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open listen socket");
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0)
+		throw std::runtime_error("failed to setsockopt listen socket");
+	if (bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0)
+		throw std::runtime_error("failed to bind listen socket");
+	if (listen(listen_fd_, 16) < 0)
+		throw std::runtime_error("failed to listen on socket");
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+		throw std::runtime_error("failed to create epoll or event fd");
+	for (int fd : { listen_fd_, event_fd_ })
+	{
+		epoll_event event = {};
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+			throw std::runtime_error("failed to add fd to epoll");
+	}
+
+	LOG(1, "TcpServerOutput: listening for clients on " << address << ":" << port);
+	server_thread_ = std::thread(&TcpServerOutput::serverThread, this);
+}
+
+TcpServerOutput::~TcpServerOutput()
+{
+	abort_ = true;
+	wake();
+	server_thread_.join();
+	for (auto &[fd, client] : clients_)
+		close(fd);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void TcpServerOutput::outputBuffer(void *mem, size_t size, int64_t /*timestamp_us*/, uint32_t flags)
+{
+	LOG(2, "TcpServerOutput: output buffer " << mem << " size " << size);
+	bool keyframe = flags & FLAG_KEYFRAME;
+	uint8_t const *data = (uint8_t const *)mem;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// Remember the stream headers, so that clients joining later can be given them.
+	bool has_headers = false;
+	if (keyframe && options_->codec == "h264")
+	{
+		size_t headers_size = stream_headers_size(data, size);
+		if (headers_size)
+		{
+			headers_ = std::make_shared<std::vector<uint8_t>>(data, data + headers_size);
+			has_headers = true;
+		}
+	}
+
+	if (clients_.empty())
+		return;
+
+	// One copy of the frame is shared by all the clients' queues.
+	Frame frame = std::make_shared<std::vector<uint8_t>>(data, data + size);
+	for (auto &[fd, client] : clients_)
+	{
+		if (client.waiting_keyframe && !keyframe)
+			continue;
+
+		bool add_headers = client.waiting_keyframe && headers_ && !has_headers;
+		size_t frame_size = size + (add_headers ? headers_->size() : 0);
+		if (client.queued + frame_size > max_queued_)
+		{
+			if (!client.waiting_keyframe)
+				LOG(1, "TcpServerOutput: client " << client.name << " is falling behind, skipping frames");
+			client.waiting_keyframe = true;
+			continue;
+		}
+
+		if (add_headers)
+			client.queue.push_back(headers_);
+		client.queue.push_back(frame);
+		client.queued += frame_size;
+		client.waiting_keyframe = false;
+	}
+
+	wake();
+}
+
+void TcpServerOutput::wake()
+{
+	uint64_t one = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &one, sizeof(one));
+}
+
+void TcpServerOutput::serverThread()
+{
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, 1000);
+		if (n < 0 && errno != EINTR)
+		{
+			LOG_ERROR("ERROR: TcpServerOutput: epoll_wait failed, no more clients will be served");
+			break;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex_);
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				uint64_t count;
+				[[maybe_unused]] ssize_t ret = read(event_fd_, &count, sizeof(count));
+			}
+			else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+				removeClient(fd, "disconnected");
+			else if (events[i].events & EPOLLIN)
+			{
+				// Clients have nothing to say to us, so throw away whatever they send.
+				char buf[256];
+				if (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) == 0)
+					removeClient(fd, "disconnected");
+			}
+		}
+
+		// Writes never block, so just try everyone. Those who can't take any more wait for EPOLLOUT.
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = clients_.begin(); it != clients_.end();)
+		{
+			int fd = it->first;
+			Client &client = (it++)->second;
+			if (!sendQueued(fd, client))
+				removeClient(fd, "failed");
+			else if (client.queued && now - client.last_progress > CLIENT_TIMEOUT)
+				removeClient(fd, "timed out");
+		}
+	}
+}
+
+void TcpServerOutput::acceptClients()
+{
+	while (true)
+	{
+		sockaddr_in saddr;
+		socklen_t len = sizeof(saddr);
+		int fd = accept4(listen_fd_, (sockaddr *)&saddr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				LOG_ERROR("WARNING: TcpServerOutput: accept failed");
+			return;
+		}
+
+		int enable = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &CLIENT_SNDBUF, sizeof(CLIENT_SNDBUF));
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			LOG_ERROR("WARNING: TcpServerOutput: failed to add client to epoll");
+			close(fd);
+			continue;
+		}
+
+		Client &client = clients_[fd];
+		client.name = std::string(inet_ntoa(saddr.sin_addr)) + ":" + std::to_string(ntohs(saddr.sin_port));
+		client.offset = client.queued = 0;
+		client.waiting_keyframe = true;
+		client.last_progress = std::chrono::steady_clock::now();
+		LOG(1, "TcpServerOutput: client " << client.name << " connected, " << clients_.size() << " now");
+
+		// Rather than leave the new client waiting for the rest of the GOP.
+		requestKeyframe();
+	}
+}
+
+void TcpServerOutput::removeClient(int fd, char const *reason)
+{
+	auto it = clients_.find(fd);
+	if (it == clients_.end())
+		return;
+	LOG(1, "TcpServerOutput: client " << it->second.name << " " << reason << ", " << clients_.size() - 1 << " left");
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(it);
+}
+
+bool TcpServerOutput::sendQueued(int fd, Client &client)
+{
+	while (!client.queue.empty())
+	{
+		iovec iov[MAX_IOV];
+		unsigned int count = 0;
+		for (auto it = client.queue.begin(); it != client.queue.end() && count < MAX_IOV; it++, count++)
+		{
+			size_t offset = count ? 0 : client.offset;
+			iov[count] = { (void *)((*it)->data() + offset), (*it)->size() - offset };
+		}
+
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		// No SIGPIPE when a client has gone away, we just forget about them.
+		ssize_t sent = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		client.queued -= sent;
+		client.last_progress = std::chrono::steady_clock::now();
+		sent += client.offset;
+		while (!client.queue.empty() && (size_t)sent >= client.queue.front()->size())
+		{
+			sent -= client.queue.front()->size();
+			client.queue.pop_front();
+		}
+		client.offset = sent;
+	}
+	return true;
+}
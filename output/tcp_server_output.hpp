@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * tcp_server_output.hpp - stream output to any number of TCP clients.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// Listens for TCP clients, which may come and go at any time, and sends the stream to all of
+// them from an epoll thread. Clients start at a keyframe, with the H.264 stream headers put
+// back in front of it if the encoder only sent them once. Each client has its own bounded
+// queue of frames; a client that falls behind skips frames until the next keyframe that
+// fits, and one that stops taking data altogether is disconnected, without the others
+// noticing either way.
+
+class TcpServerOutput : public Output
+{
+public:
+	TcpServerOutput(VideoOptions const *options);
+	~TcpServerOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	typedef std::shared_ptr<std::vector<uint8_t> const> Frame;
+	struct Client
+	{
+		std::string name;
+		std::deque<Frame> queue;
+		size_t offset; // bytes of the front frame already sent
+		size_t queued; // bytes in the queue not yet sent
+		bool waiting_keyframe;
+		std::chrono::steady_clock::time_point last_progress;
+	};
+
+	void serverThread();
+	void acceptClients();
+	void removeClient(int fd, char const *reason);
+	bool sendQueued(int fd, Client &client);
+	void wake();
+
+	size_t max_queued_;
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	std::atomic<bool> abort_;
+	std::thread server_thread_;
+
+	// Protected by mutex_.
+	std::mutex mutex_;
+	std::map<int, Client> clients_;
+	Frame headers_;
+};
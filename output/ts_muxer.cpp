@@ -0,0 +1,240 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * ts_muxer.cpp - put H.264 and KLV metadata into an MPEG transport stream.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "ts_muxer.hpp"
+
+static constexpr uint8_t STREAM_TYPE_H264 = 0x1b;
+static constexpr uint8_t STREAM_TYPE_PRIVATE_PES = 0x06;
+static constexpr uint8_t STREAM_ID_VIDEO = 0xe0;
+static constexpr uint8_t STREAM_ID_PRIVATE_1 = 0xbd;
+static constexpr uint8_t REGISTRATION_DESCRIPTOR = 0x05;
+// The PCR runs this far ahead of the PTS, giving decoders time to receive each frame.
+static constexpr uint64_t PTS_DELAY = 9000;
+static constexpr uint8_t ACCESS_UNIT_DELIMITER[] = { 0, 0, 0, 1, 0x09, 0xf0 };
+
+static uint32_t crc32_mpeg2(uint8_t const *data, size_t size)
+{
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= (uint32_t)data[i] << 24;
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+static void put16(std::vector<uint8_t> &buf, uint16_t value)
+{
+	buf.push_back(value >> 8);
+	buf.push_back(value);
+}
+
+static void put_pts(std::vector<uint8_t> &buf, uint64_t pts)
+{
+	buf.push_back(0x21 | ((pts >> 29) & 0x0e));
+	put16(buf, ((pts >> 14) & 0xfffe) | 1);
+	put16(buf, ((pts << 1) & 0xfffe) | 1);
+}
+
+// The optional PES header fields we use are the flags, the header length and a PTS.
+static std::vector<uint8_t> pes_header(uint8_t stream_id, size_t data_size, uint64_t pts)
+{
+	std::vector<uint8_t> header = { 0, 0, 1, stream_id };
+	size_t length = 3 + 5 + data_size;
+	// Video PES packets may be of unbounded length, which they have to be if they're this big.
+	put16(header, stream_id == STREAM_ID_VIDEO || length > 0xffff ? 0 : length);
+	header.push_back(0x84); // data_alignment_indicator
+	header.push_back(0x80); // PTS only
+	header.push_back(5);
+	put_pts(header, pts);
+	return header;
+}
+
+TsMuxer::TsMuxer(bool klv) : klv_(klv), continuity_ {}, last_tables_us_(0), tables_written_(false)
+{
+}
+
+void TsMuxer::Mux(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe,
+				  std::vector<uint8_t> const &klv, std::vector<uint8_t> &out)
+{
+	if (keyframe || !tables_written_ || timestamp_us - last_tables_us_ >= TABLE_INTERVAL_US)
+	{
+		writeTables(out);
+		last_tables_us_ = timestamp_us;
+		tables_written_ = true;
+	}
+
+	// Timestamps are 33 bits of a 90kHz clock, which is allowed to wrap.
+	uint64_t pcr = ((uint64_t)timestamp_us * 9 / 100) & ((1ull << 33) - 1);
+	uint64_t pts = (pcr + PTS_DELAY) & ((1ull << 33) - 1);
+
+	// Transport streams want each access unit to start with a delimiter, which the encoder doesn't give us.
+	bool has_delimiter = size > 4 && data[0] == 0 && data[1] == 0 && data[2] == 0 && data[3] == 1 &&
+						 (data[4] & 0x1f) == 9;
+	size_t data_size = size + (has_delimiter ? 0 : sizeof(ACCESS_UNIT_DELIMITER));
+	std::vector<uint8_t> header = pes_header(STREAM_ID_VIDEO, data_size, pts);
+	std::vector<iovec> pes = { { header.data(), header.size() } };
+	if (!has_delimiter)
+		pes.push_back({ (void *)ACCESS_UNIT_DELIMITER, sizeof(ACCESS_UNIT_DELIMITER) });
+	pes.push_back({ (void *)data, size });
+	writePes(VIDEO_PID, pes, pcr, keyframe, out);
+
+	if (klv_ && !klv.empty())
+	{
+		std::vector<uint8_t> klv_header = pes_header(STREAM_ID_PRIVATE_1, klv.size(), pts);
+		writePes(KLV_PID, { { klv_header.data(), klv_header.size() }, { (void *)klv.data(), klv.size() } }, -1,
+				 false, out);
+	}
+}
+
+uint8_t &TsMuxer::continuity(uint16_t pid)
+{
+	switch (pid)
+	{
+	case PAT_PID:
+		return continuity_[PAT_INDEX];
+	case PMT_PID:
+		return continuity_[PMT_INDEX];
+	case VIDEO_PID:
+		return continuity_[VIDEO_INDEX];
+	case KLV_PID:
+		return continuity_[KLV_INDEX];
+	}
+	throw std::logic_error("TsMuxer: no continuity counter for PID " + std::to_string(pid));
+}
+
+void TsMuxer::writeTables(std::vector<uint8_t> &out)
+{
+	// The PAT lists our one program, and where to find its PMT.
+	std::vector<uint8_t> pat = { 0x00, 0, 0 };
+	put16(pat, 1); // transport_stream_id
+	pat.push_back(0xc1); // version 0, current
+	pat.push_back(0);
+	pat.push_back(0);
+	put16(pat, 1); // program_number
+	put16(pat, 0xe000 | PMT_PID);
+	writeSection(PAT_PID, pat, out);
+
+	std::vector<uint8_t> pmt = { 0x02, 0, 0 };
+	put16(pmt, 1); // program_number
+	pmt.push_back(0xc1);
+	pmt.push_back(0);
+	pmt.push_back(0);
+	put16(pmt, 0xe000 | VIDEO_PID); // PCR_PID
+	put16(pmt, 0xf000); // no program_info
+	pmt.push_back(STREAM_TYPE_H264);
+	put16(pmt, 0xe000 | VIDEO_PID);
+	put16(pmt, 0xf000);
+	if (klv_)
+	{
+		pmt.push_back(STREAM_TYPE_PRIVATE_PES);
+		put16(pmt, 0xe000 | KLV_PID);
+		put16(pmt, 0xf000 | 6);
+		pmt.insert(pmt.end(), { REGISTRATION_DESCRIPTOR, 4, 'K', 'L', 'V', 'A' });
+	}
+	writeSection(PMT_PID, pmt, out);
+}
+
+void TsMuxer::writeSection(uint16_t pid, std::vector<uint8_t> &section, std::vector<uint8_t> &out)
+{
+	// Fill in the section_length, with the syntax indicator, and add the CRC.
+	size_t length = section.size() - 3 + 4;
+	section[1] = 0xb0 | (length >> 8);
+	section[2] = length;
+	uint32_t crc = crc32_mpeg2(section.data(), section.size());
+	put16(section, crc >> 16);
+	put16(section, crc);
+
+	// Our tables always fit in a single packet, after the pointer_field.
+	uint8_t *packet = &*out.insert(out.end(), PACKET_SIZE, 0xff);
+	uint8_t &continuity = this->continuity(pid);
+	packet[0] = 0x47;
+	packet[1] = 0x40 | (pid >> 8); // payload_unit_start_indicator
+	packet[2] = pid;
+	packet[3] = 0x10 | continuity;
+	continuity = (continuity + 1) & 15;
+	packet[4] = 0; // pointer_field
+	memcpy(packet + 5, section.data(), section.size());
+}
+
+void TsMuxer::writePes(uint16_t pid, std::vector<iovec> const &pes, uint64_t pcr, bool random_access,
+					   std::vector<uint8_t> &out)
+{
+	size_t remaining = 0;
+	for (auto const &piece : pes)
+		remaining += piece.iov_len;
+	out.reserve(out.size() + (remaining / 184 + 2) * PACKET_SIZE);
+	uint8_t &continuity = this->continuity(pid);
+
+	auto piece = pes.begin();
+	size_t offset = 0;
+	for (bool first = true; remaining; first = false)
+	{
+		// The adaptation field carries the PCR and random access flag, and pads out the last packet.
+		std::vector<uint8_t> adaptation;
+		bool has_adaptation = false;
+		if (first && (pcr != (uint64_t)-1 || random_access))
+		{
+			has_adaptation = true;
+			adaptation.push_back((random_access ? 0x40 : 0) | (pcr != (uint64_t)-1 ? 0x10 : 0));
+			if (pcr != (uint64_t)-1)
+			{
+				// The 27MHz extension is always zero, as our clock only has 90kHz resolution.
+				adaptation.insert(adaptation.end(), { (uint8_t)(pcr >> 25), (uint8_t)(pcr >> 17), (uint8_t)(pcr >> 9),
+													  (uint8_t)(pcr >> 1), (uint8_t)(((pcr & 1) << 7) | 0x7e), 0 });
+			}
+		}
+		size_t space = 184 - (has_adaptation ? 1 + adaptation.size() : 0);
+		if (remaining < space)
+		{
+			size_t fill = space - remaining;
+			if (!has_adaptation)
+			{
+				has_adaptation = true;
+				fill--;
+			}
+			if (fill && adaptation.empty())
+			{
+				adaptation.push_back(0);
+				fill--;
+			}
+			adaptation.insert(adaptation.end(), fill, 0xff);
+			space = remaining;
+		}
+
+		uint8_t *packet = &*out.insert(out.end(), PACKET_SIZE, 0);
+		packet[0] = 0x47;
+		packet[1] = (first ? 0x40 : 0) | (pid >> 8);
+		packet[2] = pid;
+		packet[3] = (has_adaptation ? 0x30 : 0x10) | continuity;
+		continuity = (continuity + 1) & 15;
+		uint8_t *ptr = packet + 4;
+		if (has_adaptation)
+		{
+			*ptr++ = adaptation.size();
+			ptr = std::copy(adaptation.begin(), adaptation.end(), ptr);
+		}
+
+		remaining -= space;
+		while (space)
+		{
+			size_t n = std::min(space, piece->iov_len - offset);
+			memcpy(ptr, (uint8_t const *)piece->iov_base + offset, n);
+			ptr += n;
+			space -= n;
+			offset += n;
+			if (offset == piece->iov_len)
+				piece++, offset = 0;
+		}
+	}
+}
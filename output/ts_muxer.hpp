@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * ts_muxer.hpp - put H.264 and KLV metadata into an MPEG transport stream.
+ */
+
+#pragma once
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <vector>
+
+// Makes a single program MPEG-2 transport stream (ISO/IEC 13818-1) from H.264 access units,
+// with an optional KLV metadata stream. The KLV is carried in a private data stream, tagged
+// with a "KLVA" registration descriptor as SMPTE RP 217 and MISB ST 1402 describe, in a PES
+// packet for each frame with the same PTS as the frame it describes. The PAT and PMT come
+// before every keyframe and again once TABLE_INTERVAL_US has passed, and every frame carries a PCR.
+
+class TsMuxer
+{
+public:
+	static constexpr size_t PACKET_SIZE = 188;
+	static constexpr uint16_t PAT_PID = 0;
+	static constexpr uint16_t PMT_PID = 0x1000;
+	static constexpr uint16_t VIDEO_PID = 0x100;
+	static constexpr uint16_t KLV_PID = 0x101;
+
+	TsMuxer(bool klv);
+
+	// Append the packets for one access unit, and for any KLV that goes with it, to out.
+	void Mux(uint8_t const *data, size_t size, int64_t timestamp_us, bool keyframe, std::vector<uint8_t> const &klv,
+			 std::vector<uint8_t> &out);
+
+private:
+	static constexpr int64_t TABLE_INTERVAL_US = 100000;
+	// Each PID has its own continuity counter.
+	enum
+	{
+		PAT_INDEX,
+		PMT_INDEX,
+		VIDEO_INDEX,
+		KLV_INDEX,
+		NUM_PIDS
+	};
+
+	uint8_t &continuity(uint16_t pid);
+	void writeTables(std::vector<uint8_t> &out);
+	void writeSection(uint16_t pid, std::vector<uint8_t> &section, std::vector<uint8_t> &out);
+	// Split a PES packet, given as the pieces to be joined together, into transport packets.
+	void writePes(uint16_t pid, std::vector<iovec> const &pes, uint64_t pcr, bool random_access,
+				  std::vector<uint8_t> &out);
+
+	bool klv_;
+	uint8_t continuity_[NUM_PIDS];
+	int64_t last_tables_us_;
+	bool tables_written_;
+};
@@ -0,0 +1,225 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * ts_output.cpp - write an MPEG transport stream to a file or over UDP.
+ */
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "rtp_packetizer.hpp"
+#include "ts_output.hpp"
+
+// The most datagrams we hand to sendmmsg at once.
+static constexpr unsigned int SEND_BATCH_SIZE = 32;
+
+TsOutput::TsOutput(VideoOptions const *options) : Output(options), muxer_(options->klv), fd_(-1), udp_(false)
+{
+	if (options->codec != "h264")
+		throw std::runtime_error("mpegts output needs the h264 codec");
+
+	std::string const &output = options->output;
+	if (output.compare(0, 6, "udp://") == 0)
+	{
+		int start, end, a, b, c, d, port;
+		if (sscanf(output.c_str(), "udp://%n%d.%d.%d.%d%n:%d", &start, &a, &b, &c, &d, &end, &port) != 5)
+			throw std::runtime_error("bad network address " + output);
+		std::string address = output.substr(start, end - start);
+		saddr_ = {};
+		saddr_.sin_family = AF_INET;
+		saddr_.sin_port = htons(port);
+		if (inet_aton(address.c_str(), &saddr_.sin_addr) == 0)
+			throw std::runtime_error("inet_aton failed for " + address);
+		fd_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if (fd_ < 0)
+			throw std::runtime_error("unable to open udp socket");
+		udp_ = true;
+	}
+	else if (output.empty())
+		throw std::runtime_error("mpegts output needs an output file or udp address");
+	else if (output == "-")
+		fd_ = STDOUT_FILENO;
+	else
+	{
+		fd_ = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd_ < 0)
+			throw std::runtime_error("failed to open output file " + output);
+	}
+
+	// The KLV for each frame is made from its metadata.
+	if (options->klv)
+		want_metadata_ = want_post_process_metadata_ = true;
+}
+
+TsOutput::~TsOutput()
+{
+	if (fd_ != STDOUT_FILENO)
+		close(fd_);
+}
+
+void TsOutput::SetStreamInfo(StreamInfo const &info, std::string const &camera, std::string const &sensor_mode)
+{
+	camera_ = camera;
+}
+
+void TsOutput::metadataReady(FrameMetadata const &metadata)
+{
+	klv_ = make_klv(metadata, camera_);
+}
+
+void TsOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	buffer_.clear();
+	muxer_.Mux((uint8_t const *)mem, size, timestamp_us, flags & FLAG_KEYFRAME, klv_, buffer_);
+	klv_.clear();
+	send(buffer_);
+}
+
+void TsOutput::send(std::vector<uint8_t> const &data)
+{
+	if (!udp_)
+	{
+		for (size_t done = 0; done < data.size();)
+		{
+			ssize_t ret = write(fd_, data.data() + done, data.size() - done);
+			if (ret < 0 && errno != EINTR)
+				throw std::runtime_error("failed to write output bytes");
+			done += std::max<ssize_t>(ret, 0);
+		}
+		return;
+	}
+
+	// Every frame ends with whatever is left over, so that it doesn't wait for the next one.
+	constexpr size_t DATAGRAM_SIZE = PACKETS_PER_DATAGRAM * TsMuxer::PACKET_SIZE;
+	iovec iov[SEND_BATCH_SIZE];
+	mmsghdr msgs[SEND_BATCH_SIZE];
+	for (size_t offset = 0; offset < data.size();)
+	{
+		unsigned int n = 0;
+		for (; n < SEND_BATCH_SIZE && offset < data.size(); n++)
+		{
+			size_t len = std::min(DATAGRAM_SIZE, data.size() - offset);
+			iov[n] = { (void *)(data.data() + offset), len };
+			msgs[n] = {};
+			msgs[n].msg_hdr.msg_name = &saddr_;
+			msgs[n].msg_hdr.msg_namelen = sizeof(saddr_);
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			offset += len;
+		}
+		for (unsigned int sent = 0; sent < n;)
+		{
+			int ret = sendmmsg(fd_, msgs + sent, n - sent, 0);
+			if (ret < 0 && errno != EINTR)
+				throw std::runtime_error("failed to send data on socket");
+			sent += std::max(ret, 0);
+		}
+	}
+}
+
+// The ST 0601 items we fill in from "klv.<name>" post-processing metadata, and how each is
+// mapped from its real value onto an integer of the given size.
+struct KlvItem
+{
+	char const *name;
+	uint8_t tag;
+	double min;
+	double max;
+	unsigned int size;
+	bool is_signed;
+};
+
+static const KlvItem KLV_ITEMS[] = {
+	{ "platform_heading", 5, 0, 360, 2, false },
+	{ "platform_pitch", 6, -20, 20, 2, true },
+	{ "platform_roll", 7, -50, 50, 2, true },
+	{ "sensor_latitude", 13, -90, 90, 4, true },
+	{ "sensor_longitude", 14, -180, 180, 4, true },
+	{ "sensor_altitude", 15, -900, 19000, 2, false },
+	{ "sensor_hfov", 16, 0, 180, 2, false },
+	{ "sensor_vfov", 17, 0, 180, 2, false },
+	{ "sensor_relative_azimuth", 18, 0, 360, 4, false },
+	{ "sensor_relative_elevation", 19, -180, 180, 4, true },
+	{ "sensor_relative_roll", 20, 0, 360, 4, false },
+};
+
+static const uint8_t UAS_LOCAL_SET_KEY[] = { 0x06, 0x0e, 0x2b, 0x34, 0x02, 0x0b, 0x01, 0x01,
+											 0x0e, 0x01, 0x03, 0x01, 0x01, 0x00, 0x00, 0x00 };
+static constexpr uint8_t UAS_LOCAL_SET_VERSION = 19;
+
+static void put_item(std::vector<uint8_t> &buf, uint8_t tag, uint64_t value, unsigned int size)
+{
+	buf.push_back(tag);
+	buf.push_back(size);
+	for (int shift = 8 * (size - 1); shift >= 0; shift -= 8)
+		buf.push_back(value >> shift);
+}
+
+static bool get_double(Metadata const &metadata, std::string const &tag, double &value)
+{
+	try
+	{
+		return metadata.Get(tag, value) == 0;
+	}
+	catch (std::bad_any_cast const &)
+	{
+		LOG(2, "TsOutput: " << tag << " is not a double");
+		return false;
+	}
+}
+
+std::vector<uint8_t> make_klv(FrameMetadata const &metadata, std::string const &camera)
+{
+	auto sensor_timestamp = metadata.controls.get(libcamera::controls::SensorTimestamp);
+	if (!sensor_timestamp)
+		return {};
+
+	// The precision timestamp must come first, and the checksum last.
+	std::vector<uint8_t> items;
+	put_item(items, 2, wallclock_us(*sensor_timestamp / 1000), 8);
+	put_item(items, 65, UAS_LOCAL_SET_VERSION, 1);
+	if (!camera.empty())
+	{
+		size_t len = std::min<size_t>(camera.size(), 127);
+		items.push_back(11);
+		items.push_back(len);
+		items.insert(items.end(), camera.begin(), camera.begin() + len);
+	}
+	for (KlvItem const &item : KLV_ITEMS)
+	{
+		double value;
+		if (!get_double(metadata.post_process, std::string("klv.") + item.name, value) || !(value >= item.min) ||
+			value > item.max)
+			continue;
+		double range = std::ldexp(1.0, 8 * item.size - item.is_signed) - 1;
+		int64_t mapped = item.is_signed ? std::llround(value * range / item.max)
+										: std::llround((value - item.min) * range / (item.max - item.min));
+		put_item(items, item.tag, mapped, item.size);
+	}
+
+	// The BER length covers the checksum item too, which is 4 bytes.
+	std::vector<uint8_t> klv(std::begin(UAS_LOCAL_SET_KEY), std::end(UAS_LOCAL_SET_KEY));
+	size_t length = items.size() + 4;
+	if (length < 128)
+		klv.push_back(length);
+	else
+		klv.insert(klv.end(), { 0x82, (uint8_t)(length >> 8), (uint8_t)length });
+	klv.insert(klv.end(), items.begin(), items.end());
+	klv.push_back(1);
+	klv.push_back(2);
+	uint16_t checksum = 0;
+	for (size_t i = 0; i < klv.size(); i++)
+		checksum += klv[i] << (8 * ((i + 1) % 2));
+	klv.push_back(checksum >> 8);
+	klv.push_back(checksum);
+	return klv;
+}
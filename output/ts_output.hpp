@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2024, Raspberry Pi Ltd
+ *
+ * ts_output.hpp - write an MPEG transport stream to a file or over UDP.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <string>
+#include <vector>
+
+#include "output.hpp"
+#include "ts_muxer.hpp"
+
+// Each frame is muxed straight into a buffer of transport packets, together with a KLV
+// packet made from that frame's metadata, so the metadata can never drift away from the
+// video. Over UDP the packets go out 7 to a datagram, the usual size for a transport stream
+// that fits within a 1500 byte MTU.
+
+class TsOutput : public Output
+{
+public:
+	TsOutput(VideoOptions const *options);
+	~TsOutput();
+	void SetStreamInfo(StreamInfo const &info, std::string const &camera, std::string const &sensor_mode) override;
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+	void metadataReady(FrameMetadata const &metadata) override;
+
+private:
+	static constexpr size_t PACKETS_PER_DATAGRAM = 7;
+
+	void send(std::vector<uint8_t> const &data);
+
+	TsMuxer muxer_;
+	int fd_;
+	bool udp_;
+	sockaddr_in saddr_;
+	std::string camera_;
+	std::vector<uint8_t> klv_; // for the frame that is about to be output
+	std::vector<uint8_t> buffer_;
+};
+
+// Make a MISB ST 0601 UAS Datalink Local Set for one frame.
+std::vector<uint8_t> make_klv(FrameMetadata const &metadata, std::string const &camera);
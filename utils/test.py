@@ -15,10 +15,15 @@ import argparse
 from enum import Enum
 import fcntl
 import json
+import mmap
 import os
 import os.path
+import socket
+import struct
 import subprocess
 import sys
+import threading
+import time
 from timeit import default_timer as timer
 import v4l2
 import numpy as np
@@ -56,7 +61,7 @@ def check_exists(file, preamble):
         raise TestFailure(preamble + ": " + file + " not found")
 
 
-def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', 'log.txt', 'timestamps.txt', 'metadata.json', 'metadata.txt')):
+def clean_dir(dir, exts=('.jpg', '.png', '.bmp', '.dng', '.h264', '.mjpeg', '.raw', 'log.txt', 'timestamps.txt', 'metadata.json', 'metadata.txt', 'metadata.bin', '.idx')):
     for file in os.listdir(dir):
         if file.endswith(exts):
             os.remove(os.path.join(dir, file))
@@ -258,6 +263,21 @@ def test_still(exe_dir, output_dir):
     check_time(time_taken, 1, 10, "test_still: png test")
     check_size(output_png, 1024, "test_still: png test")
 
+    # "png threads test". Write the png on several threads, and compare how long the
+    # encode takes with the single threaded libpng path.
+    print("    png threads test")
+    png_times = []
+    for threads in ['1', '4']:
+        retcode, time_taken = run_executable(
+            [executable, '-t', '1000', '-e', 'png', '-o', output_png, '--png-threads', threads, '-v', '2'], logfile)
+        check_retcode(retcode, "test_still: png threads test")
+        check_time(time_taken, 1, 10, "test_still: png threads test")
+        check_size(output_png, 1024, "test_still: png threads test")
+        with open(logfile) as f:
+            png_times += [line.strip() for line in f if line.startswith("Wrote PNG file")]
+    for line in png_times:
+        print("       ", line)
+
     # "bmp test". As above, but write a bmp.
     print("    bmp test")
     retcode, time_taken = run_executable(
@@ -284,6 +304,34 @@ def test_still(exe_dir, output_dir):
     check_size(output_jpg, 1024, "test_still: dng test")
     check_size(output_dng, 1024 * 1024, "test_still: dng test")
 
+    # "lossless dng test". Write a lossless JPEG compressed dng along with the jpg.
+    print("    lossless dng test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-o', output_jpg, '-r', '--dng-compression', 'ljpeg'], logfile)
+    check_retcode(retcode, "test_still: lossless dng test")
+    check_time(time_taken, 1, 10, "test_still: lossless dng test")
+    check_size(output_jpg, 1024, "test_still: lossless dng test")
+    check_size(output_dng, 256 * 1024, "test_still: lossless dng test")
+
+    # "save threads test". Save the jpg and dng on background threads.
+    print("    save threads test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '-o', output_jpg, '-r', '--save-threads', '2'], logfile)
+    check_retcode(retcode, "test_still: save threads test")
+    check_time(time_taken, 1, 10, "test_still: save threads test")
+    check_size(output_jpg, 1024, "test_still: save threads test")
+    check_size(output_dng, 1024 * 1024, "test_still: save threads test")
+
+    # "burst test". Capture a short burst into RAM, and check every frame was saved.
+    print("    burst test")
+    retcode, time_taken = run_executable(
+        [executable, '-t', '1000', '--burst', '4', '-o', os.path.join(output_dir, 'test%03d.jpg')], logfile)
+    check_retcode(retcode, "test_still: burst test")
+    check_time(time_taken, 1, 15, "test_still: burst test")
+    for i in range(4):
+        check_size(os.path.join(output_dir, 'test%03d.jpg' % i), 1024, "test_still: burst test")
+    clean_dir(output_dir)
+
     # "timelapse test". Check that a timelapse sequence captures more than one jpg.
     print("    timelapse test")
     retcode, time_taken = run_executable(
@@ -414,6 +462,7 @@ def test_vid(exe_dir, output_dir):
     output_timestamps = os.path.join(output_dir, 'timestamps.txt')
     output_metadata = os.path.join(output_dir, 'metadata.json')
     output_metadata_txt = os.path.join(output_dir, 'metadata.txt')
+    output_metadata_bin = os.path.join(output_dir, 'metadata.bin')
     logfile = os.path.join(output_dir, 'log.txt')
     print("Testing", executable)
     check_exists(executable, 'test_vid')
@@ -460,6 +509,25 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: libav libx264 options test")
     check_size(output_h264, 1024, "test_vid: libav libx264 options test")
 
+    # "libav x264 low latency test". As above, but with the low latency encoder settings.
+    print("    libav libx264 low latency test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264, '--codec', 'libav',
+                                          '--libav-video-codec', 'libx264', '--low-latency'], logfile)
+    check_retcode(retcode, "test_vid: libav libx264 low latency test")
+    check_time(time_taken, 2, 6, "test_vid: libav libx264 low latency test")
+    check_size(output_h264, 1024, "test_vid: libav libx264 low latency test")
+
+    # "control socket test". Check that the command socket is created and cleaned up again.
+    print("    control socket test")
+    control_socket = os.path.join(output_dir, 'control.sock')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--control-socket', control_socket], logfile)
+    check_retcode(retcode, "test_vid: control socket test")
+    check_time(time_taken, 2, 6, "test_vid: control socket test")
+    check_size(output_h264, 1024, "test_vid: control socket test")
+    if os.path.exists(control_socket):
+        raise TestFailure("test_vid: control socket test - socket was not removed")
+
     # "mjpeg test". As above, but write an mjpeg file.
     print("    mjpeg test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg',
@@ -469,6 +537,163 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: mjpeg test")
     check_size(output_mjpeg, 1024, "test_vid: mjpeg test")
 
+    # "write buffer test". As above, but write the file from a background thread using direct I/O.
+    print("    write buffer test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '--write-buffer', '8',
+                                          '--direct-io', '--preallocate', '16', '--sync-every', '4',
+                                          '-o', output_mjpeg],
+                                         logfile)
+    check_retcode(retcode, "test_vid: write buffer test")
+    check_time(time_taken, 2, 6, "test_vid: write buffer test")
+    check_size(output_mjpeg, 1024, "test_vid: write buffer test")
+
+    # "tcp server test". Listen for clients, and check that two of them both get the stream.
+    print("    tcp server test")
+    received = [bytearray(), bytearray()]
+
+    def tcp_client(data):
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            for _ in range(20):
+                try:
+                    s.connect(('127.0.0.1', 8554))
+                    break
+                except ConnectionRefusedError:
+                    time.sleep(0.1)
+            while True:
+                chunk = s.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+    clients = [threading.Thread(target=tcp_client, args=(data,)) for data in received]
+    for client in clients:
+        client.start()
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--codec', 'mjpeg', '--listen',
+                                          '-o', 'tcp://127.0.0.1:8554'], logfile)
+    for client in clients:
+        client.join()
+    check_retcode(retcode, "test_vid: tcp server test")
+    check_time(time_taken, 3, 7, "test_vid: tcp server test")
+    if any(len(data) < 1024 for data in received):
+        raise TestFailure("test_vid: tcp server test failed, a client got no stream")
+
+    # "gstreamer test". Push the frames into a GStreamer pipeline that writes them to a file.
+    print("    gstreamer test")
+    output_gst = os.path.join(output_dir, 'gst.mjpeg')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--codec', 'mjpeg', '-o',
+                                          'appsrc name=appsrc ! filesink location=' + output_gst], logfile)
+    check_retcode(retcode, "test_vid: gstreamer test")
+    check_time(time_taken, 2, 6, "test_vid: gstreamer test")
+    check_size(output_gst, 1024, "test_vid: gstreamer test")
+
+    # "frame bus test". Read the encoded frames from shared memory while they are published.
+    print("    frame bus test")
+    bus_frames = []
+
+    def bus_reader():
+        path = '/dev/shm/rpicam-test-encoded'
+        for _ in range(50):
+            if os.path.exists(path):
+                break
+            time.sleep(0.1)
+        with open(path, 'rb') as f:
+            bus = mmap.mmap(f.fileno(), 0, prot=mmap.PROT_READ)
+        header_size, num_slots = struct.unpack_from('<II', bus, 12)
+        slot_size = struct.unpack_from('<Q', bus, 24)[0]
+        for _ in range(200):
+            count = struct.unpack_from('<Q', bus, 72)[0]
+            if len(bus_frames) >= 10:
+                break
+            if count < 2:
+                time.sleep(0.01)
+                continue
+            # Read the frame before the latest, checking that it wasn't overwritten meanwhile.
+            slot = header_size + ((count - 2) % num_slots) * slot_size
+            sequence, _, frame, _, size, _ = struct.unpack_from('<IIQqII', bus, slot)
+            data = bus[slot + 64:slot + 64 + size]
+            if sequence % 2 == 0 and frame == count - 2 and struct.unpack_from('<I', bus, slot)[0] == sequence:
+                bus_frames.append(data)
+            time.sleep(0.05)
+    reader = threading.Thread(target=bus_reader)
+    reader.start()
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--codec', 'mjpeg', '-o', output_mjpeg,
+                                          '--frame-bus', 'rpicam-test', '--frame-bus-streams', 'encoded,video'],
+                                         logfile)
+    reader.join()
+    check_retcode(retcode, "test_vid: frame bus test")
+    check_time(time_taken, 3, 7, "test_vid: frame bus test")
+    if len(bus_frames) < 10 or any(not frame.startswith(b'\xff\xd8') for frame in bus_frames):
+        raise TestFailure("test_vid: frame bus test failed, bad frames on the bus")
+    if os.path.exists('/dev/shm/rpicam-test-encoded') or os.path.exists('/dev/shm/rpicam-test-video'):
+        raise TestFailure("test_vid: frame bus test failed, shared memory was left behind")
+
+    # "http test". Watch the MJPEG stream over HTTP, and fetch a snapshot while it runs.
+    print("    http test")
+    http_replies = {}
+
+    def http_request(path, seconds):
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            for _ in range(20):
+                try:
+                    s.connect(('127.0.0.1', 8080))
+                    break
+                except ConnectionRefusedError:
+                    time.sleep(0.1)
+            s.sendall(f'GET {path} HTTP/1.1\r\n\r\n'.encode())
+            s.settimeout(seconds)
+            data = bytearray()
+            start = time.time()
+            try:
+                while time.time() - start < seconds:
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        break
+                    data += chunk
+            except (socket.timeout, ConnectionError):
+                pass
+            return data
+
+    def http_get(path, seconds):
+        # The server is listening before the camera starts, so there's no snapshot until the
+        # first frame arrives. Keep asking until there is one, while the camera is still running.
+        deadline = time.time() + 2.5
+        data = http_request(path, seconds)
+        while not data.startswith(b'HTTP/1.1 200') and time.time() < deadline:
+            time.sleep(0.1)
+            data = http_request(path, seconds)
+        http_replies[path] = data
+    clients = [threading.Thread(target=http_get, args=(path, 1.5)) for path in ['/stream.mjpg', '/snapshot.jpg']]
+    for client in clients:
+        client.start()
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--codec', 'mjpeg',
+                                          '-o', 'http://127.0.0.1:8080'], logfile)
+    for client in clients:
+        client.join()
+    check_retcode(retcode, "test_vid: http test")
+    check_time(time_taken, 3, 7, "test_vid: http test")
+    stream = http_replies.get('/stream.mjpg', b'')
+    if b'multipart/x-mixed-replace' not in stream or stream.count(b'\xff\xd8') < 5:
+        raise TestFailure("test_vid: http test failed, no mjpeg stream")
+    snapshot = http_replies.get('/snapshot.jpg', b'')
+    if not snapshot.startswith(b'HTTP/1.1 200') or b'\r\n\r\n\xff\xd8' not in snapshot:
+        raise TestFailure("test_vid: http test failed, no snapshot")
+
+    # "sei test". Record H.264 with metadata SEI messages, and check that every frame has one.
+    print("    sei test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--sei', '--inline', '-o', output_h264,
+                                          '--save-pts', output_timestamps], logfile)
+    check_retcode(retcode, "test_vid: sei test")
+    check_time(time_taken, 2, 6, "test_vid: sei test")
+    check_size(output_h264, 1024, "test_vid: sei test")
+    with open(output_h264, 'rb') as f:
+        h264 = f.read()
+    with open(output_timestamps) as f:
+        num_frames = len(f.readlines()) - 1
+    sei_uuid = bytes.fromhex('c05207fff3474ae4bae957a88eab3dc6')
+    num_seis = h264.count(sei_uuid)
+    if num_frames < 30 or abs(num_seis - num_frames) > 1:
+        raise TestFailure("test_vid: sei test failed, " + str(num_seis) + " SEI messages for " +
+                          str(num_frames) + " frames")
+
     if platform == 'pisp':
         print("skipping unsupported Pi 5 rpicam-vid tests")
         return
@@ -482,6 +707,9 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: segment test")
     # A bug in commit b20dc097621a trunctated each jpg to 4096 bytes, so check against 4100:
     check_size(os.path.join(output_dir, 'test035.jpg'), 4100, "test_vid: segment test")
+    # The next segment is opened ahead of time, but that file mustn't be left behind.
+    if any(file.startswith('.rpicam-next-') for file in os.listdir(output_dir)):
+        raise TestFailure("test_vid: segment test failed, temporary file left behind")
 
     # "circular test". Test circular buffer (really we should wait for it to wrap...)
     print("    circular test")
@@ -491,6 +719,159 @@ def test_vid(exe_dir, output_dir):
     check_time(time_taken, 2, 6, "test_vid: circular test")
     check_size(output_circular, 1024, "test_vid: circular test")
 
+    # "circular hugepages test". As above, asking for huge pages and locked memory, which
+    # should quietly fall back when the system can't provide them.
+    print("    circular hugepages test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--inline', '--circular', '--circular-hugepages',
+                                          '--circular-lock', '-o', output_circular], logfile)
+    check_retcode(retcode, "test_vid: circular hugepages test")
+    check_time(time_taken, 2, 6, "test_vid: circular hugepages test")
+    check_size(output_circular, 1024, "test_vid: circular hugepages test")
+
+    # "circular trigger test". Trigger an event recording through the control socket part way through.
+    print("    circular trigger test")
+    output_event = os.path.join(output_dir, 'event%d.h264')
+
+    def send_trigger():
+        with socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM) as s:
+            s.sendto(b'trigger', control_socket)
+    trigger = threading.Timer(2.5, send_trigger)
+    trigger.start()
+    retcode, time_taken = run_executable([executable, '-t', '4000', '--inline', '--circular', '--pre-roll', '1000',
+                                          '--post-roll', '500', '--control-socket', control_socket,
+                                          '-o', output_event], logfile)
+    trigger.join()
+    check_retcode(retcode, "test_vid: circular trigger test")
+    check_time(time_taken, 4, 8, "test_vid: circular trigger test")
+    check_size(output_event % 0, 1024, "test_vid: circular trigger test")
+
+    # "fmp4 test". Write a fragmented mp4 file directly from the h264 encoder.
+    print("    fmp4 test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--fmp4', '-o', output_mp4], logfile)
+    check_retcode(retcode, "test_vid: fmp4 test")
+    check_time(time_taken, 2, 6, "test_vid: fmp4 test")
+    check_size(output_mp4, 1024, "test_vid: fmp4 test")
+
+    # "hls test". Write one second HLS segments and a playlist into a directory.
+    print("    hls test")
+    output_hls = os.path.join(output_dir, 'hls')
+    retcode, time_taken = run_executable([executable, '-t', '4000', '--hls', '3', '--segment', '1000',
+                                          '--intra', '15', '-o', output_hls], logfile)
+    check_retcode(retcode, "test_vid: hls test")
+    check_time(time_taken, 4, 8, "test_vid: hls test")
+    check_size(os.path.join(output_hls, 'init.mp4'), 256, "test_vid: hls test")
+    check_size(os.path.join(output_hls, 'index.m3u8'), 64, "test_vid: hls test")
+
+    # "mpegts test". Write a transport stream with KLV metadata, and check every packet is in sync.
+    print("    mpegts test")
+    output_ts = os.path.join(output_dir, 'test.ts')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--mpegts', '--klv', '-o', output_ts], logfile)
+    check_retcode(retcode, "test_vid: mpegts test")
+    check_time(time_taken, 2, 6, "test_vid: mpegts test")
+    check_size(output_ts, 1024, "test_vid: mpegts test")
+    with open(output_ts, 'rb') as f:
+        ts = f.read()
+    if len(ts) % 188 or any(ts[i] != 0x47 for i in range(0, len(ts), 188)):
+        raise TestFailure("test_vid: mpegts test failed, transport stream out of sync")
+    if b'KLVA' not in ts[:188 * 2]:
+        raise TestFailure("test_vid: mpegts test failed, no KLV stream")
+
+    # "adaptive bitrate test". Stream over udp and check the rate controller traces its decisions.
+    print("    adaptive bitrate test")
+    output_trace = os.path.join(output_dir, 'bitrate_trace.txt')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--bitrate', '4mbps', '--adaptive-bitrate',
+                                          '--bitrate-trace', output_trace, '-o', 'udp://127.0.0.1:5000'], logfile)
+    check_retcode(retcode, "test_vid: adaptive bitrate test")
+    check_time(time_taken, 2, 6, "test_vid: adaptive bitrate test")
+    check_size(output_trace, 64, "test_vid: adaptive bitrate test")
+
+    # "rtp test". Stream RTP to ourselves and check that no packet needs fragmenting.
+    print("    rtp test")
+    output_sdp = os.path.join(output_dir, 'stream.sdp')
+    with socket.socket(socket.AF_INET, socket.SOCK_DGRAM) as receiver:
+        receiver.bind(('127.0.0.1', 5004))
+        receiver.setblocking(False)
+        retcode, time_taken = run_executable([executable, '-t', '2000', '--mtu', '1400', '--sdp', output_sdp,
+                                              '-o', 'rtp://127.0.0.1:5004'], logfile)
+        check_retcode(retcode, "test_vid: rtp test")
+        check_time(time_taken, 2, 6, "test_vid: rtp test")
+        check_size(output_sdp, 64, "test_vid: rtp test")
+        sizes = []
+        try:
+            while True:
+                sizes.append(len(receiver.recv(65536)))
+        except BlockingIOError:
+            pass
+        if not sizes or max(sizes) > 1400 - 28:
+            raise TestFailure("test_vid: rtp test failed, bad packet sizes")
+
+    # "rtsp test". Play the stream from the built-in RTSP server with RTP interleaved over TCP.
+    print("    rtsp test")
+    rtsp_reply = bytearray()
+    rtp_packets = []
+
+    def rtsp_client():
+        url = 'rtsp://127.0.0.1:8554/stream'
+        with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as s:
+            for _ in range(20):
+                try:
+                    s.connect(('127.0.0.1', 8554))
+                    break
+                except ConnectionRefusedError:
+                    time.sleep(0.1)
+
+            def request(text):
+                s.sendall(text.encode())
+                reply = bytearray()
+                while b'\r\n\r\n' not in reply:
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        return b''
+                    reply += chunk
+                length = reply.split(b'Content-Length: ')[1].split(b'\r\n')[0] if b'Content-Length: ' in reply else 0
+                while len(reply) < reply.find(b'\r\n\r\n') + 4 + int(length):
+                    chunk = s.recv(65536)
+                    if not chunk:
+                        return b''
+                    reply += chunk
+                return reply
+
+            # The server is listening before the camera even starts, so the stream headers only
+            # appear in the session description once the first keyframe has been encoded.
+            for cseq in range(1, 31):
+                reply = request(f'DESCRIBE {url} RTSP/1.0\r\nCSeq: {cseq}\r\n\r\n')
+                if not reply or b'sprop-parameter-sets=' in reply:
+                    break
+                time.sleep(0.1)
+            rtsp_reply.extend(reply)
+            rtsp_reply.extend(request(f'SETUP {url}/track0 RTSP/1.0\r\nCSeq: 100\r\n'
+                                      'Transport: RTP/AVP/TCP;interleaved=0-1\r\n\r\n'))
+            if b'Session: ' not in rtsp_reply:
+                return
+            session = rtsp_reply.split(b'Session: ')[-1].split(b';')[0].decode()
+            s.sendall(f'PLAY {url} RTSP/1.0\r\nCSeq: 101\r\nSession: {session}\r\n\r\n'.encode())
+            data = bytearray()
+            while True:
+                chunk = s.recv(65536)
+                if not chunk:
+                    break
+                data += chunk
+            data = data[data.find(b'\r\n\r\n') + 4:]
+            while len(data) >= 4 and data[0] == ord('$'):
+                if data[1] == 0:
+                    rtp_packets.append(data[4:4 + (data[2] << 8 | data[3])])
+                data = data[4 + (data[2] << 8 | data[3]):]
+    client = threading.Thread(target=rtsp_client)
+    client.start()
+    retcode, time_taken = run_executable([executable, '-t', '3000', '-o', 'rtsp://127.0.0.1:8554/stream'], logfile)
+    client.join()
+    check_retcode(retcode, "test_vid: rtsp test")
+    check_time(time_taken, 3, 7, "test_vid: rtsp test")
+    if b'sprop-parameter-sets=' not in rtsp_reply:
+        raise TestFailure("test_vid: rtsp test failed, no stream headers in the session description")
+    if not rtp_packets or any(len(packet) < 13 or packet[1] & 0x7f != 96 for packet in rtp_packets):
+        raise TestFailure("test_vid: rtsp test failed, bad rtp packets")
+
     # "pause test". Should be no output file if we start 'paused'.
     print("    pause test")
     retcode, time_taken = run_executable([executable, '-t', '2000', '--inline',
@@ -529,6 +910,39 @@ def test_vid(exe_dir, output_dir):
     check_size(output_h264, 1024, "test_vid: metadata txt test")
     check_metadata_txt(output_metadata_txt, "test_vid: metadata txt test")
 
+    # "metadata bin test". Write binary metadata, and check that it converts to sensible json.
+    print("    metadata bin test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '-o', output_h264,
+                                          '--save-pts', output_timestamps,
+                                          '--metadata', output_metadata_bin,
+                                          '--metadata-format', 'bin'], logfile)
+    check_retcode(retcode, "test_vid: metadata bin test")
+    check_time(time_taken, 2, 6, "test_vid: metadata bin test")
+    converter = os.path.join(exe_dir, 'rpicam-metadata')
+    check_exists(converter, 'test_vid')
+    retcode, time_taken = run_executable([converter, output_metadata_bin, output_metadata], logfile)
+    check_retcode(retcode, "test_vid: metadata bin test")
+    check_metadata(output_metadata, output_timestamps, "test_vid: metadata bin test")
+
+    # "index test". Write a keyframe index, and check that a clip can be cut out with it.
+    print("    index test")
+    retcode, time_taken = run_executable([executable, '-t', '3000', '--intra', '10', '--index',
+                                          '-o', output_h264], logfile)
+    check_retcode(retcode, "test_vid: index test")
+    check_time(time_taken, 3, 7, "test_vid: index test")
+    check_exists(output_h264 + '.idx', "test_vid: index test")
+    clipper = os.path.join(exe_dir, 'rpicam-clip')
+    check_exists(clipper, 'test_vid')
+    output_clip = os.path.join(output_dir, 'clip.h264')
+    retcode, time_taken = run_executable([clipper, output_h264, '1', '2', output_clip], logfile)
+    check_retcode(retcode, "test_vid: index test")
+    check_size(output_clip, 1024, "test_vid: index test")
+    # Without inline headers a clip that starts part way through would be undecodable.
+    with open(output_clip, 'rb') as f:
+        start = f.read(5)
+        if start[:4] != b'\x00\x00\x00\x01' or start[4] & 0x1f != 7:
+            raise TestFailure("test_vid: index test - clip does not start with an SPS")
+
     print("rpicam-vid tests passed")
 
 
@@ -548,6 +962,32 @@ def test_raw(exe_dir, output_dir):
     check_time(time_taken, 2, 8, "test_vid: raw test")
     check_size(output_raw, 1024, "test_vid: raw test")
 
+    # "container raw test". Write an uncompressed container, and check that it has an index.
+    print("    container raw test")
+    output_container = os.path.join(output_dir, 'test.rpc')
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--container', '-o', output_container],
+                                         logfile)
+    check_retcode(retcode, "test_raw: container raw test")
+    check_time(time_taken, 2, 8, "test_raw: container raw test")
+    check_size(output_container, 1024, "test_raw: container raw test")
+    with open(output_container, 'rb') as f:
+        f.seek(-24, os.SEEK_END)
+        if f.read(4) != b'INDX':
+            raise TestFailure("test_raw: container raw test failed, no index found")
+
+    # "compressed raw test". Write a zstd compressed container and unpack it again.
+    print("    compressed raw test")
+    retcode, time_taken = run_executable([executable, '-t', '2000', '--compress', 'zstd', '-o', output_container],
+                                         logfile)
+    check_retcode(retcode, "test_raw: compressed raw test")
+    check_time(time_taken, 2, 8, "test_raw: compressed raw test")
+    check_size(output_container, 1024, "test_raw: compressed raw test")
+    unpack = os.path.join(exe_dir, 'rpicam-unpack')
+    check_exists(unpack, 'test_raw')
+    retcode, time_taken = run_executable([unpack, output_container, output_raw], logfile)
+    check_retcode(retcode, "test_raw: compressed raw test")
+    check_size(output_raw, 1024, "test_raw: compressed raw test")
+
     print("rpicam-raw tests passed")
 
 